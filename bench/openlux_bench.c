@@ -0,0 +1,315 @@
+// Micro-benchmarks of the firmware's hot paths, and a whole plate read on the
+// simulator (of the format it was built for, see plate.h). Results are
+// printed as JSON so they can be kept and compared from one commit to the
+// next:
+//
+//   { "benchmarks": [ { "name", "iterations", "ns_per_op" }, ... ],
+//     "plate_read": { "wells", "channels", "measured", "samples", "raster",
+//                     "calibrated", "plate_time_s", "wall_time_s",
+//                     "od_error_max" } }
+//
+// Plate time is on the simulated clock, i.e. how long the instrument takes.
+// Every well is read on every channel the simulator was built for (see
+// OPENLUX_CHANNELS), so measured counts one per well and channel. The OD
+// error is the worst difference between the OD the device reports and the
+// simulated plate at that channel's wavelength. Calibrated reads first give
+// every well position its own response and calibrate it out with blank and
+// reference passes.
+#include "common.h"
+#include "stats.h"
+#include "samples.h"
+#include "motion.h"
+#include "batch.h"
+#include "assets.h"
+#include "motors.h"
+#include "sensors.h"
+#include "job.h"
+#include "results.h"
+#include "calib.h"
+#include "sim.h"
+#include <esp_timer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <math.h>
+
+static const motion_profile_t PROFILE = {
+  .start_rate = CONFIG_OPENLUX_START_STEP_RATE,
+  .max_rate = CONFIG_OPENLUX_MAX_STEP_RATE,
+  .accel = CONFIG_OPENLUX_STEP_ACCEL
+};
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static bool FIRST = true;
+
+static void report(const char* name, long iterations, double elapsed_ns) {
+  printf("%s    { \"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.2f }",
+         FIRST ? "" : ",\n", name, iterations, elapsed_ns / iterations);
+  FIRST = false;
+}
+
+// Stops the compiler throwing away results that are never looked at
+static volatile float SINK;
+
+// The measurement path: every raw sample goes into the running statistics
+static void bench_stats(void) {
+  const long n = 2000000;
+  running_stats_t s;
+  stats_reset(&s);
+  uint32_t x = 1;
+  double start = now_ns();
+  for (long i = 0; i < n; i++) {
+    x = x * 1103515245 + 12345;
+    stats_add(&s, 2000 + (x >> 24));
+  }
+  report("stats_add", n, now_ns() - start);
+  start = now_ns();
+  const long m = 100000;
+  for (long i = 0; i < m; i++) {
+    SINK = stats_mean(&s) + stats_sd(&s) + stats_median(&s);
+  }
+  report("stats_summary", m, now_ns() - start);
+}
+
+// Every decimated reading goes into the sample ring
+static void bench_sample_ring(void) {
+  const long n = 2000000;
+  double start = now_ns();
+  for (long i = 0; i < n; i++) {
+    sample_ring_push(i & 0xFFF, i % PLATE_WELLS, i & 1, 0, OD_NONE);
+  }
+  report("sample_ring_push", n, now_ns() - start);
+}
+
+// Step stream generation for a move corner to corner of the plate, reported
+// per step
+static void bench_plan_runs(void) {
+  const int moves = 200;
+  step_run_t runs[64];
+  long steps = 0;
+  double start = now_ns();
+  for (int i = 0; i < moves; i++) {
+    move_plan_t plan;
+    int dir = (i & 1) ? -1 : 1;
+    plan_move(&plan, dir * (PLATE_ROWS - 1) * WELL_SPACING,
+              dir * (PLATE_COLS - 1) * WELL_SPACING, &PROFILE);
+    while (plan_runs(&plan, runs, 64) > 0) {
+    }
+    steps += plan.steps;
+  }
+  report("plan_runs_per_step", steps, now_ns() - start);
+}
+
+// Unpacking the largest batch /batch accepts
+static void bench_batch_decode(void) {
+  static uint8_t data[sizeof(batch_header_t) + BATCH_MAX_OPS * sizeof(batch_op_t)];
+  static batch_op_t ops[BATCH_MAX_OPS];
+  batch_header_t header = { BATCH_VERSION, BATCH_MAX_OPS, 0 };
+  memcpy(data, &header, sizeof(header));
+  for (int i = 0; i < BATCH_MAX_OPS; i++) {
+    batch_op_t op = { (i % 2) ? OP_MEASURE : OP_MOVE, 1 + i % PLATE_ROWS, 1 + i % PLATE_COLS,
+                      0, 500 };
+    memcpy(data + sizeof(header) + i * sizeof(op), &op, sizeof(op));
+  }
+  const long n = 200000;
+  double start = now_ns();
+  for (long i = 0; i < n; i++) {
+    if (batch_decode(data, sizeof(data), ops) != BATCH_MAX_OPS) {
+      fprintf(stderr, "Batch didn't decode\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  report("batch_decode_128_ops", n, now_ns() - start);
+}
+
+// Looking a request URI up in the web file manifest
+static void bench_find_asset(void) {
+  static const char* URIS[] = { "/", "/app.js", "/theme.css", "/svg/bulb+text.svg",
+                                "/index.html?x=1", "/missing.js" };
+  const int n_uris = sizeof(URIS) / sizeof(URIS[0]);
+  const long n = 1000000;
+  if (load_assets() != ESP_OK) {
+    fprintf(stderr, "No packed web files to look up\n");
+    exit(EXIT_FAILURE);
+  }
+  double start = now_ns();
+  for (long i = 0; i < n; i++) {
+    SINK = find_asset(URIS[i % n_uris]) != NULL;
+  }
+  report("find_asset", n, now_ns() - start);
+}
+
+static volatile int MEASURED = 0;
+static volatile float OD_ERROR = 0;
+static SemaphoreHandle_t RUN_DONE = NULL;
+
+static void on_job(const job_event_t* ev) {
+  if (ev->kind == JOB_WELL && ev->value >= 0) {
+    float od = ev->m.od / 1000.0f;
+    float err = fabsf(od - sim_plate_od(ev->well / PLATE_COLS + 1, ev->well % PLATE_COLS + 1,
+                                        ev->m.channel));
+    if (err > OD_ERROR) {
+      OD_ERROR = err;
+    }
+    MEASURED++;
+  } else if (ev->kind == JOB_FINISHED || ev->kind == JOB_STOPPED) {
+    xSemaphoreGive(RUN_DONE);
+  }
+}
+
+static void temp_file(char* path) {
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "Can't make a temporary file\n");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+}
+
+// Every well of the plate once, waiting for the run to end
+static void run_plate(uint32_t samples, bool raster, calib_pass_t calibrate, float od) {
+  static job_spec_t spec;
+  spec.n_wells = JOB_MAX_WELLS;
+  spec.repeats = 1;
+  spec.samples = samples;
+  spec.raster = raster;
+  spec.calibrate = calibrate;
+  spec.reference_od = od;
+  for (int i = 0; i < JOB_MAX_WELLS; i++) {
+    spec.wells[i] = i;
+  }
+  MEASURED = 0;
+  OD_ERROR = 0;
+  if (job_start(&spec) != ESP_OK) {
+    fprintf(stderr, "Plate run didn't start\n");
+    exit(EXIT_FAILURE);
+  }
+  xSemaphoreTake(RUN_DONE, portMAX_DELAY);
+  // The last event goes out just before the runner is free again
+  while (job_running()) {
+    vTaskDelay(1);
+  }
+}
+
+// Home from nothing, then read every well of the plate once as a plate run
+static void bench_plate_read(uint32_t samples, double scale, bool raster, bool calibrate) {
+  char log_path[] = "/tmp/openlux-bench-XXXXXX";
+  char settings_path[] = "/tmp/openlux-bench-XXXXXX";
+  temp_file(log_path);
+  temp_file(settings_path);
+  sim_set_store_path(log_path);
+  sim_set_settings_path(settings_path);
+  sim_set_time_scale(scale);
+  init_status();
+  open_results();
+  load_calibration();
+  start_sensor_polling(ADC_ATTEN_DB_0, CONFIG_OPENLUX_SENSOR_PERIOD_MS);
+  setup_motor_driver();
+  // With no position saved, this homes first
+  start_goto_loop(xTaskGetCurrentTaskHandle());
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  start_job_runner();
+  RUN_DONE = xSemaphoreCreateBinary();
+  set_job_listener(on_job);
+  begin_status(READY);
+  if (calibrate) {
+    sim_set_gain_spread(0.05);
+    sim_set_plate_od(0);
+    run_plate(samples, raster, CALIB_BLANK, 0);
+    sim_set_plate_od(1);
+    run_plate(samples, raster, CALIB_REFERENCE, 1);
+    sim_set_plate_od(-1);
+  }
+  int64_t sim_start = esp_timer_get_time();
+  double start = now_ns();
+  run_plate(samples, raster, CALIB_NONE, 0);
+  double wall_ns = now_ns() - start;
+  int64_t sim_us = esp_timer_get_time() - sim_start;
+  unlink(log_path);
+  unlink(settings_path);
+  printf("  \"plate_read\": { \"wells\": %d, \"channels\": %d, \"measured\": %d, "
+         "\"samples\": %u, \"raster\": %s, \"calibrated\": %s, \"plate_time_s\": %.3f, "
+         "\"wall_time_s\": %.3f, \"od_error_max\": %.4f }\n",
+         JOB_MAX_WELLS, SENSOR_CHANNELS, MEASURED, samples, raster ? "true" : "false",
+         calibrate ? "true" : "false", sim_us / 1e6,
+         wall_ns / 1e9, OD_ERROR);
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -s, --samples N        dark and lit samples per well (default %d)\n"
+          "  -t, --time-scale N     run the plate read N times faster (default 20)\n"
+          "  -r, --raster           raster scan the plate rather than stopping at wells\n"
+          "  -c, --calibrate        vary the response of each well position by up to 5%%\n"
+          "                         and calibrate it out before the read\n"
+          "  -n, --no-plate         skip the plate read\n",
+          prog, CONFIG_OPENLUX_MEASURE_SAMPLES);
+}
+
+int main(int argc, char** argv) {
+  static const struct option OPTS[] = {
+    { "samples", required_argument, NULL, 's' },
+    { "time-scale", required_argument, NULL, 't' },
+    { "raster", no_argument, NULL, 'r' },
+    { "calibrate", no_argument, NULL, 'c' },
+    { "no-plate", no_argument, NULL, 'n' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  uint32_t samples = CONFIG_OPENLUX_MEASURE_SAMPLES;
+  double scale = 20;
+  bool plate = true;
+  bool raster = false;
+  bool calibrate = false;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "s:t:rcnh", OPTS, NULL)) != -1) {
+    switch (opt) {
+    case 's':
+      samples = strtoul(optarg, NULL, 0);
+      break;
+    case 't':
+      scale = atof(optarg);
+      break;
+    case 'r':
+      raster = true;
+      break;
+    case 'c':
+      calibrate = true;
+      break;
+    case 'n':
+      plate = false;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  esp_log_level_set("*", ESP_LOG_WARN);
+  // The web files are packed into the build directory
+  if (chdir(BENCH_ROOT)) {
+    fprintf(stderr, "Can't change into %s\n", BENCH_ROOT);
+    return EXIT_FAILURE;
+  }
+  printf("{\n  \"benchmarks\": [\n");
+  bench_stats();
+  bench_sample_ring();
+  bench_plan_runs();
+  bench_batch_decode();
+  bench_find_asset();
+  printf("\n  ]%s\n", plate ? "," : "");
+  fflush(stdout);
+  if (plate) {
+    bench_plate_read(samples, scale, raster, calibrate);
+  }
+  printf("}\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,487 @@
+// Load test for the web server: many clients at once, each making one request
+// after another over a kept-alive connection, as a room full of browsers
+// watching a run would. Point it at the simulator (or a device) and it prints
+// JSON:
+//
+//   { "target", "clients", "duration_s", "requests", "errors", "retried",
+//     "aborted", "connects", "req_per_s", "mbytes_per_s",
+//     "latency_ms": { "p50", "p90", "p99", "max" },
+//     "uris": [ { "uri", "requests", "errors", "p50_ms", "p99_ms" }, ... ],
+//     "alive" }
+//
+// Latency runs from the request going out to the last byte of the response.
+// Errors are responses of 400 or more and connections lost mid-request. A
+// kept-alive connection closed before the answer started is retried on a new
+// one, as browsers do, and counted as retried rather than an error. With
+// --abort some clients hang up as the response starts coming, as a browser
+// navigating away does, which the server must shrug off. alive says whether
+// the server still answered /status afterwards, and the exit status follows
+// it.
+//
+// Everything happens on one thread over non-blocking sockets and epoll, so
+// the harness itself keeps up with far more clients than the device can.
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_CLIENTS 1024
+#define MAX_URIS 16
+// Response headers have to fit in here
+#define HEAD_SIZE 2048
+#define REQ_SIZE 512
+
+typedef enum body_state {
+  BODY_HEAD,             // Still reading headers
+  BODY_LENGTH,           // remaining bytes of a Content-Length body
+  BODY_CHUNK_SIZE,       // Reading a chunk size line
+  BODY_CHUNK,            // remaining bytes of a chunk
+  BODY_CHUNK_END,        // The CRLF after a chunk, remaining bytes of it
+  BODY_TRAILER,          // The CRLF after the last chunk, likewise
+  BODY_DONE
+} body_state_t;
+
+typedef struct client {
+  int fd;
+  bool connecting;
+  int uri;               // Index into URIS of the request in flight
+  bool aborting;         // Hang up as soon as the response starts
+  int64_t sent_us;
+  body_state_t state;
+  int status;
+  bool server_closes;    // Connection: close
+  bool reused;           // The connection has already answered a request
+  bool retry;            // Make the request in flight again on a new connection
+  long remaining;
+  size_t head_len;
+  char head[HEAD_SIZE];
+} client_t;
+
+typedef struct sample {
+  float ms;
+  uint8_t uri;
+} sample_t;
+
+static const char* URIS[MAX_URIS];
+static int N_URIS = 0;
+static client_t CLIENTS[MAX_CLIENTS];
+static struct sockaddr_storage ADDR;
+static socklen_t ADDR_LEN;
+static int EPOLL_FD = -1;
+static bool KEEP_ALIVE = true;
+static double ABORT = 0;
+static unsigned SEED = 1;
+
+static sample_t* SAMPLES = NULL;
+static size_t N_SAMPLES = 0;
+static size_t SAMPLES_CAP = 0;
+static long ERRORS[MAX_URIS];
+static long ABORTED = 0;
+static long RETRIED = 0;
+static long CONNECTS = 0;
+static uint64_t BYTES = 0;
+// No new requests once the run is over, but those in flight are seen out
+static bool STOPPING = false;
+
+static int64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void watch(client_t* c, uint32_t events, int op) {
+  struct epoll_event ev = { .events = events, .data.ptr = c };
+  epoll_ctl(EPOLL_FD, op, c->fd, &ev);
+}
+
+static void hang_up(client_t* c, bool reset) {
+  if (c->fd < 0) {
+    return;
+  }
+  if (reset) {
+    // Throw away anything unsent and send a reset, as a closed tab does
+    struct linger now = { 1, 0 };
+    setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &now, sizeof(now));
+  }
+  epoll_ctl(EPOLL_FD, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->fd = -1;
+}
+
+static void connect_client(client_t* c) {
+  c->fd = socket(ADDR.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (c->fd < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  CONNECTS++;
+  c->connecting = true;
+  c->reused = false;
+  // Whether it worked is seen to once the socket becomes writable, as is a
+  // connection refused straight away
+  connect(c->fd, (struct sockaddr*) &ADDR, ADDR_LEN);
+  watch(c, EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+static void send_request(client_t* c) {
+  char req[REQ_SIZE];
+  if (!c->retry) {
+    c->uri = rand_r(&SEED) % N_URIS;
+    c->aborting = ABORT > 0 && rand_r(&SEED) < ABORT * RAND_MAX;
+    c->sent_us = now_us();
+  }
+  c->retry = false;
+  c->state = BODY_HEAD;
+  c->status = 0;
+  c->server_closes = false;
+  c->head_len = 0;
+  int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: openlux\r\n%s\r\n",
+                     URIS[c->uri], KEEP_ALIVE ? "" : "Connection: close\r\n");
+  // A request this small goes out in one go or the connection is no good
+  if (send(c->fd, req, len, MSG_NOSIGNAL) != len) {
+    ERRORS[c->uri]++;
+    hang_up(c, false);
+    connect_client(c);
+    return;
+  }
+  watch(c, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+// Move on to the next request, reconnecting if need be
+static void next_request(client_t* c) {
+  if (STOPPING) {
+    hang_up(c, false);
+  } else if (c->fd < 0) {
+    connect_client(c);
+  } else {
+    send_request(c);
+  }
+}
+
+static void request_failed(client_t* c) {
+  // A kept-alive connection the server closed before answering, which it may
+  // when it runs out of sockets, gets the request again as browsers do
+  c->retry = c->reused && c->state == BODY_HEAD && c->head_len == 0;
+  RETRIED += c->retry;
+  ERRORS[c->uri] += !c->retry;
+  hang_up(c, false);
+  if (c->retry) {
+    connect_client(c);
+  } else {
+    next_request(c);
+  }
+}
+
+static void request_done(client_t* c) {
+  if (N_SAMPLES == SAMPLES_CAP) {
+    SAMPLES_CAP = SAMPLES_CAP ? SAMPLES_CAP * 2 : 65536;
+    SAMPLES = realloc(SAMPLES, SAMPLES_CAP * sizeof(sample_t));
+  }
+  SAMPLES[N_SAMPLES++] = (sample_t) { (now_us() - c->sent_us) / 1000.0f, c->uri };
+  if (c->status >= 400) {
+    ERRORS[c->uri]++;
+  }
+  c->reused = true;
+  if (c->server_closes || !KEEP_ALIVE) {
+    hang_up(c, false);
+  }
+  next_request(c);
+}
+
+// Pick out the status and how the body is framed, once the headers are in
+static bool parse_head(client_t* c) {
+  c->head[c->head_len] = '\0';
+  if (sscanf(c->head, "HTTP/1.%*d %d", &c->status) != 1) {
+    return false;
+  }
+  c->state = BODY_DONE;
+  for (char* line = strstr(c->head, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+    char* field = line + 2;
+    if (!strncasecmp(field, "Content-Length:", 15)) {
+      c->remaining = strtol(field + 15, NULL, 10);
+      c->state = c->remaining > 0 ? BODY_LENGTH : BODY_DONE;
+    } else if (!strncasecmp(field, "Transfer-Encoding:", 18) && strstr(field, "chunked")) {
+      c->state = BODY_CHUNK_SIZE;
+      c->head_len = 0;
+    } else if (!strncasecmp(field, "Connection:", 11) && strcasestr(field, "close")) {
+      c->server_closes = true;
+    }
+  }
+  return true;
+}
+
+// Work through as much of the response as arrived. Anything past its end
+// would be the answer to a request never made, so is an error.
+static bool take_body(client_t* c, const char* data, size_t len) {
+  size_t at = 0;
+  while (at < len && c->state != BODY_DONE) {
+    if (c->state == BODY_HEAD || c->state == BODY_CHUNK_SIZE) {
+      // Byte by byte, so nothing past the line is swallowed
+      size_t room = (c->state == BODY_HEAD) ? HEAD_SIZE - 1 : 32;
+      if (c->head_len == room) {
+        return false;
+      }
+      c->head[c->head_len++] = data[at++];
+      if (c->state == BODY_HEAD) {
+        if (c->head_len >= 4 && !memcmp(c->head + c->head_len - 4, "\r\n\r\n", 4) &&
+            !parse_head(c)) {
+          return false;
+        }
+      } else if (c->head[c->head_len - 1] == '\n') {
+        c->head[c->head_len] = '\0';
+        c->remaining = strtol(c->head, NULL, 16);
+        c->head_len = 0;
+        // The last chunk is empty, and followed by one more CRLF
+        c->state = c->remaining ? BODY_CHUNK : BODY_TRAILER;
+        c->remaining = c->remaining ? c->remaining : 2;
+      }
+      continue;
+    }
+    size_t n = (len - at < (size_t) c->remaining) ? len - at : (size_t) c->remaining;
+    at += n;
+    c->remaining -= n;
+    if (c->remaining) {
+      continue;
+    }
+    switch (c->state) {
+    case BODY_CHUNK:
+      c->state = BODY_CHUNK_END;
+      c->remaining = 2;
+      break;
+    case BODY_CHUNK_END:
+      c->state = BODY_CHUNK_SIZE;
+      break;
+    default:
+      c->state = BODY_DONE;
+    }
+  }
+  return at == len;
+}
+
+static void on_event(client_t* c, uint32_t events) {
+  if (c->connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    c->connecting = false;
+    if (err || (events & (EPOLLERR | EPOLLHUP))) {
+      request_failed(c);
+    } else {
+      send_request(c);
+    }
+    return;
+  }
+  char buf[16384];
+  ssize_t got = recv(c->fd, buf, sizeof(buf), 0);
+  if (got < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  if (got <= 0) {
+    request_failed(c);
+    return;
+  }
+  BYTES += got;
+  if (c->aborting) {
+    ABORTED++;
+    hang_up(c, true);
+    next_request(c);
+    return;
+  }
+  if (!take_body(c, buf, got)) {
+    request_failed(c);
+  } else if (c->state == BODY_DONE) {
+    request_done(c);
+  }
+}
+
+// The server is still up if it answers /status on a new connection
+static bool still_alive(void) {
+  int fd = socket(ADDR.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct timeval timeout = { 5, 0 };
+  static const char REQ[] = "GET /status HTTP/1.1\r\nHost: openlux\r\nConnection: close\r\n\r\n";
+  char buf[256];
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  bool alive = fd >= 0 && connect(fd, (struct sockaddr*) &ADDR, ADDR_LEN) == 0 &&
+               send(fd, REQ, sizeof(REQ) - 1, MSG_NOSIGNAL) == sizeof(REQ) - 1 &&
+               recv(fd, buf, sizeof(buf), 0) > 12 && !strncmp(buf + 8, " 200", 4);
+  if (fd >= 0) {
+    close(fd);
+  }
+  return alive;
+}
+
+static int by_ms(const void* a, const void* b) {
+  float x = ((const sample_t*) a)->ms;
+  float y = ((const sample_t*) b)->ms;
+  return (x > y) - (x < y);
+}
+
+// Of samples sorted by latency
+static float percentile(const sample_t* s, size_t n, double p) {
+  return n ? s[(size_t) (p * (n - 1) + 0.5)].ms : 0;
+}
+
+static bool resolve(const char* where) {
+  char host[256];
+  snprintf(host, sizeof(host), "%s", where);
+  char* colon = strrchr(host, ':');
+  if (!colon) {
+    fprintf(stderr, "The server is host:port, not %s\n", where);
+    return false;
+  }
+  *colon = '\0';
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  struct addrinfo* res;
+  int err = getaddrinfo(host, colon + 1, &hints, &res);
+  if (err) {
+    fprintf(stderr, "Can't find %s: %s\n", where, gai_strerror(err));
+    return false;
+  }
+  memcpy(&ADDR, res->ai_addr, res->ai_addrlen);
+  ADDR_LEN = res->ai_addrlen;
+  freeaddrinfo(res);
+  return true;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [options] [HOST:PORT]\n"
+          "  -c, --clients N        clients at once, each with its own connection\n"
+          "                         (default 32, at most %d)\n"
+          "  -d, --duration S       seconds to keep making requests for (default 10)\n"
+          "  -u, --uri PATH         request PATH, more than once for a mix of requests\n"
+          "                         (default /status, / and /app.js)\n"
+          "  -a, --abort F          hang up on this fraction of responses as they start\n"
+          "  -k, --no-keep-alive    a new connection for every request\n"
+          "The server defaults to localhost:8080, the simulator.\n",
+          prog, MAX_CLIENTS);
+}
+
+int main(int argc, char** argv) {
+  static const struct option OPTS[] = {
+    { "clients", required_argument, NULL, 'c' },
+    { "duration", required_argument, NULL, 'd' },
+    { "uri", required_argument, NULL, 'u' },
+    { "abort", required_argument, NULL, 'a' },
+    { "no-keep-alive", no_argument, NULL, 'k' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  int n_clients = 32;
+  double duration = 10;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:d:u:a:kh", OPTS, NULL)) != -1) {
+    switch (opt) {
+    case 'c':
+      n_clients = atoi(optarg);
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'u':
+      if (N_URIS < MAX_URIS) {
+        URIS[N_URIS++] = optarg;
+      }
+      break;
+    case 'a':
+      ABORT = atof(optarg);
+      break;
+    case 'k':
+      KEEP_ALIVE = false;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  const char* target = (optind < argc) ? argv[optind] : "localhost:8080";
+  if (optind < argc - 1 || n_clients < 1 || n_clients > MAX_CLIENTS || !resolve(target)) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!N_URIS) {
+    URIS[N_URIS++] = "/status";
+    URIS[N_URIS++] = "/";
+    URIS[N_URIS++] = "/app.js";
+  }
+  EPOLL_FD = epoll_create1(EPOLL_CLOEXEC);
+  int64_t start = now_us();
+  int64_t stop = start + (int64_t) (duration * 1e6);
+  for (int i = 0; i < n_clients; i++) {
+    CLIENTS[i].fd = -1;
+    connect_client(&CLIENTS[i]);
+  }
+  // Once time is up, whatever is still in flight gets a few seconds to finish
+  int64_t give_up = stop + 5000000;
+  int open = n_clients;
+  while (open > 0 && now_us() < give_up) {
+    struct epoll_event events[64];
+    int n = epoll_wait(EPOLL_FD, events, 64, 50);
+    for (int i = 0; i < n; i++) {
+      client_t* c = (client_t*) events[i].data.ptr;
+      if (c->fd >= 0) {
+        on_event(c, events[i].events);
+      }
+    }
+    STOPPING = now_us() >= stop;
+    if (STOPPING) {
+      open = 0;
+      for (int i = 0; i < n_clients; i++) {
+        open += CLIENTS[i].fd >= 0;
+      }
+    }
+  }
+  double elapsed = (now_us() - start) / 1e6;
+  for (int i = 0; i < n_clients; i++) {
+    if (CLIENTS[i].fd >= 0) {
+      ERRORS[CLIENTS[i].uri]++;
+      hang_up(&CLIENTS[i], false);
+    }
+  }
+  bool alive = still_alive();
+
+  long errors = 0;
+  for (int u = 0; u < N_URIS; u++) {
+    errors += ERRORS[u];
+  }
+  qsort(SAMPLES, N_SAMPLES, sizeof(sample_t), by_ms);
+  printf("{\n  \"target\": \"%s\", \"clients\": %d, \"duration_s\": %.3f,\n", target, n_clients,
+         elapsed);
+  printf("  \"requests\": %zu, \"errors\": %ld, \"retried\": %ld, \"aborted\": %ld, "
+         "\"connects\": %ld,\n", N_SAMPLES, errors, RETRIED, ABORTED, CONNECTS);
+  printf("  \"req_per_s\": %.1f, \"mbytes_per_s\": %.3f,\n", N_SAMPLES / elapsed,
+         BYTES / elapsed / 1e6);
+  printf("  \"latency_ms\": { \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f },\n",
+         percentile(SAMPLES, N_SAMPLES, 0.5), percentile(SAMPLES, N_SAMPLES, 0.9),
+         percentile(SAMPLES, N_SAMPLES, 0.99), percentile(SAMPLES, N_SAMPLES, 1));
+  printf("  \"uris\": [\n");
+  // The samples are in latency order, so each URI's are too
+  sample_t* mine = malloc((N_SAMPLES + 1) * sizeof(sample_t));
+  for (int u = 0; u < N_URIS; u++) {
+    size_t n = 0;
+    for (size_t i = 0; i < N_SAMPLES; i++) {
+      if (SAMPLES[i].uri == u) {
+        mine[n++] = SAMPLES[i];
+      }
+    }
+    printf("    { \"uri\": \"%s\", \"requests\": %zu, \"errors\": %ld, \"p50_ms\": %.2f, "
+           "\"p99_ms\": %.2f }%s\n", URIS[u], n, ERRORS[u], percentile(mine, n, 0.5),
+           percentile(mine, n, 0.99), (u < N_URIS - 1) ? "," : "");
+  }
+  free(mine);
+  printf("  ],\n  \"alive\": %s\n}\n", alive ? "true" : "false");
+  return alive ? EXIT_SUCCESS : EXIT_FAILURE;
+}
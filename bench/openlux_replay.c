@@ -0,0 +1,586 @@
+// Replays a trace recorded with /trace (see trace.h) on the simulator, faster
+// than real time, and compares what the firmware does now with what it did
+// then. The plate is made to read as it did: each well at each wavelength is
+// given the OD its recorded measurements came to, one after another, and
+// every HTTP request but /events and /trace is made again, body and all, at
+// the time it was first made. The firmware starts with the carriage where it
+// was and the calibration it had. The comparison is printed as JSON:
+//
+//   { "recorded": { "duration_s", "requests", "moves", "wells", "readings",
+//                   "dropped", "homing_s", "moving_s", "reading_s" },
+//     "replayed": { the same, "requests_failed", "wall_time_s" },
+//     "moves_matching", "signal_error_max", "slowdown" }
+//
+// Durations run from the start of the trace to the last status change, so
+// slowdown (replayed over recorded duration, less one) is how much longer the
+// same work took. Moves match when the nth move of each went the same way,
+// and the signal error is the worst difference between a well's nth recorded
+// and replayed measurements. With --max-slowdown the exit status says whether
+// the replay kept within it, for git bisect run.
+//
+// Requests and the plate follow the simulated clock, so a trace is replayed
+// the same way every time. The firmware's tasks are still threads the host
+// schedules, which leaves some jitter in the timings, more the faster the
+// clock runs.
+#include "common.h"
+#include "plate.h"
+#include "sensors.h"
+#include "motors.h"
+#include "job.h"
+#include "batch.h"
+#include "results.h"
+#include "calib.h"
+#include "trace.h"
+#include "web.h"
+#include "sim.h"
+#include <esp_timer.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Wavelengths the plate can be given, one per LED the simulator can drive
+#define MAX_CHANNELS 4
+// Longest the replay waits for the firmware to finish after the last request,
+// beyond the recorded duration
+static const int64_t FINISH_GRACE_US = 60000000;
+
+typedef struct event {
+  int64_t time_us;       // Since the trace started
+  trace_record_t rec;
+  const uint8_t* extra;  // rec.len bytes
+} event_t;
+
+typedef struct trace {
+  trace_header_t header;
+  event_t* events;
+  size_t n_events;
+} trace_t;
+
+typedef struct tally {
+  int64_t end_us;        // Last status change
+  int requests;
+  int moves;
+  int wells;
+  int readings;
+  int dropped;
+  int64_t in_status_us[READING + 1];
+} tally_t;
+
+// What the replay itself records, drained as it goes
+static uint8_t* REPLAYED = NULL;
+static size_t REPLAYED_LEN = 0;
+static size_t REPLAYED_CAP = 0;
+
+static uint16_t PORT = 18080;
+static atomic_int IN_FLIGHT = 0;
+static atomic_int FAILED = 0;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint8_t* read_file(const char* path, size_t* size) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  long len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  uint8_t* data = malloc(len > 0 ? len : 1);
+  if (!data || fread(data, 1, len, fp) != (size_t) len) {
+    free(data);
+    data = NULL;
+  }
+  fclose(fp);
+  *size = len;
+  return data;
+}
+
+// Index the records, which stay where they are in data
+static bool parse_trace(const uint8_t* data, size_t size, trace_t* t, const char* what) {
+  if (size < sizeof(trace_header_t)) {
+    fprintf(stderr, "%s is too short to be a trace\n", what);
+    return false;
+  }
+  memcpy(&t->header, data, sizeof(t->header));
+  if (t->header.magic != TRACE_MAGIC || t->header.version != TRACE_VERSION) {
+    fprintf(stderr, "%s isn't a version %d trace\n", what, TRACE_VERSION);
+    return false;
+  }
+  size_t cap = 1024;
+  t->events = malloc(cap * sizeof(event_t));
+  t->n_events = 0;
+  int64_t time_us = 0;
+  size_t off = sizeof(trace_header_t);
+  while (off + sizeof(trace_record_t) <= size) {
+    trace_record_t rec;
+    memcpy(&rec, data + off, sizeof(rec));
+    if (off + sizeof(rec) + rec.len > size) {
+      break;
+    }
+    if (t->n_events == cap) {
+      cap *= 2;
+      t->events = realloc(t->events, cap * sizeof(event_t));
+    }
+    time_us += rec.dt_us;
+    t->events[t->n_events++] = (event_t) { time_us, rec, data + off + sizeof(rec) };
+    off += sizeof(rec) + rec.len;
+  }
+  if (off != size) {
+    fprintf(stderr, "%s ends part way through a record, which is ignored\n", what);
+  }
+  return true;
+}
+
+static void tally_trace(const trace_t* t, tally_t* s) {
+  int64_t since[READING + 1];
+  memset(s, 0, sizeof(*s));
+  for (int i = 0; i <= READING; i++) {
+    since[i] = -1;
+  }
+  for (size_t i = 0; i < t->n_events; i++) {
+    const event_t* ev = &t->events[i];
+    int status = ev->rec.arg;
+    switch (ev->rec.kind) {
+    case TRACE_READING:
+      s->readings++;
+      break;
+    case TRACE_MOVE:
+      s->moves++;
+      break;
+    case TRACE_WELL:
+      s->wells++;
+      break;
+    case TRACE_REQUEST:
+      s->requests++;
+      break;
+    case TRACE_GAP:
+      s->dropped += ev->rec.a;
+      break;
+    case TRACE_STATUS:
+      s->end_us = ev->time_us;
+      if (status > READING) {
+        break;
+      }
+      if (ev->rec.a) {
+        since[status] = ev->time_us;
+      } else if (since[status] >= 0) {
+        s->in_status_us[status] += ev->time_us - since[status];
+        since[status] = -1;
+      }
+      break;
+    }
+  }
+}
+
+static void print_tally(const char* name, const tally_t* s) {
+  printf("  \"%s\": { \"duration_s\": %.3f, \"requests\": %d, \"moves\": %d, \"wells\": %d, "
+         "\"readings\": %d, \"dropped\": %d, \"homing_s\": %.3f, \"moving_s\": %.3f, "
+         "\"reading_s\": %.3f",
+         name, s->end_us / 1e6, s->requests, s->moves, s->wells, s->readings, s->dropped,
+         s->in_status_us[HOMING] / 1e6, s->in_status_us[MOVING] / 1e6,
+         s->in_status_us[READING] / 1e6);
+  printf(" },\n");
+}
+
+// Keep what the replay is recording, before the ring fills up
+static void drain_replayed(void) {
+  for (;;) {
+    if (REPLAYED_CAP - REPLAYED_LEN < 4096) {
+      REPLAYED_CAP = REPLAYED_CAP ? REPLAYED_CAP * 2 : 65536;
+      REPLAYED = realloc(REPLAYED, REPLAYED_CAP);
+    }
+    size_t n = trace_read(REPLAYED + REPLAYED_LEN, REPLAYED_CAP - REPLAYED_LEN);
+    if (!n) {
+      break;
+    }
+    REPLAYED_LEN += n;
+  }
+}
+
+// Wait on the simulated clock, keeping the replayed trace drained
+static void wait_until(int64_t due_us) {
+  for (;;) {
+    drain_replayed();
+    int64_t left_ms = (due_us - esp_timer_get_time()) / 1000;
+    if (left_ms <= 0) {
+      return;
+    }
+    TickType_t ticks = ((left_ms < 50) ? left_ms : 50) / portTICK_PERIOD_MS;
+    vTaskDelay(ticks ? ticks : 1);
+  }
+}
+
+typedef struct request {
+  int method;
+  char uri[HTTPD_MAX_URI_LEN + 1];
+  const uint8_t* body;
+  size_t len;
+} request_t;
+
+// Make one request of the firmware over loopback, on a thread of its own so
+// that a slow answer doesn't hold up the rest of the replay
+static void* send_request(void* arg) {
+  static const char* METHODS[] = { "DELETE", "GET", "HEAD", "POST", "PUT" };
+  request_t* req = (request_t*) arg;
+  char head[HTTPD_MAX_URI_LEN + 160];
+  int status = 0;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(PORT) };
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int len = snprintf(head, sizeof(head),
+                     "%s %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n"
+                     "Content-Length: %zu\r\n\r\n",
+                     (req->method >= 0 && req->method <= 4) ? METHODS[req->method] : "GET",
+                     req->uri, req->len);
+  if (fd >= 0 && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0 &&
+      send(fd, head, len, MSG_NOSIGNAL) == len &&
+      (!req->len || send(fd, req->body, req->len, MSG_NOSIGNAL) == (ssize_t) req->len)) {
+    // Only the status line matters, but the rest is read so the server
+    // isn't held up writing it
+    char buf[4096];
+    ssize_t got;
+    bool first = true;
+    while ((got = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+      if (first) {
+        buf[got] = '\0';
+        sscanf(buf, "HTTP/1.%*d %d", &status);
+        first = false;
+      }
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (status < 200 || status >= 400) {
+    atomic_fetch_add(&FAILED, 1);
+  }
+  atomic_fetch_sub(&IN_FLIGHT, 1);
+  free(req);
+  return NULL;
+}
+
+// Requests that stream, or are about the trace, aren't made again
+static bool replayable(const char* uri) {
+  return strncmp(uri, "/events", 7) && strncmp(uri, "/trace", 6);
+}
+
+static void replay_request(const trace_t* t, size_t i) {
+  const event_t* ev = &t->events[i];
+  request_t* req = calloc(1, sizeof(request_t));
+  size_t len = (ev->rec.len < HTTPD_MAX_URI_LEN) ? ev->rec.len : HTTPD_MAX_URI_LEN;
+  memcpy(req->uri, ev->extra, len);
+  req->method = ev->rec.arg;
+  if (!replayable(req->uri)) {
+    free(req);
+    return;
+  }
+  // The body, if it was traced, comes before the next request
+  for (size_t j = i + 1; j < t->n_events && t->events[j].rec.kind != TRACE_REQUEST; j++) {
+    if (t->events[j].rec.kind == TRACE_BODY) {
+      req->body = t->events[j].extra;
+      req->len = t->events[j].rec.len;
+      break;
+    }
+  }
+  pthread_t thread;
+  atomic_fetch_add(&IN_FLIGHT, 1);
+  if (pthread_create(&thread, NULL, send_request, req)) {
+    atomic_fetch_sub(&IN_FLIGHT, 1);
+    atomic_fetch_add(&FAILED, 1);
+    free(req);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+// The nth measurement of a well at a wavelength is followed by next[n]
+static size_t* follow_wells(const trace_t* t, size_t first[MAX_CHANNELS][PLATE_WELLS]) {
+  size_t* next = malloc((t->n_events + 1) * sizeof(size_t));
+  for (int c = 0; c < MAX_CHANNELS; c++) {
+    for (int w = 0; w < PLATE_WELLS; w++) {
+      first[c][w] = SIZE_MAX;
+    }
+  }
+  for (size_t i = t->n_events; i-- > 0;) {
+    const trace_record_t* rec = &t->events[i].rec;
+    next[i] = SIZE_MAX;
+    if (rec->kind == TRACE_WELL && rec->arg < MAX_CHANNELS && rec->a >= 0 &&
+        rec->a < PLATE_WELLS) {
+      next[i] = first[rec->arg][rec->a];
+      first[rec->arg][rec->a] = i;
+    }
+  }
+  return next;
+}
+
+// Put a well at the OD its measurement at event i came to
+static void plate_from(const trace_t* t, size_t i) {
+  if (i == SIZE_MAX) {
+    return;
+  }
+  const trace_record_t* rec = &t->events[i].rec;
+  double od = sim_od_for_signal(rec->b / 100.0);
+  sim_set_well_od(rec->a / PLATE_COLS + 1, rec->a % PLATE_COLS + 1, rec->arg,
+                  (od > 0) ? od : 0);
+}
+
+// The worst difference between the nth recorded and replayed measurement of
+// each well at each wavelength
+static float signal_error(const trace_t* rec, const trace_t* rep) {
+  static size_t rec_first[MAX_CHANNELS][PLATE_WELLS];
+  static size_t rep_first[MAX_CHANNELS][PLATE_WELLS];
+  size_t* rec_next = follow_wells(rec, rec_first);
+  size_t* rep_next = follow_wells(rep, rep_first);
+  float worst = 0;
+  for (int c = 0; c < MAX_CHANNELS; c++) {
+    for (int w = 0; w < PLATE_WELLS; w++) {
+      for (size_t i = rec_first[c][w], j = rep_first[c][w]; i != SIZE_MAX && j != SIZE_MAX;
+           i = rec_next[i], j = rep_next[j]) {
+        float err = fabsf(rec->events[i].rec.b - rep->events[j].rec.b) / 100.0f;
+        worst = (err > worst) ? err : worst;
+      }
+    }
+  }
+  free(rec_next);
+  free(rep_next);
+  return worst;
+}
+
+static int matching_moves(const trace_t* a, const trace_t* b) {
+  int matching = 0;
+  size_t i = 0, j = 0;
+  for (;;) {
+    while (i < a->n_events && a->events[i].rec.kind != TRACE_MOVE) {
+      i++;
+    }
+    while (j < b->n_events && b->events[j].rec.kind != TRACE_MOVE) {
+      j++;
+    }
+    if (i == a->n_events || j == b->n_events) {
+      return matching;
+    }
+    matching += a->events[i].rec.a == b->events[j].rec.a &&
+                a->events[i].rec.b == b->events[j].rec.b;
+    i++;
+    j++;
+  }
+}
+
+static void temp_file(char* path) {
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "Can't make a temporary file\n");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+}
+
+// Put the carriage where the device had it at rest, and give the firmware
+// the calibration it had, before it starts
+static void start_from(const trace_t* t) {
+  if (!t->n_events || t->events[0].rec.kind != TRACE_START) {
+    return;
+  }
+  const event_t* ev = &t->events[0];
+  if (ev->rec.a >= 0 && ev->rec.b >= 0) {
+    sim_set_carriage(ev->rec.a, ev->rec.b);
+    park_preset(ev->rec.a, ev->rec.b);
+  }
+  if (ev->rec.len) {
+    calib_preset(ev->extra, ev->rec.len);
+  }
+}
+
+// Bring the firmware up as the simulator does, minus the staging
+static void boot(void) {
+  init_status();
+  start_job_runner();
+  start_batch_runner();
+  open_results();
+  load_calibration();
+  start_sensor_polling(ADC_ATTEN_DB_0, CONFIG_OPENLUX_SENSOR_PERIOD_MS);
+  setup_motor_driver();
+  // With the carriage not at rest when the trace started, this homes first
+  start_goto_loop(xTaskGetCurrentTaskHandle());
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  sim_httpd_set_port(PORT);
+  if (!start_webserver()) {
+    fprintf(stderr, "Can't serve on port %u\n", PORT);
+    exit(EXIT_FAILURE);
+  }
+  begin_status(READY);
+}
+
+static bool busy(void) {
+  return job_running() || batch_busy() || in_status(HOMING) || in_status(MOVING) ||
+         in_status(READING) || atomic_load(&IN_FLIGHT) > 0;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [options] TRACE\n"
+          "  -t, --time-scale N     replay N times faster than recorded (default 20)\n"
+          "  -p, --port PORT        port the firmware serves the replayed requests on\n"
+          "                         (default %u)\n"
+          "  -s, --seed N           seed for the simulated plate, for wells never measured\n"
+          "  -o, --output FILE      keep the trace of the replay in FILE\n"
+          "  -m, --max-slowdown F   fail if the replay took more than F longer (0.1 for\n"
+          "                         10%%) than the recording\n",
+          prog, PORT);
+}
+
+int main(int argc, char** argv) {
+  static const struct option OPTS[] = {
+    { "time-scale", required_argument, NULL, 't' },
+    { "port", required_argument, NULL, 'p' },
+    { "seed", required_argument, NULL, 's' },
+    { "output", required_argument, NULL, 'o' },
+    { "max-slowdown", required_argument, NULL, 'm' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  double scale = 20;
+  double max_slowdown = -1;
+  const char* output = NULL;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "t:p:s:o:m:h", OPTS, NULL)) != -1) {
+    switch (opt) {
+    case 't':
+      scale = atof(optarg);
+      break;
+    case 'p':
+      PORT = atoi(optarg);
+      break;
+    case 's':
+      sim_plate_seed(strtoul(optarg, NULL, 0));
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'm':
+      max_slowdown = atof(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  size_t size;
+  uint8_t* data = read_file(argv[optind], &size);
+  trace_t recorded;
+  if (!data) {
+    fprintf(stderr, "Can't read %s\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+  if (!parse_trace(data, size, &recorded, argv[optind])) {
+    return EXIT_FAILURE;
+  }
+  if (recorded.header.wells != PLATE_WELLS) {
+    fprintf(stderr, "The trace is of a %u well plate, and this was built for %d\n",
+                    recorded.header.wells, PLATE_WELLS);
+    return EXIT_FAILURE;
+  }
+  if (recorded.header.channels > SENSOR_CHANNELS) {
+    fprintf(stderr, "The trace has %u channels and this was built for %d, so some wells "
+                    "won't be measured\n", recorded.header.channels, SENSOR_CHANNELS);
+  }
+  esp_log_level_set("*", ESP_LOG_WARN);
+  char log_path[] = "/tmp/openlux-replay-XXXXXX";
+  char settings_path[] = "/tmp/openlux-replay-XXXXXX";
+  temp_file(log_path);
+  temp_file(settings_path);
+  sim_set_store_path(log_path);
+  sim_set_settings_path(settings_path);
+  sim_set_time_scale(scale);
+  start_from(&recorded);
+  // The web files are packed into the build directory
+  if (chdir(BENCH_ROOT)) {
+    fprintf(stderr, "Can't change into %s\n", BENCH_ROOT);
+    return EXIT_FAILURE;
+  }
+  boot();
+
+  // Every well starts at what it was first measured as
+  static size_t first[MAX_CHANNELS][PLATE_WELLS];
+  size_t* next = follow_wells(&recorded, first);
+  for (int c = 0; c < MAX_CHANNELS; c++) {
+    for (int w = 0; w < PLATE_WELLS; w++) {
+      plate_from(&recorded, first[c][w]);
+    }
+  }
+  double wall_start = now_ns();
+  trace_start();
+  int64_t start_us = esp_timer_get_time();
+  for (size_t i = 0; i < recorded.n_events; i++) {
+    const event_t* ev = &recorded.events[i];
+    if (ev->rec.kind == TRACE_REQUEST) {
+      wait_until(start_us + ev->time_us);
+      replay_request(&recorded, i);
+    } else if (ev->rec.kind == TRACE_WELL) {
+      // Once measured, a well moves on to what it was measured as next
+      wait_until(start_us + ev->time_us);
+      plate_from(&recorded, next[i]);
+    }
+  }
+  tally_t rec_tally;
+  tally_trace(&recorded, &rec_tally);
+  int64_t give_up = start_us + 2 * rec_tally.end_us + FINISH_GRACE_US;
+  wait_until(start_us + rec_tally.end_us);
+  while (busy() && esp_timer_get_time() < give_up) {
+    wait_until(esp_timer_get_time() + 100000);
+  }
+  trace_stop();
+  drain_replayed();
+  double wall_ns = now_ns() - wall_start;
+  unlink(log_path);
+  unlink(settings_path);
+
+  trace_t replayed;
+  if (!parse_trace(REPLAYED, REPLAYED_LEN, &replayed, "The replay")) {
+    return EXIT_FAILURE;
+  }
+  if (output) {
+    FILE* fp = fopen(output, "wb");
+    if (!fp || fwrite(REPLAYED, 1, REPLAYED_LEN, fp) != REPLAYED_LEN) {
+      fprintf(stderr, "Can't write %s\n", output);
+    }
+    if (fp) {
+      fclose(fp);
+    }
+  }
+  tally_t rep_tally;
+  tally_trace(&replayed, &rep_tally);
+  double slowdown = rec_tally.end_us ? (double) rep_tally.end_us / rec_tally.end_us - 1 : 0;
+  printf("{\n");
+  print_tally("recorded", &rec_tally);
+  printf("  \"replayed\": { \"duration_s\": %.3f, \"requests\": %d, \"requests_failed\": %d, "
+         "\"moves\": %d, \"wells\": %d, \"readings\": %d, \"dropped\": %d, \"homing_s\": %.3f, "
+         "\"moving_s\": %.3f, \"reading_s\": %.3f, \"wall_time_s\": %.3f },\n",
+         rep_tally.end_us / 1e6, rep_tally.requests, atomic_load(&FAILED), rep_tally.moves,
+         rep_tally.wells, rep_tally.readings, rep_tally.dropped,
+         rep_tally.in_status_us[HOMING] / 1e6, rep_tally.in_status_us[MOVING] / 1e6,
+         rep_tally.in_status_us[READING] / 1e6, wall_ns / 1e9);
+  printf("  \"moves_matching\": %d, \"signal_error_max\": %.2f, \"slowdown\": %.4f\n}\n",
+         matching_moves(&recorded, &replayed), signal_error(&recorded, &replayed), slowdown);
+  if (max_slowdown >= 0 && slowdown > max_slowdown) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,112 @@
+// Compare well orders for 96 and 384 well selections by predicted travel
+// time: the order the wells were selected in, the browser's old greedy
+// Euclidean sort, and route_wells. Also times route_wells itself.
+#include "route.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#define MAX_WELLS 384
+// Times each route is recomputed to get a steady timing
+static const int REPEATS = 20;
+
+static const motion_profile_t PROFILE = {
+  .start_rate = CONFIG_OPENLUX_START_STEP_RATE,
+  .max_rate = CONFIG_OPENLUX_MAX_STEP_RATE,
+  .accel = CONFIG_OPENLUX_STEP_ACCEL
+};
+
+static const plate_grid_t PLATES[] = {
+  { 8, 12, 464 },
+  { 16, 24, 232 }
+};
+
+static uint32_t RNG = 12345;
+
+static uint32_t xorshift(void) {
+  RNG ^= RNG << 13;
+  RNG ^= RNG >> 17;
+  RNG ^= RNG << 5;
+  return RNG;
+}
+
+typedef enum { FULL, HALF, QUARTER, CHECKER, ROWS } selection_t;
+static const char* SELECTION_NAMES[] = { "full", "random 1/2", "random 1/4",
+                                         "checkerboard", "alternate rows" };
+
+// Wells in row-major order, as the page collects them
+static int select_wells(int* wells, const plate_grid_t* grid, selection_t sel) {
+  int n = 0;
+  for (int r = 0; r < grid->rows; r++) {
+    for (int c = 0; c < grid->cols; c++) {
+      bool pick = (sel == FULL) ||
+                  (sel == HALF && xorshift() % 2 == 0) ||
+                  (sel == QUARTER && xorshift() % 4 == 0) ||
+                  (sel == CHECKER && (r + c) % 2 == 0) ||
+                  (sel == ROWS && r % 2 == 0);
+      if (pick) {
+        wells[n++] = r * grid->cols + c;
+      }
+    }
+  }
+  return n;
+}
+
+// What sortDistance in app.js does: take the first well, then repeatedly
+// re-sort the rest by straight line distance from the one just taken
+static void browser_sort(int* wells, int n, const plate_grid_t* grid) {
+  for (int i = 0; i + 1 < n; i++) {
+    int cur = wells[i];
+    int best = i + 1;
+    double best_d = INFINITY;
+    for (int j = i + 1; j < n; j++) {
+      double dr = wells[j] / grid->cols - cur / grid->cols;
+      double dc = wells[j] % grid->cols - cur % grid->cols;
+      double d = sqrt(dr * dr + dc * dc);
+      if (d < best_d) {
+        best = j;
+        best_d = d;
+      }
+    }
+    // Array.sort is stable, so ties keep their order: shift rather than swap
+    int pick = wells[best];
+    memmove(&wells[i + 2], &wells[i + 1], (best - i - 1) * sizeof(int));
+    wells[i + 1] = pick;
+  }
+}
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(void) {
+  static int selected[MAX_WELLS];
+  static int wells[MAX_WELLS];
+  printf("%-6s %-15s %5s %12s %12s %12s %10s\n", "plate", "selection", "wells",
+         "selected s", "greedy s", "route s", "route us");
+  for (size_t p = 0; p < sizeof(PLATES) / sizeof(PLATES[0]); p++) {
+    const plate_grid_t* grid = &PLATES[p];
+    for (selection_t sel = FULL; sel <= ROWS; sel++) {
+      int n = select_wells(selected, grid, sel);
+      int64_t as_selected = route_cost(selected, n, -1, grid, &PROFILE);
+      memcpy(wells, selected, n * sizeof(int));
+      browser_sort(wells, n, grid);
+      int64_t greedy = route_cost(wells, n, -1, grid, &PROFILE);
+      int64_t routed = 0;
+      double start = now_us();
+      for (int i = 0; i < REPEATS; i++) {
+        memcpy(wells, selected, n * sizeof(int));
+        routed = route_wells(wells, n, -1, grid, &PROFILE);
+      }
+      double took = (now_us() - start) / REPEATS;
+      printf("%-6d %-15s %5d %12.2f %12.2f %12.2f %10.0f\n",
+             grid->rows * grid->cols, SELECTION_NAMES[sel], n, as_selected / 1e6,
+             greedy / 1e6, routed / 1e6, took);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,732 @@
+// Runs several OpenLUX readers as one. The gateway keeps the event stream
+// (/events) of every device open, fans plate runs out to all of them (POST
+// /run, and DELETE /run to stop) and writes what they measure as one CSV
+// stream, in time order across devices:
+//
+//   time_s,device,event,cycle,well,channel,value,dark,signal_se,od
+//
+// time_s is seconds since the gateway started. Measured wells ("well") give
+// the mean lit reading as value, or -1 if the well couldn't be read, as the
+// event stream does. Readings ("reading", with -R) give the raw ADC value and
+// are stamped with when the device took them rather than when they arrived.
+// Lines are held back for HOLDBACK_US so that those from different devices
+// come out in order. "start", "cycle", "done" and "stopped" follow the plate
+// run, "status" lines carry the device status as value, "refused" the HTTP
+// status of a run a device wouldn't start, and "connected" and "lost" say when
+// a device's event stream came and went.
+//
+// Everything happens on one thread over non-blocking sockets and epoll, so a
+// slow or unreachable device never holds up the others. Devices that drop off
+// are reconnected with a growing back off.
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Most devices one gateway drives
+#define MAX_DEVICES 32
+// Room for a couple of the device's event frames, which are at most 2048 bytes
+#define IN_SIZE 8192
+#define OUT_SIZE 1024
+#define NAME_SIZE 32
+#define WELL_SIZE 12
+// Merged lines waiting for their turn to be written. Should this fill up, the
+// earliest goes out straight away.
+#define PENDING_SIZE 4096
+#define LINE_SIZE 160
+
+// Long enough for one device's frame (100 ms apart) to catch up with another's
+static const int64_t HOLDBACK_US = 500000;
+// A device's clock offset is the smallest seen over this window and the last
+static const int64_t OFFSET_WINDOW_US = 5000000;
+static const int64_t RETRY_MIN_US = 500000;
+static const int64_t RETRY_MAX_US = 30000000;
+// How often retries and held back lines are seen to when nothing arrives
+static const int TICK_MS = 50;
+// How often a device is asked whether its run is still going, in case the
+// done or stopped event never comes
+static const int64_t POLL_US = 2000000;
+
+typedef enum conn_state {
+  CONN_IDLE,             // No socket, waiting for retry_at
+  CONN_CONNECTING,
+  CONN_SENDING,
+  CONN_RECEIVING
+} conn_state_t;
+
+// Requests made on a device's command connection, one at a time
+typedef enum request {
+  REQ_NONE,
+  REQ_PLATE,             // GET /plate, for well names
+  REQ_RUN,               // POST /run
+  REQ_PROGRESS,          // GET /run, after the event stream was lost
+  REQ_STOP               // DELETE /run
+} request_t;
+
+typedef enum run_state {
+  RUN_WAITING,           // Not started yet, or not asked for
+  RUN_GOING,
+  RUN_ENDED
+} run_state_t;
+
+struct device;
+
+typedef struct conn {
+  struct device* dev;
+  bool events;           // The event stream, or else requests answered and closed
+  int fd;
+  conn_state_t state;
+  int64_t retry_at;
+  int64_t backoff_us;
+  char out[OUT_SIZE];
+  size_t out_len;
+  size_t out_sent;
+  char in[IN_SIZE];
+  size_t in_len;
+  int status;            // HTTP status, once the headers are in
+  size_t body_at;        // Where the body starts in in
+  long content_len;      // Or -1 if the body runs until the connection closes
+} conn_t;
+
+typedef struct device {
+  char name[NAME_SIZE];
+  char host[NAME_SIZE * 2];
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  conn_t events;
+  conn_t command;
+  request_t request;     // In flight on command
+  bool streaming;        // The event stream is up
+  bool check_run;        // The stream was lost during the run, so ask after it
+  bool stop_sent;
+  int64_t poll_at;       // When to next ask after the run
+  int idle_polls;        // Answers in a row saying the run isn't going
+  int cols;              // Plate columns, 0 until known and -1 if never
+  run_state_t run;
+  // Smallest gap between readings being taken and arriving, this window and last
+  int64_t window_start;
+  int64_t gap_min;
+  int64_t gap_prev;
+} device_t;
+
+typedef struct pending {
+  int64_t time_us;
+  uint64_t order;        // Keeps lines of the same time in arrival order
+  char line[LINE_SIZE];
+} pending_t;
+
+static device_t DEVICES[MAX_DEVICES];
+static int N_DEVICES = 0;
+static int EPOLL_FD = -1;
+static int64_t START_US = 0;
+static FILE* OUT = NULL;
+static bool QUIET = false;
+static bool READINGS = false;
+static const char* RUN_BODY = NULL;
+static bool REFUSED = false;
+static volatile sig_atomic_t STOP_REQUESTS = 0;
+
+static pending_t PENDING[PENDING_SIZE];
+static int N_PENDING = 0;
+static uint64_t N_LINES = 0;
+
+static int64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void note(const device_t* dev, const char* fmt, ...) {
+  if (QUIET) {
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "%s: ", dev->name);
+  vfprintf(stderr, fmt, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+// ---------------------------------------------------------------------------
+// Merging: a min-heap of lines by time
+// ---------------------------------------------------------------------------
+
+static bool before(const pending_t* a, const pending_t* b) {
+  return a->time_us < b->time_us || (a->time_us == b->time_us && a->order < b->order);
+}
+
+static void swap(int i, int j) {
+  pending_t tmp = PENDING[i];
+  PENDING[i] = PENDING[j];
+  PENDING[j] = tmp;
+}
+
+static void write_earliest(void) {
+  fputs(PENDING[0].line, OUT);
+  PENDING[0] = PENDING[--N_PENDING];
+  for (int i = 0;;) {
+    int least = i;
+    int l = 2 * i + 1, r = 2 * i + 2;
+    if (l < N_PENDING && before(&PENDING[l], &PENDING[least])) {
+      least = l;
+    }
+    if (r < N_PENDING && before(&PENDING[r], &PENDING[least])) {
+      least = r;
+    }
+    if (least == i) {
+      break;
+    }
+    swap(i, least);
+    i = least;
+  }
+}
+
+// Write every line older than the hold back, or all of them
+static void flush_pending(int64_t now, bool all) {
+  bool any = false;
+  while (N_PENDING > 0 && (all || PENDING[0].time_us <= now - HOLDBACK_US)) {
+    write_earliest();
+    any = true;
+  }
+  if (any) {
+    fflush(OUT);
+  }
+}
+
+// Queue "time_s,device," and the rest of a line
+static void emit(int64_t time_us, const device_t* dev, const char* fmt, ...) {
+  if (N_PENDING == PENDING_SIZE) {
+    write_earliest();
+  }
+  pending_t* p = &PENDING[N_PENDING];
+  p->time_us = time_us;
+  p->order = N_LINES++;
+  int len = snprintf(p->line, LINE_SIZE, "%.3f,%s,", (time_us - START_US) / 1e6, dev->name);
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(p->line + len, LINE_SIZE - len - 1, fmt, args);
+  va_end(args);
+  len = strlen(p->line);
+  p->line[len] = '\n';
+  p->line[len + 1] = '\0';
+  for (int i = N_PENDING++; i > 0 && before(&PENDING[i], &PENDING[(i - 1) / 2]);
+       i = (i - 1) / 2) {
+    swap(i, (i - 1) / 2);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Connections
+// ---------------------------------------------------------------------------
+
+static void watch(conn_t* conn, uint32_t events, int op) {
+  struct epoll_event ev = { .events = events, .data.ptr = conn };
+  epoll_ctl(EPOLL_FD, op, conn->fd, &ev);
+}
+
+static void fail_conn(conn_t* conn, int64_t now, const char* why);
+
+static void open_conn(conn_t* conn, const char* method, const char* path,
+                      const char* body) {
+  device_t* dev = conn->dev;
+  if (conn->events) {
+    conn->out_len = snprintf(conn->out, OUT_SIZE,
+                             "%s %s HTTP/1.1\r\nHost: %s\r\n\r\n", method, path, dev->host);
+  } else {
+    conn->out_len = snprintf(conn->out, OUT_SIZE,
+                             "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n"
+                             "Content-Type: application/x-www-form-urlencoded\r\n"
+                             "Content-Length: %zu\r\n\r\n%s",
+                             method, path, dev->host, strlen(body), body);
+  }
+  conn->out_sent = 0;
+  conn->in_len = 0;
+  conn->status = 0;
+  conn->body_at = 0;
+  conn->content_len = -1;
+  conn->state = CONN_CONNECTING;
+  conn->fd = socket(dev->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (conn->fd < 0) {
+    fail_conn(conn, now_us(), strerror(errno));
+    return;
+  }
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  // Otherwise the connection is seen to when the socket becomes writable
+  if (connect(conn->fd, (struct sockaddr*) &dev->addr, dev->addr_len) < 0 &&
+      errno != EINPROGRESS) {
+    fail_conn(conn, now_us(), strerror(errno));
+    return;
+  }
+  watch(conn, EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+static void close_conn(conn_t* conn) {
+  if (conn->fd >= 0) {
+    epoll_ctl(EPOLL_FD, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  conn->state = CONN_IDLE;
+}
+
+// Give up on the connection for now and try again later
+static void fail_conn(conn_t* conn, int64_t now, const char* why) {
+  device_t* dev = conn->dev;
+  close_conn(conn);
+  conn->retry_at = now + conn->backoff_us;
+  conn->backoff_us = (conn->backoff_us * 2 > RETRY_MAX_US) ? RETRY_MAX_US
+                                                           : conn->backoff_us * 2;
+  if (conn->events && dev->streaming) {
+    dev->streaming = false;
+    dev->check_run = dev->run == RUN_GOING;
+    emit(now, dev, "lost,,,,,,,");
+    note(dev, "event stream lost (%s)", why);
+  } else if (!conn->events) {
+    dev->request = REQ_NONE;
+  }
+}
+
+static void format_well(const device_t* dev, const char* field, char* name) {
+  int well = atoi(field);
+  if (!*field || well < 0) {
+    name[0] = '\0';
+  } else if (dev->cols > 0) {
+    snprintf(name, WELL_SIZE, "%c%d", 'A' + well / dev->cols, well % dev->cols + 1);
+  } else {
+    snprintf(name, WELL_SIZE, "%d", well);
+  }
+}
+
+// Split a line on ';' into at most max fields, keeping empty ones
+static int split(char* line, char** fields, int max) {
+  int n = 0;
+  for (char* tok; n < max && (tok = strsep(&line, ";"));) {
+    fields[n++] = tok;
+  }
+  return n;
+}
+
+// Device time stamps are put on our clock by the smallest gap seen between a
+// reading being taken and arriving, which is the reading that waited least.
+// Only the recent past counts, so clocks running at different rates (the
+// simulator's, for one) are followed.
+static int64_t align(device_t* dev, int64_t now, int64_t device_us) {
+  int64_t gap = now - device_us;
+  if (now - dev->window_start > OFFSET_WINDOW_US) {
+    dev->gap_prev = dev->gap_min;
+    dev->gap_min = gap;
+    dev->window_start = now;
+  } else if (gap < dev->gap_min) {
+    dev->gap_min = gap;
+  }
+  return device_us + ((dev->gap_prev < dev->gap_min) ? dev->gap_prev : dev->gap_min);
+}
+
+static void on_data(device_t* dev, const char* kind, char* data, int64_t now) {
+  char* f[12];
+  char well[WELL_SIZE];
+  if (!strcmp(kind, "status")) {
+    if (split(data, f, 2) == 2) {
+      emit(now, dev, "status,,,,%s,,,", f[1]);
+    }
+  } else if (!strcmp(kind, "job")) {
+    // kind;cycle;well;value, and for measured wells
+    // ;dark;signal;signal_se;light_sd;light_median;od;channel
+    int n = split(data, f, 11);
+    if (n < 4) {
+      return;
+    }
+    format_well(dev, f[2], well);
+    if (!strcmp(f[0], "well") && n == 11) {
+      emit(now, dev, "well,%s,%s,%s,%s,%s,%s,%s", f[1], well, f[10], f[3], f[4], f[6], f[9]);
+    } else {
+      emit(now, dev, "%s,%s,%s,,%s,,,", f[0], f[1], well, f[3]);
+    }
+    if (!strcmp(f[0], "start") && dev->run == RUN_WAITING && dev->request == REQ_RUN) {
+      dev->run = RUN_GOING;
+    } else if ((!strcmp(f[0], "done") || !strcmp(f[0], "stopped")) && dev->run == RUN_GOING) {
+      dev->run = RUN_ENDED;
+      note(dev, "run %s", f[0]);
+    }
+  } else if (!strcmp(kind, "readings") && READINGS) {
+    // seq;time_us;raw;well;led;od;channel
+    if (split(data, f, 7) == 7) {
+      format_well(dev, f[3], well);
+      emit(align(dev, now, strtoll(f[1], NULL, 10)), dev, "reading,,%s,%s,%s,,,%s",
+           well, f[6], f[2], f[5]);
+    }
+  }
+}
+
+// Events are blocks of "event: kind" and "data: ..." lines ending in a blank
+// line. Readings put many data lines in one block.
+static void on_events(conn_t* conn, int64_t now) {
+  char* start = conn->in + conn->body_at;
+  char* end = conn->in + conn->in_len;
+  char* stop;
+  while ((stop = memmem(start, end - start, "\n\n", 2))) {
+    *stop = '\0';
+    const char* kind = "message";
+    char* rest = start;
+    for (char* line; (line = strsep(&rest, "\n"));) {
+      if (!strncmp(line, "event: ", 7)) {
+        kind = line + 7;
+      } else if (!strncmp(line, "data: ", 6)) {
+        on_data(conn->dev, kind, line + 6, now);
+      }
+    }
+    start = stop + 2;
+  }
+  conn->in_len = end - start;
+  memmove(conn->in, start, conn->in_len);
+  conn->body_at = 0;
+}
+
+// Once the status line and headers are in, note the status and body length
+static bool parse_headers(conn_t* conn) {
+  char* end = memmem(conn->in, conn->in_len, "\r\n\r\n", 4);
+  if (!end) {
+    return false;
+  }
+  *end = '\0';
+  if (sscanf(conn->in, "HTTP/1.%*d %d", &conn->status) != 1) {
+    conn->status = 500;
+  }
+  for (char* line = strstr(conn->in, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+    if (!strncasecmp(line + 2, "Content-Length:", 15)) {
+      conn->content_len = strtol(line + 17, NULL, 10);
+    }
+  }
+  conn->body_at = end + 4 - conn->in;
+  return true;
+}
+
+static void on_response(device_t* dev, conn_t* conn, int64_t now) {
+  char* body = conn->in + conn->body_at;
+  conn->in[conn->in_len] = '\0';
+  request_t req = dev->request;
+  dev->request = REQ_NONE;
+  conn->backoff_us = RETRY_MIN_US;
+  if (req == REQ_PLATE) {
+    // "format;rows;columns"
+    int rows, cols;
+    dev->cols = (conn->status == 200 && sscanf(body, "%*[^;];%d;%d", &rows, &cols) == 2)
+              ? cols : -1;
+  } else if (req == REQ_RUN) {
+    if (conn->status == 200) {
+      if (dev->run == RUN_WAITING) {
+        dev->run = RUN_GOING;
+      }
+      note(dev, "run started");
+    } else {
+      dev->run = RUN_ENDED;
+      REFUSED = true;
+      emit(now, dev, "refused,,,,%d,,,", conn->status);
+      note(dev, "run refused with %d", conn->status);
+    }
+  } else if (req == REQ_PROGRESS) {
+    // "running;cycle;repeats;done;wells". With the stream up, the done event
+    // is given until the next answer to turn up, so that it gets written.
+    bool idle = conn->status == 200 && atoi(body) == 0;
+    dev->idle_polls = idle ? dev->idle_polls + 1 : 0;
+    if (idle && dev->run == RUN_GOING &&
+        (dev->check_run || dev->stop_sent || dev->idle_polls > 1)) {
+      dev->run = RUN_ENDED;
+      note(dev, "run ended without a done or stopped event");
+    }
+    dev->check_run = false;
+  } else if (req == REQ_STOP) {
+    dev->stop_sent = true;
+  }
+}
+
+static void on_readable(conn_t* conn, int64_t now) {
+  device_t* dev = conn->dev;
+  for (;;) {
+    if (conn->in_len == IN_SIZE - 1) {
+      fail_conn(conn, now, "response too large");
+      return;
+    }
+    ssize_t got = recv(conn->fd, conn->in + conn->in_len, IN_SIZE - 1 - conn->in_len, 0);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (got <= 0) {
+      if (!conn->events && conn->status) {
+        // Answered, and the body ran until the connection closed
+        on_response(dev, conn, now);
+        close_conn(conn);
+      } else {
+        fail_conn(conn, now, got ? strerror(errno) : "closed");
+      }
+      return;
+    }
+    conn->in_len += got;
+    if (!conn->status && !parse_headers(conn)) {
+      continue;
+    }
+    if (conn->events) {
+      if (conn->status != 200) {
+        fail_conn(conn, now, "refused");
+        return;
+      }
+      if (!dev->streaming) {
+        dev->streaming = true;
+        conn->backoff_us = RETRY_MIN_US;
+        dev->window_start = now;
+        dev->gap_min = dev->gap_prev = INT64_MAX;
+        emit(now, dev, "connected,,,,,,,");
+        note(dev, "event stream connected");
+      }
+      on_events(conn, now);
+    } else if (conn->content_len >= 0 &&
+               conn->in_len - conn->body_at >= (size_t) conn->content_len) {
+      on_response(dev, conn, now);
+      close_conn(conn);
+      return;
+    }
+  }
+}
+
+static void on_writable(conn_t* conn, int64_t now) {
+  if (conn->state == CONN_CONNECTING) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+      fail_conn(conn, now, strerror(err));
+      return;
+    }
+    conn->state = CONN_SENDING;
+  }
+  while (conn->out_sent < conn->out_len) {
+    ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent,
+                        MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (sent <= 0) {
+      fail_conn(conn, now, strerror(errno));
+      return;
+    }
+    conn->out_sent += sent;
+  }
+  conn->state = CONN_RECEIVING;
+  watch(conn, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+// ---------------------------------------------------------------------------
+// What each device should be doing next
+// ---------------------------------------------------------------------------
+
+static void start_request(device_t* dev, request_t req, const char* method,
+                          const char* path, const char* body) {
+  dev->request = req;
+  open_conn(&dev->command, method, path, body);
+}
+
+static void service(device_t* dev, int64_t now) {
+  if (STOP_REQUESTS && dev->run == RUN_WAITING && dev->request != REQ_RUN) {
+    dev->run = RUN_ENDED;
+  }
+  if (dev->events.state == CONN_IDLE && now >= dev->events.retry_at) {
+    open_conn(&dev->events, "GET", "/events", "");
+  }
+  if (dev->command.state != CONN_IDLE || now < dev->command.retry_at) {
+    return;
+  }
+  if (!dev->cols) {
+    start_request(dev, REQ_PLATE, "GET", "/plate", "");
+  } else if (!dev->streaming) {
+    // Nothing is started until the device can be heard from
+  } else if (STOP_REQUESTS && dev->run == RUN_GOING && !dev->stop_sent) {
+    start_request(dev, REQ_STOP, "DELETE", "/run", "");
+  } else if (dev->run == RUN_GOING && (dev->check_run || now >= dev->poll_at)) {
+    dev->poll_at = now + POLL_US;
+    start_request(dev, REQ_PROGRESS, "GET", "/run", "");
+  } else if (RUN_BODY && dev->run == RUN_WAITING) {
+    start_request(dev, REQ_RUN, "POST", "/run", RUN_BODY);
+  }
+}
+
+// With a run asked for, the gateway is done once every device has finished it
+static bool all_ended(void) {
+  if (!RUN_BODY && !STOP_REQUESTS) {
+    return false;
+  }
+  for (int i = 0; i < N_DEVICES; i++) {
+    if (DEVICES[i].run != RUN_ENDED) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// "[name=]host:port", the name defaulting to host:port
+static bool add_device(const char* arg) {
+  if (N_DEVICES == MAX_DEVICES) {
+    fprintf(stderr, "At most %d devices\n", MAX_DEVICES);
+    return false;
+  }
+  device_t* dev = &DEVICES[N_DEVICES];
+  const char* eq = strchr(arg, '=');
+  const char* where = eq ? eq + 1 : arg;
+  snprintf(dev->name, NAME_SIZE, "%.*s", (int) (eq ? eq - arg : strlen(arg)), arg);
+  snprintf(dev->host, sizeof(dev->host), "%s", where);
+  char* colon = strrchr(dev->host, ':');
+  if (!colon || strchr(dev->name, ',')) {
+    fprintf(stderr, "Devices are [name=]host:port, without commas: %s\n", arg);
+    return false;
+  }
+  *colon = '\0';
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  struct addrinfo* res;
+  int err = getaddrinfo(dev->host, colon + 1, &hints, &res);
+  if (err) {
+    fprintf(stderr, "Can't find %s: %s\n", where, gai_strerror(err));
+    return false;
+  }
+  memcpy(&dev->addr, res->ai_addr, res->ai_addrlen);
+  dev->addr_len = res->ai_addrlen;
+  freeaddrinfo(res);
+  *colon = ':';
+  conn_t* conns[] = { &dev->events, &dev->command };
+  for (int i = 0; i < 2; i++) {
+    conns[i]->dev = dev;
+    conns[i]->events = (i == 0);
+    conns[i]->fd = -1;
+    conns[i]->backoff_us = RETRY_MIN_US;
+  }
+  N_DEVICES++;
+  return true;
+}
+
+static void on_signal(int sig) {
+  STOP_REQUESTS++;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [options] [NAME=]HOST:PORT ...\n"
+          "  -r, --run BODY         start a plate run on every device, BODY as for POST /run,\n"
+          "                         e.g. \"wells=0,1,2&repeats=3\", and exit once they have\n"
+          "                         all finished. Without this, follow the devices until\n"
+          "                         interrupted.\n"
+          "  -R, --readings         merge every reading in too, not just measured wells\n"
+          "  -o, --output FILE      write the merged stream to FILE rather than stdout\n"
+          "  -q, --quiet            don't report devices coming and going\n"
+          "Interrupting stops any runs going first; a second interrupt quits now.\n",
+          prog);
+}
+
+int main(int argc, char** argv) {
+  static const struct option OPTS[] = {
+    { "run", required_argument, NULL, 'r' },
+    { "readings", no_argument, NULL, 'R' },
+    { "output", required_argument, NULL, 'o' },
+    { "quiet", no_argument, NULL, 'q' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  OUT = stdout;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "r:Ro:qh", OPTS, NULL)) != -1) {
+    switch (opt) {
+    case 'r':
+      RUN_BODY = optarg;
+      break;
+    case 'R':
+      READINGS = true;
+      break;
+    case 'o':
+      OUT = fopen(optarg, "w");
+      if (!OUT) {
+        fprintf(stderr, "Can't write to %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'q':
+      QUIET = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (optind == argc) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  for (int i = optind; i < argc; i++) {
+    if (!add_device(argv[i])) {
+      return EXIT_FAILURE;
+    }
+  }
+  if (RUN_BODY && strlen(RUN_BODY) > OUT_SIZE - 256) {
+    fprintf(stderr, "Run description too long\n");
+    return EXIT_FAILURE;
+  }
+  EPOLL_FD = epoll_create1(EPOLL_CLOEXEC);
+  if (EPOLL_FD < 0) {
+    perror("epoll_create1");
+    return EXIT_FAILURE;
+  }
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGPIPE, SIG_IGN);
+  START_US = now_us();
+  fprintf(OUT, "time_s,device,event,cycle,well,channel,value,dark,signal_se,od\n");
+  struct epoll_event events[2 * MAX_DEVICES];
+  while (STOP_REQUESTS < 2 && !all_ended()) {
+    int64_t now = now_us();
+    for (int i = 0; i < N_DEVICES; i++) {
+      service(&DEVICES[i], now);
+    }
+    int n = epoll_wait(EPOLL_FD, events, 2 * MAX_DEVICES, TICK_MS);
+    now = now_us();
+    for (int i = 0; i < n; i++) {
+      conn_t* conn = (conn_t*) events[i].data.ptr;
+      if (conn->state == CONN_IDLE) {
+        // Closed while handling an earlier event
+        continue;
+      }
+      if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP) &&
+          conn->state != CONN_RECEIVING) {
+        on_writable(conn, now);
+      } else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        on_readable(conn, now);
+      }
+    }
+    flush_pending(now, false);
+  }
+  flush_pending(now_us(), true);
+  for (int i = 0; i < N_DEVICES; i++) {
+    close_conn(&DEVICES[i].events);
+    close_conn(&DEVICES[i].command);
+  }
+  if (OUT != stdout) {
+    fclose(OUT);
+  }
+  return REFUSED ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,32 @@
+#include "esp_err.h"
+
+#ifndef ADC_H
+#define ADC_H
+typedef enum {
+  ADC1_CHANNEL_0 = 0,
+  ADC1_CHANNEL_1,
+  ADC1_CHANNEL_2,
+  ADC1_CHANNEL_3,
+  ADC1_CHANNEL_4,
+  ADC1_CHANNEL_5,
+  ADC1_CHANNEL_6,
+  ADC1_CHANNEL_7,
+  ADC1_CHANNEL_MAX
+} adc1_channel_t;
+
+typedef enum {
+  ADC_ATTEN_DB_0 = 0,
+  ADC_ATTEN_DB_2_5,
+  ADC_ATTEN_DB_6,
+  ADC_ATTEN_DB_11,
+  ADC_ATTEN_MAX
+} adc_atten_t;
+
+typedef enum {
+  ADC_WIDTH_BIT_9 = 0,
+  ADC_WIDTH_BIT_10,
+  ADC_WIDTH_BIT_11,
+  ADC_WIDTH_BIT_12,
+  ADC_WIDTH_MAX
+} adc_bits_width_t;
+#endif
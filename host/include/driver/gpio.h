@@ -0,0 +1,6 @@
+#include "esp_err.h"
+
+#ifndef GPIO_H
+#define GPIO_H
+typedef int gpio_num_t;
+#endif
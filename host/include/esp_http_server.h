@@ -0,0 +1,145 @@
+// Host stand-in for the subset of esp_http_server used by the firmware. Like
+// the real server it runs every handler from a single task with a select loop,
+// so handler latency and blocking behave the same way as on the ESP32.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+
+#ifndef ESP_HTTP_SERVER_H
+#define ESP_HTTP_SERVER_H
+#define HTTPD_MAX_REQ_HDR_LEN 512
+#define HTTPD_MAX_URI_LEN 512
+#define HTTPD_RESP_USE_STRLEN -1
+
+#define HTTPD_SOCK_ERR_FAIL -1
+#define HTTPD_SOCK_ERR_INVALID -2
+#define HTTPD_SOCK_ERR_TIMEOUT -3
+
+#define ESP_ERR_HTTPD_BASE 0xb000
+#define ESP_ERR_HTTPD_HANDLERS_FULL (ESP_ERR_HTTPD_BASE + 1)
+#define ESP_ERR_HTTPD_HANDLER_EXISTS (ESP_ERR_HTTPD_BASE + 2)
+#define ESP_ERR_HTTPD_INVALID_REQ (ESP_ERR_HTTPD_BASE + 3)
+#define ESP_ERR_HTTPD_RESULT_TRUNC (ESP_ERR_HTTPD_BASE + 4)
+#define ESP_ERR_HTTPD_RESP_HDR (ESP_ERR_HTTPD_BASE + 5)
+#define ESP_ERR_HTTPD_RESP_SEND (ESP_ERR_HTTPD_BASE + 6)
+#define ESP_ERR_HTTPD_ALLOC_MEM (ESP_ERR_HTTPD_BASE + 7)
+#define ESP_ERR_HTTPD_TASK (ESP_ERR_HTTPD_BASE + 8)
+
+typedef void* httpd_handle_t;
+
+typedef enum http_method {
+  HTTP_DELETE = 0,
+  HTTP_GET = 1,
+  HTTP_HEAD = 2,
+  HTTP_POST = 3,
+  HTTP_PUT = 4
+} httpd_method_t;
+
+typedef enum {
+  HTTPD_500_INTERNAL_SERVER_ERROR = 0,
+  HTTPD_501_METHOD_NOT_IMPLEMENTED,
+  HTTPD_505_VERSION_NOT_SUPPORTED,
+  HTTPD_400_BAD_REQUEST,
+  HTTPD_404_NOT_FOUND,
+  HTTPD_405_METHOD_NOT_ALLOWED,
+  HTTPD_408_REQ_TIMEOUT,
+  HTTPD_411_LENGTH_REQUIRED,
+  HTTPD_414_URI_TOO_LONG,
+  HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE,
+  HTTPD_ERR_CODE_MAX
+} httpd_err_code_t;
+
+typedef struct httpd_req {
+  httpd_handle_t handle;
+  int method;
+  const char uri[HTTPD_MAX_URI_LEN + 1];
+  size_t content_len;
+  void* aux;
+  void* user_ctx;
+  void* sess_ctx;
+} httpd_req_t;
+
+typedef struct httpd_uri {
+  const char* uri;
+  httpd_method_t method;
+  esp_err_t (*handler)(httpd_req_t* r);
+  void* user_ctx;
+} httpd_uri_t;
+
+typedef bool (*httpd_uri_match_func_t)(const char*, const char*, size_t);
+typedef esp_err_t (*httpd_open_func_t)(httpd_handle_t, int);
+typedef void (*httpd_close_func_t)(httpd_handle_t, int);
+typedef void (*httpd_work_fn_t)(void*);
+
+typedef struct httpd_config {
+  unsigned task_priority;
+  size_t stack_size;
+  BaseType_t core_id;
+  uint16_t server_port;
+  uint16_t ctrl_port;
+  uint16_t max_open_sockets;
+  uint16_t max_uri_handlers;
+  uint16_t max_resp_headers;
+  uint16_t backlog_conn;
+  bool lru_purge_enable;
+  uint16_t recv_wait_timeout;
+  uint16_t send_wait_timeout;
+  httpd_open_func_t open_fn;
+  httpd_close_func_t close_fn;
+  httpd_uri_match_func_t uri_match_fn;
+} httpd_config_t;
+
+#define HTTPD_DEFAULT_CONFIG() {                  \
+    .task_priority = tskIDLE_PRIORITY + 5,        \
+    .stack_size = 4096,                           \
+    .core_id = tskNO_AFFINITY,                    \
+    .server_port = 80,                            \
+    .ctrl_port = 32768,                           \
+    .max_open_sockets = 7,                        \
+    .max_uri_handlers = 8,                        \
+    .max_resp_headers = 8,                        \
+    .backlog_conn = 5,                            \
+    .lru_purge_enable = false,                    \
+    .recv_wait_timeout = 5,                       \
+    .send_wait_timeout = 5,                       \
+    .open_fn = NULL,                              \
+    .close_fn = NULL,                             \
+    .uri_match_fn = NULL                          \
+  }
+
+// Server control
+extern esp_err_t httpd_start(httpd_handle_t*, const httpd_config_t*);
+extern esp_err_t httpd_stop(httpd_handle_t);
+extern esp_err_t httpd_register_uri_handler(httpd_handle_t, const httpd_uri_t*);
+extern bool httpd_uri_match_wildcard(const char*, const char*, size_t);
+extern esp_err_t httpd_queue_work(httpd_handle_t, httpd_work_fn_t, void*);
+extern int httpd_socket_send(httpd_handle_t, int, const char*, size_t, int);
+extern esp_err_t httpd_sess_trigger_close(httpd_handle_t, int);
+// Requests
+extern int httpd_req_recv(httpd_req_t*, char*, size_t);
+extern int httpd_req_to_sockfd(httpd_req_t*);
+extern size_t httpd_req_get_hdr_value_len(httpd_req_t*, const char*);
+extern esp_err_t httpd_req_get_hdr_value_str(httpd_req_t*, const char*, char*, size_t);
+extern size_t httpd_req_get_url_query_len(httpd_req_t*);
+extern esp_err_t httpd_req_get_url_query_str(httpd_req_t*, char*, size_t);
+extern esp_err_t httpd_query_key_value(const char*, const char*, char*, size_t);
+// Responses
+extern esp_err_t httpd_resp_set_status(httpd_req_t*, const char*);
+extern esp_err_t httpd_resp_set_type(httpd_req_t*, const char*);
+extern esp_err_t httpd_resp_set_hdr(httpd_req_t*, const char*, const char*);
+extern esp_err_t httpd_resp_send(httpd_req_t*, const char*, ssize_t);
+extern esp_err_t httpd_resp_send_chunk(httpd_req_t*, const char*, ssize_t);
+extern esp_err_t httpd_resp_send_err(httpd_req_t*, httpd_err_code_t, const char*);
+#define httpd_resp_send_404(req) httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, NULL)
+#define httpd_resp_send_408(req) httpd_resp_send_err(req, HTTPD_408_REQ_TIMEOUT, NULL)
+#define httpd_resp_send_500(req) httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, NULL)
+
+// The simulator cannot bind port 80 without privileges, so the port the
+// firmware asks for can be overridden from the command line
+extern void sim_httpd_set_port(uint16_t);
+#endif
@@ -0,0 +1,33 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+typedef enum {
+  ESP_LOG_NONE,
+  ESP_LOG_ERROR,
+  ESP_LOG_WARN,
+  ESP_LOG_INFO,
+  ESP_LOG_DEBUG,
+  ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+// The host build has a single global log level rather than one per tag
+extern esp_log_level_t sim_log_level;
+extern void esp_log_level_set(const char*, esp_log_level_t);
+extern uint32_t esp_log_timestamp(void);
+
+#define SIM_LOG(level, letter, tag, format, ...)                          \
+  do {                                                                    \
+    if (sim_log_level >= level) {                                         \
+      fprintf(stderr, letter " (%u) %s: " format "\n", esp_log_timestamp(), \
+              tag, ##__VA_ARGS__);                                        \
+    }                                                                     \
+  } while (0)
+
+#define ESP_LOGE(tag, format, ...) SIM_LOG(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) SIM_LOG(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) SIM_LOG(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) SIM_LOG(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) SIM_LOG(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
+#endif
@@ -0,0 +1,10 @@
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifndef ESP_SYSTEM_H
+#define ESP_SYSTEM_H
+// Restarting the simulator simply ends the process with a failure status
+extern void esp_restart(void) __attribute__((noreturn));
+extern uint32_t esp_get_free_heap_size(void);
+extern uint32_t esp_get_minimum_free_heap_size(void);
+#endif
@@ -0,0 +1,7 @@
+#include <stdint.h>
+
+#ifndef ESP_TIMER_H
+#define ESP_TIMER_H
+// Microseconds since the simulator started, on the (scaled) simulator clock
+extern int64_t esp_timer_get_time(void);
+#endif
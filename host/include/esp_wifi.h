@@ -0,0 +1,9 @@
+// The real esp_wifi.h drags in the event loop and most of FreeRTOS. Nothing
+// WiFi related is simulated, but firmware headers rely on those includes.
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "esp_err.h"
+#include "esp_system.h"
@@ -0,0 +1,46 @@
+// Host stand-in for the ESP-IDF FreeRTOS headers. Tasks are POSIX threads and
+// ticks are derived from a monotonic clock that can be sped up with
+// sim_set_time_scale(), so firmware code runs unmodified in a Linux process.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "sdkconfig.h"
+
+#ifndef FREERTOS_H
+#define FREERTOS_H
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define configTICK_RATE_HZ CONFIG_FREERTOS_HZ
+#define portTICK_PERIOD_MS ((TickType_t) 1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY ((TickType_t) 0xffffffffUL)
+#define pdMS_TO_TICKS(ms) ((TickType_t) (((uint64_t) (ms) * configTICK_RATE_HZ) / 1000))
+#define pdFALSE ((BaseType_t) 0)
+#define pdTRUE ((BaseType_t) 1)
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+#define errQUEUE_EMPTY ((BaseType_t) 0)
+#define errQUEUE_FULL ((BaseType_t) 0)
+#define tskIDLE_PRIORITY ((UBaseType_t) 0)
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define portNUM_PROCESSORS 2
+
+// Critical sections are a single process-wide recursive lock on the host
+typedef struct { int unused; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+extern void sim_enter_critical(void);
+extern void sim_exit_critical(void);
+#define portENTER_CRITICAL(mux) ((void) (mux), sim_enter_critical())
+#define portEXIT_CRITICAL(mux) ((void) (mux), sim_exit_critical())
+#define taskENTER_CRITICAL(mux) ((void) (mux), sim_enter_critical())
+#define taskEXIT_CRITICAL(mux) ((void) (mux), sim_exit_critical())
+
+// Simulator clock controls
+extern void sim_set_time_scale(double);
+extern double sim_get_time_scale(void);
+extern int64_t sim_time_us(void);
+#endif
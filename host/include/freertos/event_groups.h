@@ -0,0 +1,15 @@
+#include "freertos/FreeRTOS.h"
+
+#ifndef EVENT_GROUPS_H
+#define EVENT_GROUPS_H
+typedef struct sim_event_group* EventGroupHandle_t;
+typedef TickType_t EventBits_t;
+
+extern EventGroupHandle_t xEventGroupCreate(void);
+extern void vEventGroupDelete(EventGroupHandle_t);
+extern EventBits_t xEventGroupSetBits(EventGroupHandle_t, EventBits_t);
+extern EventBits_t xEventGroupClearBits(EventGroupHandle_t, EventBits_t);
+extern EventBits_t xEventGroupGetBits(EventGroupHandle_t);
+extern EventBits_t xEventGroupWaitBits(EventGroupHandle_t, EventBits_t,
+                                       BaseType_t, BaseType_t, TickType_t);
+#endif
@@ -0,0 +1,20 @@
+#include "freertos/FreeRTOS.h"
+
+#ifndef QUEUE_H
+#define QUEUE_H
+typedef struct sim_queue* QueueHandle_t;
+
+extern QueueHandle_t xQueueCreate(UBaseType_t, UBaseType_t);
+extern void vQueueDelete(QueueHandle_t);
+extern BaseType_t xQueueSendToBack(QueueHandle_t, const void*, TickType_t);
+extern BaseType_t xQueueSendToFront(QueueHandle_t, const void*, TickType_t);
+#define xQueueSend(q, item, wait) xQueueSendToBack(q, item, wait)
+extern BaseType_t xQueueOverwrite(QueueHandle_t, const void*);
+extern BaseType_t xQueueReceive(QueueHandle_t, void*, TickType_t);
+extern BaseType_t xQueuePeek(QueueHandle_t, void*, TickType_t);
+extern UBaseType_t uxQueueMessagesWaiting(QueueHandle_t);
+extern UBaseType_t uxQueueSpacesAvailable(QueueHandle_t);
+extern BaseType_t xQueueReset(QueueHandle_t);
+// Used by semphr.h
+extern QueueHandle_t sim_queue_create_counting(UBaseType_t, UBaseType_t);
+#endif
@@ -0,0 +1,15 @@
+#include "freertos/queue.h"
+
+#ifndef SEMPHR_H
+#define SEMPHR_H
+// As in FreeRTOS proper, semaphores are queues of zero sized items
+typedef QueueHandle_t SemaphoreHandle_t;
+
+#define xSemaphoreCreateBinary() sim_queue_create_counting(1, 0)
+#define xSemaphoreCreateCounting(max, initial) sim_queue_create_counting(max, initial)
+#define xSemaphoreCreateMutex() sim_queue_create_counting(1, 1)
+#define xSemaphoreTake(sem, wait) xQueueReceive(sem, NULL, wait)
+#define xSemaphoreGive(sem) xQueueSendToBack(sem, NULL, 0)
+#define uxSemaphoreGetCount(sem) uxQueueMessagesWaiting(sem)
+#define vSemaphoreDelete(sem) vQueueDelete(sem)
+#endif
@@ -0,0 +1,50 @@
+#include "freertos/FreeRTOS.h"
+
+#ifndef TASK_H
+#define TASK_H
+typedef struct sim_task* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+extern BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char*, uint32_t,
+                                          void*, UBaseType_t, TaskHandle_t*,
+                                          BaseType_t);
+#define xTaskCreate(fn, name, stack, arg, prio, handle) \
+  xTaskCreatePinnedToCore(fn, name, stack, arg, prio, handle, tskNO_AFFINITY)
+extern void vTaskDelete(TaskHandle_t);
+extern void vTaskDelay(TickType_t);
+extern void vTaskDelayUntil(TickType_t*, TickType_t);
+extern TickType_t xTaskGetTickCount(void);
+extern TaskHandle_t xTaskGetCurrentTaskHandle(void);
+extern char* pcTaskGetTaskName(TaskHandle_t);
+extern UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t);
+// Task statistics, as with CONFIG_FREERTOS_USE_TRACE_FACILITY and
+// CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS. Run time is thread CPU time in
+// microseconds, against wall clock time for the total.
+typedef enum {
+  eRunning = 0,
+  eReady,
+  eBlocked,
+  eSuspended,
+  eDeleted,
+  eInvalid
+} eTaskState;
+
+typedef struct xTASK_STATUS {
+  TaskHandle_t xHandle;
+  const char* pcTaskName;
+  UBaseType_t xTaskNumber;
+  eTaskState eCurrentState;
+  UBaseType_t uxCurrentPriority;
+  UBaseType_t uxBasePriority;
+  uint32_t ulRunTimeCounter;
+  void* pxStackBase;
+  uint32_t usStackHighWaterMark;
+  BaseType_t xCoreID;
+} TaskStatus_t;
+
+extern UBaseType_t uxTaskGetNumberOfTasks(void);
+extern UBaseType_t uxTaskGetSystemState(TaskStatus_t*, UBaseType_t, uint32_t*);
+// Direct to task notifications
+extern BaseType_t xTaskNotifyGive(TaskHandle_t);
+extern uint32_t ulTaskNotifyTake(BaseType_t, TickType_t);
+#endif
@@ -0,0 +1,32 @@
+// Configuration for the simulator build. Keep in step with the OpenLUX entries
+// in the project sdkconfig.
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+#define CONFIG_FREERTOS_HZ 1000
+#define CONFIG_FREERTOS_USE_TRACE_FACILITY 1
+#define CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS 1
+#define CONFIG_LWIP_MAX_SOCKETS 16
+// The plate format can be picked with -DOPENLUX_PLATE=384 (or 24) instead
+#if !defined(CONFIG_OPENLUX_PLATE_384) && !defined(CONFIG_OPENLUX_PLATE_24)
+#define CONFIG_OPENLUX_PLATE_96 1
+#endif
+// The number of channels can be set with -DOPENLUX_CHANNELS=2 (up to 4)
+#ifndef CONFIG_OPENLUX_CHANNELS
+#define CONFIG_OPENLUX_CHANNELS 1
+#endif
+#define CONFIG_OPENLUX_LED_GPIO_1 17
+#define CONFIG_OPENLUX_ADC_CHANNEL_1 0
+#define CONFIG_OPENLUX_LED_GPIO_2 16
+#define CONFIG_OPENLUX_ADC_CHANNEL_2 0
+#define CONFIG_OPENLUX_LED_GPIO_3 4
+#define CONFIG_OPENLUX_ADC_CHANNEL_3 0
+#define CONFIG_OPENLUX_LED_GPIO_4 22
+#define CONFIG_OPENLUX_ADC_CHANNEL_4 0
+#define CONFIG_OPENLUX_ADC_SAMPLE_RATE 20000
+#define CONFIG_OPENLUX_SENSOR_PERIOD_MS 200
+#define CONFIG_OPENLUX_MEASURE_SAMPLES 2000
+#define CONFIG_OPENLUX_START_STEP_RATE 333
+#define CONFIG_OPENLUX_MAX_STEP_RATE 800
+#define CONFIG_OPENLUX_STEP_ACCEL 2000
+#define CONFIG_OPENLUX_SCAN_STEP_RATE 800
+#endif
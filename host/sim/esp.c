@@ -0,0 +1,62 @@
+// Host implementations of the small ESP-IDF system APIs the firmware uses
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include <stdlib.h>
+
+esp_log_level_t sim_log_level = ESP_LOG_INFO;
+
+void esp_log_level_set(const char* tag, esp_log_level_t level) {
+  sim_log_level = level;
+}
+
+uint32_t esp_log_timestamp(void) {
+  return (uint32_t) (sim_time_us() / 1000);
+}
+
+const char* esp_err_to_name(esp_err_t err) {
+  switch (err) {
+  case ESP_OK:
+    return "ESP_OK";
+  case ESP_FAIL:
+    return "ESP_FAIL";
+  case ESP_ERR_NO_MEM:
+    return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_ARG:
+    return "ESP_ERR_INVALID_ARG";
+  case ESP_ERR_INVALID_STATE:
+    return "ESP_ERR_INVALID_STATE";
+  case ESP_ERR_INVALID_SIZE:
+    return "ESP_ERR_INVALID_SIZE";
+  case ESP_ERR_NOT_FOUND:
+    return "ESP_ERR_NOT_FOUND";
+  case ESP_ERR_NOT_SUPPORTED:
+    return "ESP_ERR_NOT_SUPPORTED";
+  case ESP_ERR_TIMEOUT:
+    return "ESP_ERR_TIMEOUT";
+  case ESP_ERR_INVALID_CRC:
+    return "ESP_ERR_INVALID_CRC";
+  default:
+    return "UNKNOWN ERROR";
+  }
+}
+
+void esp_restart(void) {
+  ESP_LOGE("sim", "Firmware requested a restart, exiting");
+  exit(EXIT_FAILURE);
+}
+
+// There is no fixed heap to report on the host
+uint32_t esp_get_free_heap_size(void) {
+  return 0;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void) {
+  return 0;
+}
+
+int64_t esp_timer_get_time(void) {
+  return sim_time_us();
+}
@@ -0,0 +1,502 @@
+// POSIX implementation of the FreeRTOS subset declared in host/include. Each
+// task is a detached pthread; blocking calls sleep on condition variables with
+// deadlines taken from the scaled simulator clock.
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+
+// ---------------------------------------------------------------------------
+// Clock
+// ---------------------------------------------------------------------------
+
+static double TIME_SCALE = 1.0;
+static pthread_once_t CLOCK_ONCE = PTHREAD_ONCE_INIT;
+static struct timespec CLOCK_START;
+
+static void clock_init(void) {
+  clock_gettime(CLOCK_MONOTONIC, &CLOCK_START);
+}
+
+static int64_t real_us(void) {
+  pthread_once(&CLOCK_ONCE, clock_init);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) (now.tv_sec - CLOCK_START.tv_sec) * 1000000 +
+         (now.tv_nsec - CLOCK_START.tv_nsec) / 1000;
+}
+
+// The scale should be set once at start up, before any task is created
+void sim_set_time_scale(double scale) {
+  TIME_SCALE = (scale > 0) ? scale : 1.0;
+}
+
+double sim_get_time_scale(void) {
+  return TIME_SCALE;
+}
+
+int64_t sim_time_us(void) {
+  return (int64_t) (real_us() * TIME_SCALE);
+}
+
+// Turn a timeout in ticks into an absolute CLOCK_MONOTONIC deadline in real
+// (unscaled) time. Returns false for portMAX_DELAY, which never expires.
+static bool deadline_after(TickType_t ticks, struct timespec* ts) {
+  if (ticks == portMAX_DELAY) {
+    return false;
+  }
+  int64_t us = (int64_t) (ticks * portTICK_PERIOD_MS * 1000 / TIME_SCALE);
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ts->tv_sec += us / 1000000;
+  ts->tv_nsec += (us % 1000000) * 1000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+  return true;
+}
+
+// Wait on a condition variable that uses CLOCK_MONOTONIC. Returns false once
+// the deadline has passed.
+static bool cond_wait(pthread_cond_t* cond, pthread_mutex_t* mtx,
+                      bool timed, const struct timespec* ts) {
+  if (!timed) {
+    pthread_cond_wait(cond, mtx);
+    return true;
+  }
+  return pthread_cond_timedwait(cond, mtx, ts) != ETIMEDOUT;
+}
+
+static void cond_init(pthread_cond_t* cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static pthread_mutex_t CRITICAL;
+static pthread_once_t CRITICAL_ONCE = PTHREAD_ONCE_INIT;
+
+static void critical_init(void) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&CRITICAL, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+void sim_enter_critical(void) {
+  pthread_once(&CRITICAL_ONCE, critical_init);
+  pthread_mutex_lock(&CRITICAL);
+}
+
+void sim_exit_critical(void) {
+  pthread_mutex_unlock(&CRITICAL);
+}
+
+// ---------------------------------------------------------------------------
+// Tasks
+// ---------------------------------------------------------------------------
+
+struct sim_task {
+  pthread_t thread;
+  UBaseType_t number;
+  UBaseType_t prio;
+  char name[16];
+  TaskFunction_t fn;
+  void* arg;
+  uint32_t stack;
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+  uint32_t notify;
+};
+
+static __thread struct sim_task* CURRENT_TASK = NULL;
+// Every task that has been created, for uxTaskGetSystemState
+#define MAX_TASKS 32
+static struct sim_task* TASKS[MAX_TASKS];
+static UBaseType_t N_TASKS = 0;
+static pthread_mutex_t TASKS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static void task_register(struct sim_task* task) {
+  pthread_mutex_lock(&TASKS_LOCK);
+  task->number = N_TASKS + 1;
+  if (N_TASKS < MAX_TASKS) {
+    TASKS[N_TASKS++] = task;
+  }
+  pthread_mutex_unlock(&TASKS_LOCK);
+}
+
+static void task_unregister(struct sim_task* task) {
+  pthread_mutex_lock(&TASKS_LOCK);
+  for (UBaseType_t i = 0; i < N_TASKS; i++) {
+    if (TASKS[i] == task) {
+      TASKS[i] = TASKS[--N_TASKS];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&TASKS_LOCK);
+}
+
+static void* task_entry(void* arg) {
+  struct sim_task* task = (struct sim_task*) arg;
+  CURRENT_TASK = task;
+  task->fn(task->arg);
+  // FreeRTOS tasks must never return, but be forgiving about it here
+  return NULL;
+}
+
+static struct sim_task* task_alloc(const char* name) {
+  struct sim_task* task = calloc(1, sizeof(struct sim_task));
+  snprintf(task->name, sizeof(task->name), "%s", name ? name : "");
+  pthread_mutex_init(&task->mtx, NULL);
+  cond_init(&task->cond);
+  return task;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name,
+                                   uint32_t stack, void* arg, UBaseType_t prio,
+                                   TaskHandle_t* handle, BaseType_t core) {
+  struct sim_task* task = task_alloc(name);
+  task->fn = fn;
+  task->arg = arg;
+  task->stack = stack;
+  task->prio = prio;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int err = pthread_create(&task->thread, &attr, task_entry, task);
+  pthread_attr_destroy(&attr);
+  if (err) {
+    free(task);
+    return pdFAIL;
+  }
+  task_register(task);
+  if (handle) {
+    *handle = task;
+  }
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  task_unregister(task ? task : xTaskGetCurrentTaskHandle());
+  if (task == NULL || task == CURRENT_TASK) {
+    pthread_exit(NULL);
+  }
+  pthread_cancel(task->thread);
+}
+
+void vTaskDelay(TickType_t ticks) {
+  if (ticks == 0) {
+    sched_yield();
+    return;
+  }
+  int64_t us = (int64_t) (ticks * portTICK_PERIOD_MS * 1000 / TIME_SCALE);
+  struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+  while (nanosleep(&ts, &ts) && errno == EINTR) {
+  }
+}
+
+void vTaskDelayUntil(TickType_t* previous, TickType_t increment) {
+  TickType_t wake = *previous + increment;
+  TickType_t now = xTaskGetTickCount();
+  if ((int32_t) (wake - now) > 0) {
+    vTaskDelay(wake - now);
+  }
+  *previous = wake;
+}
+
+TickType_t xTaskGetTickCount(void) {
+  return (TickType_t) (sim_time_us() / 1000 / portTICK_PERIOD_MS);
+}
+
+// Threads that were not created through xTaskCreate (the main thread, the
+// HTTP server) get a handle lazily the first time they ask for one
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+  if (!CURRENT_TASK) {
+    CURRENT_TASK = task_alloc("main");
+    CURRENT_TASK->thread = pthread_self();
+    task_register(CURRENT_TASK);
+  }
+  return CURRENT_TASK;
+}
+
+char* pcTaskGetTaskName(TaskHandle_t task) {
+  return (task ? task : xTaskGetCurrentTaskHandle())->name;
+}
+
+// Host threads have megabytes of stack, so report the whole allocation free
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+  task = task ? task : xTaskGetCurrentTaskHandle();
+  return task->stack;
+}
+
+UBaseType_t uxTaskGetNumberOfTasks(void) {
+  pthread_mutex_lock(&TASKS_LOCK);
+  UBaseType_t n = N_TASKS;
+  pthread_mutex_unlock(&TASKS_LOCK);
+  return n;
+}
+
+UBaseType_t uxTaskGetSystemState(TaskStatus_t* status, UBaseType_t max,
+                                 uint32_t* total) {
+  pthread_mutex_lock(&TASKS_LOCK);
+  UBaseType_t n = (N_TASKS < max) ? N_TASKS : max;
+  for (UBaseType_t i = 0; i < n; i++) {
+    struct sim_task* task = TASKS[i];
+    clockid_t clock;
+    struct timespec cpu = { 0, 0 };
+    if (!pthread_getcpuclockid(task->thread, &clock)) {
+      clock_gettime(clock, &cpu);
+    }
+    status[i] = (TaskStatus_t) {
+      .xHandle = task,
+      .pcTaskName = task->name,
+      .xTaskNumber = task->number,
+      .eCurrentState = (task == CURRENT_TASK) ? eRunning : eBlocked,
+      .uxCurrentPriority = task->prio,
+      .uxBasePriority = task->prio,
+      .ulRunTimeCounter = (uint32_t) (cpu.tv_sec * 1000000 + cpu.tv_nsec / 1000),
+      .usStackHighWaterMark = task->stack,
+      .xCoreID = tskNO_AFFINITY
+    };
+  }
+  pthread_mutex_unlock(&TASKS_LOCK);
+  if (total) {
+    *total = (uint32_t) real_us();
+  }
+  return n;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  pthread_mutex_lock(&task->mtx);
+  task->notify++;
+  pthread_cond_broadcast(&task->cond);
+  pthread_mutex_unlock(&task->mtx);
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+  struct sim_task* task = xTaskGetCurrentTaskHandle();
+  struct timespec ts;
+  bool timed = deadline_after(ticks, &ts);
+  pthread_mutex_lock(&task->mtx);
+  while (task->notify == 0 && ticks != 0 &&
+         cond_wait(&task->cond, &task->mtx, timed, &ts)) {
+  }
+  uint32_t value = task->notify;
+  if (value) {
+    task->notify = clear ? 0 : value - 1;
+  }
+  pthread_mutex_unlock(&task->mtx);
+  return value;
+}
+
+// ---------------------------------------------------------------------------
+// Queues and semaphores
+// ---------------------------------------------------------------------------
+
+struct sim_queue {
+  pthread_mutex_t mtx;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  UBaseType_t length;
+  UBaseType_t item_size;
+  UBaseType_t head;
+  UBaseType_t count;
+  uint8_t* items;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+  struct sim_queue* q = calloc(1, sizeof(struct sim_queue));
+  pthread_mutex_init(&q->mtx, NULL);
+  cond_init(&q->not_empty);
+  cond_init(&q->not_full);
+  q->length = length;
+  q->item_size = item_size;
+  q->items = item_size ? calloc(length, item_size) : NULL;
+  return q;
+}
+
+QueueHandle_t sim_queue_create_counting(UBaseType_t max, UBaseType_t initial) {
+  struct sim_queue* q = xQueueCreate(max, 0);
+  q->count = initial;
+  return q;
+}
+
+void vQueueDelete(QueueHandle_t q) {
+  free(q->items);
+  free(q);
+}
+
+static BaseType_t queue_send(QueueHandle_t q, const void* item,
+                             TickType_t ticks, bool front, bool overwrite) {
+  struct timespec ts;
+  bool timed = deadline_after(ticks, &ts);
+  pthread_mutex_lock(&q->mtx);
+  while (q->count == q->length && !overwrite) {
+    if (ticks == 0 || !cond_wait(&q->not_full, &q->mtx, timed, &ts)) {
+      pthread_mutex_unlock(&q->mtx);
+      return errQUEUE_FULL;
+    }
+  }
+  if (overwrite && q->count == q->length) {
+    // Only used on single item queues, so just replace the head
+    q->count--;
+  }
+  UBaseType_t slot;
+  if (front) {
+    q->head = (q->head + q->length - 1) % q->length;
+    slot = q->head;
+  } else {
+    slot = (q->head + q->count) % q->length;
+  }
+  if (q->item_size) {
+    memcpy(q->items + slot * q->item_size, item, q->item_size);
+  }
+  q->count++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->mtx);
+  return pdPASS;
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t q, const void* item, TickType_t ticks) {
+  return queue_send(q, item, ticks, false, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void* item, TickType_t ticks) {
+  return queue_send(q, item, ticks, true, false);
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t q, const void* item) {
+  return queue_send(q, item, 0, false, true);
+}
+
+static BaseType_t queue_receive(QueueHandle_t q, void* item, TickType_t ticks,
+                                bool peek) {
+  struct timespec ts;
+  bool timed = deadline_after(ticks, &ts);
+  pthread_mutex_lock(&q->mtx);
+  while (q->count == 0) {
+    if (ticks == 0 || !cond_wait(&q->not_empty, &q->mtx, timed, &ts)) {
+      pthread_mutex_unlock(&q->mtx);
+      return errQUEUE_EMPTY;
+    }
+  }
+  if (q->item_size && item) {
+    memcpy(item, q->items + q->head * q->item_size, q->item_size);
+  }
+  if (!peek) {
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+  }
+  pthread_mutex_unlock(&q->mtx);
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void* item, TickType_t ticks) {
+  return queue_receive(q, item, ticks, false);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t q, void* item, TickType_t ticks) {
+  return queue_receive(q, item, ticks, true);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+  pthread_mutex_lock(&q->mtx);
+  UBaseType_t count = q->count;
+  pthread_mutex_unlock(&q->mtx);
+  return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q) {
+  pthread_mutex_lock(&q->mtx);
+  UBaseType_t spaces = q->length - q->count;
+  pthread_mutex_unlock(&q->mtx);
+  return spaces;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q) {
+  pthread_mutex_lock(&q->mtx);
+  q->head = 0;
+  q->count = 0;
+  pthread_cond_broadcast(&q->not_full);
+  pthread_mutex_unlock(&q->mtx);
+  return pdPASS;
+}
+
+// ---------------------------------------------------------------------------
+// Event groups
+// ---------------------------------------------------------------------------
+
+struct sim_event_group {
+  pthread_mutex_t mtx;
+  pthread_cond_t changed;
+  EventBits_t bits;
+};
+
+EventGroupHandle_t xEventGroupCreate(void) {
+  struct sim_event_group* eg = calloc(1, sizeof(struct sim_event_group));
+  pthread_mutex_init(&eg->mtx, NULL);
+  cond_init(&eg->changed);
+  return eg;
+}
+
+void vEventGroupDelete(EventGroupHandle_t eg) {
+  free(eg);
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t eg, EventBits_t bits) {
+  pthread_mutex_lock(&eg->mtx);
+  eg->bits |= bits;
+  EventBits_t now = eg->bits;
+  pthread_cond_broadcast(&eg->changed);
+  pthread_mutex_unlock(&eg->mtx);
+  return now;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t eg, EventBits_t bits) {
+  pthread_mutex_lock(&eg->mtx);
+  EventBits_t before = eg->bits;
+  eg->bits &= ~bits;
+  pthread_mutex_unlock(&eg->mtx);
+  return before;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t eg) {
+  pthread_mutex_lock(&eg->mtx);
+  EventBits_t bits = eg->bits;
+  pthread_mutex_unlock(&eg->mtx);
+  return bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t eg, EventBits_t bits,
+                                BaseType_t clear, BaseType_t all,
+                                TickType_t ticks) {
+  struct timespec ts;
+  bool timed = deadline_after(ticks, &ts);
+  pthread_mutex_lock(&eg->mtx);
+  for (;;) {
+    EventBits_t set = eg->bits & bits;
+    if (all ? set == bits : set != 0) {
+      EventBits_t result = eg->bits;
+      if (clear) {
+        eg->bits &= ~bits;
+      }
+      pthread_mutex_unlock(&eg->mtx);
+      return result;
+    }
+    if (ticks == 0 || !cond_wait(&eg->changed, &eg->mtx, timed, &ts)) {
+      EventBits_t result = eg->bits;
+      pthread_mutex_unlock(&eg->mtx);
+      return result;
+    }
+  }
+}
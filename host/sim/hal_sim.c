@@ -0,0 +1,633 @@
+// Simulated hardware for the host build. The carriage position is recovered
+// from the coil patterns clocked into the shift register, exactly as the real
+// steppers would follow them, and the photodiode sees the optical density of
+// whichever well (if any) is under the carriage while an LED is lit. Every
+// LED is a wavelength of its own, numbered in the order they are set up, and
+// the plate has a different OD at each.
+#include "hal.h"
+#include "plate.h"
+#include "sim.h"
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Mechanical travel from the end stops, matching the homing distances
+static const int R_TRAVEL = 4000;
+static const int C_TRAVEL = 6250;
+// The plate is the format the firmware was built for (see plate.h)
+static const int R_OFFSET = PLATE_R_OFFSET;
+static const int C_OFFSET = PLATE_C_OFFSET;
+// Photodiode response: raw = LIGHT - SLOPE * OD, the inverse of sensorToOD
+static const double LIGHT = 2836;
+static const double SLOPE = 378;
+static const double DARK = 140;
+// Optical density seen between wells, through the plate frame
+static const double FRAME_OD = 2.5;
+
+static pthread_mutex_t LOCK = PTHREAD_MUTEX_INITIALIZER;
+static int POS[2] = { 1500, 2500 };
+// Motors are assumed to power up resting on their first coil, as motion.c does
+static int PHASE[2] = { 0, 0 };
+static uint64_t STEPS = 0;
+// As many LEDs as the firmware can drive, see sensors.h
+#define MAX_LEDS 4
+static int LED_GPIO[MAX_LEDS];
+static int N_LEDS = 0;
+static uint32_t LED_ON = 0;        // Bit n for the nth LED set up
+// Changes to the LEDs, kept like the steps below so streamed samples see them
+// as they were when taken
+#define LED_TRACK_LEN 64
+typedef struct led_change {
+  int64_t time_us;
+  uint32_t from;         // Before the change
+} led_change_t;
+static led_change_t LED_TRACK[LED_TRACK_LEN];
+static uint32_t LED_TRACK_HEAD = 0;
+static uint32_t PLATE_SEED = 1;
+static double NOISE = 6.0;
+static double UNIFORM_OD = -1;
+// Wells given an OD of their own at a wavelength, or NAN
+static double WELL_OD[PLATE_ROWS][PLATE_COLS][MAX_LEDS];
+static pthread_once_t WELL_OD_ONCE = PTHREAD_ONCE_INIT;
+static double GAIN_SPREAD = 0;
+static uint32_t RNG = 0x12345678;
+// Steps the carriage has made, so streamed samples see the position at the
+// time they were taken rather than when they were read. Kept for ~10 s of
+// stepping at the highest rate, oldest overwritten first.
+#define TRACK_LEN 8192
+typedef struct track_point {
+  int64_t time_us;
+  int from[2];           // Before the step
+} track_point_t;
+static track_point_t TRACK[TRACK_LEN];
+static uint32_t TRACK_HEAD = 0;
+
+// ---------------------------------------------------------------------------
+// Plate model
+// ---------------------------------------------------------------------------
+
+void sim_plate_seed(uint32_t seed) {
+  PLATE_SEED = seed;
+  RNG = seed * 2654435761u + 1;
+}
+
+void sim_set_noise(double sigma) {
+  NOISE = sigma;
+}
+
+void sim_set_plate_od(double od) {
+  UNIFORM_OD = od;
+}
+
+void sim_set_gain_spread(double spread) {
+  GAIN_SPREAD = spread;
+}
+
+static void well_od_init(void) {
+  for (int i = 0; i < PLATE_ROWS * PLATE_COLS * MAX_LEDS; i++) {
+    (&WELL_OD[0][0][0])[i] = NAN;
+  }
+}
+
+void sim_set_well_od(int row, int col, int wavelength, double od) {
+  pthread_once(&WELL_OD_ONCE, well_od_init);
+  if (row < 1 || row > PLATE_ROWS || col < 1 || col > PLATE_COLS || wavelength < 0 ||
+      wavelength >= MAX_LEDS) {
+    return;
+  }
+  pthread_mutex_lock(&LOCK);
+  WELL_OD[row - 1][col - 1][wavelength] = (od < 0) ? NAN : od;
+  pthread_mutex_unlock(&LOCK);
+}
+
+// The OD of a well that a measurement read as this signal, with the nominal
+// response
+double sim_od_for_signal(double signal) {
+  return (LIGHT - DARK - signal) / SLOPE;
+}
+
+static uint32_t well_hash(uint32_t seed, int row, int col) {
+  uint32_t h = seed ^ (uint32_t) (row * 73856093) ^ (uint32_t) (col * 19349663);
+  h ^= h >> 16;
+  h *= 0x7feb352d;
+  h ^= h >> 15;
+  h *= 0x846ca68b;
+  h ^= h >> 16;
+  return h;
+}
+
+// A fixed pseudo-random OD between 0.05 and 1.55 for each well at each
+// wavelength, unless the well or the whole plate has been set to one
+double sim_plate_od(int row, int col, int wavelength) {
+  pthread_once(&WELL_OD_ONCE, well_od_init);
+  double od = WELL_OD[row - 1][col - 1][wavelength % MAX_LEDS];
+  if (!isnan(od)) {
+    return od;
+  }
+  if (UNIFORM_OD >= 0) {
+    return UNIFORM_OD;
+  }
+  return 0.05 + (well_hash(PLATE_SEED ^ (wavelength * 0x85ebca6bu), row, col) % 1500) / 1000.0;
+}
+
+// How much more or less light than nominal reaches the photodiode through
+// each well position from each LED. This belongs to the instrument, not the
+// plate.
+static double well_gain(int row, int col, int wavelength) {
+  uint32_t h = well_hash(0x9e3779b9 ^ (wavelength * 0xc2b2ae35u), row, col);
+  return 1 + GAIN_SPREAD * ((h % 2001) / 1000.0 - 1);
+}
+
+static uint32_t xorshift(void) {
+  RNG ^= RNG << 13;
+  RNG ^= RNG >> 17;
+  RNG ^= RNG << 5;
+  return RNG;
+}
+
+static double gaussian(void) {
+  double u1 = (xorshift() + 1.0) / 4294967297.0;
+  double u2 = (xorshift() + 1.0) / 4294967297.0;
+  return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+// Which well centre, if any, is within a quarter pitch of this position
+static bool well_at(int r_pos, int c_pos, int* row, int* col) {
+  int r = (int) lround((r_pos - R_OFFSET) / (double) WELL_SPACING);
+  int c = (int) lround((c_pos - C_OFFSET) / (double) WELL_SPACING);
+  if (r < 0 || r >= PLATE_ROWS || c < 0 || c >= PLATE_COLS) {
+    return false;
+  }
+  if (abs(r_pos - (R_OFFSET + r * WELL_SPACING)) > WELL_SPACING / 4 ||
+      abs(c_pos - (C_OFFSET + c * WELL_SPACING)) > WELL_SPACING / 4) {
+    return false;
+  }
+  *row = r + 1;
+  *col = c + 1;
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Carriage
+// ---------------------------------------------------------------------------
+
+void sim_set_carriage(int r_pos, int c_pos) {
+  pthread_mutex_lock(&LOCK);
+  POS[0] = r_pos;
+  POS[1] = c_pos;
+  pthread_mutex_unlock(&LOCK);
+}
+
+void sim_get_carriage(int* r_pos, int* c_pos) {
+  pthread_mutex_lock(&LOCK);
+  *r_pos = POS[0];
+  *c_pos = POS[1];
+  pthread_mutex_unlock(&LOCK);
+}
+
+uint64_t sim_step_count(void) {
+  pthread_mutex_lock(&LOCK);
+  uint64_t steps = STEPS;
+  pthread_mutex_unlock(&LOCK);
+  return steps;
+}
+
+bool sim_led_on(void) {
+  return LED_ON != 0;
+}
+
+// Settings key the carriage is kept under, see below
+static const char SIM_CARRIAGE_KEY[] = "sim.carriage";
+
+// Put the carriage back where the last run of the simulator left it
+void hal_setup_shift_register(void) {
+  int pos[2];
+  if (hal_settings_load(SIM_CARRIAGE_KEY, pos, sizeof(pos)) == ESP_OK) {
+    sim_set_carriage(pos[0], pos[1]);
+  }
+}
+
+// The low nibble drives the row motors and the high nibble the column motors.
+// A phase advance of one is a step forward, three is a step back, and two is
+// a stall that a real motor may resolve either way, so it doesn't move.
+static void latch(uint8_t byte, int64_t when) {
+  pthread_mutex_lock(&LOCK);
+  int old[2] = { POS[0], POS[1] };
+  for (int axis = 0; axis < 2; axis++) {
+    int nibble = (byte >> (4 * axis)) & 0x0F;
+    if (!nibble) {
+      continue;
+    }
+    int phase = __builtin_ctz(nibble);
+    int limit = axis ? C_TRAVEL : R_TRAVEL;
+    if (PHASE[axis] >= 0) {
+      int delta = (phase - PHASE[axis]) & 3;
+      if (delta == 1 && POS[axis] < limit) {
+        POS[axis]++;
+        STEPS++;
+      } else if (delta == 3 && POS[axis] > 0) {
+        POS[axis]--;
+        STEPS++;
+      }
+    }
+    PHASE[axis] = phase;
+  }
+  if (POS[0] != old[0] || POS[1] != old[1]) {
+    track_point_t* p = &TRACK[TRACK_HEAD++ % TRACK_LEN];
+    p->time_us = when;
+    p->from[0] = old[0];
+    p->from[1] = old[1];
+  }
+  pthread_mutex_unlock(&LOCK);
+}
+
+// Where the carriage was at a time. Called with the lock held.
+static void position_at(int64_t when, int* pos) {
+  uint32_t lo = (TRACK_HEAD > TRACK_LEN) ? TRACK_HEAD - TRACK_LEN : 0;
+  uint32_t hi = TRACK_HEAD;
+  // Find the first step latched after then; steps are recorded in time order
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (TRACK[mid % TRACK_LEN].time_us <= when) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == TRACK_HEAD) {
+    pos[0] = POS[0];
+    pos[1] = POS[1];
+  } else {
+    // Where that step started from
+    pos[0] = TRACK[lo % TRACK_LEN].from[0];
+    pos[1] = TRACK[lo % TRACK_LEN].from[1];
+  }
+}
+
+// The step stream latches each run's byte on its deadline in simulator time,
+// so the writer is held up for as long as the hardware would take to play it.
+// The writer thread can wake late, more so the faster the clock runs, so the
+// next deadline is published for streamed ADC reads to wait on: hardware
+// would have latched on time, and samples must see it.
+static int64_t STEP_END_US = 0;
+static _Atomic int64_t STEP_PENDING_US = INT64_MAX;
+
+void hal_step_stream_write(const step_run_t* runs, size_t n) {
+  // Part way through a move the stream carries straight on, as the DMA would,
+  // however late this thread is to write the next batch
+  int64_t now = sim_time_us();
+  if (STEP_PENDING_US == INT64_MAX && STEP_END_US < now) {
+    STEP_END_US = now;
+  }
+  for (size_t i = 0; i < n; i++) {
+    STEP_PENDING_US = STEP_END_US;
+    hal_wait_until_us(STEP_END_US);
+    latch(runs[i].byte, STEP_END_US);
+    STEP_END_US += (int64_t) runs[i].ticks * HAL_STEP_TICK_US;
+  }
+  // The next write carries on from here, until the stream is flushed
+  STEP_PENDING_US = STEP_END_US;
+}
+
+// Holds the stream to starting then, so a write made a little later still
+// latches its first byte at the time given
+int64_t hal_step_stream_next_us(void) {
+  int64_t now = sim_time_us();
+  if (STEP_END_US < now) {
+    STEP_END_US = now;
+  }
+  return STEP_END_US;
+}
+
+void hal_step_stream_flush(void) {
+  hal_wait_until_us(STEP_END_US);
+  STEP_PENDING_US = INT64_MAX;
+}
+
+// ---------------------------------------------------------------------------
+// LED and photodiode
+// ---------------------------------------------------------------------------
+
+void hal_setup_led(int gpio) {
+  for (int i = 0; i < N_LEDS; i++) {
+    if (LED_GPIO[i] == gpio) {
+      return;
+    }
+  }
+  if (N_LEDS < MAX_LEDS) {
+    LED_GPIO[N_LEDS++] = gpio;
+  }
+}
+
+void hal_set_led(int gpio, int level) {
+  pthread_mutex_lock(&LOCK);
+  for (int i = 0; i < N_LEDS; i++) {
+    uint32_t on = level ? (LED_ON | 1u << i) : (LED_ON & ~(1u << i));
+    if (LED_GPIO[i] == gpio && on != LED_ON) {
+      led_change_t* c = &LED_TRACK[LED_TRACK_HEAD++ % LED_TRACK_LEN];
+      c->time_us = sim_time_us();
+      c->from = LED_ON;
+      LED_ON = on;
+    }
+  }
+  pthread_mutex_unlock(&LOCK);
+}
+
+// Which LEDs were lit at a time. Called with the lock held.
+static uint32_t leds_at(int64_t when) {
+  uint32_t lo = (LED_TRACK_HEAD > LED_TRACK_LEN) ? LED_TRACK_HEAD - LED_TRACK_LEN : 0;
+  uint32_t hi = LED_TRACK_HEAD;
+  // Find the first change made after then, as for position_at
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (LED_TRACK[mid % LED_TRACK_LEN].time_us <= when) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return (lo == LED_TRACK_HEAD) ? LED_ON : LED_TRACK[lo % LED_TRACK_LEN].from;
+}
+
+esp_err_t hal_setup_adc(adc1_channel_t ch, adc_atten_t atn) {
+  return (ch < ADC1_CHANNEL_MAX) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+// What the photodiode reads with the carriage at a position. Every
+// photodiode looks through the same spot, so sees every LED that is lit.
+// Called with the lock held.
+static int photodiode(const int* pos, uint32_t leds) {
+  double raw = DARK;
+  int row = 0, col = 0;
+  bool over_well = well_at(pos[0], pos[1], &row, &col);
+  for (int i = 0; i < N_LEDS; i++) {
+    if (!((leds >> i) & 1)) {
+      continue;
+    }
+    if (over_well) {
+      raw += well_gain(row, col, i) * (LIGHT - DARK - SLOPE * sim_plate_od(row, col, i));
+    } else {
+      raw += LIGHT - DARK - SLOPE * FRAME_OD;
+    }
+  }
+  raw += NOISE * gaussian();
+  // 12 bit ADC
+  return (int) fmin(4095, fmax(0, lround(raw)));
+}
+
+int hal_read_adc(adc1_channel_t ch) {
+  pthread_mutex_lock(&LOCK);
+  int raw = photodiode(POS, LED_ON);
+  pthread_mutex_unlock(&LOCK);
+  return raw;
+}
+
+// The simulated DMA stream delivers samples on the simulator clock: a read
+// blocks until enough conversions are due to fill the buffer, like i2s_read.
+// Each sample sees the carriage where it was, and the LEDs as they were, when
+// the sample was due.
+static uint32_t STREAM_RATE = 0;
+static adc1_channel_t STREAM_CHANNEL;
+static int64_t STREAM_START = 0;
+static uint64_t STREAM_TAKEN = 0;
+
+esp_err_t hal_adc_stream_start(adc1_channel_t ch, adc_atten_t atn, uint32_t rate) {
+  if (rate == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  STREAM_RATE = rate;
+  STREAM_CHANNEL = ch;
+  STREAM_START = sim_time_us();
+  STREAM_TAKEN = 0;
+  return hal_setup_adc(ch, atn);
+}
+
+size_t hal_adc_stream_read(uint16_t* buf, size_t max, int64_t* first_us) {
+  uint64_t wanted = STREAM_TAKEN + max;
+  int64_t last_us = STREAM_START + (int64_t) ((wanted - 1) * 1000000 / STREAM_RATE);
+  for (;;) {
+    uint64_t due = (uint64_t) (sim_time_us() - STREAM_START) * STREAM_RATE / 1000000;
+    if (due >= wanted) {
+      // Any step due within the block must have been latched
+      if (STEP_PENDING_US > last_us) {
+        break;
+      }
+      vTaskDelay(1);
+      continue;
+    }
+    uint64_t wait_us = (wanted - due) * 1000000 / STREAM_RATE;
+    vTaskDelay((wait_us + 999) / 1000 / portTICK_PERIOD_MS + 1);
+  }
+  *first_us = STREAM_START + (int64_t) (STREAM_TAKEN * 1000000 / STREAM_RATE);
+  pthread_mutex_lock(&LOCK);
+  for (size_t i = 0; i < max; i++) {
+    int pos[2];
+    int64_t when = STREAM_START + (int64_t) ((STREAM_TAKEN + i) * 1000000 / STREAM_RATE);
+    position_at(when, pos);
+    buf[i] = photodiode(pos, leds_at(when));
+  }
+  pthread_mutex_unlock(&LOCK);
+  STREAM_TAKEN = wanted;
+  return max;
+}
+
+esp_err_t hal_adc_stream_select(adc1_channel_t ch) {
+  if (ch >= ADC1_CHANNEL_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  STREAM_CHANNEL = ch;
+  return ESP_OK;
+}
+
+// There are no DMA buffers to fill up, so a read only ever returns samples
+// taken before it was called if the reader has fallen behind
+size_t hal_adc_stream_lag(void) {
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Result log storage
+// ---------------------------------------------------------------------------
+
+// The same size as the results partition in partitions.csv
+static const size_t STORE_SIZE = 0x1E0000;
+static const char* STORE_PATH = "openlux-results.bin";
+static int STORE_FD = -1;
+
+void sim_set_store_path(const char* path) {
+  STORE_PATH = path;
+}
+
+// The flash is a file, erased (all ones) when it is first created
+esp_err_t hal_store_open(size_t* size) {
+  STORE_FD = open(STORE_PATH, O_RDWR | O_CREAT, 0644);
+  if (STORE_FD < 0) {
+    return ESP_FAIL;
+  }
+  off_t len = lseek(STORE_FD, 0, SEEK_END);
+  if (len < (off_t) STORE_SIZE) {
+    esp_err_t err = hal_store_erase(len, STORE_SIZE - len);
+    if (err) {
+      return err;
+    }
+  }
+  *size = STORE_SIZE;
+  return ESP_OK;
+}
+
+esp_err_t hal_store_read(size_t off, void* buf, size_t len) {
+  if (off + len > STORE_SIZE) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  return (pread(STORE_FD, buf, len, off) == (ssize_t) len) ? ESP_OK : ESP_FAIL;
+}
+
+// Like NOR flash, writing can only clear bits
+esp_err_t hal_store_write(size_t off, const void* buf, size_t len) {
+  uint8_t old[256];
+  const uint8_t* src = buf;
+  while (len) {
+    size_t n = (len < sizeof(old)) ? len : sizeof(old);
+    esp_err_t err = hal_store_read(off, old, n);
+    if (err) {
+      return err;
+    }
+    for (size_t i = 0; i < n; i++) {
+      old[i] &= src[i];
+    }
+    if (pwrite(STORE_FD, old, n, off) != (ssize_t) n) {
+      return ESP_FAIL;
+    }
+    off += n;
+    src += n;
+    len -= n;
+  }
+  return ESP_OK;
+}
+
+esp_err_t hal_store_erase(size_t off, size_t len) {
+  uint8_t ones[HAL_STORE_SECTOR];
+  if (off % HAL_STORE_SECTOR || len % HAL_STORE_SECTOR || off + len > STORE_SIZE) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  memset(ones, 0xFF, sizeof(ones));
+  for (size_t done = 0; done < len; done += sizeof(ones)) {
+    if (pwrite(STORE_FD, ones, sizeof(ones), off + done) != sizeof(ones)) {
+      return ESP_FAIL;
+    }
+  }
+  return ESP_OK;
+}
+
+// ---------------------------------------------------------------------------
+// Settings
+// ---------------------------------------------------------------------------
+
+// Standing in for NVS: a file holding a small table of keyed records, read
+// once and rewritten whole on every save. The carriage itself is kept there
+// too, under a key the firmware doesn't use, so that the plate is where it
+// was left when the simulator is restarted, as it would be on a real reader.
+#define SETTINGS_MAX 16
+// Room for the calibration of a 384 well plate on four channels
+#define SETTINGS_LEN 16384
+typedef struct setting {
+  char key[16];
+  uint32_t len;
+  uint8_t data[SETTINGS_LEN];
+} setting_t;
+
+static const char* SETTINGS_PATH = "openlux-settings.bin";
+static setting_t SETTINGS[SETTINGS_MAX];
+static int N_SETTINGS = -1;
+static pthread_mutex_t SETTINGS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+void sim_set_settings_path(const char* path) {
+  SETTINGS_PATH = path;
+}
+
+// Called with SETTINGS_LOCK held
+static void settings_read(void) {
+  if (N_SETTINGS >= 0) {
+    return;
+  }
+  N_SETTINGS = 0;
+  FILE* f = fopen(SETTINGS_PATH, "rb");
+  if (f) {
+    N_SETTINGS = fread(SETTINGS, sizeof(setting_t), SETTINGS_MAX, f);
+    fclose(f);
+  }
+}
+
+static setting_t* settings_find(const char* key) {
+  for (int i = 0; i < N_SETTINGS; i++) {
+    if (!strncmp(SETTINGS[i].key, key, sizeof(SETTINGS[i].key))) {
+      return &SETTINGS[i];
+    }
+  }
+  return NULL;
+}
+
+static esp_err_t settings_put(const char* key, const void* buf, size_t len) {
+  setting_t* s = settings_find(key);
+  if (!s && N_SETTINGS < SETTINGS_MAX) {
+    s = &SETTINGS[N_SETTINGS++];
+    memset(s, 0, sizeof(*s));
+    strncpy(s->key, key, sizeof(s->key));
+  }
+  if (!s || len > SETTINGS_LEN || strlen(key) >= sizeof(s->key)) {
+    return ESP_ERR_NO_MEM;
+  }
+  s->len = len;
+  memcpy(s->data, buf, len);
+  return ESP_OK;
+}
+
+esp_err_t hal_settings_load(const char* key, void* buf, size_t len) {
+  pthread_mutex_lock(&SETTINGS_LOCK);
+  settings_read();
+  setting_t* s = settings_find(key);
+  esp_err_t err = ESP_ERR_NOT_FOUND;
+  if (s && s->len == len) {
+    memcpy(buf, s->data, len);
+    err = ESP_OK;
+  }
+  pthread_mutex_unlock(&SETTINGS_LOCK);
+  return err;
+}
+
+esp_err_t hal_settings_save(const char* key, const void* buf, size_t len) {
+  int pos[2];
+  sim_get_carriage(&pos[0], &pos[1]);
+  pthread_mutex_lock(&SETTINGS_LOCK);
+  settings_read();
+  esp_err_t err = settings_put(key, buf, len);
+  if (!err) {
+    err = settings_put(SIM_CARRIAGE_KEY, pos, sizeof(pos));
+  }
+  FILE* f = err ? NULL : fopen(SETTINGS_PATH, "wb");
+  if (!err && (!f || fwrite(SETTINGS, sizeof(setting_t), N_SETTINGS, f) != (size_t) N_SETTINGS)) {
+    err = ESP_FAIL;
+  }
+  if (f && fclose(f)) {
+    err = ESP_FAIL;
+  }
+  pthread_mutex_unlock(&SETTINGS_LOCK);
+  return err;
+}
+
+int64_t hal_time_us(void) {
+  return sim_time_us();
+}
+
+void hal_wait_until_us(int64_t deadline) {
+  int64_t left = (int64_t) ((deadline - sim_time_us()) / sim_get_time_scale());
+  if (left > 0) {
+    struct timespec ts = { left / 1000000, (left % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) && errno == EINTR) {
+    }
+  }
+}
@@ -0,0 +1,776 @@
+// A small HTTP/1.1 server that implements the esp_http_server API on top of
+// BSD sockets. One server task owns every session and runs every handler, as
+// in ESP-IDF, and work can be injected into that task with httpd_queue_work.
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "freertos/task.h"
+#include <pthread.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static const char* HTAG = "httpd";
+
+// Requests whose header block doesn't fit here are rejected with a 431
+#define SESS_BUF_SIZE (HTTPD_MAX_REQ_HDR_LEN + HTTPD_MAX_URI_LEN + 64)
+
+typedef struct work {
+  httpd_work_fn_t fn;
+  void* arg;
+  struct work* next;
+} work_t;
+
+typedef struct sess {
+  int fd;
+  int64_t last_used;
+  bool close;
+  size_t len;
+  char buf[SESS_BUF_SIZE];
+} sess_t;
+
+typedef struct server {
+  httpd_config_t cfg;
+  int listen_fd;
+  int ctrl[2];
+  bool stop;
+  httpd_uri_t* handlers;
+  int n_handlers;
+  sess_t** sessions;
+  pthread_mutex_t work_mtx;
+  work_t* work_head;
+  work_t* work_tail;
+} server_t;
+
+typedef struct resp_hdr {
+  const char* field;
+  const char* value;
+} resp_hdr_t;
+
+// Per request state hung off httpd_req_t.aux
+typedef struct req_aux {
+  server_t* server;
+  sess_t* sess;
+  const char* hdrs;
+  size_t hdrs_len;
+  size_t remaining;
+  const char* status;
+  const char* type;
+  resp_hdr_t* resp_hdrs;
+  int n_resp_hdrs;
+  bool headers_sent;
+  bool failed;
+} req_aux_t;
+
+static uint16_t PORT_OVERRIDE = 0;
+
+void sim_httpd_set_port(uint16_t port) {
+  PORT_OVERRIDE = port;
+}
+
+// ---------------------------------------------------------------------------
+// Socket helpers
+// ---------------------------------------------------------------------------
+
+static void set_timeouts(int fd, const httpd_config_t* cfg) {
+  struct timeval rt = { cfg->recv_wait_timeout, 0 };
+  struct timeval st = { cfg->send_wait_timeout, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rt, sizeof(rt));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &st, sizeof(st));
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static bool send_all(int fd, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    buf += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+int httpd_socket_send(httpd_handle_t hd, int fd, const char* buf, size_t len,
+                      int flags) {
+  if (!buf) {
+    return HTTPD_SOCK_ERR_INVALID;
+  }
+  return send_all(fd, buf, len) ? (int) len : HTTPD_SOCK_ERR_FAIL;
+}
+
+// ---------------------------------------------------------------------------
+// Work queue, processed by the server task
+// ---------------------------------------------------------------------------
+
+esp_err_t httpd_queue_work(httpd_handle_t hd, httpd_work_fn_t fn, void* arg) {
+  server_t* server = (server_t*) hd;
+  work_t* work = malloc(sizeof(work_t));
+  if (!work) {
+    return ESP_ERR_NO_MEM;
+  }
+  work->fn = fn;
+  work->arg = arg;
+  work->next = NULL;
+  pthread_mutex_lock(&server->work_mtx);
+  if (server->work_tail) {
+    server->work_tail->next = work;
+  } else {
+    server->work_head = work;
+  }
+  server->work_tail = work;
+  pthread_mutex_unlock(&server->work_mtx);
+  // Wake the select loop
+  char c = 0;
+  if (write(server->ctrl[1], &c, 1) < 0 && errno != EAGAIN) {
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+static void run_work(server_t* server) {
+  char drain[64];
+  while (read(server->ctrl[0], drain, sizeof(drain)) > 0) {
+  }
+  pthread_mutex_lock(&server->work_mtx);
+  work_t* work = server->work_head;
+  server->work_head = NULL;
+  server->work_tail = NULL;
+  pthread_mutex_unlock(&server->work_mtx);
+  while (work) {
+    work_t* next = work->next;
+    work->fn(work->arg);
+    free(work);
+    work = next;
+  }
+}
+
+typedef struct close_args {
+  server_t* server;
+  int fd;
+} close_args_t;
+
+static void mark_closed(void* arg) {
+  close_args_t* args = (close_args_t*) arg;
+  for (int i = 0; i < args->server->cfg.max_open_sockets; i++) {
+    sess_t* sess = args->server->sessions[i];
+    if (sess && sess->fd == args->fd) {
+      sess->close = true;
+    }
+  }
+  free(args);
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t hd, int fd) {
+  close_args_t* args = malloc(sizeof(close_args_t));
+  if (!args) {
+    return ESP_ERR_NO_MEM;
+  }
+  args->server = (server_t*) hd;
+  args->fd = fd;
+  return httpd_queue_work(hd, mark_closed, args);
+}
+
+// ---------------------------------------------------------------------------
+// Request side
+// ---------------------------------------------------------------------------
+
+static req_aux_t* aux_of(httpd_req_t* req) {
+  return (req_aux_t*) req->aux;
+}
+
+int httpd_req_to_sockfd(httpd_req_t* req) {
+  return aux_of(req)->sess->fd;
+}
+
+int httpd_req_recv(httpd_req_t* req, char* buf, size_t len) {
+  req_aux_t* aux = aux_of(req);
+  sess_t* sess = aux->sess;
+  if (len > aux->remaining) {
+    len = aux->remaining;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  // Hand out any body bytes that arrived along with the headers first
+  if (sess->len > 0) {
+    size_t n = (len < sess->len) ? len : sess->len;
+    memcpy(buf, sess->buf, n);
+    memmove(sess->buf, sess->buf + n, sess->len - n);
+    sess->len -= n;
+    aux->remaining -= n;
+    return (int) n;
+  }
+  ssize_t got;
+  do {
+    got = recv(sess->fd, buf, len, 0);
+  } while (got < 0 && errno == EINTR);
+  if (got < 0) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? HTTPD_SOCK_ERR_TIMEOUT
+                                                     : HTTPD_SOCK_ERR_FAIL;
+  }
+  aux->remaining -= got;
+  return (int) got;
+}
+
+// Find a header in the raw request header block. Returns a pointer to the
+// value and stores its length, or NULL if it isn't present.
+static const char* find_hdr(httpd_req_t* req, const char* field, size_t* len) {
+  req_aux_t* aux = aux_of(req);
+  size_t flen = strlen(field);
+  const char* line = aux->hdrs;
+  const char* end = aux->hdrs + aux->hdrs_len;
+  while (line < end) {
+    const char* eol = memchr(line, '\n', end - line);
+    if (!eol) {
+      eol = end;
+    }
+    if ((size_t) (eol - line) > flen && line[flen] == ':' &&
+        strncasecmp(line, field, flen) == 0) {
+      const char* val = line + flen + 1;
+      while (val < eol && (*val == ' ' || *val == '\t')) {
+        val++;
+      }
+      const char* vend = eol;
+      while (vend > val && (vend[-1] == '\r' || vend[-1] == ' ')) {
+        vend--;
+      }
+      *len = vend - val;
+      return val;
+    }
+    line = eol + 1;
+  }
+  return NULL;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t* req, const char* field) {
+  size_t len = 0;
+  return find_hdr(req, field, &len) ? len : 0;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t* req, const char* field,
+                                      char* val, size_t size) {
+  size_t len = 0;
+  const char* found = find_hdr(req, field, &len);
+  if (!found) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (size == 0) {
+    return ESP_ERR_HTTPD_RESULT_TRUNC;
+  }
+  size_t n = (len < size - 1) ? len : size - 1;
+  memcpy(val, found, n);
+  val[n] = '\0';
+  return (n < len) ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+size_t httpd_req_get_url_query_len(httpd_req_t* req) {
+  const char* q = strchr(req->uri, '?');
+  return q ? strlen(q + 1) : 0;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t* req, char* buf, size_t size) {
+  const char* q = strchr(req->uri, '?');
+  if (!q) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (size == 0) {
+    return ESP_ERR_HTTPD_RESULT_TRUNC;
+  }
+  snprintf(buf, size, "%s", q + 1);
+  return (strlen(q + 1) >= size) ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+esp_err_t httpd_query_key_value(const char* qry, const char* key, char* val,
+                                size_t size) {
+  size_t klen = strlen(key);
+  const char* p = qry;
+  while (p && *p) {
+    const char* end = strchr(p, '&');
+    size_t plen = end ? (size_t) (end - p) : strlen(p);
+    if (plen > klen && p[klen] == '=' && strncmp(p, key, klen) == 0) {
+      size_t vlen = plen - klen - 1;
+      if (size == 0) {
+        return ESP_ERR_HTTPD_RESULT_TRUNC;
+      }
+      size_t n = (vlen < size - 1) ? vlen : size - 1;
+      memcpy(val, p + klen + 1, n);
+      val[n] = '\0';
+      return (n < vlen) ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+    }
+    p = end ? end + 1 : NULL;
+  }
+  return ESP_ERR_NOT_FOUND;
+}
+
+// ---------------------------------------------------------------------------
+// Response side
+// ---------------------------------------------------------------------------
+
+esp_err_t httpd_resp_set_status(httpd_req_t* req, const char* status) {
+  aux_of(req)->status = status;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t* req, const char* type) {
+  aux_of(req)->type = type;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t* req, const char* field,
+                             const char* value) {
+  req_aux_t* aux = aux_of(req);
+  if (aux->n_resp_hdrs >= aux->server->cfg.max_resp_headers) {
+    return ESP_ERR_HTTPD_RESP_HDR;
+  }
+  aux->resp_hdrs[aux->n_resp_hdrs].field = field;
+  aux->resp_hdrs[aux->n_resp_hdrs].value = value;
+  aux->n_resp_hdrs++;
+  return ESP_OK;
+}
+
+static esp_err_t send_headers(httpd_req_t* req, ssize_t content_len) {
+  req_aux_t* aux = aux_of(req);
+  char head[1024];
+  int n = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\n",
+                   aux->status, aux->type);
+  for (int i = 0; i < aux->n_resp_hdrs && n < (int) sizeof(head); i++) {
+    n += snprintf(head + n, sizeof(head) - n, "%s: %s\r\n",
+                  aux->resp_hdrs[i].field, aux->resp_hdrs[i].value);
+  }
+  if (n < (int) sizeof(head)) {
+    if (content_len >= 0) {
+      n += snprintf(head + n, sizeof(head) - n, "Content-Length: %zd\r\n\r\n",
+                    content_len);
+    } else {
+      n += snprintf(head + n, sizeof(head) - n,
+                    "Transfer-Encoding: chunked\r\n\r\n");
+    }
+  }
+  if (n >= (int) sizeof(head)) {
+    return ESP_ERR_HTTPD_RESP_HDR;
+  }
+  aux->headers_sent = true;
+  if (!send_all(aux->sess->fd, head, n)) {
+    aux->failed = true;
+    return ESP_ERR_HTTPD_RESP_SEND;
+  }
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t* req, const char* buf, ssize_t len) {
+  req_aux_t* aux = aux_of(req);
+  if (len == HTTPD_RESP_USE_STRLEN) {
+    len = buf ? strlen(buf) : 0;
+  }
+  esp_err_t err = send_headers(req, len);
+  if (err) {
+    return err;
+  }
+  if (len > 0 && !send_all(aux->sess->fd, buf, len)) {
+    aux->failed = true;
+    return ESP_ERR_HTTPD_RESP_SEND;
+  }
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t* req, const char* buf, ssize_t len) {
+  req_aux_t* aux = aux_of(req);
+  if (len == HTTPD_RESP_USE_STRLEN) {
+    len = buf ? strlen(buf) : 0;
+  }
+  if (!aux->headers_sent) {
+    esp_err_t err = send_headers(req, -1);
+    if (err) {
+      return err;
+    }
+  }
+  char size[16];
+  int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+  if (!send_all(aux->sess->fd, size, n) ||
+      (len > 0 && !send_all(aux->sess->fd, buf, len)) ||
+      !send_all(aux->sess->fd, "\r\n", 2)) {
+    aux->failed = true;
+    return ESP_ERR_HTTPD_RESP_SEND;
+  }
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t* req, httpd_err_code_t code,
+                              const char* msg) {
+  const char* status;
+  const char* text;
+  switch (code) {
+  case HTTPD_501_METHOD_NOT_IMPLEMENTED:
+    status = "501 Method Not Implemented";
+    text = "Request method is not supported by server";
+    break;
+  case HTTPD_505_VERSION_NOT_SUPPORTED:
+    status = "505 Version Not Supported";
+    text = "HTTP version not supported by server";
+    break;
+  case HTTPD_400_BAD_REQUEST:
+    status = "400 Bad Request";
+    text = "Server unable to understand request due to invalid syntax";
+    break;
+  case HTTPD_404_NOT_FOUND:
+    status = "404 Not Found";
+    text = "This URI does not exist";
+    break;
+  case HTTPD_405_METHOD_NOT_ALLOWED:
+    status = "405 Method Not Allowed";
+    text = "Request method for this URI is not handled by server";
+    break;
+  case HTTPD_408_REQ_TIMEOUT:
+    status = "408 Request Timeout";
+    text = "Server closed this connection";
+    break;
+  case HTTPD_411_LENGTH_REQUIRED:
+    status = "411 Length Required";
+    text = "Chunked encoding not supported by server";
+    break;
+  case HTTPD_414_URI_TOO_LONG:
+    status = "414 URI Too Long";
+    text = "URI is too long for server to interpret";
+    break;
+  case HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE:
+    status = "431 Request Header Fields Too Large";
+    text = "Header fields are too long for server to interpret";
+    break;
+  default:
+    status = "500 Internal Server Error";
+    text = "Server has encountered an unexpected error";
+  }
+  httpd_resp_set_status(req, status);
+  httpd_resp_set_type(req, "text/html");
+  return httpd_resp_send(req, msg ? msg : text, HTTPD_RESP_USE_STRLEN);
+}
+
+// ---------------------------------------------------------------------------
+// URI matching and dispatch
+// ---------------------------------------------------------------------------
+
+bool httpd_uri_match_wildcard(const char* tpl, const char* uri, size_t len) {
+  size_t tpl_len = strlen(tpl);
+  if (tpl_len > 0 && tpl[tpl_len - 1] == '*') {
+    // "/foo/*" also matches "/foo"
+    size_t prefix = tpl_len - 1;
+    if (prefix > 0 && tpl[prefix - 1] == '/' && len == prefix - 1) {
+      return strncmp(tpl, uri, len) == 0;
+    }
+    return len >= prefix && strncmp(tpl, uri, prefix) == 0;
+  }
+  if (tpl_len > 0 && tpl[tpl_len - 1] == '?') {
+    // Optional trailing character
+    tpl_len--;
+    if (len == tpl_len + 1) {
+      return strncmp(tpl, uri, len) == 0;
+    }
+  }
+  return len == tpl_len && strncmp(tpl, uri, len) == 0;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t hd, const httpd_uri_t* uri) {
+  server_t* server = (server_t*) hd;
+  for (int i = 0; i < server->n_handlers; i++) {
+    if (server->handlers[i].method == uri->method &&
+        strcmp(server->handlers[i].uri, uri->uri) == 0) {
+      return ESP_ERR_HTTPD_HANDLER_EXISTS;
+    }
+  }
+  if (server->n_handlers >= server->cfg.max_uri_handlers) {
+    ESP_LOGW(HTAG, "No slots left for registering handler");
+    return ESP_ERR_HTTPD_HANDLERS_FULL;
+  }
+  server->handlers[server->n_handlers++] = *uri;
+  return ESP_OK;
+}
+
+static int parse_method(const char* m, size_t len) {
+  static const char* NAMES[] = { "DELETE", "GET", "HEAD", "POST", "PUT" };
+  for (int i = 0; i < 5; i++) {
+    if (strlen(NAMES[i]) == len && strncmp(NAMES[i], m, len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Parse and dispatch one request whose header block ends at hdr_end bytes
+// into the session buffer. Returns false if the session should be closed.
+static bool handle_request(server_t* server, sess_t* sess, size_t hdr_end) {
+  char hdrs[SESS_BUF_SIZE];
+  memcpy(hdrs, sess->buf, hdr_end);
+  hdrs[hdr_end] = '\0';
+  memmove(sess->buf, sess->buf + hdr_end, sess->len - hdr_end);
+  sess->len -= hdr_end;
+
+  httpd_req_t req_storage;
+  httpd_req_t* req = &req_storage;
+  memset(req, 0, sizeof(*req));
+  resp_hdr_t resp_hdrs[server->cfg.max_resp_headers + 1];
+  req_aux_t aux = { .server = server, .sess = sess, .status = "200 OK",
+                    .type = "text/html", .resp_hdrs = resp_hdrs };
+  req->handle = server;
+  req->aux = &aux;
+
+  // Request line: METHOD SP URI SP VERSION
+  char* eol = strstr(hdrs, "\r\n");
+  char* sp1 = memchr(hdrs, ' ', eol - hdrs);
+  char* sp2 = sp1 ? memchr(sp1 + 1, ' ', eol - sp1 - 1) : NULL;
+  aux.hdrs = eol + 2;
+  aux.hdrs_len = hdr_end - (eol + 2 - hdrs);
+  if (!sp1 || !sp2) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, NULL);
+    return false;
+  }
+  req->method = parse_method(hdrs, sp1 - hdrs);
+  size_t uri_len = sp2 - sp1 - 1;
+  if (uri_len > HTTPD_MAX_URI_LEN) {
+    httpd_resp_send_err(req, HTTPD_414_URI_TOO_LONG, NULL);
+    return false;
+  }
+  memcpy((char*) req->uri, sp1 + 1, uri_len);
+  ((char*) req->uri)[uri_len] = '\0';
+  char len_str[16];
+  if (httpd_req_get_hdr_value_str(req, "Content-Length", len_str,
+                                  sizeof(len_str)) == ESP_OK) {
+    req->content_len = strtoul(len_str, NULL, 10);
+  } else if (httpd_req_get_hdr_value_len(req, "Transfer-Encoding")) {
+    httpd_resp_send_err(req, HTTPD_411_LENGTH_REQUIRED, NULL);
+    return false;
+  }
+  aux.remaining = req->content_len;
+  if (req->method < 0) {
+    httpd_resp_send_err(req, HTTPD_501_METHOD_NOT_IMPLEMENTED, NULL);
+    return false;
+  }
+
+  // Find the handler, matching on the path without the query string
+  size_t match_len = strcspn(req->uri, "?");
+  httpd_uri_match_func_t match = server->cfg.uri_match_fn;
+  const httpd_uri_t* found = NULL;
+  bool uri_known = false;
+  for (int i = 0; i < server->n_handlers && !found; i++) {
+    const httpd_uri_t* h = &server->handlers[i];
+    bool hit = match ? match(h->uri, req->uri, match_len)
+                     : (strlen(h->uri) == match_len &&
+                        strncmp(h->uri, req->uri, match_len) == 0);
+    if (hit) {
+      uri_known = true;
+      if ((int) h->method == req->method) {
+        found = h;
+      }
+    }
+  }
+
+  esp_err_t ret = ESP_OK;
+  if (found) {
+    req->user_ctx = found->user_ctx;
+    ret = found->handler(req);
+  } else {
+    httpd_resp_send_err(req, uri_known ? HTTPD_405_METHOD_NOT_ALLOWED
+                                       : HTTPD_404_NOT_FOUND, NULL);
+  }
+  if (ret != ESP_OK || aux.failed) {
+    return false;
+  }
+  // Throw away any part of the body the handler didn't read
+  char purge[256];
+  while (aux.remaining > 0) {
+    if (httpd_req_recv(req, purge, sizeof(purge)) <= 0) {
+      return false;
+    }
+  }
+  char conn[16];
+  if (httpd_req_get_hdr_value_str(req, "Connection", conn, sizeof(conn)) == ESP_OK &&
+      strcasecmp(conn, "close") == 0) {
+    return false;
+  }
+  return true;
+}
+
+// Handle every complete request buffered on a session
+static bool process_session(server_t* server, sess_t* sess) {
+  for (;;) {
+    char* end = memmem(sess->buf, sess->len, "\r\n\r\n", 4);
+    if (!end) {
+      if (sess->len >= SESS_BUF_SIZE - 1) {
+        static const char TOO_LARGE[] =
+          "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+          "Content-Length: 0\r\n\r\n";
+        send_all(sess->fd, TOO_LARGE, sizeof(TOO_LARGE) - 1);
+        return false;
+      }
+      return true;
+    }
+    sess->last_used = sim_time_us();
+    if (!handle_request(server, sess, end + 4 - sess->buf)) {
+      return false;
+    }
+  }
+}
+
+static void close_session(server_t* server, int idx) {
+  sess_t* sess = server->sessions[idx];
+  if (server->cfg.close_fn) {
+    // As with ESP-IDF, a custom close function is responsible for the socket
+    server->cfg.close_fn(server, sess->fd);
+  } else {
+    close(sess->fd);
+  }
+  free(sess);
+  server->sessions[idx] = NULL;
+}
+
+static void accept_session(server_t* server) {
+  int fd = accept(server->listen_fd, NULL, NULL);
+  if (fd < 0) {
+    return;
+  }
+  int slot = -1;
+  int oldest = -1;
+  for (int i = 0; i < server->cfg.max_open_sockets; i++) {
+    sess_t* sess = server->sessions[i];
+    if (!sess && slot < 0) {
+      slot = i;
+    } else if (sess && (oldest < 0 ||
+                        sess->last_used < server->sessions[oldest]->last_used)) {
+      oldest = i;
+    }
+  }
+  if (slot < 0 && server->cfg.lru_purge_enable && oldest >= 0) {
+    ESP_LOGD(HTAG, "Purging least recently used session %d",
+             server->sessions[oldest]->fd);
+    close_session(server, oldest);
+    slot = oldest;
+  }
+  if (slot < 0) {
+    ESP_LOGW(HTAG, "No free sessions, closing new connection");
+    close(fd);
+    return;
+  }
+  set_timeouts(fd, &server->cfg);
+  sess_t* sess = calloc(1, sizeof(sess_t));
+  sess->fd = fd;
+  sess->last_used = sim_time_us();
+  server->sessions[slot] = sess;
+  if (server->cfg.open_fn && server->cfg.open_fn(server, fd) != ESP_OK) {
+    close_session(server, slot);
+  }
+}
+
+static void server_task(void* arg) {
+  server_t* server = (server_t*) arg;
+  while (!server->stop) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(server->listen_fd, &fds);
+    FD_SET(server->ctrl[0], &fds);
+    int max_fd = (server->listen_fd > server->ctrl[0]) ? server->listen_fd
+                                                       : server->ctrl[0];
+    for (int i = 0; i < server->cfg.max_open_sockets; i++) {
+      sess_t* sess = server->sessions[i];
+      if (sess) {
+        FD_SET(sess->fd, &fds);
+        max_fd = (sess->fd > max_fd) ? sess->fd : max_fd;
+      }
+    }
+    if (select(max_fd + 1, &fds, NULL, NULL, NULL) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ESP_LOGE(HTAG, "select failed: %s", strerror(errno));
+      break;
+    }
+    if (FD_ISSET(server->ctrl[0], &fds)) {
+      run_work(server);
+    }
+    for (int i = 0; i < server->cfg.max_open_sockets; i++) {
+      sess_t* sess = server->sessions[i];
+      if (!sess) {
+        continue;
+      }
+      if (!sess->close && FD_ISSET(sess->fd, &fds)) {
+        ssize_t got = recv(sess->fd, sess->buf + sess->len,
+                           SESS_BUF_SIZE - 1 - sess->len, 0);
+        if (got <= 0) {
+          sess->close = true;
+        } else {
+          sess->len += got;
+          sess->close = !process_session(server, sess);
+        }
+      }
+      if (sess->close) {
+        close_session(server, i);
+      }
+    }
+    if (FD_ISSET(server->listen_fd, &fds)) {
+      accept_session(server);
+    }
+  }
+  vTaskDelete(NULL);
+}
+
+esp_err_t httpd_start(httpd_handle_t* handle, const httpd_config_t* config) {
+  server_t* server = calloc(1, sizeof(server_t));
+  if (!server) {
+    return ESP_ERR_HTTPD_ALLOC_MEM;
+  }
+  server->cfg = *config;
+  if (PORT_OVERRIDE) {
+    server->cfg.server_port = PORT_OVERRIDE;
+  }
+  server->handlers = calloc(config->max_uri_handlers, sizeof(httpd_uri_t));
+  server->sessions = calloc(config->max_open_sockets, sizeof(sess_t*));
+  pthread_mutex_init(&server->work_mtx, NULL);
+
+  server->listen_fd = socket(AF_INET6, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in6 addr = { .sin6_family = AF_INET6,
+                               .sin6_port = htons(server->cfg.server_port),
+                               .sin6_addr = in6addr_any };
+  if (server->listen_fd < 0 ||
+      bind(server->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+      listen(server->listen_fd, config->backlog_conn) < 0 ||
+      pipe(server->ctrl) < 0) {
+    ESP_LOGE(HTAG, "Failed to listen on port %d: %s", server->cfg.server_port,
+             strerror(errno));
+    if (server->listen_fd >= 0) {
+      close(server->listen_fd);
+    }
+    free(server->handlers);
+    free(server->sessions);
+    free(server);
+    return ESP_ERR_HTTPD_TASK;
+  }
+  fcntl(server->ctrl[0], F_SETFL, O_NONBLOCK);
+  fcntl(server->ctrl[1], F_SETFL, O_NONBLOCK);
+  if (xTaskCreate(server_task, "httpd", config->stack_size, server,
+                  config->task_priority, NULL) != pdPASS) {
+    return ESP_ERR_HTTPD_TASK;
+  }
+  ESP_LOGI(HTAG, "Listening on port %d", server->cfg.server_port);
+  *handle = server;
+  return ESP_OK;
+}
+
+static void stop_server(void* arg) {
+  ((server_t*) arg)->stop = true;
+}
+
+esp_err_t httpd_stop(httpd_handle_t hd) {
+  return httpd_queue_work(hd, stop_server, hd);
+}
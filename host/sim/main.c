@@ -0,0 +1,166 @@
+// Entry point for the Linux simulator build. This performs the same bring-up
+// as app_main in main/main.c, in the same concurrent stages, minus WiFi and
+// SPIFFS: the web files are served from the working directory and the
+// hardware is simulated by hal_sim.c.
+#include "sensors.h"
+#include "common.h"
+#include "motors.h"
+#include "job.h"
+#include "batch.h"
+#include "results.h"
+#include "web.h"
+#include "boot.h"
+#include "calib.h"
+#include "sim.h"
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+
+// Relative paths are resolved before changing into the web root, so they mean
+// what they say
+static bool resolve(const char* file, char* path) {
+  if (file[0] == '/') {
+    snprintf(path, PATH_MAX, "%s", file);
+  } else if (!getcwd(path, PATH_MAX) || strlen(path) + strlen(file) + 2 > PATH_MAX) {
+    fprintf(stderr, "Can't work out where %s is\n", file);
+    return false;
+  } else {
+    strcat(strcat(path, "/"), file);
+  }
+  return true;
+}
+
+static const char* LOG_PATH = NULL;
+
+static void motors_stage(void) {
+  setup_motor_driver();
+  // Picks up the carriage position from the last run, or homes
+  start_goto_loop(xTaskGetCurrentTaskHandle());
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+static void web_stage(void) {
+  if (!start_webserver()) {
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void results_stage(void) {
+  if (open_results() != ESP_OK) {
+    ESP_LOGW(TAG, "Can't open %s, measurements won't be kept", LOG_PATH);
+  }
+}
+
+static void sensors_stage(void) {
+  load_calibration();
+  start_sensor_polling(ADC_ATTEN_DB_0, CONFIG_OPENLUX_SENSOR_PERIOD_MS);
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -p, --port PORT        HTTP port (default 8080)\n"
+          "  -r, --root DIR         directory containing the packed web/ (default %s)\n"
+          "  -t, --time-scale N     run the simulated clock N times faster\n"
+          "  -s, --seed N           seed for the simulated plate\n"
+          "  -n, --noise SIGMA      photodiode noise in ADC counts\n"
+          "  -o, --plate-od OD      put a plate with every well at OD in, e.g. a blank\n"
+          "  -g, --gain-spread F    vary the light through each well by up to F\n"
+          "  -l, --log FILE         file standing in for the result log partition\n"
+          "                         (default openlux-results.bin in the current directory)\n"
+          "  -k, --settings FILE    file standing in for NVS, which also keeps the carriage\n"
+          "                         (default openlux-settings.bin in the current directory)\n"
+          "  -q, --quiet            only log warnings and errors\n",
+          prog, SIM_ROOT);
+}
+
+int main(int argc, char** argv) {
+  static const struct option OPTS[] = {
+    { "port", required_argument, NULL, 'p' },
+    { "root", required_argument, NULL, 'r' },
+    { "time-scale", required_argument, NULL, 't' },
+    { "seed", required_argument, NULL, 's' },
+    { "noise", required_argument, NULL, 'n' },
+    { "plate-od", required_argument, NULL, 'o' },
+    { "gain-spread", required_argument, NULL, 'g' },
+    { "log", required_argument, NULL, 'l' },
+    { "settings", required_argument, NULL, 'k' },
+    { "quiet", no_argument, NULL, 'q' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  const char* root = SIM_ROOT;
+  static char log_path[PATH_MAX];
+  static char settings_path[PATH_MAX];
+  const char* log_file = "openlux-results.bin";
+  const char* settings_file = "openlux-settings.bin";
+  uint16_t port = 8080;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "p:r:t:s:n:o:g:l:k:qh", OPTS, NULL)) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'r':
+      root = optarg;
+      break;
+    case 't':
+      sim_set_time_scale(atof(optarg));
+      break;
+    case 's':
+      sim_plate_seed(strtoul(optarg, NULL, 0));
+      break;
+    case 'n':
+      sim_set_noise(atof(optarg));
+      break;
+    case 'o':
+      sim_set_plate_od(atof(optarg));
+      break;
+    case 'g':
+      sim_set_gain_spread(atof(optarg));
+      break;
+    case 'l':
+      log_file = optarg;
+      break;
+    case 'k':
+      settings_file = optarg;
+      break;
+    case 'q':
+      esp_log_level_set("*", ESP_LOG_WARN);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (!resolve(log_file, log_path) || !resolve(settings_file, settings_path)) {
+    return EXIT_FAILURE;
+  }
+  sim_set_store_path(log_path);
+  sim_set_settings_path(settings_path);
+  if (chdir(root)) {
+    fprintf(stderr, "Can't change into %s\n", root);
+    return EXIT_FAILURE;
+  }
+  LOG_PATH = log_path;
+  sim_httpd_set_port(port);
+  boot_begin(BOOT_READY);
+  init_status();
+  // Plate runs are carried out by the firmware once a client starts one
+  start_job_runner();
+  // As are batches of operations, one at a time
+  start_batch_runner();
+  boot_spawn(BOOT_MOTORS, motors_stage);
+  boot_spawn(BOOT_WEB, web_stage);
+  boot_spawn(BOOT_RESULTS, results_stage);
+  boot_spawn(BOOT_SENSORS, sensors_stage);
+  boot_join();
+  ESP_LOGI(TAG, "Initialised!");
+  begin_status(READY);
+  boot_end(BOOT_READY);
+
+  // Everything else happens in the tasks
+  for (;;) {
+    pause();
+  }
+}
@@ -0,0 +1,33 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef SIM_H
+#define SIM_H
+// Controls and probes for the simulated plate reader behind host/sim/hal_sim.c
+// Plate model. ODs are of a well (row and column from 1) at the wavelength of
+// an LED, numbered from 0 in the order the firmware set them up.
+extern void sim_plate_seed(uint32_t);
+extern double sim_plate_od(int, int, int);
+extern void sim_set_noise(double);
+// Every well at one OD, as for a blank or reference plate; negative for the
+// seeded plate again
+extern void sim_set_plate_od(double);
+// One well (row and column from 1) at one OD and wavelength, which the plate
+// as a whole doesn't change; negative to put it back
+extern void sim_set_well_od(int, int, int, double);
+// The OD a well must have to be measured as a given signal (light less dark)
+extern double sim_od_for_signal(double);
+// Each well position passes up to this fraction more or less light than
+// nominal, fixed for the instrument (0 by default), as calibration corrects
+extern void sim_set_gain_spread(double);
+// Carriage, in motor steps measured from the end stops:
+extern void sim_set_carriage(int, int);
+extern void sim_get_carriage(int*, int*);
+extern uint64_t sim_step_count(void);
+// Whether any LED is lit:
+extern bool sim_led_on(void);
+// File standing in for the result log partition:
+extern void sim_set_store_path(const char*);
+// File standing in for NVS settings, which also keeps the carriage position:
+extern void sim_set_settings_path(const char*);
+#endif
@@ -1,7 +1,12 @@
 #include "openlux/sensors.h"
 #include "openlux/common.h"
 #include "openlux/motors.h"
+#include "openlux/job.h"
+#include "openlux/batch.h"
+#include "openlux/results.h"
 #include "openlux/web.h"
+#include "openlux/boot.h"
+#include "openlux/calib.h"
 #include <esp_spiffs.h>
 #include <nvs_flash.h>
 #include <esp_wifi.h>
@@ -12,13 +17,80 @@
 // Declare the functions we'll be defining later
 // Event handlers:
 static void on_disconnect(void *, esp_event_base_t, int32_t, void *);
+static void on_got_ip(void *, esp_event_base_t, int32_t, void *);
 // System initialisation:
 static void mount_webdata();
 static void wifi_start(char[], char[]);
 
+// Start up stages, which each run on a task of their own (see boot.h) so that
+// homing, WiFi and the web server all come up at the same time
+static void motors_stage(void)
+{
+  setup_motor_driver();
+  // Picks up the carriage position from the last run, or homes, and tells us
+  // once it knows where the carriage is
+  start_goto_loop(xTaskGetCurrentTaskHandle());
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+static void wifi_stage(void)
+{
+  // Joining the network finishes whenever it finishes, see on_got_ip. Until
+  // then the access point is up. Currently the network SSID and password are
+  // set in an external configuration program, but could be set here directly.
+  boot_begin(BOOT_STATION);
+  wifi_start(CONFIG_ESP_WIFI_SSID, CONFIG_ESP_WIFI_PASSWORD);
+}
+
+static void web_stage(void)
+{
+  // Mount the SPIFFS filesystem so that web resources are accessible
+  mount_webdata();
+  // This kicks off the server! It listens on every interface, so needn't
+  // wait for WiFi.
+  start_webserver();
+}
+
+static void results_stage(void)
+{
+  // Find where the result log in flash left off. Runs still work without it,
+  // their results just aren't kept.
+  if (open_results() != ESP_OK) {
+    ESP_LOGW(TAG, "No result log, measurements won't be kept");
+  }
+}
+
+static void sensors_stage(void)
+{
+  // Readings are converted to optical density as they are taken
+  load_calibration();
+  // This function call starts polling the light sensors (the LED and ADC1
+  // channel of each are set in menuconfig, the first on GPIO 17 and
+  // ADC1_CHANNEL_0 by default), the range of the channels is set to 0-1.1V
+  // (ADC_ATTEN_DB_0), and a reading is published every
+  // CONFIG_OPENLUX_SENSOR_PERIOD_MS (200ms by default).
+  start_sensor_polling(ADC_ATTEN_DB_0, CONFIG_OPENLUX_SENSOR_PERIOD_MS);
+}
+
 // This is the entry-point to our program
 void app_main(void)
 {
+  boot_begin(BOOT_READY);
+  // The device state has to exist before anything can change it
+  init_status();
+
+  // Initialise the Non-Volatile Storage partition, which holds our settings
+  // as well as the WiFi driver's. If it is full or from a newer IDF it is
+  // wiped, which costs a homing on the next start.
+  boot_begin(BOOT_NVS);
+  esp_err_t err = nvs_flash_init();
+  if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+    nvs_flash_erase();
+    err = nvs_flash_init();
+  }
+  die_politely(err, "Failed to initialise NVS");
+  boot_end(BOOT_NVS);
+
   // Initialise the default event loop. The WiFi subsystem (and other built-in
   // APIs) post events to this event loop. This allows user-defined functions to
   // be run in response to system events
@@ -28,29 +100,28 @@ void app_main(void)
   die_politely(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED,
                                           &on_disconnect, NULL),
                "Failed to register disconnect handler");
+  die_politely(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &on_got_ip, NULL),
+               "Failed to register connect handler");
 
-  // Mount the SPIFFS filesystem so that web resources are accessible
-  mount_webdata();
-
-  // Connect to WiFi. Currently the network SSID and password are set in an
-  // external configuration program, but could be set here directly.
-  wifi_start(CONFIG_ESP_WIFI_SSID, CONFIG_ESP_WIFI_PASSWORD);
-
-  // This kicks off the server!
-  start_webserver();
-
-  // This function call starts polling the light sensor (which is connected to
-  // the first analogue channel (ADC1_CHANNEL_0), the range of the channel is
-  // set to 0-1.1V (ADC_ATTEN_DB_0), and the sampling period is 200ms.
-  start_sensor_polling(ADC1_CHANNEL_0, ADC_ATTEN_DB_0, 200);
+  // Initialises the TCP/IP stack, which both WiFi and the web server need
+  tcpip_adapter_init();
 
-  // !!! DIRTY CHUNK !!!
-  setup_motor_driver();
-  // home_motors();
-  start_goto_loop();
+  // Plate runs are carried out by the firmware once a client starts one
+  start_job_runner();
+  // As are batches of operations, one at a time. Neither starts on its work
+  // until the device is READY.
+  start_batch_runner();
+
+  // Homing takes longest, so it goes first
+  boot_spawn(BOOT_MOTORS, motors_stage);
+  boot_spawn(BOOT_WIFI, wifi_stage);
+  boot_spawn(BOOT_WEB, web_stage);
+  boot_spawn(BOOT_RESULTS, results_stage);
+  boot_spawn(BOOT_SENSORS, sensors_stage);
+  boot_join();
   ESP_LOGI(TAG, "Initialised!");
-  set_status(READY);
-  // !!! DIRTY CHUNK !!!
+  begin_status(READY);
+  boot_end(BOOT_READY);
 }
 
 // The static means this function can only be used from inside this file
@@ -74,6 +145,13 @@ static void on_disconnect(void *arg, esp_event_base_t event_base,
   die_politely(esp_wifi_connect(), "Failed to connect to the given SSID");
 }
 
+// Marks the end of the station stage, the first time we get an address
+static void on_got_ip(void *arg, esp_event_base_t event_base,
+                      int32_t event_id, void *event_data)
+{
+  boot_end(BOOT_STATION);
+}
+
 // This function does not return any value
 // It takes a string that determines the mount location of the webdata partition
 // and attempt to mount SPIFFS there.
@@ -95,12 +173,6 @@ static void mount_webdata()
 // Connects to the WiFi network described by the SSID and password provided
 static void wifi_start(char ssid[], char pass[])
 {
-  // This initialises the Non-Volitile Storage partition
-  // This API stores key-value pairs on the flash and is required by esp_wifi_init()
-  nvs_flash_init();
-  // Initialises the TCP/IP stack so that networking can take place
-  tcpip_adapter_init();
-
   // Get the default WiFi configuration
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   // Attempt to start the WiFi Driver, signalling error on failure
@@ -0,0 +1,109 @@
+#include "assets.h"
+#include "common.h"
+#include "metrics.h"
+#include <esp_timer.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The manifest written by tools/pack_web.py, next to the files it lists
+#define MANIFEST "/manifest.tsv"
+// Most files the web interface can be made of
+#define MAX_ASSETS 32
+// Files up to this size are kept in RAM once first asked for, as long as the
+// cache has room. Together the packed pages come to well under the budget.
+static const size_t CACHE_FILE_MAX = 8192;
+static const size_t CACHE_BUDGET = 24576;
+
+static asset_t ASSETS[MAX_ASSETS];
+static int N_ASSETS = 0;
+static size_t CACHE_USED = 0;
+
+// Full path of an asset on the mounted filesystem
+static void asset_path(char* buf, size_t size, const char* path) {
+  snprintf(buf, size, "%s%s", WEB, path);
+}
+
+esp_err_t load_assets(void) {
+  char path[64];
+  char line[128];
+  asset_path(path, sizeof(path), MANIFEST);
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    ESP_LOGE(TAG, "Failed to open %s", path);
+    return ESP_ERR_NOT_FOUND;
+  }
+  N_ASSETS = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (N_ASSETS == MAX_ASSETS) {
+      ESP_LOGW(TAG, "Only the first %d web files will be served", MAX_ASSETS);
+      break;
+    }
+    asset_t* a = &ASSETS[N_ASSETS];
+    unsigned size;
+    int gzipped;
+    if (sscanf(line, "%31[^\t]\t%31[^\t]\t%11[^\t]\t%u\t%d", a->path, a->mime,
+               a->etag, &size, &gzipped) != 5) {
+      ESP_LOGW(TAG, "Skipping bad manifest line: %s", line);
+      continue;
+    }
+    a->size = size;
+    a->gzipped = gzipped;
+    a->cached = NULL;
+    N_ASSETS++;
+  }
+  fclose(fp);
+  ESP_LOGI(TAG, "%d web files in the manifest", N_ASSETS);
+  return ESP_OK;
+}
+
+asset_t* find_asset(const char* uri) {
+  char path[sizeof(ASSETS[0].path)];
+  size_t len = strcspn(uri, "?#");
+  if (len >= sizeof(path)) {
+    return NULL;
+  }
+  memcpy(path, uri, len);
+  path[len] = '\0';
+  // No dot in the last part of the path means a directory
+  const char* last = strrchr(path, '/');
+  if (!strchr(last ? last : path, '.')) {
+    const char* index = (len && path[len - 1] == '/') ? "index.html" : "/index.html";
+    if (len + strlen(index) >= sizeof(path)) {
+      return NULL;
+    }
+    strcpy(path + len, index);
+  }
+  for (int i = 0; i < N_ASSETS; i++) {
+    if (!strcmp(ASSETS[i].path, path)) {
+      return &ASSETS[i];
+    }
+  }
+  return NULL;
+}
+
+FILE* open_asset(const asset_t* a) {
+  char path[64];
+  asset_path(path, sizeof(path), a->path);
+  return fopen(path, "r");
+}
+
+const uint8_t* asset_data(asset_t* a) {
+  if (a->cached || a->size > CACHE_FILE_MAX || CACHE_USED + a->size > CACHE_BUDGET) {
+    return a->cached;
+  }
+  FILE* fp = open_asset(a);
+  if (!fp) {
+    return NULL;
+  }
+  uint8_t* data = malloc(a->size ? a->size : 1);
+  int64_t start = esp_timer_get_time();
+  if (data && fread(data, 1, a->size, fp) == a->size) {
+    metric_since(METRIC_FLASH_READ, start);
+    a->cached = data;
+    CACHE_USED += a->size;
+  } else {
+    free(data);
+  }
+  fclose(fp);
+  return a->cached;
+}
@@ -0,0 +1,30 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <esp_err.h>
+
+#ifndef ASSETS_H
+#define ASSETS_H
+// The web interface is packed at build time by tools/pack_web.py: files are
+// gzipped where that helps and listed in a manifest with their MIME type,
+// ETag and stored size. Only files in the manifest are served.
+typedef struct asset {
+  char path[32];         // Name on SPIFFS, e.g. /index.html
+  char mime[32];
+  char etag[12];         // Quoted, ready for the ETag header
+  size_t size;           // Bytes as stored, i.e. as sent
+  bool gzipped;
+  uint8_t* cached;       // Whole file, once read into RAM
+} asset_t;
+
+// System initialisation, once SPIFFS is mounted:
+extern esp_err_t load_assets(void);
+// The asset a request URI refers to, or NULL. A URI without an extension
+// means the index.html in that directory. Queries are ignored.
+extern asset_t* find_asset(const char*);
+// The whole file from RAM, reading it in the first time if it is small
+// enough to keep there. NULL means it has to be streamed with open_asset.
+extern const uint8_t* asset_data(asset_t*);
+extern FILE* open_asset(const asset_t*);
+#endif
@@ -0,0 +1,180 @@
+#include "batch.h"
+#include "motors.h"
+#include "job.h"
+#include <freertos/semphr.h>
+#include <stdatomic.h>
+#include <string.h>
+
+// Longest a single move can take, homing included, before giving up on it
+static const int MOVE_TIMEOUT_MS = 30000;
+// Longest a wait operation can ask for
+static const uint32_t MAX_WAIT_MS = 3600000;
+
+typedef struct queued_op {
+  uint32_t id;
+  batch_op_t op;
+} queued_op_t;
+
+static QueueHandle_t OPS = NULL;
+// Held while a batch is checked and queued, so batches never interleave
+static SemaphoreHandle_t SUBMIT = NULL;
+static uint32_t NEXT_ID = 1;
+// Operations queued or under way
+static atomic_int PENDING = 0;
+static atomic_uint LAST_DONE = 0;
+static batch_listener_t BATCH_LISTENER = NULL;
+
+void set_batch_listener(batch_listener_t listener) {
+  BATCH_LISTENER = listener;
+}
+
+// Measurements are one per channel
+static void finish(const queued_op_t* q, bool ok, const measurement_t* m) {
+  batch_event_t ev = { .id = q->id, .code = q->op.code, .ok = ok };
+  // Cancelled operations finish ahead of the one under way, so never go back
+  unsigned last = atomic_load(&LAST_DONE);
+  while (last < q->id && !atomic_compare_exchange_weak(&LAST_DONE, &last, q->id)) {
+  }
+  atomic_fetch_sub(&PENDING, 1);
+  for (int c = 0; BATCH_LISTENER && c < (m ? SENSOR_CHANNELS : 1); c++) {
+    if (m) {
+      ev.m = m[c];
+    }
+    BATCH_LISTENER(&ev);
+  }
+  // Status events carry the last ID done
+  announce_status();
+}
+
+// Queue a move and wait for the carriage to get there
+static bool move_to(int row, int col) {
+  ulTaskNotifyTake(pdTRUE, 0);
+  if (goto_coord(row, col, xTaskGetCurrentTaskHandle()) != ESP_OK) {
+    return false;
+  }
+  return ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MOVE_TIMEOUT_MS));
+}
+
+static void run_op(const queued_op_t* q) {
+  measurement_t m[SENSOR_CHANNELS];
+  bool ok = true;
+  switch (q->op.code) {
+  case OP_MOVE:
+    ok = move_to(q->op.row, q->op.col);
+    break;
+  case OP_HOME:
+    ok = move_to(0, 0);
+    break;
+  case OP_LED:
+    set_led(q->op.level);
+    break;
+  case OP_MEASURE:
+    ok = measure(q->op.value ? q->op.value : CONFIG_OPENLUX_MEASURE_SAMPLES, m) == ESP_OK;
+    finish(q, ok, ok ? m : NULL);
+    return;
+  case OP_WAIT:
+    vTaskDelay(pdMS_TO_TICKS(q->op.value));
+    break;
+  }
+  if (!ok) {
+    ESP_LOGW(TAG, "Operation %u failed", q->id);
+  }
+  finish(q, ok, NULL);
+}
+
+static void batch_loop(void* args) {
+  queued_op_t q;
+  // Batches can be queued while the rest of the device is starting up
+  xEventGroupWaitBits(state_events(), STATE_READY_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+  while (true) {
+    xQueueReceive(OPS, &q, portMAX_DELAY);
+    run_op(&q);
+  }
+}
+
+void start_batch_runner(void) {
+  OPS = xQueueCreate(BATCH_MAX_OPS, sizeof(queued_op_t));
+  SUBMIT = xSemaphoreCreateMutex();
+  xTaskCreate(batch_loop, "BATCH", 4096, NULL, 3, NULL);
+}
+
+static bool valid_op(const batch_op_t* op) {
+  switch (op->code) {
+  case OP_MOVE:
+    return op->row >= 1 && op->row <= PLATE_ROWS && op->col >= 1 && op->col <= PLATE_COLS;
+  case OP_LED:
+    return op->level < (1 << SENSOR_CHANNELS);
+  case OP_MEASURE:
+    return op->value <= MEASURE_MAX_SAMPLES;
+  case OP_HOME:
+    return true;
+  case OP_WAIT:
+    return op->value <= MAX_WAIT_MS;
+  default:
+    return false;
+  }
+}
+
+int batch_decode(const void* data, size_t len, batch_op_t* ops) {
+  batch_header_t header;
+  if (len < sizeof(header)) {
+    return -1;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.version != BATCH_VERSION || header.n_ops < 1 ||
+      header.n_ops > BATCH_MAX_OPS ||
+      len != sizeof(header) + header.n_ops * sizeof(batch_op_t)) {
+    return -1;
+  }
+  memcpy(ops, (const uint8_t*) data + sizeof(header), header.n_ops * sizeof(batch_op_t));
+  for (int i = 0; i < header.n_ops; i++) {
+    if (!valid_op(&ops[i])) {
+      return -1;
+    }
+  }
+  return header.n_ops;
+}
+
+esp_err_t batch_submit(const batch_op_t* ops, int n, uint32_t* first_id) {
+  if (n < 1 || n > BATCH_MAX_OPS) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  for (int i = 0; i < n; i++) {
+    if (!valid_op(&ops[i])) {
+      return ESP_ERR_INVALID_ARG;
+    }
+  }
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(SUBMIT, portMAX_DELAY);
+  if (job_running()) {
+    err = ESP_ERR_INVALID_STATE;
+  } else if (uxQueueSpacesAvailable(OPS) < (UBaseType_t) n) {
+    err = ESP_ERR_NO_MEM;
+  } else {
+    // Only batches take up space, so all of this one is sure to fit
+    *first_id = NEXT_ID;
+    atomic_fetch_add(&PENDING, n);
+    for (int i = 0; i < n; i++) {
+      queued_op_t q = { NEXT_ID++, ops[i] };
+      xQueueSend(OPS, &q, 0);
+    }
+  }
+  xSemaphoreGive(SUBMIT);
+  return err;
+}
+
+// Dropped operations are reported as failed, so clients aren't left waiting
+void batch_cancel(void) {
+  queued_op_t q;
+  while (xQueueReceive(OPS, &q, 0)) {
+    finish(&q, false, NULL);
+  }
+}
+
+bool batch_busy(void) {
+  return atomic_load(&PENDING) > 0;
+}
+
+uint32_t batch_last_done(void) {
+  return atomic_load(&LAST_DONE);
+}
@@ -0,0 +1,68 @@
+#include "common.h"
+#include "sensors.h"
+
+#ifndef BATCH_H
+#define BATCH_H
+// Clients send the device a batch of operations in one request, which are
+// queued as a whole and then carried out in order by the batch task. Every
+// operation is given an ID, counting up from 1, which is reported as it is
+// done and in the sync field of status events.
+//
+// A batch on the wire is a batch_header_t and then n_ops batch_op_t, all
+// little-endian. The reply is the header again followed by each
+// operation's ID as a uint32_t.
+#define BATCH_VERSION 1
+// Most operations in one batch, and waiting at once
+#define BATCH_MAX_OPS 128
+
+typedef enum batch_code {
+  OP_MOVE = 1,      // Go to row, col (from 1)
+  OP_LED = 2,       // Light the LEDs of the channels set in level (bit 0 is
+                    // the first), see sensors.h
+  OP_MEASURE = 3,   // Measure value dark and lit samples (0 for the default)
+                    // on every channel, reported once for each
+  OP_HOME = 4,
+  OP_WAIT = 5       // Do nothing for value milliseconds
+} batch_code_t;
+
+typedef struct batch_header {
+  uint8_t version;
+  uint8_t n_ops;
+  uint16_t reserved;
+} batch_header_t;
+
+typedef struct batch_op {
+  uint8_t code;
+  uint8_t row;
+  uint8_t col;
+  uint8_t level;
+  uint32_t value;
+} batch_op_t;
+
+typedef struct batch_event {
+  uint32_t id;
+  batch_code_t code;
+  bool ok;
+  measurement_t m;  // For OP_MEASURE, one channel's
+} batch_event_t;
+
+// System initialisation:
+extern void start_batch_runner(void);
+// Unpack a batch off the wire into up to BATCH_MAX_OPS operations, checking
+// each one. Returns how many there are, or -1 if the batch is no good.
+extern int batch_decode(const void*, size_t, batch_op_t*);
+// Queues every operation or none. Fills in the ID of the first; the rest
+// follow on from it. Fails with ESP_ERR_INVALID_ARG if any operation is no
+// good, ESP_ERR_INVALID_STATE during a plate run and ESP_ERR_NO_MEM if
+// there isn't room for the whole batch.
+extern esp_err_t batch_submit(const batch_op_t*, int, uint32_t*);
+// Drops every operation that hasn't been started yet
+extern void batch_cancel(void);
+// Whether any operations are waiting or under way
+extern bool batch_busy(void);
+// ID of the last operation done, or 0
+extern uint32_t batch_last_done(void);
+// Called for every operation done, from the batch task, so it must not block
+typedef void (*batch_listener_t)(const batch_event_t*);
+extern void set_batch_listener(batch_listener_t);
+#endif
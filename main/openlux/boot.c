@@ -0,0 +1,87 @@
+#include "boot.h"
+#include <esp_timer.h>
+#include <freertos/task.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* NAMES[BOOT_STAGE_COUNT] = {
+  "nvs", "results", "web", "wifi", "station", "sensors", "motors", "ready"
+};
+static boot_span_t TIMELINE[BOOT_STAGE_COUNT];
+static portMUX_TYPE LOCK = portMUX_INITIALIZER_UNLOCKED;
+// One bit per stage spawned, set as each finishes
+static EventGroupHandle_t DONE = NULL;
+static EventBits_t SPAWNED = 0;
+
+typedef struct boot_task {
+  boot_stage_t stage;
+  void (*run)(void);
+} boot_task_t;
+
+void boot_begin(boot_stage_t stage) {
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&LOCK);
+  TIMELINE[stage].start_us = now;
+  TIMELINE[stage].end_us = 0;
+  portEXIT_CRITICAL(&LOCK);
+}
+
+// Only the first end counts, so events that repeat can mark a stage done
+void boot_end(boot_stage_t stage) {
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&LOCK);
+  bool first = !TIMELINE[stage].end_us;
+  if (first) {
+    TIMELINE[stage].end_us = now;
+  }
+  int64_t took = now - TIMELINE[stage].start_us;
+  portEXIT_CRITICAL(&LOCK);
+  if (!first) {
+    return;
+  }
+  ESP_LOGI(TAG, "Boot: %s done at %lld ms, took %lld ms", NAMES[stage],
+           (long long) (now / 1000), (long long) (took / 1000));
+}
+
+static void stage_task(void* arg) {
+  boot_task_t task = *(boot_task_t*) arg;
+  free(arg);
+  boot_begin(task.stage);
+  task.run();
+  boot_end(task.stage);
+  xEventGroupSetBits(DONE, 1 << task.stage);
+  vTaskDelete(NULL);
+}
+
+// Only called from the start up task
+void boot_spawn(boot_stage_t stage, void (*run)(void)) {
+  if (!DONE) {
+    DONE = xEventGroupCreate();
+  }
+  boot_task_t* task = malloc(sizeof(boot_task_t));
+  if (!task) {
+    die_politely(ESP_ERR_NO_MEM, "No memory for a start up stage");
+  }
+  task->stage = stage;
+  task->run = run;
+  SPAWNED |= 1 << stage;
+  if (xTaskCreate(stage_task, NAMES[stage], 4096, task, 2, NULL) != pdPASS) {
+    die_politely(ESP_ERR_NO_MEM, "Failed to start a start up stage");
+  }
+}
+
+void boot_join(void) {
+  if (SPAWNED) {
+    xEventGroupWaitBits(DONE, SPAWNED, pdFALSE, pdTRUE, portMAX_DELAY);
+  }
+}
+
+void get_boot_timeline(boot_span_t* spans) {
+  portENTER_CRITICAL(&LOCK);
+  memcpy(spans, TIMELINE, sizeof(TIMELINE));
+  portEXIT_CRITICAL(&LOCK);
+}
+
+const char* boot_stage_name(boot_stage_t stage) {
+  return NAMES[stage];
+}
@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include "common.h"
+
+#ifndef BOOT_H
+#define BOOT_H
+// Start up as a set of stages, each timed from boot. Stages that don't depend
+// on each other run on tasks of their own, and the timeline is logged as it
+// happens and served on /metrics.
+typedef enum boot_stage {
+  BOOT_NVS,              // Settings storage
+  BOOT_RESULTS,          // Finding where the result log left off
+  BOOT_WEB,              // Web files and the HTTP server
+  BOOT_WIFI,             // WiFi driver up, access point running
+  BOOT_STATION,          // Joined the network as a station, if ever
+  BOOT_SENSORS,
+  BOOT_MOTORS,           // Driver set up and the carriage position known
+  BOOT_READY,            // From boot until READY
+  BOOT_STAGE_COUNT
+} boot_stage_t;
+
+typedef struct boot_span {
+  int64_t start_us;      // On the esp_timer_get_time() clock, 0 if not begun
+  int64_t end_us;        // 0 until done
+} boot_span_t;
+
+// Mark a stage started or done, from any task. Only the first end counts.
+extern void boot_begin(boot_stage_t);
+extern void boot_end(boot_stage_t);
+// Run a stage on a task of its own. boot_join waits for every stage spawned.
+extern void boot_spawn(boot_stage_t, void (*)(void));
+extern void boot_join(void);
+extern void get_boot_timeline(boot_span_t*);
+extern const char* boot_stage_name(boot_stage_t);
+#endif
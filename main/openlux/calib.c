@@ -0,0 +1,265 @@
+#include "calib.h"
+#include "hal.h"
+#include "plate.h"
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Every reading the sensor task publishes is converted, so the conversion is
+// fixed point: per channel and well, the blank in sixteenths of a count and a
+// gain in thousandths of an OD per sixteenth of a count, scaled by 2^16. The
+// line is the same for every reading of a well, so a table of coefficients
+// per well does the job of a table of ODs per reading in a fraction of the
+// memory.
+
+// The photodiode's nominal response, OD = (2836 - lit reading) / 378, as
+// sensorToOD in the web page worked it out. It takes no account of the dark
+// reading, so wells without a blank pass are converted from the lit reading
+// alone.
+static const float NOMINAL_LIGHT = 2836;
+static const float NOMINAL_COUNTS = 378;
+// A well whose reference reading is closer than this to its blank, in counts
+// per OD, is taken to have failed and keeps its old slope
+static const float MIN_COUNTS = 16;
+#define GAIN_SHIFT 16
+
+// As kept in settings
+#define CALIB_VERSION 2
+typedef struct calib_record {
+  uint8_t version;
+  uint8_t passes;
+  uint16_t wells;        // Must be PLATE_WELLS to be used
+  uint8_t channels;      // And SENSOR_CHANNELS
+  uint8_t reserved;
+  calib_well_t well[SENSOR_CHANNELS][PLATE_WELLS];
+} calib_record_t;
+
+typedef struct od_coeff {
+  int32_t light;
+  int32_t signal;        // 0 to go by the lit reading alone
+  int32_t gain;
+} od_coeff_t;
+
+static const char CALIB_KEY[] = "calib";
+// Only the job task (and start up) touches the sums; the record is changed
+// by the job task and the server and copied out by a trace, under RECORD
+static calib_record_t CALIB;
+static SemaphoreHandle_t RECORD = NULL;
+static float SUM_LIGHT[SENSOR_CHANNELS][PLATE_WELLS];
+static float SUM_SIGNAL[SENSOR_CHANNELS][PLATE_WELLS];
+static uint16_t N_ADDED[SENSOR_CHANNELS][PLATE_WELLS];
+// Read from any task, so rebuilt under the lock
+static od_coeff_t COEFF[SENSOR_CHANNELS][PLATE_WELLS];
+static portMUX_TYPE LOCK = portMUX_INITIALIZER_UNLOCKED;
+
+// Until load_calibration there is no record to take
+static bool take_record(void) {
+  if (!RECORD) {
+    return false;
+  }
+  xSemaphoreTake(RECORD, portMAX_DELAY);
+  return true;
+}
+
+static uint16_t q4(float counts) {
+  return (uint16_t) fminf(65535, fmaxf(0, lroundf(counts * 16)));
+}
+
+static void build_coefficients(void) {
+  for (int ch = 0; ch < SENSOR_CHANNELS; ch++) {
+    for (int w = 0; w < PLATE_WELLS; w++) {
+      const calib_well_t* c = &CALIB.well[ch][w];
+      od_coeff_t k = {
+        .light = c->light,
+        .signal = c->signal,
+        .gain = (int32_t) ((1000 << GAIN_SHIFT) / c->counts)
+      };
+      portENTER_CRITICAL(&LOCK);
+      COEFF[ch][w] = k;
+      portEXIT_CRITICAL(&LOCK);
+    }
+  }
+}
+
+// No blank measured, so no signal either
+static void set_nominal(void) {
+  memset(&CALIB, 0, sizeof(CALIB));
+  CALIB.version = CALIB_VERSION;
+  CALIB.wells = PLATE_WELLS;
+  CALIB.channels = SENSOR_CHANNELS;
+  for (int ch = 0; ch < SENSOR_CHANNELS; ch++) {
+    for (int w = 0; w < PLATE_WELLS; w++) {
+      CALIB.well[ch][w].light = q4(NOMINAL_LIGHT);
+      CALIB.well[ch][w].counts = q4(NOMINAL_COUNTS);
+    }
+  }
+}
+
+void load_calibration(void) {
+  if (!RECORD) {
+    RECORD = xSemaphoreCreateMutex();
+  }
+  xSemaphoreTake(RECORD, portMAX_DELAY);
+  if (hal_settings_load(CALIB_KEY, &CALIB, sizeof(CALIB)) != ESP_OK ||
+      CALIB.version != CALIB_VERSION || CALIB.wells != PLATE_WELLS ||
+      CALIB.channels != SENSOR_CHANNELS) {
+    set_nominal();
+  }
+  for (int ch = 0; ch < SENSOR_CHANNELS; ch++) {
+    for (int w = 0; w < PLATE_WELLS; w++) {
+      if (!CALIB.well[ch][w].counts) {
+        CALIB.well[ch][w].counts = q4(NOMINAL_COUNTS);
+      }
+    }
+  }
+  build_coefficients();
+  xSemaphoreGive(RECORD);
+  ESP_LOGI(TAG, "Calibration has%s a blank and%s a reference pass",
+           (CALIB.passes & (1 << CALIB_BLANK)) ? "" : "n't had",
+           (CALIB.passes & (1 << CALIB_REFERENCE)) ? "" : " no");
+}
+
+static int16_t od_milli(int32_t from_blank, int32_t gain) {
+  int32_t od = (int32_t) (((int64_t) from_blank * gain + (1 << (GAIN_SHIFT - 1))) >> GAIN_SHIFT);
+  return (int16_t) ((od < -32767) ? -32767 : (od > 32767) ? 32767 : od);
+}
+
+// In thousandths, from a measurement's light less dark mean, or its light
+// mean for a well that has never had a blank measured
+int16_t od_from_means(int channel, int well, float light, float dark) {
+  if (well < 0 || well >= PLATE_WELLS || channel < 0 || channel >= SENSOR_CHANNELS) {
+    return OD_NONE;
+  }
+  portENTER_CRITICAL(&LOCK);
+  od_coeff_t k = COEFF[channel][well];
+  portEXIT_CRITICAL(&LOCK);
+  if (!k.signal) {
+    return od_milli(k.light - lroundf(light * 16), k.gain);
+  }
+  return od_milli(k.signal - lroundf((light - dark) * 16), k.gain);
+}
+
+// In thousandths, from one lit reading. This takes the dark level to be what
+// it was during the blank pass.
+int16_t od_from_raw(int channel, int well, uint16_t raw) {
+  if (well < 0 || well >= PLATE_WELLS || channel < 0 || channel >= SENSOR_CHANNELS) {
+    return OD_NONE;
+  }
+  portENTER_CRITICAL(&LOCK);
+  od_coeff_t k = COEFF[channel][well];
+  portEXIT_CRITICAL(&LOCK);
+  return od_milli(k.light - ((int32_t) raw << 4), k.gain);
+}
+
+int format_od(char* buf, char sep, int16_t od) {
+  if (od == OD_NONE) {
+    buf[0] = sep;
+    buf[1] = '\0';
+    return 1;
+  }
+  return sprintf(buf, "%c%s%d.%03d", sep, (od < 0) ? "-" : "", abs(od) / 1000, abs(od) % 1000);
+}
+
+void calib_begin(calib_pass_t pass) {
+  memset(SUM_LIGHT, 0, sizeof(SUM_LIGHT));
+  memset(SUM_SIGNAL, 0, sizeof(SUM_SIGNAL));
+  memset(N_ADDED, 0, sizeof(N_ADDED));
+}
+
+void calib_add(int well, const measurement_t* m) {
+  if (well < 0 || well >= PLATE_WELLS || m->channel >= SENSOR_CHANNELS) {
+    return;
+  }
+  SUM_LIGHT[m->channel][well] += m->light_mean;
+  SUM_SIGNAL[m->channel][well] += m->signal;
+  N_ADDED[m->channel][well]++;
+}
+
+// Wells that weren't measured keep what they had
+esp_err_t calib_end(calib_pass_t pass, float reference_od) {
+  if (pass == CALIB_REFERENCE && !(reference_od > 0)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (!take_record()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  int fitted = 0;
+  for (int ch = 0; ch < SENSOR_CHANNELS; ch++) {
+    for (int w = 0; w < PLATE_WELLS; w++) {
+      uint16_t n = N_ADDED[ch][w];
+      if (!n) {
+        continue;
+      }
+      calib_well_t* c = &CALIB.well[ch][w];
+      float light = SUM_LIGHT[ch][w] / n;
+      float signal = SUM_SIGNAL[ch][w] / n;
+      if (pass == CALIB_BLANK) {
+        c->light = q4(light);
+        // Never 0, which would mean no blank
+        c->signal = q4(signal) ? q4(signal) : 1;
+      } else {
+        // Against the same reading the well is converted from
+        float blank = c->signal ? c->signal / 16.0f : c->light / 16.0f;
+        float reading = c->signal ? signal : light;
+        float counts = (blank - reading) / reference_od;
+        if (counts < MIN_COUNTS) {
+          ESP_LOGW(TAG, "Well %d reads %.0f against a blank of %.0f on channel %d, "
+                   "keeping its slope", w, reading, blank, ch);
+          continue;
+        }
+        c->counts = q4(counts);
+      }
+      fitted++;
+    }
+  }
+  CALIB.passes |= 1 << pass;
+  build_coefficients();
+  ESP_LOGI(TAG, "Calibrated %d wells over %d channels from a %s pass", fitted,
+           SENSOR_CHANNELS, (pass == CALIB_BLANK) ? "blank" : "reference");
+  esp_err_t err = hal_settings_save(CALIB_KEY, &CALIB, sizeof(CALIB));
+  xSemaphoreGive(RECORD);
+  return err;
+}
+
+esp_err_t calib_reset(void) {
+  if (!take_record()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  set_nominal();
+  build_coefficients();
+  esp_err_t err = hal_settings_save(CALIB_KEY, &CALIB, sizeof(CALIB));
+  xSemaphoreGive(RECORD);
+  return err;
+}
+
+uint8_t calib_passes(void) {
+  if (!take_record()) {
+    return 0;
+  }
+  uint8_t passes = CALIB.passes;
+  xSemaphoreGive(RECORD);
+  return passes;
+}
+
+void calib_get_well(int channel, int well, calib_well_t* out) {
+  if (!take_record()) {
+    memset(out, 0, sizeof(*out));
+    return;
+  }
+  *out = CALIB.well[channel][well];
+  xSemaphoreGive(RECORD);
+}
+
+size_t calib_snapshot(void* buf, size_t max) {
+  if (max < sizeof(CALIB) || !take_record()) {
+    return 0;
+  }
+  memcpy(buf, &CALIB, sizeof(CALIB));
+  xSemaphoreGive(RECORD);
+  return sizeof(CALIB);
+}
+
+esp_err_t calib_preset(const void* data, size_t len) {
+  return hal_settings_save(CALIB_KEY, data, len);
+}
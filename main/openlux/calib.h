@@ -0,0 +1,56 @@
+#include <stdint.h>
+#include "sensors.h"
+#include "samples.h"
+
+#ifndef CALIB_H
+#define CALIB_H
+// Optical density, worked out on the device from a straight line through each
+// well's reading of a blank:
+//   OD = (blank - reading) / counts per OD
+// A blank pass over a plate of clear wells measures the blank for each well,
+// and a reference pass over wells of one known OD measures the slope. Both
+// are kept in settings. Until they are done the nominal response is used,
+// which goes by the lit reading alone; after a blank pass the reading is lit
+// less dark. Every channel (see sensors.h) has a calibration of its own, and
+// passes calibrate them all at once.
+typedef enum calib_pass {
+  CALIB_NONE,
+  CALIB_BLANK,
+  CALIB_REFERENCE
+} calib_pass_t;
+
+// One well's calibration, in sixteenths of an ADC count
+typedef struct calib_well {
+  uint16_t light;        // Lit reading through the blank
+  uint16_t signal;       // Lit less dark reading through the blank, 0 if none
+  uint16_t counts;       // Signal lost per unit OD
+} calib_well_t;
+
+// System initialisation, once settings can be read:
+extern void load_calibration(void);
+// Conversions for a channel and well, from any task, of a measurement's lit
+// and dark means or of one lit reading. Give OD_NONE for a well of -1.
+extern int16_t od_from_means(int, int, float, float);
+extern int16_t od_from_raw(int, int, uint16_t);
+// Passes are made by the job task: begin, add each well's measurement on each
+// channel as it is made (more than once averages), then end to fit and save,
+// which fails with ESP_ERR_INVALID_ARG for a reference OD that isn't positive.
+extern void calib_begin(calib_pass_t);
+extern void calib_add(int, const measurement_t*);
+extern esp_err_t calib_end(calib_pass_t, float);
+// Write an OD in thousandths as a field of a text record: a separator then
+// the OD to three places, or nothing after the separator for OD_NONE. Returns
+// the length written.
+extern int format_od(char*, char, int16_t);
+// Back to the nominal response
+extern esp_err_t calib_reset(void);
+// Which passes (1 << calib_pass_t) the calibration has had, and each
+// channel's for each well
+extern uint8_t calib_passes(void);
+extern void calib_get_well(int, int, calib_well_t*);
+// Copies the calibration in use, as it is kept in settings, for a trace to
+// start from, giving its size or 0 if it doesn't fit; and keeps one for
+// load_calibration to find, as a replay does
+extern size_t calib_snapshot(void*, size_t);
+extern esp_err_t calib_preset(const void*, size_t);
+#endif
@@ -1,41 +1,157 @@
 #include "common.h"
+#include "trace.h"
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+#include <stdatomic.h>
 
 // Name of our application
 const char* TAG = "OpenLUX";
-// Where on the file system we are storing web data
-const char* WEB = "/web";
-// Status stack
-struct Stack {
-  status_t data[8];
-  int idx;
-};
-// Current status of the machine
-struct Stack STAT_STACK = { { INITIALISING }, 0 };
-int SYNC_KEY = 0;
+// Where on the file system we are storing web data. The simulator build
+// serves the same files relative to its working directory instead.
+#ifndef WEB_ROOT
+#define WEB_ROOT "/web"
+#endif
+const char* WEB = WEB_ROOT;
+// Who to tell when the status changes
+static status_listener_t STATUS_LISTENER = NULL;
 
-void set_status(status_t status) {
-  STAT_STACK.idx++;
-  STAT_STACK.data[STAT_STACK.idx] = status;
+// The whole state is one word, so reading it is a single load and every
+// transition is a compare and swap
+#define ST_READY (1u << 0)
+#define ST_MOTION_SHIFT 1
+#define ST_MOTION (3u << ST_MOTION_SHIFT)   // 0, HOMING or MOVING
+#define ST_READING (1u << 3)
+static atomic_uint STATE = 0;
+static EventGroupHandle_t STATE_EVENTS = NULL;
+// Keeps the event group bits from being updated out of order
+static SemaphoreHandle_t STATE_SYNC = NULL;
+static atomic_uint ENTERED[READING + 1];
+static atomic_llong LAST_US[READING + 1];
+static atomic_uint REFUSED = 0;
+static const char* STATUS_NAMES[] = { "INITIALISING", "READY", "HOMING", "MOVING", "READING" };
+
+static status_t state_to_status(unsigned state) {
+  unsigned motion = (state & ST_MOTION) >> ST_MOTION_SHIFT;
+  if (!(state & ST_READY)) {
+    return INITIALISING;
+  } else if (motion) {
+    return motion;
+  } else if (state & ST_READING) {
+    return READING;
+  }
+  return READY;
+}
+
+void init_status(void) {
+  STATE_EVENTS = xEventGroupCreate();
+  STATE_SYNC = xSemaphoreCreateMutex();
+  xEventGroupSetBits(STATE_EVENTS, STATE_IDLE_BIT | STATE_DARK_BIT);
+}
+
+void set_status_listener(status_listener_t listener) {
+  STATUS_LISTENER = listener;
+}
+
+// Tell the listener the current status even though it hasn't changed, e.g.
+// so clients learn that a command with a new sync key was accepted
+void announce_status(void) {
+  if (STATUS_LISTENER) {
+    STATUS_LISTENER(get_status());
+  }
+}
+
+// Bring the event group in line with the state as it is now. Whoever syncs
+// last sees the latest state, so racing transitions can't leave it stale.
+static void sync_events(void) {
+  xSemaphoreTake(STATE_SYNC, portMAX_DELAY);
+  unsigned state = atomic_load(&STATE);
+  EventBits_t set = ((state & ST_READY) ? STATE_READY_BIT : 0) |
+                    ((state & ST_MOTION) ? 0 : STATE_IDLE_BIT) |
+                    ((state & ST_READING) ? 0 : STATE_DARK_BIT);
+  xEventGroupClearBits(STATE_EVENTS, ~set & (STATE_READY_BIT | STATE_IDLE_BIT | STATE_DARK_BIT));
+  xEventGroupSetBits(STATE_EVENTS, set);
+  xSemaphoreGive(STATE_SYNC);
+}
+
+// Move from a state with (state & mask) == from to one with (state & mask) == to
+static bool transition(status_t status, bool begin, unsigned mask, unsigned from,
+                       unsigned to) {
+  unsigned state = atomic_load(&STATE);
+  do {
+    if ((state & mask) != from) {
+      atomic_fetch_add(&REFUSED, 1);
+      ESP_LOGW(TAG, "Refused to %s %s while %s", begin ? "begin" : "end",
+               STATUS_NAMES[status], STATUS_NAMES[state_to_status(state)]);
+      return false;
+    }
+  } while (!atomic_compare_exchange_weak(&STATE, &state, (state & ~mask) | to));
+  if (begin) {
+    atomic_fetch_add(&ENTERED[status], 1);
+    atomic_store(&LAST_US[status], esp_timer_get_time());
+  }
+  trace_status(status, begin);
+  sync_events();
+  if (STATUS_LISTENER) {
+    STATUS_LISTENER(state_to_status((state & ~mask) | to));
+  }
+  return true;
+}
+
+bool begin_status(status_t status) {
+  switch (status) {
+  case READY:
+    return transition(status, true, ST_READY, 0, ST_READY);
+  case HOMING:
+  case MOVING:
+    return transition(status, true, ST_MOTION, 0, status << ST_MOTION_SHIFT);
+  case READING:
+    return transition(status, true, ST_READING, 0, ST_READING);
+  default:
+    return transition(status, true, 0, 1, 0);
+  }
+}
+
+bool end_status(status_t status) {
+  switch (status) {
+  case HOMING:
+  case MOVING:
+    return transition(status, false, ST_MOTION, status << ST_MOTION_SHIFT, 0);
+  case READING:
+    return transition(status, false, ST_READING, ST_READING, 0);
+  default:
+    return transition(status, false, 0, 1, 0);
+  }
 }
 
-void revert_status(void) {
-  STAT_STACK.idx--;
+bool in_status(status_t status) {
+  unsigned state = atomic_load(&STATE);
+  switch (status) {
+  case READY:
+    return state & ST_READY;
+  case HOMING:
+  case MOVING:
+    return (state & ST_MOTION) == status << ST_MOTION_SHIFT;
+  case READING:
+    return state & ST_READING;
+  default:
+    return !(state & ST_READY);
+  }
 }
 
 status_t get_status(void) {
-  /* ESP_LOGI(TAG, "[%d,%d,%d,%d,%d,%d,%d,%d] (%d)",
-           STAT_STACK.data[0],
-           STAT_STACK.data[1],
-           STAT_STACK.data[2],
-           STAT_STACK.data[3],
-           STAT_STACK.data[4],
-           STAT_STACK.data[5],
-           STAT_STACK.data[6],
-           STAT_STACK.data[7],
-           STAT_STACK.idx
-           );*/
-  // ESP_LOGE(TAG, "IDX: %d", STAT_STACK.idx);
-  return STAT_STACK.data[STAT_STACK.idx];
+  return state_to_status(atomic_load(&STATE));
+}
+
+EventGroupHandle_t state_events(void) {
+  return STATE_EVENTS;
+}
+
+void get_status_stats(status_stats_t* stats) {
+  for (int i = 0; i <= READING; i++) {
+    stats->entered[i] = atomic_load(&ENTERED[i]);
+    stats->last_us[i] = atomic_load(&LAST_US[i]);
+  }
+  stats->refused = atomic_load(&REFUSED);
 }
 
 // This function does not return a value
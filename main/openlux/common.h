@@ -1,7 +1,9 @@
+#include <stdbool.h>
 #include <freertos/FreeRTOS.h>
 #include <esp_wifi.h>
 #include <esp_err.h>
 #include <esp_log.h>
+#include <freertos/event_groups.h>
 
 #ifndef COMMON_H
 #define COMMON_H
@@ -16,12 +18,37 @@ typedef enum status {
   MOVING,
   READING
 } status_t;
-// Status getting and setting:
-extern void set_status(status_t);
-extern void revert_status(void);
+// Device state. Motion (homing or moving) and reading (LED lit) are tracked
+// separately, since a client can light the LED while the carriage moves, and
+// the status reported is the most important thing going on. Only legal
+// transitions are made:
+//   READY                  once, at the end of start up
+//   HOMING, MOVING         begin while the motors are idle, end the same one
+//   READING                begin while not reading, end while reading
+// Anything else is refused, logged and counted, and returns false.
+// init_status must be called before anything else.
+extern void init_status(void);
+extern bool begin_status(status_t);
+extern bool end_status(status_t);
+// Whether the given activity (or READY, start up being over) is under way
+extern bool in_status(status_t);
 extern status_t get_status(void);
+// Event group bits kept in step with the state, for waiting on it
+#define STATE_READY_BIT (1 << 0) // Start up is over
+#define STATE_IDLE_BIT (1 << 1)  // The motors are not moving or homing
+#define STATE_DARK_BIT (1 << 2)  // Not reading
+extern EventGroupHandle_t state_events(void);
+// How many times each status has been entered, and when it last was
+typedef struct status_stats {
+  uint32_t entered[READING + 1];
+  int64_t last_us[READING + 1];
+  uint32_t refused;          // Illegal transitions turned away
+} status_stats_t;
+extern void get_status_stats(status_stats_t*);
+// Called with the new status on every change, from whichever task made it
+typedef void (*status_listener_t)(status_t);
+extern void set_status_listener(status_listener_t);
+extern void announce_status(void);
 // Error handling:
 extern void die_politely(esp_err_t, char[]);
-// Kill me
-int SYNC_KEY;
 #endif
@@ -0,0 +1,56 @@
+#include <stdint.h>
+#include <driver/adc.h>
+#include "common.h"
+
+#ifndef HAL_H
+#define HAL_H
+// The hardware abstraction layer. Everything that touches a pin, the ADC or
+// the clock goes through these functions, so the motor, sensor and web code
+// can be built either for the ESP32 (hal_esp32.c) or for a Linux process
+// driving a simulated plate (host/sim/hal_sim.c).
+// Stepper shift register. Bytes are clocked out by a peripheral rather than
+// the CPU: a move is handed over as runs of a byte held for a whole number of
+// HAL_STEP_TICK_US ticks. Writes block only while the output buffer is full,
+// and once everything queued has played out the coils are released.
+#define HAL_STEP_TICK_US 10
+typedef struct step_run {
+  uint8_t byte;
+  uint32_t ticks;
+} step_run_t;
+extern void hal_setup_shift_register(void);
+extern void hal_step_stream_write(const step_run_t*, size_t);
+extern void hal_step_stream_flush(void);
+// When a run written now would be latched, on the hal_time_us clock
+extern int64_t hal_step_stream_next_us(void);
+// LED and photodiode:
+extern void hal_setup_led(int);
+extern void hal_set_led(int, int);
+extern esp_err_t hal_setup_adc(adc1_channel_t, adc_atten_t);
+extern int hal_read_adc(adc1_channel_t);
+// Continuous, DMA driven acquisition. Reads block until the buffer is full and
+// return the number of 12 bit samples written, and when (on the hal_time_us
+// clock) the first of them was taken. Samples are evenly spaced at the rate.
+extern esp_err_t hal_adc_stream_start(adc1_channel_t, adc_atten_t, uint32_t);
+extern size_t hal_adc_stream_read(uint16_t*, size_t, int64_t*);
+// Switch the stream to another channel (set up with hal_setup_adc) without
+// stopping it. Samples taken from the next hal_time_us on are of the new one.
+extern esp_err_t hal_adc_stream_select(adc1_channel_t);
+// How many samples a read may return that were taken before it was called
+extern size_t hal_adc_stream_lag(void);
+// Result log storage: a raw flash partition made of whole erase sectors.
+// Writes can only clear bits, so a sector must be erased before reuse. Open
+// returns the partition size.
+#define HAL_STORE_SECTOR 4096
+extern esp_err_t hal_store_open(size_t*);
+extern esp_err_t hal_store_read(size_t, void*, size_t);
+extern esp_err_t hal_store_write(size_t, const void*, size_t);
+extern esp_err_t hal_store_erase(size_t, size_t);
+// Settings: small records kept by key across restarts, in NVS on the ESP32.
+// Loads fail with ESP_ERR_NOT_FOUND if nothing of that size was saved. Every
+// save wears the flash, so they should be rare.
+extern esp_err_t hal_settings_load(const char*, void*, size_t);
+extern esp_err_t hal_settings_save(const char*, const void*, size_t);
+// Clock:
+extern int64_t hal_time_us(void);
+extern void hal_wait_until_us(int64_t);
+#endif
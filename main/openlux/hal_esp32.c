@@ -0,0 +1,287 @@
+#include "hal.h"
+#include <driver/gpio.h>
+#include <driver/i2s.h>
+#include <esp_timer.h>
+#include <esp_partition.h>
+#include <nvs.h>
+#include <rom/ets_sys.h>
+
+// Pins wired to the 74HC595 style shift register driving the steppers
+static const gpio_num_t DATA = GPIO_NUM_18;
+static const gpio_num_t CLK = GPIO_NUM_21;
+static const gpio_num_t LATCH = GPIO_NUM_19;
+// The I2S peripheral that clocks the ADC for continuous acquisition. This is
+// the only one that can be routed to the built-in ADC.
+static const i2s_port_t ADC_I2S = I2S_NUM_0;
+// Enough DMA buffering to ride out a busy scheduler
+#define ADC_DMA_COUNT 4
+#define ADC_DMA_LEN 256
+// The other I2S peripheral clocks the shift register. In serial mode its bit
+// clock, word select and data lines are exactly the register's clock, latch
+// and data inputs, so every stereo frame shifts in a byte and latches it on
+// the word select edge. One frame per step tick, fed from DMA, gives step
+// timing that doesn't depend on the scheduler at all.
+static const i2s_port_t STEP_I2S = I2S_NUM_1;
+// Frames per DMA buffer, 5 ms each, and how many are queued ahead
+#define STEP_DMA_LEN 500
+#define STEP_DMA_COUNT 8
+// Frames expanded from runs before being handed to the driver
+#define STEP_CHUNK 256
+
+static uint32_t STEP_FRAMES[STEP_CHUNK];
+// When the last frame written so far will have been clocked out
+static int64_t STEP_END_US = 0;
+
+void hal_setup_shift_register(void) {
+  i2s_config_t config = {
+    .mode = I2S_MODE_MASTER | I2S_MODE_TX,
+    .sample_rate = 1000000 / HAL_STEP_TICK_US,
+    .bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
+    .channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT,
+    .communication_format = I2S_COMM_FORMAT_I2S_MSB,
+    .intr_alloc_flags = 0,
+    .dma_buf_count = STEP_DMA_COUNT,
+    .dma_buf_len = STEP_DMA_LEN,
+    .use_apll = false,
+    // Send zeros, i.e. release the coils, whenever the buffers run dry rather
+    // than replaying the last move
+    .tx_desc_auto_clear = true
+  };
+  i2s_pin_config_t pins = {
+    .bck_io_num = CLK,
+    .ws_io_num = LATCH,
+    .data_out_num = DATA,
+    .data_in_num = I2S_PIN_NO_CHANGE
+  };
+  die_politely(i2s_driver_install(STEP_I2S, &config, 0, NULL),
+               "Failed to install the stepper I2S driver");
+  die_politely(i2s_set_pin(STEP_I2S, &pins), "Failed to route the stepper pins");
+  i2s_zero_dma_buffer(STEP_I2S);
+}
+
+// I2S sends the most significant bit first, where the coils were wired up
+// for bytes clocked in least significant bit first
+static uint8_t reverse_bits(uint8_t b) {
+  b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+  b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+  b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+  return b;
+}
+
+static void write_frames(size_t n) {
+  size_t written = 0;
+  i2s_write(STEP_I2S, STEP_FRAMES, n * sizeof(uint32_t), &written, portMAX_DELAY);
+}
+
+// Expand runs into frames and queue them for DMA. Both channels carry the
+// byte, so it is the last eight bits shifted whichever edge latches.
+void hal_step_stream_write(const step_run_t* runs, size_t n) {
+  int64_t now = esp_timer_get_time();
+  if (STEP_END_US < now) {
+    STEP_END_US = now;
+  }
+  size_t fill = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint32_t rev = reverse_bits(runs[i].byte);
+    uint32_t frame = rev << 16 | rev;
+    for (uint32_t t = 0; t < runs[i].ticks; t++) {
+      STEP_FRAMES[fill++] = frame;
+      if (fill == STEP_CHUNK) {
+        write_frames(fill);
+        fill = 0;
+      }
+    }
+    STEP_END_US += (int64_t) runs[i].ticks * HAL_STEP_TICK_US;
+  }
+  if (fill) {
+    write_frames(fill);
+  }
+}
+
+// Frames written now go out once those already queued have. That could be up
+// to one buffer (5 ms) later, if the driver is part way through sending one.
+int64_t hal_step_stream_next_us(void) {
+  int64_t now = esp_timer_get_time();
+  return (STEP_END_US > now) ? STEP_END_US : now;
+}
+
+// Sleep until the DMA has played out everything written. Allow for one extra
+// buffer, since new frames may start after one the driver is already sending.
+void hal_step_stream_flush(void) {
+  hal_wait_until_us(STEP_END_US + STEP_DMA_LEN * HAL_STEP_TICK_US);
+}
+
+void hal_setup_led(int gpio) {
+  // Fail check this
+  gpio_pad_select_gpio(gpio);
+  gpio_set_direction(gpio, GPIO_MODE_OUTPUT);
+}
+
+void hal_set_led(int gpio, int level) {
+  gpio_set_level(gpio, level);
+}
+
+esp_err_t hal_setup_adc(adc1_channel_t ch, adc_atten_t atn) {
+  esp_err_t err = adc1_config_width(ADC_WIDTH_BIT_12);
+  if (err) {
+    return err;
+  }
+  return adc1_config_channel_atten(ch, atn);
+}
+
+int hal_read_adc(adc1_channel_t ch) {
+  return adc1_get_raw(ch);
+}
+
+// The I2S clock paces the conversions, so sample times follow from counting
+// them. What isn't known is when the count started, only that no sample can
+// have been taken after the read that returned it: the earliest start that
+// the reads allow for is the best estimate. The I2S clock is only nominally
+// at the rate asked for, though, so the start each read allows for drifts.
+// Earlier is taken at once, and later is crept towards over this many reads,
+// so a late read moves the estimate little but a slow clock can't leave it
+// ever further behind. Only the polling task falling a whole DMA queue
+// behind, so the driver drops buffers, upsets this.
+#define ADC_EPOCH_SETTLE 64
+static uint32_t ADC_RATE = 1;
+static uint64_t ADC_COUNT = 0;
+static int64_t ADC_EPOCH_US = INT64_MAX;
+
+// Put I2S0 into built-in ADC mode so that conversions are triggered by the I2S
+// clock and land in DMA buffers without any CPU involvement
+esp_err_t hal_adc_stream_start(adc1_channel_t ch, adc_atten_t atn, uint32_t rate) {
+  i2s_config_t config = {
+    .mode = I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN,
+    .sample_rate = rate,
+    .bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
+    .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,
+    .communication_format = I2S_COMM_FORMAT_I2S_MSB,
+    .intr_alloc_flags = 0,
+    .dma_buf_count = ADC_DMA_COUNT,
+    .dma_buf_len = ADC_DMA_LEN,   // Samples per DMA buffer
+    .use_apll = false
+  };
+  esp_err_t err = hal_setup_adc(ch, atn);
+  ADC_RATE = rate;
+  ADC_COUNT = 0;
+  ADC_EPOCH_US = INT64_MAX;
+  if (!err) {
+    err = i2s_driver_install(ADC_I2S, &config, 0, NULL);
+  }
+  if (!err) {
+    err = i2s_set_adc_mode(ADC_UNIT_1, ch);
+  }
+  if (!err) {
+    err = i2s_adc_enable(ADC_I2S);
+  }
+  return err;
+}
+
+size_t hal_adc_stream_read(uint16_t* buf, size_t max, int64_t* first_us) {
+  size_t bytes = 0;
+  i2s_read(ADC_I2S, buf, max * sizeof(uint16_t), &bytes, portMAX_DELAY);
+  size_t n = bytes / sizeof(uint16_t);
+  int64_t epoch = esp_timer_get_time() - (int64_t) ((ADC_COUNT + n) * 1000000 / ADC_RATE);
+  if (epoch < ADC_EPOCH_US) {
+    ADC_EPOCH_US = epoch;
+  } else {
+    ADC_EPOCH_US += (epoch - ADC_EPOCH_US) / ADC_EPOCH_SETTLE;
+  }
+  *first_us = ADC_EPOCH_US + (int64_t) (ADC_COUNT * 1000000 / ADC_RATE);
+  ADC_COUNT += n;
+  // The top four bits of each sample hold the channel number
+  for (size_t i = 0; i < n; i++) {
+    buf[i] &= 0x0FFF;
+  }
+  return n;
+}
+
+// Only the SAR pattern table the I2S clock triggers conversions from is
+// rewritten, so the clock keeps running and sample times stay evenly spaced.
+// Samples already waiting in the DMA buffers are of the old channel.
+esp_err_t hal_adc_stream_select(adc1_channel_t ch) {
+  return i2s_set_adc_mode(ADC_UNIT_1, ch);
+}
+
+// Every DMA buffer may be full and waiting when a read starts
+size_t hal_adc_stream_lag(void) {
+  return ADC_DMA_COUNT * ADC_DMA_LEN;
+}
+
+// The result log lives in its own data partition, see partitions.csv
+static const char STORE_LABEL[] = "results";
+static const esp_partition_subtype_t STORE_SUBTYPE = 0x40;
+static const esp_partition_t* STORE = NULL;
+
+esp_err_t hal_store_open(size_t* size) {
+  STORE = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, STORE_SUBTYPE, STORE_LABEL);
+  if (!STORE) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  *size = STORE->size;
+  return ESP_OK;
+}
+
+esp_err_t hal_store_read(size_t off, void* buf, size_t len) {
+  return esp_partition_read(STORE, off, buf, len);
+}
+
+esp_err_t hal_store_write(size_t off, const void* buf, size_t len) {
+  return esp_partition_write(STORE, off, buf, len);
+}
+
+esp_err_t hal_store_erase(size_t off, size_t len) {
+  return esp_partition_erase_range(STORE, off, len);
+}
+
+// Settings are blobs in their own NVS namespace. nvs_flash_init() must have
+// been called first.
+static const char SETTINGS_NAMESPACE[] = "openlux";
+
+esp_err_t hal_settings_load(const char* key, void* buf, size_t len) {
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(SETTINGS_NAMESPACE, NVS_READONLY, &nvs);
+  if (err) {
+    return (err == ESP_ERR_NVS_NOT_FOUND) ? ESP_ERR_NOT_FOUND : err;
+  }
+  size_t got = len;
+  err = nvs_get_blob(nvs, key, buf, &got);
+  nvs_close(nvs);
+  if (err == ESP_ERR_NVS_NOT_FOUND || err == ESP_ERR_NVS_INVALID_LENGTH ||
+      (!err && got != len)) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  return err;
+}
+
+esp_err_t hal_settings_save(const char* key, const void* buf, size_t len) {
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err) {
+    return err;
+  }
+  err = nvs_set_blob(nvs, key, buf, len);
+  if (!err) {
+    err = nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+  return err;
+}
+
+int64_t hal_time_us(void) {
+  return esp_timer_get_time();
+}
+
+// Sleep through whole ticks, then spin out the last fraction of one so step
+// timing isn't rounded to the tick period
+void hal_wait_until_us(int64_t deadline) {
+  int64_t left = deadline - esp_timer_get_time();
+  int64_t tick_us = portTICK_PERIOD_MS * 1000;
+  if (left > 2 * tick_us) {
+    vTaskDelay(left / tick_us - 1);
+  }
+  left = deadline - esp_timer_get_time();
+  if (left > 0) {
+    ets_delay_us(left);
+  }
+}
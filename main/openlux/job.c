@@ -0,0 +1,294 @@
+#include "job.h"
+#include "motors.h"
+#include "sensors.h"
+#include "results.h"
+#include "scan.h"
+#include <math.h>
+
+// The job task runs a whole plate read on its own: it moves to each well,
+// takes a dark and lit measurement there on every channel and reports each
+// result as a job event. Clients only start, watch and stop runs, so a
+// stalled browser tab can no longer hold up or break a read.
+
+// How often a wait between cycles checks whether the run was cancelled
+static const int POLL_MS = 10;
+// Longest a single move can take, homing included, before giving up on it
+static const int MOVE_TIMEOUT_MS = 30000;
+
+static QueueHandle_t JOBS = NULL;
+static job_listener_t JOB_LISTENER = NULL;
+static portMUX_TYPE LOCK = portMUX_INITIALIZER_UNLOCKED;
+static job_progress_t PROGRESS = { false, 0, 0, 0, 0 };
+static volatile bool STOP = false;
+
+void set_job_listener(job_listener_t listener) {
+  JOB_LISTENER = listener;
+}
+
+static void emit_event(job_event_t* ev) {
+  if (JOB_LISTENER) {
+    JOB_LISTENER(ev);
+  }
+}
+
+static void emit(job_event_kind_t kind, int cycle, int well, int value) {
+  job_event_t ev = { .kind = kind, .cycle = cycle, .well = well, .value = value };
+  emit_event(&ev);
+}
+
+static void set_progress(int cycle, int done) {
+  portENTER_CRITICAL(&LOCK);
+  PROGRESS.cycle = cycle;
+  PROGRESS.done = done;
+  portEXIT_CRITICAL(&LOCK);
+}
+
+// Sleep for up to ms, waking early if the run is cancelled
+static void wait_ms(uint32_t ms) {
+  TickType_t start = xTaskGetTickCount();
+  TickType_t ticks = pdMS_TO_TICKS(ms);
+  while (!STOP && xTaskGetTickCount() - start < ticks) {
+    vTaskDelay(pdMS_TO_TICKS(POLL_MS));
+  }
+}
+
+// Move to a well and measure it. Returns false if cancelled on the way or
+// the measurement fails.
+static bool read_well(int well, uint32_t samples, measurement_t m[SENSOR_CHANNELS]) {
+  // A move that has started is always finished, so this waits on the motor
+  // task rather than on STOP. Any notification left over from a move that
+  // timed out is cleared first.
+  ulTaskNotifyTake(pdTRUE, 0);
+  if (goto_well(well, xTaskGetCurrentTaskHandle()) != ESP_OK) {
+    return false;
+  }
+  if (!ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MOVE_TIMEOUT_MS))) {
+    ESP_LOGW(TAG, "Timed out moving to well %d", well);
+    return false;
+  }
+  if (STOP || get_current_well() != well) {
+    return false;
+  }
+  esp_err_t err = measure(samples, m);
+  if (err) {
+    ESP_LOGW(TAG, "Measuring well %d failed: %s", well, esp_err_to_name(err));
+    return false;
+  }
+  return true;
+}
+
+// Keep the measurement in flash, or towards the calibration, before anyone
+// is told about it
+static void log_result(const job_spec_t* job, uint32_t run, uint32_t time_ms,
+                       const job_event_t* ev) {
+  if (job->calibrate) {
+    calib_add(ev->well, &ev->m);
+    return;
+  }
+  result_record_t rec = {
+    .run = run,
+    .time_ms = time_ms,
+    .cycle = ev->cycle,
+    .well = ev->well,
+    .channel = ev->m.channel,
+    .light = ev->m.light_mean,
+    .dark = ev->m.dark_mean,
+    .signal_se = fminf(65535, lroundf(ev->m.signal_se * 100)),
+    .od = ev->m.od
+  };
+  esp_err_t err = results_append(&rec);
+  if (err) {
+    ESP_LOGW(TAG, "Failed to log well %d: %s", ev->well, esp_err_to_name(err));
+  }
+}
+
+// Stop at each well in turn
+static void well_cycle(job_spec_t* job, int cycle, uint32_t run, TickType_t run_start) {
+  // Reorder from wherever the previous cycle left the carriage
+  order_wells(job->wells, job->n_wells);
+  for (int i = 0; i < job->n_wells && !STOP; i++) {
+    measurement_t m[SENSOR_CHANNELS];
+    bool ok = read_well(job->wells[i], job->samples, m);
+    if (STOP) {
+      break;
+    }
+    uint32_t time_ms = (xTaskGetTickCount() - run_start) * portTICK_PERIOD_MS;
+    // Every channel, or just the one event if the well couldn't be read
+    for (int c = 0; c < (ok ? SENSOR_CHANNELS : 1); c++) {
+      job_event_t ev = { .kind = JOB_WELL, .cycle = cycle, .well = job->wells[i], .value = -1 };
+      if (ok) {
+        ev.m = m[c];
+        ev.value = lroundf(ev.m.light_mean);
+        log_result(job, run, time_ms, &ev);
+      }
+      emit_event(&ev);
+    }
+    set_progress(cycle, i + 1);
+  }
+}
+
+// Raster mode: sweep each row that has wells to read, alternating direction
+// so every sweep starts near where the last one ended
+static void raster_cycle(const job_spec_t* job, int cycle, uint32_t run, TickType_t run_start) {
+  static measurement_t m[SENSOR_CHANNELS][PLATE_COLS];
+  uint32_t rows[PLATE_ROWS] = { 0 };
+  for (int i = 0; i < job->n_wells; i++) {
+    rows[job->wells[i] / PLATE_COLS] |= 1u << (job->wells[i] % PLATE_COLS);
+  }
+  bool reverse = false;
+  int done = 0;
+  for (int row = 0; row < PLATE_ROWS && !STOP; row++) {
+    if (!rows[row]) {
+      continue;
+    }
+    uint32_t read[SENSOR_CHANNELS];
+    bool ok = scan_row(row, rows[row], reverse, job->samples, m, read) == ESP_OK;
+    reverse = !reverse;
+    if (STOP) {
+      break;
+    }
+    uint32_t time_ms = (xTaskGetTickCount() - run_start) * portTICK_PERIOD_MS;
+    for (int col = 0; col < PLATE_COLS; col++) {
+      if (!((rows[row] >> col) & 1)) {
+        continue;
+      }
+      bool any = false;
+      for (int c = 0; ok && c < SENSOR_CHANNELS; c++) {
+        if (!((read[c] >> col) & 1)) {
+          continue;
+        }
+        job_event_t ev = { .kind = JOB_WELL, .cycle = cycle, .well = row * PLATE_COLS + col,
+                           .value = -1 };
+        ev.m = m[c][col];
+        ev.value = lroundf(ev.m.light_mean);
+        log_result(job, run, time_ms, &ev);
+        emit_event(&ev);
+        any = true;
+      }
+      if (!any) {
+        job_event_t ev = { .kind = JOB_WELL, .cycle = cycle, .well = row * PLATE_COLS + col,
+                           .value = -1 };
+        emit_event(&ev);
+      }
+      set_progress(cycle, ++done);
+    }
+  }
+}
+
+static void run_job(job_spec_t* job) {
+  ESP_LOGI(TAG, "Starting a %srun of %d wells, %d times", job->raster ? "raster " : "",
+           job->n_wells, job->repeats);
+  emit(JOB_STARTED, 0, -1, job->n_wells);
+  uint32_t run = results_new_run();
+  if (job->calibrate) {
+    calib_begin(job->calibrate);
+  }
+  int cycle = 0;
+  TickType_t run_start = xTaskGetTickCount();
+  TickType_t cycle_start = run_start;
+  for (; cycle < job->repeats && !STOP; cycle++) {
+    if (cycle) {
+      TickType_t since = xTaskGetTickCount() - cycle_start;
+      TickType_t interval = pdMS_TO_TICKS(job->interval_ms);
+      if (since < interval) {
+        wait_ms((interval - since) * portTICK_PERIOD_MS);
+      }
+      if (STOP) {
+        break;
+      }
+      cycle_start = xTaskGetTickCount();
+    }
+    set_progress(cycle, 0);
+    if (job->raster) {
+      raster_cycle(job, cycle, run, run_start);
+    } else {
+      well_cycle(job, cycle, run, run_start);
+    }
+    if (!STOP) {
+      emit(JOB_CYCLE, cycle, -1, 0);
+    }
+  }
+  ESP_LOGI(TAG, "Run %s after %d cycles", STOP ? "stopped" : "finished", cycle);
+  if (job->calibrate && !STOP) {
+    esp_err_t err = calib_end(job->calibrate, job->reference_od);
+    if (err) {
+      ESP_LOGW(TAG, "Failed to save the calibration: %s", esp_err_to_name(err));
+    }
+  }
+  emit(STOP ? JOB_STOPPED : JOB_FINISHED, cycle, -1, 0);
+}
+
+static void job_loop(void* args) {
+  // Too big for the stack, and only ever touched by this task
+  static job_spec_t job;
+  // Runs can be asked for while the rest of the device is starting up
+  xEventGroupWaitBits(state_events(), STATE_READY_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+  while (true) {
+    xQueueReceive(JOBS, &job, portMAX_DELAY);
+    run_job(&job);
+    portENTER_CRITICAL(&LOCK);
+    PROGRESS.running = false;
+    portEXIT_CRITICAL(&LOCK);
+  }
+}
+
+void start_job_runner(void) {
+  JOBS = xQueueCreate(1, sizeof(job_spec_t));
+  xTaskCreate(job_loop, "PLATE_RUN", 4096, NULL, 3, NULL);
+}
+
+static bool valid_spec(const job_spec_t* spec) {
+  bool seen[JOB_MAX_WELLS] = { false };
+  if (spec->n_wells < 1 || spec->n_wells > JOB_MAX_WELLS || spec->repeats < 1 ||
+      spec->samples < 1 || spec->samples > MEASURE_MAX_SAMPLES ||
+      spec->calibrate > CALIB_REFERENCE ||
+      (spec->calibrate == CALIB_REFERENCE && !(spec->reference_od > 0))) {
+    return false;
+  }
+  for (int i = 0; i < spec->n_wells; i++) {
+    int well = spec->wells[i];
+    if (well < 0 || well >= JOB_MAX_WELLS || seen[well]) {
+      return false;
+    }
+    seen[well] = true;
+  }
+  return true;
+}
+
+esp_err_t job_start(const job_spec_t* spec) {
+  if (!valid_spec(spec)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  portENTER_CRITICAL(&LOCK);
+  bool busy = PROGRESS.running;
+  if (!busy) {
+    PROGRESS.running = true;
+    PROGRESS.cycle = 0;
+    PROGRESS.repeats = spec->repeats;
+    PROGRESS.done = 0;
+    PROGRESS.n_wells = spec->n_wells;
+  }
+  portEXIT_CRITICAL(&LOCK);
+  if (busy) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  STOP = false;
+  xQueueSend(JOBS, spec, portMAX_DELAY);
+  return ESP_OK;
+}
+
+void job_stop(void) {
+  if (job_running()) {
+    STOP = true;
+  }
+}
+
+bool job_running(void) {
+  return PROGRESS.running;
+}
+
+void job_get_progress(job_progress_t* progress) {
+  portENTER_CRITICAL(&LOCK);
+  *progress = PROGRESS;
+  portEXIT_CRITICAL(&LOCK);
+}
@@ -0,0 +1,68 @@
+#include "common.h"
+#include "sensors.h"
+#include "plate.h"
+#include "calib.h"
+
+#ifndef JOB_H
+#define JOB_H
+// Most wells one plate run can visit: the whole plate
+#define JOB_MAX_WELLS PLATE_WELLS
+
+// A plate run: read every well in turn, then do it all again until repeats
+// cycles are done. Cycles start interval_ms apart (or back to back, if one
+// takes longer than that). Raster runs read each row on the move in one sweep
+// (see scan.h) instead of stopping at every well. A calibration pass (see
+// calib.h) is a run whose measurements go towards the calibration, which is
+// saved if the run finishes, instead of into the result log.
+typedef struct job_spec {
+  int wells[JOB_MAX_WELLS];  // Row-major well numbers, 0 is A1
+  int n_wells;
+  int repeats;               // Cycles over the wells, at least 1
+  uint32_t interval_ms;      // From the start of one cycle to the next
+  uint32_t samples;          // Dark and lit samples per well measurement on
+                             // each channel, or dark samples per row if
+                             // raster scanning
+  bool raster;
+  calib_pass_t calibrate;
+  float reference_od;        // OD of every well, for a reference pass
+} job_spec_t;
+
+typedef enum job_event_kind {
+  JOB_STARTED,   // value is the number of wells
+  JOB_WELL,      // A well has been measured, once for each channel (see
+                 // m.channel): value is the mean lit reading, or -1 if the
+                 // measurement failed on every channel
+  JOB_CYCLE,     // A cycle over all the wells has finished
+  JOB_FINISHED,  // Every cycle is done
+  JOB_STOPPED    // Cancelled before finishing
+} job_event_kind_t;
+
+typedef struct job_event {
+  job_event_kind_t kind;
+  int cycle;     // Counting from 0
+  int well;      // -1 unless this is about a particular well
+  int value;
+  measurement_t m;  // The full measurement, for JOB_WELL
+} job_event_t;
+
+// Where a run is up to, for clients that join part way through
+typedef struct job_progress {
+  bool running;
+  int cycle;
+  int repeats;
+  int done;      // Wells read so far this cycle
+  int n_wells;
+} job_progress_t;
+
+// System initialisation:
+extern void start_job_runner(void);
+// Control, from any task. Starting fails with ESP_ERR_INVALID_STATE if a run
+// is already going and ESP_ERR_INVALID_ARG if the description is no good.
+extern esp_err_t job_start(const job_spec_t*);
+extern void job_stop(void);
+extern bool job_running(void);
+extern void job_get_progress(job_progress_t*);
+// Called for every job event, from the job task, so it must not block
+typedef void (*job_listener_t)(const job_event_t*);
+extern void set_job_listener(job_listener_t);
+#endif
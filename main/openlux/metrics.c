@@ -0,0 +1,217 @@
+#include "metrics.h"
+#include "common.h"
+#include "boot.h"
+#include "web.h"
+#include <esp_timer.h>
+#include <esp_system.h>
+#include <freertos/task.h>
+#include <stdarg.h>
+#include <string.h>
+
+// Bucket upper bounds in microseconds, roughly three to a decade. Anything
+// slower lands in the +Inf bucket.
+static const uint32_t BOUNDS_US[] = {
+  100, 300, 1000, 3000, 10000, 30000, 100000, 300000, 1000000, 3000000, 10000000
+};
+#define N_BOUNDS (sizeof(BOUNDS_US) / sizeof(BOUNDS_US[0]))
+// Tasks reported on, which is more than the firmware and ESP-IDF run
+#define MAX_TASKS 24
+
+typedef struct histogram {
+  const char* name;
+  const char* labels;    // Without braces, or NULL
+  const char* help;
+  uint32_t counts[N_BOUNDS + 1];   // Per bucket, not cumulative
+  uint32_t count;
+  uint64_t sum_us;
+} histogram_t;
+
+// Histograms with the same name must be next to each other, so that their
+// HELP and TYPE lines are only written once
+static histogram_t HISTOGRAMS[METRIC_COUNT] = {
+  [METRIC_MOVE] = { "openlux_move_seconds", NULL,
+                    "Time to make a move, including the settle at the end" },
+  [METRIC_MEASURE_PHASE] = { "openlux_measure_phase_seconds", NULL,
+                             "Time to take the samples for one phase of a measurement" },
+  [METRIC_SENSOR_BLOCK] = { "openlux_sensor_block_seconds", NULL,
+                            "Time to process one block of ADC samples" },
+  [METRIC_FLASH_READ] = { "openlux_flash_read_seconds", NULL,
+                          "Time to read a web file off flash" },
+  [METRIC_HTTP_STATUS] = { "openlux_http_handler_seconds", "handler=\"status\"",
+                           "Time to handle an HTTP request" },
+  [METRIC_HTTP_BATCH] = { "openlux_http_handler_seconds", "handler=\"batch\"", NULL },
+  [METRIC_HTTP_STATIC] = { "openlux_http_handler_seconds", "handler=\"static\"", NULL },
+};
+static uint32_t DROPPED_RESPONSES = 0;
+static portMUX_TYPE LOCK = portMUX_INITIALIZER_UNLOCKED;
+static const char* STATUS_NAMES[] = { "initialising", "ready", "homing", "moving", "reading" };
+
+void metric_observe(metric_t metric, int64_t us) {
+  histogram_t* h = &HISTOGRAMS[metric];
+  size_t b = 0;
+  while (b < N_BOUNDS && us > BOUNDS_US[b]) {
+    b++;
+  }
+  portENTER_CRITICAL(&LOCK);
+  h->counts[b]++;
+  h->count++;
+  h->sum_us += us;
+  portEXIT_CRITICAL(&LOCK);
+}
+
+void metric_since(metric_t metric, int64_t start_us) {
+  metric_observe(metric, esp_timer_get_time() - start_us);
+}
+
+void metric_dropped_response(void) {
+  portENTER_CRITICAL(&LOCK);
+  DROPPED_RESPONSES++;
+  portEXIT_CRITICAL(&LOCK);
+}
+
+// Lines are gathered into a buffer and sent a chunk at a time. Once the client
+// has gone, the rest is written to nowhere.
+typedef struct out {
+  httpd_req_t* req;
+  bool gone;
+  size_t len;
+  char buf[1024];
+} out_t;
+
+static void flush(out_t* out) {
+  out->gone = out->gone || !sent(out->req, httpd_resp_send_chunk(out->req, out->buf, out->len));
+  out->len = 0;
+}
+
+// Append to the buffer, sending it first if there isn't room
+static void emit(out_t* out, const char* fmt, ...) {
+  va_list args;
+  for (int tries = 0; tries < 2; tries++) {
+    size_t room = sizeof(out->buf) - out->len;
+    va_start(args, fmt);
+    int n = vsnprintf(out->buf + out->len, room, fmt, args);
+    va_end(args);
+    if (n >= 0 && (size_t) n < room) {
+      out->len += n;
+      return;
+    }
+    flush(out);
+  }
+}
+
+static void write_histograms(out_t* out) {
+  for (int m = 0; m < METRIC_COUNT; m++) {
+    histogram_t h;
+    portENTER_CRITICAL(&LOCK);
+    h = HISTOGRAMS[m];
+    portEXIT_CRITICAL(&LOCK);
+    // Labels for the buckets, which also have le, and for the totals
+    char labels[48];
+    char totals[48];
+    snprintf(labels, sizeof(labels), "%s%s", h.labels ? h.labels : "", h.labels ? "," : "");
+    totals[0] = '\0';
+    if (h.labels) {
+      snprintf(totals, sizeof(totals), "{%s}", h.labels);
+    }
+    if (!m || strcmp(h.name, HISTOGRAMS[m - 1].name)) {
+      emit(out, "# HELP %s %s\n# TYPE %s histogram\n", h.name, h.help, h.name);
+    }
+    uint32_t cumulative = 0;
+    for (size_t b = 0; b < N_BOUNDS; b++) {
+      cumulative += h.counts[b];
+      emit(out, "%s_bucket{%sle=\"%g\"} %u\n", h.name, labels, BOUNDS_US[b] / 1e6,
+           cumulative);
+    }
+    emit(out, "%s_bucket{%sle=\"+Inf\"} %u\n", h.name, labels, h.count);
+    emit(out, "%s_sum%s %.6f\n", h.name, totals, h.sum_us / 1e6);
+    emit(out, "%s_count%s %u\n", h.name, totals, h.count);
+  }
+}
+
+static void write_tasks(out_t* out) {
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+  // Handlers only ever run on the server task, so this can live off the stack
+  static TaskStatus_t tasks[MAX_TASKS];
+  uint32_t total;
+  UBaseType_t n = uxTaskGetSystemState(tasks, MAX_TASKS, &total);
+  emit(out, "# HELP openlux_task_stack_free_bytes Least stack a task has had free\n"
+            "# TYPE openlux_task_stack_free_bytes gauge\n");
+  for (UBaseType_t i = 0; i < n; i++) {
+    emit(out, "openlux_task_stack_free_bytes{task=\"%s\"} %u\n", tasks[i].pcTaskName,
+         (unsigned) tasks[i].usStackHighWaterMark);
+  }
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+  // The counters are 32 bit microseconds, so wrap about every 71 minutes,
+  // which Prometheus counts as a reset
+  emit(out, "# HELP openlux_task_cpu_seconds_total CPU time used by a task\n"
+            "# TYPE openlux_task_cpu_seconds_total counter\n");
+  for (UBaseType_t i = 0; i < n; i++) {
+    emit(out, "openlux_task_cpu_seconds_total{task=\"%s\"} %.6f\n", tasks[i].pcTaskName,
+         tasks[i].ulRunTimeCounter / 1e6);
+  }
+#endif
+#endif
+}
+
+// Serves everything in the Prometheus text exposition format
+esp_err_t metrics_get(httpd_req_t* req) {
+  static out_t out;
+  out.req = req;
+  out.gone = false;
+  out.len = 0;
+  httpd_resp_set_type(req, "text/plain; version=0.0.4");
+  write_histograms(&out);
+  write_tasks(&out);
+  emit(&out, "# HELP openlux_heap_free_bytes Free heap\n"
+             "# TYPE openlux_heap_free_bytes gauge\n"
+             "openlux_heap_free_bytes %u\n", esp_get_free_heap_size());
+  emit(&out, "# HELP openlux_heap_min_free_bytes Least free heap since boot\n"
+             "# TYPE openlux_heap_min_free_bytes gauge\n"
+             "openlux_heap_min_free_bytes %u\n", esp_get_minimum_free_heap_size());
+  emit(&out, "# HELP openlux_uptime_seconds Time since boot\n"
+             "# TYPE openlux_uptime_seconds gauge\n"
+             "openlux_uptime_seconds %.3f\n", esp_timer_get_time() / 1e6);
+  boot_span_t boot[BOOT_STAGE_COUNT];
+  get_boot_timeline(boot);
+  emit(&out, "# HELP openlux_boot_stage_start_seconds When a start up stage began\n"
+             "# TYPE openlux_boot_stage_start_seconds gauge\n");
+  for (int i = 0; i < BOOT_STAGE_COUNT; i++) {
+    if (boot[i].start_us || boot[i].end_us) {
+      emit(&out, "openlux_boot_stage_start_seconds{stage=\"%s\"} %.3f\n",
+           boot_stage_name(i), boot[i].start_us / 1e6);
+    }
+  }
+  emit(&out, "# HELP openlux_boot_stage_end_seconds When a start up stage was done\n"
+             "# TYPE openlux_boot_stage_end_seconds gauge\n");
+  for (int i = 0; i < BOOT_STAGE_COUNT; i++) {
+    if (boot[i].end_us) {
+      emit(&out, "openlux_boot_stage_end_seconds{stage=\"%s\"} %.3f\n",
+           boot_stage_name(i), boot[i].end_us / 1e6);
+    }
+  }
+  status_stats_t stats;
+  get_status_stats(&stats);
+  emit(&out, "# HELP openlux_status Current device status\n"
+             "# TYPE openlux_status gauge\n");
+  for (int i = 0; i <= READING; i++) {
+    emit(&out, "openlux_status{status=\"%s\"} %d\n", STATUS_NAMES[i], get_status() == i);
+  }
+  emit(&out, "# HELP openlux_status_entered_total Times each status was entered\n"
+             "# TYPE openlux_status_entered_total counter\n");
+  for (int i = 0; i <= READING; i++) {
+    emit(&out, "openlux_status_entered_total{status=\"%s\"} %u\n", STATUS_NAMES[i],
+         stats.entered[i]);
+  }
+  emit(&out, "# HELP openlux_status_refused_total Illegal status transitions refused\n"
+             "# TYPE openlux_status_refused_total counter\n"
+             "openlux_status_refused_total %u\n", stats.refused);
+  emit(&out, "# HELP openlux_http_dropped_responses_total Responses cut short by the client "
+             "going away\n"
+             "# TYPE openlux_http_dropped_responses_total counter\n"
+             "openlux_http_dropped_responses_total %u\n", DROPPED_RESPONSES);
+  flush(&out);
+  if (out.gone || !sent(req, httpd_resp_send_chunk(req, "", 0))) {
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
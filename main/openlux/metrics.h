@@ -0,0 +1,27 @@
+#include <stdint.h>
+#include <esp_http_server.h>
+
+#ifndef METRICS_H
+#define METRICS_H
+// Latency histograms for the hot paths, kept in static memory and served with
+// task and heap statistics as Prometheus text on /metrics
+typedef enum metric {
+  METRIC_MOVE,           // drive_motors, start to coils released
+  METRIC_MEASURE_PHASE,  // One dark or lit phase of a measurement
+  METRIC_SENSOR_BLOCK,   // Processing one block of samples in poll_avg
+  METRIC_FLASH_READ,     // Reading a web file off SPIFFS
+  METRIC_HTTP_STATUS,    // Handlers, from request to response sent
+  METRIC_HTTP_BATCH,
+  METRIC_HTTP_STATIC,
+  METRIC_COUNT
+} metric_t;
+
+// Record how long something took, from any task
+extern void metric_observe(metric_t, int64_t);
+// Record the time since a start taken with esp_timer_get_time()
+extern void metric_since(metric_t, int64_t);
+// Count a response cut short by the client going away
+extern void metric_dropped_response(void);
+// URI handler for /metrics:
+extern esp_err_t metrics_get(httpd_req_t*);
+#endif
@@ -0,0 +1,145 @@
+#include "motion.h"
+#include <stdlib.h>
+#include <math.h>
+
+// Coil currently energised on each axis (row, column). Moves carry on from
+// here, so the first step of a move is always one phase from the last one.
+static int PHASE[2] = { 0, 0 };
+
+void plan_move(move_plan_t* plan, int r_steps, int c_steps,
+               const motion_profile_t* prof) {
+  plan->r_steps = abs(r_steps);
+  plan->c_steps = abs(c_steps);
+  plan->r_dir = (r_steps < 0) ? -1 : 1;
+  plan->c_dir = (c_steps < 0) ? -1 : 1;
+  plan->steps = (plan->r_steps > plan->c_steps) ? plan->r_steps : plan->c_steps;
+  plan->done = 0;
+  plan->err = 0;
+  float v0 = prof->start_rate;
+  float vmax = (prof->max_rate > prof->start_rate) ? prof->max_rate : prof->start_rate;
+  plan->v0_sq = v0 * v0;
+  plan->v_max = vmax;
+  plan->two_a = 2.0f * prof->accel;
+  plan->settle_us = (uint32_t) (1e6f / v0);
+  plan->held = 0x00;
+  plan->tail = 0;
+  plan->time_us = 0;
+  plan->ticks = 0;
+}
+
+// Speed for a tick: ramp up from the start, cruise, and ramp down so that the
+// last tick is back at the start speed. Short moves give a triangle.
+static float tick_rate(const move_plan_t* plan, int tick) {
+  int from_end = plan->steps - 1 - tick;
+  int nearest = (tick < from_end) ? tick : from_end;
+  float v = sqrtf(plan->v0_sq + plan->two_a * nearest);
+  return (v < plan->v_max) ? v : plan->v_max;
+}
+
+// Produce the next shift register byte of a move and how long to wait before
+// latching it. Returns false once the move is finished.
+bool plan_next(move_plan_t* plan, uint8_t* byte, uint32_t* wait_us) {
+  if (plan->done >= plan->steps) {
+    return false;
+  }
+  bool r_major = plan->r_steps >= plan->c_steps;
+  int minor = r_major ? plan->c_steps : plan->r_steps;
+  bool r_step = r_major;
+  bool c_step = !r_major;
+  plan->err += minor;
+  if (2 * plan->err >= plan->steps) {
+    plan->err -= plan->steps;
+    r_step = true;
+    c_step = true;
+  }
+  if (r_step) {
+    PHASE[0] = (PHASE[0] + plan->r_dir) & 3;
+  }
+  if (c_step) {
+    PHASE[1] = (PHASE[1] + plan->c_dir) & 3;
+  }
+  // Low nibble drives the row motors, high nibble the column motors. An axis
+  // that isn't part of this move is left unpowered.
+  *byte = (plan->r_steps ? 1 << PHASE[0] : 0) |
+          (plan->c_steps ? 1 << (PHASE[1] + 4) : 0);
+  *wait_us = (uint32_t) (1e6f / tick_rate(plan, plan->done));
+  plan->done++;
+  return true;
+}
+
+// Hold a byte for the given time. Time is kept exactly and only rounded to
+// stream ticks here, so rounding errors never build up over a move.
+static void emit(move_plan_t* plan, step_run_t* run, uint8_t byte, uint32_t us) {
+  plan->time_us += us;
+  int64_t tick = (plan->time_us + HAL_STEP_TICK_US / 2) / HAL_STEP_TICK_US;
+  if (tick <= plan->ticks) {
+    tick = plan->ticks + 1;
+  }
+  run->byte = byte;
+  run->ticks = (uint32_t) (tick - plan->ticks);
+  plan->ticks = tick;
+}
+
+// Fill a buffer with up to max runs of the move for the step stream. Each
+// byte is held until the next one is due; the last is held for one start
+// speed period so the rotor settles on it, then the coils are released.
+// Returns 0 once the whole move has been produced.
+size_t plan_runs(move_plan_t* plan, step_run_t* runs, size_t max) {
+  size_t n = 0;
+  uint8_t byte;
+  uint32_t wait_us;
+  while (n < max && plan->steps && plan->tail < 2) {
+    if (plan_next(plan, &byte, &wait_us)) {
+      // The first byte goes out as soon as the stream starts
+      if (plan->done > 1) {
+        emit(plan, &runs[n++], plan->held, wait_us);
+      }
+      plan->held = byte;
+    } else if (plan->tail == 0) {
+      emit(plan, &runs[n++], plan->held, plan->settle_us);
+      plan->tail = 1;
+    } else {
+      emit(plan, &runs[n++], 0x00, HAL_STEP_TICK_US);
+      plan->tail = 2;
+    }
+  }
+  return n;
+}
+
+// Step k of a move latches 1/rate(k) after step k-1, the first at the start.
+// Uses the plan's tick and time counters, so the plan can't also be stepped.
+int plan_steps_by(move_plan_t* plan, int64_t elapsed_us) {
+  while (plan->done < plan->steps) {
+    int64_t next = 0;
+    if (plan->done) {
+      next = plan->time_us + (uint32_t) (1e6f / tick_rate(plan, plan->done));
+    }
+    if (next > elapsed_us) {
+      break;
+    }
+    plan->time_us = next;
+    plan->done++;
+  }
+  return plan->done;
+}
+
+// Steps it takes to ramp from the start speed up to cruising
+int plan_ramp_steps(const motion_profile_t* prof) {
+  if (prof->max_rate <= prof->start_rate || !prof->accel) {
+    return 0;
+  }
+  float v0 = prof->start_rate;
+  float v = prof->max_rate;
+  return (int) ceilf((v * v - v0 * v0) / (2.0f * prof->accel));
+}
+
+// How long a move will take, without stepping anything
+int64_t plan_duration_us(int r_steps, int c_steps, const motion_profile_t* prof) {
+  move_plan_t plan;
+  plan_move(&plan, r_steps, c_steps, prof);
+  int64_t total = 0;
+  for (int tick = 0; tick < plan.steps; tick++) {
+    total += (int64_t) (1e6f / tick_rate(&plan, tick));
+  }
+  return total;
+}
@@ -0,0 +1,44 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "hal.h"
+
+#ifndef MOTION_H
+#define MOTION_H
+// Speeds are in steps per second and acceleration in steps per second squared
+typedef struct motion_profile {
+  uint32_t start_rate;   // Speed the motors can start and stop at without ramping
+  uint32_t max_rate;     // Cruise speed
+  uint32_t accel;        // Ramp between the two
+} motion_profile_t;
+
+// A move of both axes at once. The axis with further to go (the major axis)
+// steps every tick and the other is interleaved Bresenham-style, so a
+// diagonal takes as long as its longer side rather than the sum of both.
+typedef struct move_plan {
+  int steps;             // Major axis steps, i.e. ticks in the move
+  int done;              // Ticks generated so far
+  int r_steps;           // Absolute row and column steps
+  int c_steps;
+  int r_dir;             // +1 or -1
+  int c_dir;
+  int err;               // Bresenham error term for the minor axis
+  float v0_sq;           // Start speed squared
+  float v_max;
+  float two_a;           // Twice the acceleration
+  // Step stream output
+  uint32_t settle_us;    // How long the last step is held before letting go
+  uint8_t held;          // Byte latched by the previous step
+  int tail;              // Runs emitted after the last step: settle, release
+  int64_t time_us;       // Exact time of the next latch from the move start
+  int64_t ticks;         // Stream ticks emitted so far
+} move_plan_t;
+
+extern void plan_move(move_plan_t*, int, int, const motion_profile_t*);
+extern bool plan_next(move_plan_t*, uint8_t*, uint32_t*);
+extern size_t plan_runs(move_plan_t*, step_run_t*, size_t);
+extern int64_t plan_duration_us(int, int, const motion_profile_t*);
+// Replaying a move's timing without stepping: steps latched so far, given
+// how long since the move started. Times must not go backwards.
+extern int plan_steps_by(move_plan_t*, int64_t);
+extern int plan_ramp_steps(const motion_profile_t*);
+#endif
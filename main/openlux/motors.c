@@ -1,99 +1,390 @@
 #include "motors.h"
+#include "hal.h"
+#include "metrics.h"
+#include "trace.h"
+#include <esp_timer.h>
+#include <freertos/queue.h>
+#include <stdlib.h>
+#include <string.h>
 
-static const gpio_num_t DATA = GPIO_NUM_18;
-static const gpio_num_t CLK = GPIO_NUM_21;
-static const gpio_num_t LATCH = GPIO_NUM_19;
+// Homing runs into the end stops, so it never leaves the safe start speed
+static const motion_profile_t HOMING_PROFILE = {
+  .start_rate = CONFIG_OPENLUX_START_STEP_RATE,
+  .max_rate = CONFIG_OPENLUX_START_STEP_RATE,
+  .accel = 0
+};
+// Well to well moves ramp up to full speed
+static const motion_profile_t MOVE_PROFILE = {
+  .start_rate = CONFIG_OPENLUX_START_STEP_RATE,
+  .max_rate = CONFIG_OPENLUX_MAX_STEP_RATE,
+  .accel = CONFIG_OPENLUX_STEP_ACCEL
+};
+// Raster scans sweep at one steady speed, ramping only in the run-up
+static const motion_profile_t SCAN_PROFILE = {
+  .start_rate = CONFIG_OPENLUX_START_STEP_RATE,
+  .max_rate = CONFIG_OPENLUX_SCAN_STEP_RATE,
+  .accel = CONFIG_OPENLUX_STEP_ACCEL
+};
+// Runs planned ahead of the step stream at a time
+#define STEP_BATCH 64
+// Full travel of each axis, far enough to reach the end stops from anywhere
+static const int R_TRAVEL = 4000;
+static const int C_TRAVEL = 6250;
+// Fast homing stops this far short of where the end stop may be, and then
+// seeks it slowly
+static const int SEEK_MARGIN = 100;
+// How long the carriage must have been still before it is recorded at rest.
+// Long enough that a plate run doesn't write between every pair of wells.
+static const int PARK_IDLE_MS = 5000;
 
-static const int STEP_PERIOD = 3;
-static const int WELL_SPACING = 464;
-static const int R_OFFSET = 252;
-static const int C_OFFSET = 232;
+// Moves waiting for the motor task
+#define MOVE_QUEUE_LEN 8
 
-static int R_TAR = 0;
-static int C_TAR = 0;
+typedef enum move_kind {
+  MOVE_TO,
+  MOVE_SWEEP,            // As MOVE_TO, at raster scan speed
+  MOVE_HOME
+} move_kind_t;
+
+typedef struct move_cmd {
+  move_kind_t kind;
+  int r_tar;             // Steps from A1
+  int c_tar;
+  TaskHandle_t notify;   // Given a notification once the move is done
+} move_cmd_t;
+
+static QueueHandle_t MOVES = NULL;
+// Where the carriage is, in steps from A1. Only the motor task writes these.
 static int R_POS = 0;
 static int C_POS = 0;
+// Well the carriage is parked over, or -1 while moving or between wells
+static volatile int CURRENT_WELL = -1;
+// The latest move, overwritten as each one starts, and its id for checking
+// whether it has changed without copying it
+static QueueHandle_t LATEST_MOVE = NULL;
+static volatile uint32_t LATEST_ID = 0;
+static bool HOMING_NOW = false;
+// Every well centre in steps from A1, row-major, worked out once at start up
+static int16_t WELL_POS[PLATE_WELLS][2];
+
+// Where the carriage was left, kept in settings so that a restart needn't
+// home. Positions are steps from the end stops, so they don't depend on the
+// plate format. A clean record was written with the carriage at rest at
+// r_pos, c_pos; otherwise it may be anywhere in the envelope, which is
+// enough to home quickly. Records are only written when the envelope grows
+// and once the carriage comes to rest, to spare the flash.
+#define PARK_VERSION 1
+typedef struct park_record {
+  uint8_t version;       // 0 when nothing is known
+  uint8_t clean;
+  int16_t r_pos;
+  int16_t c_pos;
+  int16_t r_min;
+  int16_t r_max;
+  int16_t c_min;
+  int16_t c_max;
+} park_record_t;
+
+static const char PARK_KEY[] = "park";
+static park_record_t PARK;
+// Whether R_POS and C_POS are where the carriage really is
+static bool HOMED = false;
+
+static void park_save(void) {
+  esp_err_t err = hal_settings_save(PARK_KEY, &PARK, sizeof(PARK));
+  if (err) {
+    ESP_LOGW(TAG, "Can't save the carriage position (%s)", esp_err_to_name(err));
+  }
+}
+
+static bool widen(int16_t* min, int16_t* max, int pos) {
+  if (pos < *min) {
+    *min = pos;
+    return true;
+  }
+  if (pos > *max) {
+    *max = pos;
+    return true;
+  }
+  return false;
+}
+
+// Before a move to a target in steps from A1. Moves made before homing leave
+// the carriage who knows where, so they forget it.
+static void park_moving(int r_tar, int c_tar) {
+  if (!HOMED) {
+    if (PARK.version) {
+      PARK.version = 0;
+      park_save();
+    }
+    return;
+  }
+  bool grew = widen(&PARK.r_min, &PARK.r_max, r_tar + PLATE_R_OFFSET);
+  grew |= widen(&PARK.c_min, &PARK.c_max, c_tar + PLATE_C_OFFSET);
+  if (PARK.clean || grew) {
+    PARK.clean = false;
+    park_save();
+  }
+}
+
+// Once the carriage has been still for a while
+static void park_rest(void) {
+  PARK.version = PARK_VERSION;
+  PARK.clean = true;
+  PARK.r_pos = PARK.r_min = PARK.r_max = R_POS + PLATE_R_OFFSET;
+  PARK.c_pos = PARK.c_min = PARK.c_max = C_POS + PLATE_C_OFFSET;
+  park_save();
+}
 
+bool park_position(int* r_pos, int* c_pos) {
+  if (!HOMED || in_status(HOMING) || in_status(MOVING)) {
+    return false;
+  }
+  *r_pos = R_POS + PLATE_R_OFFSET;
+  *c_pos = C_POS + PLATE_C_OFFSET;
+  return true;
+}
+
+esp_err_t park_preset(int r_pos, int c_pos) {
+  park_record_t rec = { PARK_VERSION, true, r_pos, c_pos, r_pos, r_pos, c_pos, c_pos };
+  return hal_settings_save(PARK_KEY, &rec, sizeof(rec));
+}
+
+
+// Both axes run into their end stops together, at the start speed that is
+// safe to stall at. When the carriage is known to be within an envelope it
+// first moves at full speed to just short of where the stops could be.
 void home_motors() {
-  set_status(HOMING);
-  ESP_LOGI(TAG, "Device is homing...");
-  ESP_LOGI(TAG, "Row");
-  drive_motors(LOWER_MOTORS, -4000, 3);
-  ESP_LOGI(TAG, "Column");
-  drive_motors(UPPER_MOTORS, -6250, 3);
-  drive_motors(LOWER_MOTORS, R_OFFSET, STEP_PERIOD);
-  drive_motors(UPPER_MOTORS, C_OFFSET, STEP_PERIOD);
-  shift_byte(0x00);
-  ESP_LOGI(TAG, "Homed!");
-  revert_status();
-  R_TAR = 0;
-  C_TAR = 0;
+  begin_status(HOMING);
+  HOMING_NOW = true;
+  int r_seek = R_TRAVEL;
+  int c_seek = C_TRAVEL;
+  if (PARK.version) {
+    ESP_LOGI(TAG, "Device is homing (fast)...");
+    int r_fast = (PARK.r_min > SEEK_MARGIN) ? PARK.r_min - SEEK_MARGIN : 0;
+    int c_fast = (PARK.c_min > SEEK_MARGIN) ? PARK.c_min - SEEK_MARGIN : 0;
+    if (PARK.r_max + SEEK_MARGIN - r_fast < r_seek) {
+      r_seek = PARK.r_max + SEEK_MARGIN - r_fast;
+    }
+    if (PARK.c_max + SEEK_MARGIN - c_fast < c_seek) {
+      c_seek = PARK.c_max + SEEK_MARGIN - c_fast;
+    }
+    // The stops are in the envelope from here on, and so is where homing
+    // leaves the carriage
+    PARK.r_min = PARK.c_min = 0;
+    if (PARK.r_max < PLATE_R_OFFSET) {
+      PARK.r_max = PLATE_R_OFFSET;
+    }
+    if (PARK.c_max < PLATE_C_OFFSET) {
+      PARK.c_max = PLATE_C_OFFSET;
+    }
+    PARK.clean = false;
+    park_save();
+    drive_motors(-r_fast, -c_fast, &MOVE_PROFILE);
+  } else {
+    ESP_LOGI(TAG, "Device is homing...");
+  }
+  drive_motors(-r_seek, -c_seek, &HOMING_PROFILE);
+  drive_motors(PLATE_R_OFFSET, PLATE_C_OFFSET, &MOVE_PROFILE);
   R_POS = 0;
   C_POS = 0;
+  HOMED = true;
+  if (!PARK.version) {
+    PARK.version = PARK_VERSION;
+    PARK.r_min = PARK.c_min = 0;
+    PARK.r_max = PLATE_R_OFFSET;
+    PARK.c_max = PLATE_C_OFFSET;
+  }
+  HOMING_NOW = false;
+  ESP_LOGI(TAG, "Homed!");
+  end_status(HOMING);
 }
 
-// Make these args meaningful and kill the global vars
-void goto_loop(void* args) {
+static int well_at(int r_pos, int c_pos) {
+  if (r_pos < 0 || c_pos < 0 || r_pos % WELL_SPACING || c_pos % WELL_SPACING) {
+    return -1;
+  }
+  return (r_pos / WELL_SPACING) * PLATE_COLS + c_pos / WELL_SPACING;
+}
+
+// The motor task sleeps on the queue until there is a move to make, then
+// carries moves out one at a time in the order they were asked for
+static void goto_loop(void* args) {
+  move_cmd_t cmd;
   while (true) {
-    int r_err = R_TAR - R_POS;
-    int c_err = C_TAR - C_POS;
-    if (R_TAR < 0 || C_TAR < 0) {
+    // Until the carriage is recorded at rest, wake up to do so once idle
+    bool resting = !HOMED || (PARK.version && PARK.clean);
+    if (!xQueueReceive(MOVES, &cmd, resting ? portMAX_DELAY : pdMS_TO_TICKS(PARK_IDLE_MS))) {
+      park_rest();
+      continue;
+    }
+    CURRENT_WELL = -1;
+    if (cmd.kind == MOVE_HOME) {
       home_motors();
-    } else if (r_err || c_err) {
-      set_status(MOVING);
-      drive_motors(LOWER_MOTORS, r_err, STEP_PERIOD);
-      drive_motors(UPPER_MOTORS, c_err, STEP_PERIOD);
-      R_POS += r_err;
-      C_POS += c_err;
-    } else if (get_status() == MOVING) {
+    } else if (cmd.r_tar != R_POS || cmd.c_tar != C_POS) {
+      begin_status(MOVING);
+      park_moving(cmd.r_tar, cmd.c_tar);
+      drive_motors(cmd.r_tar - R_POS, cmd.c_tar - C_POS,
+                   (cmd.kind == MOVE_SWEEP) ? &SCAN_PROFILE : &MOVE_PROFILE);
+      R_POS = cmd.r_tar;
+      C_POS = cmd.c_tar;
       ESP_LOGI(TAG, "Done moving!");
-      revert_status();
-      shift_byte(0x00);
+      end_status(MOVING);
+    }
+    CURRENT_WELL = well_at(R_POS, C_POS);
+    if (cmd.notify) {
+      xTaskNotifyGive(cmd.notify);
     }
-    vTaskDelay(1); // Find a meaningful number to put here
   }
 }
 
-void goto_coord(int row, int col) {
+static esp_err_t queue_move(move_kind_t kind, int r_tar, int c_tar, TaskHandle_t notify) {
+  move_cmd_t cmd = { kind, r_tar, c_tar, notify };
+  if (!MOVES || xQueueSend(MOVES, &cmd, 0) != pdTRUE) {
+    ESP_LOGW(TAG, "Motor queue full, move dropped");
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+// Row or column 0 means home first. The motor task notifies the notify task
+// (if not NULL) once the carriage gets there; wait with ulTaskNotifyTake.
+esp_err_t goto_coord(int row, int col, TaskHandle_t notify) {
+  if (row < 1 || col < 1) {
+    ESP_LOGI(TAG, "Homing...");
+    return queue_move(MOVE_HOME, 0, 0, notify);
+  }
+  if (row > PLATE_ROWS || col > PLATE_COLS) {
+    return ESP_ERR_INVALID_ARG;
+  }
   ESP_LOGI(TAG, "Moving to row %d and column %d...", row, col);
-  R_TAR = (row - 1) * WELL_SPACING;
-  C_TAR = (col - 1) * WELL_SPACING;
+  return goto_well((row - 1) * PLATE_COLS + col - 1, notify);
 }
 
-void setup_motor_driver() {
-  // Error handle me...
-  gpio_pad_select_gpio(DATA);
-  gpio_pad_select_gpio(CLK);
-  gpio_pad_select_gpio(LATCH);
-  gpio_set_direction(DATA, GPIO_MODE_OUTPUT);
-  gpio_set_direction(CLK, GPIO_MODE_OUTPUT);
-  gpio_set_direction(LATCH, GPIO_MODE_OUTPUT);
+// Move to a well by its row-major index (0 is A1)
+esp_err_t goto_well(int well, TaskHandle_t notify) {
+  if (well < 0 || well >= PLATE_WELLS) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  return queue_move(MOVE_TO, WELL_POS[well][0], WELL_POS[well][1], notify);
+}
+
+// Move to a position in steps from A1, which needn't be over a well
+esp_err_t goto_pos(int r_pos, int c_pos, TaskHandle_t notify) {
+  return queue_move(MOVE_TO, r_pos, c_pos, notify);
+}
+
+// The same at raster scan speed. Once the carriage is sweep_runup() steps
+// into the sweep it holds that speed until as far from the end.
+esp_err_t sweep_to(int r_pos, int c_pos, TaskHandle_t notify) {
+  return queue_move(MOVE_SWEEP, r_pos, c_pos, notify);
 }
 
-// This should be combined with another function...
-void start_goto_loop() {
-  TaskHandle_t goto_handle = NULL;
-  xTaskCreate(goto_loop, "MOTOR_MOVEMENT", 4096, NULL, 3, &goto_handle);
+int sweep_runup(void) {
+  return plan_ramp_steps(&SCAN_PROFILE);
 }
 
-void shift_byte(char byte) {
-  gpio_set_level(LATCH, 0);
-  for (int n = 0; n < 8; n++) {
-    // Get the nth bit
-    uint32_t bit = ((byte & (1 << n)) == 0) ? 0 : 1;
-    gpio_set_level(DATA, bit);
-    gpio_set_level(CLK, 1);
-    gpio_set_level(CLK, 0);
+// Replays moves as they happen. Steps are counted along the move's own plan
+// from the time its first step was latched, which is exact as far as the
+// step stream keeps time; on the ESP32 that is to within one DMA buffer.
+bool carriage_at(move_track_t* track, int64_t when, int* r_pos, int* c_pos) {
+  if (LATEST_ID != track->id) {
+    move_track_t latest;
+    if (xQueuePeek(LATEST_MOVE, &latest, 0) && latest.start_us <= when) {
+      *track = latest;
+    }
+  }
+  if (!track->id || track->homing) {
+    return false;
+  }
+  int r = track->r_from;
+  int c = track->c_from;
+  if (when >= track->start_us) {
+    const move_plan_t* plan = &track->clock;
+    int n = plan_steps_by(&track->clock, when - track->start_us);
+    bool r_major = plan->r_steps >= plan->c_steps;
+    int minor = r_major ? plan->c_steps : plan->r_steps;
+    // Where the Bresenham interleave has got the minor axis to
+    int m = plan->steps ? (int) ((2LL * n * minor + plan->steps) / (2LL * plan->steps)) : 0;
+    r += plan->r_dir * (r_major ? n : m);
+    c += plan->c_dir * (r_major ? m : n);
   }
-  gpio_set_level(LATCH, 1);
+  *r_pos = r;
+  *c_pos = c;
+  return true;
 }
 
-void drive_motors(motor_set_t ms, int stp, int per) {
-  char mask = (ms == LOWER_MOTORS) ? 0x0F : 0xF0;
-  for (int n = 0; n < abs(stp); n++) {
-    int sh = (stp > 0) ? n % 4 : 3 - n % 4;
-    char byte = ((1 << (sh + 4)) + (1 << sh)) & mask;
-    vTaskDelay(per / portTICK_PERIOD_MS);
-    shift_byte(byte);
+// Row-major index of the well the carriage is parked over (0 is A1), or -1
+// while moving or between wells
+int get_current_well(void) {
+  return CURRENT_WELL;
+}
+
+// Put a set of wells (row-major, 0 is A1) into the quickest order to visit
+// them from wherever the carriage is now. Returns the predicted travel time
+// in microseconds.
+int64_t order_wells(int* wells, int n) {
+  const plate_grid_t plate = { PLATE_ROWS, PLATE_COLS, WELL_SPACING };
+  return route_wells(wells, n, get_current_well(), &plate, &MOVE_PROFILE);
+}
+
+void setup_motor_driver() {
+  for (int well = 0; well < PLATE_WELLS; well++) {
+    WELL_POS[well][0] = (well / PLATE_COLS) * WELL_SPACING;
+    WELL_POS[well][1] = (well % PLATE_COLS) * WELL_SPACING;
+  }
+  hal_setup_shift_register();
+}
+
+// Take up where the last run left off: trust a clean record, or home
+static void park_restore(TaskHandle_t notify) {
+  if (hal_settings_load(PARK_KEY, &PARK, sizeof(PARK)) != ESP_OK ||
+      PARK.version != PARK_VERSION) {
+    memset(&PARK, 0, sizeof(PARK));
+  }
+  if (PARK.version && PARK.clean) {
+    R_POS = PARK.r_pos - PLATE_R_OFFSET;
+    C_POS = PARK.c_pos - PLATE_C_OFFSET;
+    HOMED = true;
+    CURRENT_WELL = well_at(R_POS, C_POS);
+    ESP_LOGI(TAG, "Carriage was left at %d, %d", R_POS, C_POS);
+    if (notify) {
+      xTaskNotifyGive(notify);
+    }
+  } else {
+    queue_move(MOVE_HOME, 0, 0, notify);
+  }
+}
+
+// The task passed in (or NULL) is notified once the carriage position is
+// known, which may mean homing first
+void start_goto_loop(TaskHandle_t notify) {
+  MOVES = xQueueCreate(MOVE_QUEUE_LEN, sizeof(move_cmd_t));
+  LATEST_MOVE = xQueueCreate(1, sizeof(move_track_t));
+  park_restore(notify);
+  xTaskCreate(goto_loop, "MOTOR_MOVEMENT", 4096, NULL, 3, NULL);
+}
+
+// Step the row and column motors together along the given profile. The move
+// is planned a batch at a time and handed to the step stream, which clocks it
+// out in hardware; this task only wakes to refill it. The move is published
+// for carriage_at before any of it is written.
+void drive_motors(int r_steps, int c_steps, const motion_profile_t* prof) {
+  static uint32_t moves = 0;
+  move_plan_t plan;
+  step_run_t runs[STEP_BATCH];
+  size_t n;
+  int64_t start = esp_timer_get_time();
+  trace_move(r_steps, c_steps);
+  plan_move(&plan, r_steps, c_steps, prof);
+  if (LATEST_MOVE) {
+    move_track_t track = { ++moves, hal_step_stream_next_us(), R_POS, C_POS, HOMING_NOW, plan };
+    xQueueOverwrite(LATEST_MOVE, &track);
+    LATEST_ID = track.id;
+  }
+  while ((n = plan_runs(&plan, runs, STEP_BATCH)) > 0) {
+    hal_step_stream_write(runs, n);
   }
+  hal_step_stream_flush();
+  metric_since(METRIC_MOVE, start);
 }
@@ -1,16 +1,43 @@
-#include <driver/gpio.h>
 #include "common.h"
+#include "motion.h"
+#include "route.h"
+#include "plate.h"
+#include <freertos/task.h>
 
 #ifndef MOTORS_H
 #define MOTORS_H
+// One move as it plays out, for working out where the carriage was at any
+// moment. Positions are in steps from A1.
+typedef struct move_track {
+  uint32_t id;           // Counts moves from 1; 0 before there are any
+  int64_t start_us;      // When the first step latched, on the hal_time_us clock
+  int r_from;            // Where the move started
+  int c_from;
+  bool homing;           // Positions mean nothing until homing is done
+  move_plan_t clock;     // The move's plan, replayed for its timing
+} move_track_t;
+
 // System initialisation
 extern void setup_motor_driver();
-// Hide this
-extern void shift_byte(char);
-typedef enum motor_set { LOWER_MOTORS, UPPER_MOTORS } motor_set_t;
-extern void drive_motors(motor_set_t, int, int);
-extern void shift_byte(char);
-extern void goto_coord(int,int);
+extern void drive_motors(int, int, const motion_profile_t*);
+// Moves are queued for the motor task and made in order. The task passed in
+// (or NULL) gets a notification once the carriage arrives.
+extern esp_err_t goto_coord(int, int, TaskHandle_t);
+extern esp_err_t goto_well(int, TaskHandle_t);
+extern esp_err_t goto_pos(int, int, TaskHandle_t);
+extern esp_err_t sweep_to(int, int, TaskHandle_t);
+extern int sweep_runup(void);
+// Where the carriage was at a time, from the latest move started by then.
+// Start from a zeroed track and keep passing it in, asking about times in
+// order. False if unknown (before any move, or while homing).
+extern bool carriage_at(move_track_t*, int64_t, int*, int*);
+extern int get_current_well(void);
+extern int64_t order_wells(int*, int);
 extern void home_motors();
-extern void start_goto_loop();
+// Where the carriage is at rest, in steps from the end stops, for a trace to
+// start from. False while it moves or before homing.
+extern bool park_position(int*, int*);
+// Keep the carriage as at rest there for the next start up, as a replay does
+extern esp_err_t park_preset(int, int);
+extern void start_goto_loop(TaskHandle_t);
 #endif
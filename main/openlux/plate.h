@@ -0,0 +1,31 @@
+#include "sdkconfig.h"
+
+#ifndef PLATE_H
+#define PLATE_H
+// Plate geometry for the format chosen in menuconfig. Pitch and offsets are in
+// motor steps (464 to 9 mm). The offsets are how far A1's centre is from the
+// end stops, which is where homing leaves the carriage.
+#if defined(CONFIG_OPENLUX_PLATE_384)
+#define PLATE_NAME "384"
+#define PLATE_ROWS 16
+#define PLATE_COLS 24
+#define WELL_SPACING 232
+#define PLATE_R_OFFSET 136
+#define PLATE_C_OFFSET 116
+#elif defined(CONFIG_OPENLUX_PLATE_24)
+#define PLATE_NAME "24"
+#define PLATE_ROWS 4
+#define PLATE_COLS 6
+#define WELL_SPACING 995
+#define PLATE_R_OFFSET 377
+#define PLATE_C_OFFSET 394
+#else
+#define PLATE_NAME "96"
+#define PLATE_ROWS 8
+#define PLATE_COLS 12
+#define WELL_SPACING 464
+#define PLATE_R_OFFSET 252
+#define PLATE_C_OFFSET 232
+#endif
+#define PLATE_WELLS (PLATE_ROWS * PLATE_COLS)
+#endif
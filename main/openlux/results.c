@@ -0,0 +1,236 @@
+#include "results.h"
+#include "common.h"
+#include "hal.h"
+#include <freertos/semphr.h>
+#include <string.h>
+
+#define RECORD_SIZE sizeof(result_record_t)
+#define SLOTS (HAL_STORE_SECTOR / RECORD_SIZE)
+_Static_assert(HAL_STORE_SECTOR % sizeof(result_record_t) == 0,
+               "Records must not straddle erase sectors");
+
+// Partition size in bytes and sectors
+static size_t SIZE = 0;
+static size_t SECTORS = 0;
+// Where the next record goes, and its sequence number
+static size_t HEAD = 0;
+static uint32_t NEXT_SEQ = 0;
+// Sequence number of the oldest record still in the log
+static uint32_t FIRST_SEQ = 0;
+static uint32_t LAST_RUN = 0;
+// Serialises flash access between the writer and readers
+static SemaphoreHandle_t LOCK = NULL;
+// Set once open_results has found where the log left off. The web server may
+// be up before then, and finds the log empty until it is.
+static volatile bool OPEN = false;
+
+// Plain bitwise CRC-32 (IEEE), plenty fast for one small record at a time
+static uint32_t crc32(const void* data, size_t len) {
+  const uint8_t* p = data;
+  uint32_t crc = 0xFFFFFFFF;
+  while (len--) {
+    crc ^= *p++;
+    for (int k = 0; k < 8; k++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static uint32_t record_crc(const result_record_t* rec) {
+  return crc32(rec, offsetof(result_record_t, crc));
+}
+
+typedef enum slot {
+  SLOT_EMPTY,    // Erased, never written
+  SLOT_VALID,
+  SLOT_TORN      // Written, but not completely
+} slot_t;
+
+static slot_t read_slot(size_t off, result_record_t* rec) {
+  if (hal_store_read(off, rec, RECORD_SIZE)) {
+    return SLOT_TORN;
+  }
+  if (rec->crc == record_crc(rec)) {
+    return SLOT_VALID;
+  }
+  const uint8_t* bytes = (const uint8_t*) rec;
+  for (size_t i = 0; i < RECORD_SIZE; i++) {
+    if (bytes[i] != 0xFF) {
+      return SLOT_TORN;
+    }
+  }
+  return SLOT_EMPTY;
+}
+
+// First valid record in a sector, if it has one
+static bool sector_first(size_t sector, result_record_t* rec) {
+  for (size_t i = 0; i < SLOTS; i++) {
+    slot_t slot = read_slot(sector * HAL_STORE_SECTOR + i * RECORD_SIZE, rec);
+    if (slot == SLOT_VALID) {
+      return true;
+    }
+    if (slot == SLOT_EMPTY) {
+      return false;
+    }
+  }
+  return false;
+}
+
+// Oldest sector still holding data: the first one that has any going round
+// the ring from the head. The head's own sector only counts if nothing has
+// been written to it this time round.
+static size_t oldest_sector(void) {
+  result_record_t rec;
+  size_t from = HEAD / HAL_STORE_SECTOR + (HEAD % HAL_STORE_SECTOR ? 1 : 0);
+  for (size_t i = 0; i < SECTORS; i++) {
+    size_t s = (from + i) % SECTORS;
+    if (sector_first(s, &rec)) {
+      return s;
+    }
+  }
+  return HEAD / HAL_STORE_SECTOR;
+}
+
+static void update_first_seq(void) {
+  result_record_t rec;
+  FIRST_SEQ = sector_first(oldest_sector(), &rec) ? rec.seq : NEXT_SEQ;
+}
+
+esp_err_t open_results(void) {
+  LOCK = xSemaphoreCreateMutex();
+  esp_err_t err = hal_store_open(&SIZE);
+  if (err) {
+    return err;
+  }
+  SECTORS = SIZE / HAL_STORE_SECTOR;
+  // The newest sector is the one that starts with the highest sequence number
+  result_record_t rec;
+  bool any = false;
+  size_t newest = 0;
+  uint32_t newest_seq = 0;
+  for (size_t s = 0; s < SECTORS; s++) {
+    if (sector_first(s, &rec) && (!any || rec.seq > newest_seq)) {
+      any = true;
+      newest = s;
+      newest_seq = rec.seq;
+    }
+  }
+  HEAD = 0;
+  NEXT_SEQ = 0;
+  if (any) {
+    // Carry on after the last slot written in it, torn or not
+    HEAD = newest * HAL_STORE_SECTOR;
+    for (size_t i = 0; i < SLOTS; i++) {
+      size_t off = newest * HAL_STORE_SECTOR + i * RECORD_SIZE;
+      slot_t slot = read_slot(off, &rec);
+      if (slot == SLOT_EMPTY) {
+        break;
+      }
+      if (slot == SLOT_VALID) {
+        NEXT_SEQ = rec.seq + 1;
+        LAST_RUN = rec.run;
+      }
+      HEAD = (off + RECORD_SIZE) % SIZE;
+    }
+  }
+  update_first_seq();
+  OPEN = true;
+  ESP_LOGI(TAG, "Result log holds records %u to %u", FIRST_SEQ, NEXT_SEQ);
+  return ESP_OK;
+}
+
+uint32_t results_new_run(void) {
+  xSemaphoreTake(LOCK, portMAX_DELAY);
+  uint32_t run = ++LAST_RUN;
+  xSemaphoreGive(LOCK);
+  return run;
+}
+
+esp_err_t results_append(result_record_t* rec) {
+  if (!OPEN) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  xSemaphoreTake(LOCK, portMAX_DELAY);
+  esp_err_t err = ESP_OK;
+  // Entering a sector means erasing it, which drops the oldest records once
+  // the log has wrapped around
+  if (HEAD % HAL_STORE_SECTOR == 0) {
+    err = hal_store_erase(HEAD, HAL_STORE_SECTOR);
+  }
+  if (!err) {
+    rec->seq = NEXT_SEQ;
+    rec->crc = record_crc(rec);
+    err = hal_store_write(HEAD, rec, RECORD_SIZE);
+    NEXT_SEQ++;
+    // The slot is used up even if the write failed part way
+    HEAD = (HEAD + RECORD_SIZE) % SIZE;
+    if (HEAD % HAL_STORE_SECTOR == RECORD_SIZE) {
+      update_first_seq();
+    }
+  }
+  xSemaphoreGive(LOCK);
+  return err;
+}
+
+// Find the record with the cursor's sequence number, or the next one after
+// it that still exists: skip whole sectors by their first record, then step
+// through the one it must be in
+static void locate(result_cursor_t* cur) {
+  result_record_t rec;
+  if (cur->next < FIRST_SEQ) {
+    cur->next = FIRST_SEQ;
+  }
+  size_t sector = oldest_sector();
+  size_t start = sector;
+  // Sectors in use, from the oldest up to the one last written
+  size_t newest = ((HEAD + SIZE - RECORD_SIZE) % SIZE) / HAL_STORE_SECTOR;
+  size_t used = (newest + SECTORS - start) % SECTORS + 1;
+  for (size_t i = 1; i < used; i++) {
+    size_t s = (start + i) % SECTORS;
+    if (!sector_first(s, &rec) || rec.seq > cur->next) {
+      break;
+    }
+    sector = s;
+  }
+  cur->off = sector * HAL_STORE_SECTOR;
+  cur->located = true;
+}
+
+size_t results_read(result_cursor_t* cur, result_record_t* out, size_t max) {
+  size_t n = 0;
+  if (!OPEN) {
+    return 0;
+  }
+  xSemaphoreTake(LOCK, portMAX_DELAY);
+  if (!cur->located || cur->next < FIRST_SEQ) {
+    locate(cur);
+  }
+  // Never read past the head, which may be a whole lap away
+  size_t left = (HEAD + SIZE - cur->off) % SIZE;
+  if (!left && cur->next < NEXT_SEQ) {
+    left = SIZE;
+  }
+  while (n < max && left && cur->next < NEXT_SEQ) {
+    slot_t slot = read_slot(cur->off, &out[n]);
+    cur->off = (cur->off + RECORD_SIZE) % SIZE;
+    left -= RECORD_SIZE;
+    if (slot == SLOT_VALID && out[n].seq >= cur->next) {
+      cur->next = out[n].seq + 1;
+      n++;
+    }
+  }
+  xSemaphoreGive(LOCK);
+  return n;
+}
+
+void results_span(uint32_t* first, uint32_t* next) {
+  if (!OPEN) {
+    *first = *next = 0;
+    return;
+  }
+  xSemaphoreTake(LOCK, portMAX_DELAY);
+  *first = FIRST_SEQ;
+  *next = NEXT_SEQ;
+  xSemaphoreGive(LOCK);
+}
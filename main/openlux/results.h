@@ -0,0 +1,48 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+#ifndef RESULTS_H
+#define RESULTS_H
+// Measured wells are appended to a log in their own flash partition as they
+// come in, so a run survives the browser going away or the power going off.
+// The log is a ring of erase sectors: once full, the oldest sector is erased
+// to make room. Every record carries a CRC, so a write torn by a power cut is
+// skipped rather than read back as data.
+typedef struct result_record {
+  uint32_t seq;          // Position in the log, counting up forever
+  uint32_t run;          // Plate run the record belongs to
+  uint32_t time_ms;      // Since the run started
+  uint16_t cycle;
+  // Row-major, 0 is A1. The channel (see sensors.h) takes the top bits, so
+  // records from before there were channels read back as channel 0.
+  uint16_t well : 12;
+  uint16_t channel : 4;
+  float light;           // Mean lit reading
+  float dark;            // Mean dark reading
+  uint16_t signal_se;    // Standard error of light less dark, in hundredths
+  int16_t od;            // Calibrated OD in thousandths, or OD_NONE (samples.h)
+  uint32_t crc;          // CRC-32 of everything above
+} result_record_t;
+
+// Where a reader has got to. Initialise next to the first sequence number
+// wanted and located to false.
+typedef struct result_cursor {
+  uint32_t next;
+  size_t off;            // Flash offset of the record with seq next
+  bool located;
+} result_cursor_t;
+
+// System initialisation, which scans the log for where it left off:
+extern esp_err_t open_results(void);
+// Writing (one task at a time). Numbers a new run or fills in the sequence
+// number and CRC and appends the record.
+extern uint32_t results_new_run(void);
+extern esp_err_t results_append(result_record_t*);
+// Reading, from any task. Fills in up to max records from the cursor on and
+// returns how many; 0 once the cursor has caught up.
+extern size_t results_read(result_cursor_t*, result_record_t*, size_t);
+// Sequence numbers of the oldest record still held and of the next to write
+extern void results_span(uint32_t*, uint32_t*);
+#endif
@@ -0,0 +1,179 @@
+#include "route.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Largest number of rows or columns a grid can have
+#define MAX_SPAN 32
+// 2-opt gives up after this many passes even if it is still finding gains
+static const int MAX_PASSES = 16;
+
+// Hop times depend only on how many wells the longer axis moves, so they are
+// worked out once per call rather than once per pair
+typedef struct route_ctx {
+  const plate_grid_t* grid;
+  int64_t hop_us[MAX_SPAN];
+} route_ctx_t;
+
+static bool setup_ctx(route_ctx_t* ctx, const plate_grid_t* grid,
+                      const motion_profile_t* prof) {
+  if (grid->rows > MAX_SPAN || grid->cols > MAX_SPAN) {
+    return false;
+  }
+  ctx->grid = grid;
+  int span = (grid->rows > grid->cols) ? grid->rows : grid->cols;
+  for (int d = 0; d < span; d++) {
+    ctx->hop_us[d] = plan_duration_us(d * grid->pitch, 0, prof);
+  }
+  return true;
+}
+
+// A well of -1 is wherever the carriage happens to be, which costs nothing
+static int64_t cost(const route_ctx_t* ctx, int a, int b) {
+  if (a < 0 || b < 0) {
+    return 0;
+  }
+  int cols = ctx->grid->cols;
+  int dr = abs(a / cols - b / cols);
+  int dc = abs(a % cols - b % cols);
+  return ctx->hop_us[(dr > dc) ? dr : dc];
+}
+
+static int64_t path_cost(const route_ctx_t* ctx, const int* wells, int n, int start) {
+  int64_t total = 0;
+  int prev = start;
+  for (int i = 0; i < n; i++) {
+    total += cost(ctx, prev, wells[i]);
+    prev = wells[i];
+  }
+  return total;
+}
+
+// Count the selected wells in each row. Returns true if every row is either
+// complete or empty.
+static bool full_rows(const int* wells, int n, const plate_grid_t* grid, int* counts) {
+  memset(counts, 0, MAX_SPAN * sizeof(int));
+  for (int i = 0; i < n; i++) {
+    counts[wells[i] / grid->cols]++;
+  }
+  for (int r = 0; r < grid->rows; r++) {
+    if (counts[r] && counts[r] != grid->cols) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Snake through the selected rows, starting from one of the four corners
+static void snake(int* wells, const int* counts, const plate_grid_t* grid,
+                  bool bottom_up, bool right_first) {
+  int k = 0;
+  bool right = right_first;
+  for (int i = 0; i < grid->rows; i++) {
+    int r = bottom_up ? grid->rows - 1 - i : i;
+    if (!counts[r]) {
+      continue;
+    }
+    for (int j = 0; j < grid->cols; j++) {
+      int c = right ? grid->cols - 1 - j : j;
+      wells[k++] = r * grid->cols + c;
+    }
+    right = !right;
+  }
+}
+
+static void serpentine(const route_ctx_t* ctx, int* wells, int n, int start,
+                       const int* counts) {
+  int best = 0;
+  int64_t best_cost = -1;
+  for (int corner = 0; corner < 4; corner++) {
+    snake(wells, counts, ctx->grid, corner & 1, corner & 2);
+    int64_t c = path_cost(ctx, wells, n, start);
+    if (best_cost < 0 || c < best_cost) {
+      best = corner;
+      best_cost = c;
+    }
+  }
+  snake(wells, counts, ctx->grid, best & 1, best & 2);
+}
+
+// Greedy tour, built by swapping the nearest unvisited well into place
+static void nearest_neighbour(const route_ctx_t* ctx, int* wells, int n, int start) {
+  int prev = start;
+  for (int i = 0; i < n; i++) {
+    int best = i;
+    int64_t best_cost = cost(ctx, prev, wells[i]);
+    for (int j = i + 1; j < n && best_cost > 0; j++) {
+      int64_t c = cost(ctx, prev, wells[j]);
+      if (c < best_cost) {
+        best = j;
+        best_cost = c;
+      }
+    }
+    int tmp = wells[i];
+    wells[i] = wells[best];
+    wells[best] = tmp;
+    prev = wells[i];
+  }
+}
+
+static void reverse(int* wells, int i, int j) {
+  for (; i < j; i++, j--) {
+    int tmp = wells[i];
+    wells[i] = wells[j];
+    wells[j] = tmp;
+  }
+}
+
+// Reverse any stretch of the tour that comes out cheaper the other way round.
+// The tour is open ended: it starts from the carriage and stops at the last
+// well, so a stretch running to the end only has one edge to reconnect.
+static void two_opt(const route_ctx_t* ctx, int* wells, int n, int start) {
+  for (int pass = 0; pass < MAX_PASSES; pass++) {
+    bool improved = false;
+    for (int i = 0; i < n - 1; i++) {
+      int before = (i > 0) ? wells[i - 1] : start;
+      for (int j = i + 1; j < n; j++) {
+        int after = (j < n - 1) ? wells[j + 1] : -1;
+        int64_t delta = cost(ctx, before, wells[j]) + cost(ctx, wells[i], after) -
+                        cost(ctx, before, wells[i]) - cost(ctx, wells[j], after);
+        if (delta < 0) {
+          reverse(wells, i, j);
+          improved = true;
+        }
+      }
+    }
+    if (!improved) {
+      break;
+    }
+  }
+}
+
+int64_t route_wells(int* wells, int n, int start, const plate_grid_t* grid,
+                    const motion_profile_t* prof) {
+  route_ctx_t ctx;
+  int counts[MAX_SPAN];
+  if (!setup_ctx(&ctx, grid, prof)) {
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (wells[i] < 0 || wells[i] >= grid->rows * grid->cols) {
+      return -1;
+    }
+  }
+  if (n > 1 && full_rows(wells, n, grid, counts)) {
+    serpentine(&ctx, wells, n, start, counts);
+  } else if (n > 1) {
+    nearest_neighbour(&ctx, wells, n, start);
+    two_opt(&ctx, wells, n, start);
+  }
+  return path_cost(&ctx, wells, n, start);
+}
+
+int64_t route_cost(const int* wells, int n, int start, const plate_grid_t* grid,
+                   const motion_profile_t* prof) {
+  route_ctx_t ctx;
+  if (!setup_ctx(&ctx, grid, prof)) {
+    return -1;
+  }
+  return path_cost(&ctx, wells, n, start);
+}
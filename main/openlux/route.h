@@ -0,0 +1,23 @@
+#include "motion.h"
+
+#ifndef ROUTE_H
+#define ROUTE_H
+// Well order optimisation. Wells are numbered row-major from 0 (A1) on a
+// regular grid, and a hop between two of them costs the time the motors take
+// to make it. Both axes step together, so that only depends on whichever axis
+// has further to go.
+typedef struct plate_grid {
+  int rows;
+  int cols;
+  int pitch;   // Steps between neighbouring wells
+} plate_grid_t;
+
+// Reorder wells in place for the quickest visit starting from the given well
+// (-1 if the carriage isn't over one). Selections made of whole rows are
+// snaked through; anything else gets a nearest neighbour tour tidied up by
+// 2-opt. Returns the predicted travel time in microseconds, or -1 if the grid
+// is too big or a well is off it. Wells must not repeat.
+extern int64_t route_wells(int*, int, int, const plate_grid_t*, const motion_profile_t*);
+// Travel time of a visiting order as given
+extern int64_t route_cost(const int*, int, int, const plate_grid_t*, const motion_profile_t*);
+#endif
@@ -0,0 +1,91 @@
+#include "samples.h"
+#include "hal.h"
+#include <stdatomic.h>
+
+// A single-producer, multi-consumer ring of readings. The producer never
+// blocks: it overwrites the oldest slot, and each slot carries a sequence tag
+// so readers can tell when a slot changed underneath them (a per-slot
+// seqlock). A tag of 0 means "being written", otherwise it is seq + 1.
+typedef struct slot {
+  atomic_uint tag;
+  sample_t data;
+} slot_t;
+
+static slot_t RING[SAMPLE_RING_SIZE];
+// Number of readings ever published
+static atomic_uint HEAD = 0;
+
+void sample_ring_push(uint16_t raw, int16_t well, uint8_t led, uint8_t channel, int16_t od) {
+  uint32_t seq = atomic_load_explicit(&HEAD, memory_order_relaxed);
+  slot_t* slot = &RING[seq & (SAMPLE_RING_SIZE - 1)];
+  atomic_store_explicit(&slot->tag, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot->data.seq = seq;
+  slot->data.time_us = hal_time_us();
+  slot->data.raw = raw;
+  slot->data.well = well;
+  slot->data.led = led;
+  slot->data.channel = channel;
+  slot->data.od = od;
+  atomic_store_explicit(&slot->tag, seq + 1, memory_order_release);
+  atomic_store_explicit(&HEAD, seq + 1, memory_order_release);
+}
+
+// Copy out the reading with sequence number seq, if it is still in the ring
+static bool read_slot(uint32_t seq, sample_t* out) {
+  slot_t* slot = &RING[seq & (SAMPLE_RING_SIZE - 1)];
+  if (atomic_load_explicit(&slot->tag, memory_order_acquire) != seq + 1) {
+    return false;
+  }
+  *out = slot->data;
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&slot->tag, memory_order_relaxed) == seq + 1;
+}
+
+uint32_t sample_ring_head(void) {
+  return atomic_load_explicit(&HEAD, memory_order_acquire);
+}
+
+// New cursors start at the next reading to be published
+void sample_cursor_init(sample_cursor_t* cur) {
+  cur->next = sample_ring_head();
+  cur->dropped = 0;
+}
+
+// Read up to max readings from the cursor onwards, returning how many were
+// copied into out. Readings that have been overwritten are skipped and
+// counted in cur->dropped.
+size_t sample_ring_read(sample_cursor_t* cur, sample_t* out, size_t max) {
+  uint32_t head = sample_ring_head();
+  // A cursor from the future (e.g. a client that outlived a reboot) restarts
+  if ((int32_t) (head - cur->next) < 0) {
+    cur->next = head;
+  }
+  size_t n = 0;
+  while (n < max && cur->next != head) {
+    if (head - cur->next > SAMPLE_RING_SIZE) {
+      uint32_t oldest = head - SAMPLE_RING_SIZE;
+      cur->dropped += oldest - cur->next;
+      cur->next = oldest;
+    }
+    if (read_slot(cur->next, &out[n])) {
+      n++;
+    } else {
+      cur->dropped++;
+    }
+    cur->next++;
+  }
+  return n;
+}
+
+bool sample_ring_latest(sample_t* out) {
+  for (;;) {
+    uint32_t head = sample_ring_head();
+    if (head == 0) {
+      return false;
+    }
+    if (read_slot(head - 1, out)) {
+      return true;
+    }
+  }
+}
@@ -0,0 +1,37 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifndef SAMPLES_H
+#define SAMPLES_H
+// Optical density, in thousandths, where there is none to give: the LED of
+// the channel read is off or the carriage isn't over a well (see calib.h)
+#define OD_NONE INT16_MIN
+// Number of readings kept in the ring (must be a power of two)
+#define SAMPLE_RING_SIZE 256
+
+// One published reading
+typedef struct sample {
+  uint32_t seq;      // Position in the stream, counting from 0 at boot
+  int64_t time_us;   // When the reading was published
+  uint16_t raw;      // Averaged ADC value
+  int16_t well;      // Well under the carriage (row-major, 0 = A1), -1 if none
+  uint8_t led;       // LEDs lit while the reading was taken, bit n for channel n
+  uint8_t channel;   // Whose photodiode was read (see sensors.h)
+  int16_t od;        // Calibrated optical density in thousandths, or OD_NONE
+} sample_t;
+
+// Each consumer keeps its own cursor, so nobody waits on anybody else
+typedef struct sample_cursor {
+  uint32_t next;     // Sequence number of the next reading to return
+  uint32_t dropped;  // Readings that were overwritten before being read
+} sample_cursor_t;
+
+// Producer (the sensor task only):
+extern void sample_ring_push(uint16_t, int16_t, uint8_t, uint8_t, int16_t);
+// Consumers:
+extern void sample_cursor_init(sample_cursor_t*);
+extern size_t sample_ring_read(sample_cursor_t*, sample_t*, size_t);
+extern bool sample_ring_latest(sample_t*);
+extern uint32_t sample_ring_head(void);
+#endif
@@ -0,0 +1,118 @@
+#include "scan.h"
+#include "hal.h"
+#include "motors.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Samples count towards a well within this many steps of its centre, well
+// inside the wall so none see the plate frame
+static const int SCAN_WINDOW = WELL_SPACING / 8;
+// Fewest samples a well must collect to be read
+static const uint32_t SCAN_MIN_SAMPLES = 16;
+// Longest a single move can take before giving up on it
+static const int MOVE_TIMEOUT_MS = 30000;
+
+// The row being swept. Written by the calling task before the scan starts
+// and after it ends; in between, only the polling task touches it.
+typedef struct row_scan {
+  move_track_t track;
+  int r_pos;
+  uint32_t cols;
+  running_stats_t bins[SENSOR_CHANNELS][PLATE_COLS];
+} row_scan_t;
+
+static row_scan_t ROW;
+
+// Scan listener: place each sample and add it to the well it was taken over
+static void bin_samples(int channel, const uint16_t* block, size_t n, int64_t first_us,
+                        float period_us) {
+  for (size_t i = 0; i < n; i++) {
+    int r_pos, c_pos;
+    if (!carriage_at(&ROW.track, first_us + (int64_t) (i * period_us), &r_pos, &c_pos) ||
+        r_pos != ROW.r_pos || c_pos < -SCAN_WINDOW) {
+      continue;
+    }
+    int col = (c_pos + WELL_SPACING / 2) / WELL_SPACING;
+    if (col >= PLATE_COLS || !((ROW.cols >> col) & 1) ||
+        abs(c_pos - col * WELL_SPACING) > SCAN_WINDOW) {
+      continue;
+    }
+    stats_add(&ROW.bins[channel][col], block[i]);
+  }
+}
+
+// Hand a move to the motor task and wait for it to be made
+static esp_err_t move_and_wait(esp_err_t queued) {
+  if (queued) {
+    return queued;
+  }
+  if (!ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MOVE_TIMEOUT_MS))) {
+    return ESP_ERR_TIMEOUT;
+  }
+  return ESP_OK;
+}
+
+esp_err_t scan_row(int row, uint32_t cols, bool reverse, uint32_t dark_samples,
+                   measurement_t out[][PLATE_COLS], uint32_t read[SENSOR_CHANNELS]) {
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  memset(read, 0, SENSOR_CHANNELS * sizeof(read[0]));
+  cols &= (1u << PLATE_COLS) - 1;
+  if (row < 0 || row >= PLATE_ROWS || !cols) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  int first = __builtin_ctz(cols);
+  int last = 31 - __builtin_clz(cols);
+  int dir = reverse ? -1 : 1;
+  if (reverse) {
+    int tmp = first;
+    first = last;
+    last = tmp;
+  }
+  // Up to speed before the first window opens, and still at it once the last
+  // closes. There is only about half a pitch of travel beyond the outer wells,
+  // so a long ramp may run into the first window; samples are placed by step
+  // count rather than assuming a steady speed, so that only costs samples.
+  int ramp = sweep_runup();
+  int runup = SCAN_WINDOW + ((ramp < WELL_SPACING / 4) ? ramp : WELL_SPACING / 4);
+  int r_pos = row * WELL_SPACING;
+  ulTaskNotifyTake(pdTRUE, 0);
+  esp_err_t err = move_and_wait(goto_pos(r_pos, first * WELL_SPACING - dir * runup, self));
+  running_stats_t dark[SENSOR_CHANNELS];
+  if (!err) {
+    err = measure_dark(dark_samples, dark);
+  }
+  if (err) {
+    ESP_LOGW(TAG, "Raster scan of row %d failed to start: %s", row, esp_err_to_name(err));
+    return err;
+  }
+  memset(&ROW.track, 0, sizeof(ROW.track));
+  ROW.r_pos = r_pos;
+  ROW.cols = cols;
+  for (int c = 0; c < SENSOR_CHANNELS; c++) {
+    for (int col = 0; col < PLATE_COLS; col++) {
+      stats_reset(&ROW.bins[c][col]);
+    }
+  }
+  err = begin_scan(bin_samples);
+  if (!err) {
+    err = move_and_wait(sweep_to(r_pos, last * WELL_SPACING + dir * runup, self));
+    esp_err_t end_err = end_scan(hal_time_us());
+    if (!err) {
+      err = end_err;
+    }
+  }
+  if (err) {
+    ESP_LOGW(TAG, "Raster scan of row %d failed: %s", row, esp_err_to_name(err));
+    return err;
+  }
+  for (int c = 0; c < SENSOR_CHANNELS; c++) {
+    for (int col = 0; col < PLATE_COLS; col++) {
+      if (((cols >> col) & 1) && ROW.bins[c][col].n >= SCAN_MIN_SAMPLES) {
+        summarise(&dark[c], &ROW.bins[c][col], c, row * PLATE_COLS + col, &out[c][col]);
+        read[c] |= 1u << col;
+      }
+    }
+  }
+  return ESP_OK;
+}
@@ -0,0 +1,21 @@
+#include "common.h"
+#include "sensors.h"
+#include "plate.h"
+
+#ifndef SCAN_H
+#define SCAN_H
+// Raster scanning: read a row of wells on the move instead of stopping at
+// each. The carriage sweeps the row at constant speed with the channels' LEDs
+// lit in turn (see sensors.h); every raw sample is placed by the step count
+// the move had reached when it was taken and counted towards a well on its
+// channel if it fell near enough to the centre.
+//
+// Read the columns set in the mask (bit 0 is column 1) of a row (0 is A) in
+// one sweep, right to left if reversed. One dark reading of the given number
+// of samples is taken from each photodiode for the row before the sweep.
+// Fills in a measurement for each channel and column read, and sets it in
+// that channel's read mask; columns that didn't collect enough samples on a
+// channel are left out of it.
+extern esp_err_t scan_row(int, uint32_t, bool, uint32_t, measurement_t[][PLATE_COLS],
+                          uint32_t[SENSOR_CHANNELS]);
+#endif
@@ -1,56 +1,414 @@
 #include "sensors.h"
 #include "common.h"
+#include "hal.h"
+#include "motors.h"
+#include "samples.h"
+#include "stats.h"
+#include "metrics.h"
+#include "calib.h"
+#include "trace.h"
+#include <esp_timer.h>
+#include <freertos/semphr.h>
 #include <math.h>
 
+// Number of raw samples fetched from the DMA buffers at a time
+#define ADC_BLOCK 256
+// Time allowed for the LED and photodiode to settle after switching, and for
+// the ADC to move on to another photodiode
+static const int SETTLE_US = 1000;
+// Between raw samples
+static const float SAMPLE_US = 1e6f / CONFIG_OPENLUX_ADC_SAMPLE_RATE;
+
 typedef struct poll_args {
-  adc1_channel_t channel;
   unsigned int samples;
 } poll_args;
 
-// Purge this, make it an argument
-static const int LED = 17;
+static const sensor_channel_t CHANNELS[SENSOR_CHANNELS] = {
+  { CONFIG_OPENLUX_LED_GPIO_1, CONFIG_OPENLUX_ADC_CHANNEL_1 },
+#if SENSOR_CHANNELS >= 2
+  { CONFIG_OPENLUX_LED_GPIO_2, CONFIG_OPENLUX_ADC_CHANNEL_2 },
+#endif
+#if SENSOR_CHANNELS >= 3
+  { CONFIG_OPENLUX_LED_GPIO_3, CONFIG_OPENLUX_ADC_CHANNEL_3 },
+#endif
+#if SENSOR_CHANNELS >= 4
+  { CONFIG_OPENLUX_LED_GPIO_4, CONFIG_OPENLUX_ADC_CHANNEL_4 },
+#endif
+};
+_Static_assert(SENSOR_CHANNELS >= 1 && SENSOR_CHANNELS <= 4, "One to four channels");
 
-static int SENSOR_VALUE = -1;
+// LEDs lit (bit n for channel n), recorded alongside each reading
+static volatile int LED_STATE = 0;
+// Channel whose photodiode is being sampled
+static volatile int CHANNEL = 0;
 static void poll_avg(void*);
 
+// A measurement phase in progress. The caller fills it in and arms it; the
+// polling task then skips samples taken before the LED settled, feeds exactly
+// the requested number into the statistics and signals PHASE_DONE.
+typedef struct phase {
+  volatile bool armed;
+  int64_t from_us;       // Settled, on the hal_time_us clock
+  uint32_t left;
+  running_stats_t stats;
+} phase_t;
+
+static phase_t PHASE;
+static SemaphoreHandle_t PHASE_DONE = NULL;
+// Only one measurement or scan can use the LEDs at a time
+static SemaphoreHandle_t MEASURING = NULL;
+
+// A raster scan in progress. The listener is set last to start one; the
+// polling task drops it and signals SCAN_DONE once ending is set and it has
+// passed on everything up to until_us.
+//
+// The channels take turns with their LEDs lit, a block of samples each. Reads
+// return samples up to hal_adc_stream_lag() late, so when each turn started
+// is kept until every sample taken during it has been passed on.
+#define SCAN_TURNS 16
+typedef struct scan_turn {
+  int64_t start_us;      // Switching began, on the hal_time_us clock
+  int64_t settled_us;
+  int channel;
+} scan_turn_t;
+
+typedef struct scan {
+  volatile scan_listener_t listener;
+  int64_t until_us;
+  volatile bool ending;
+  scan_turn_t turns[SCAN_TURNS];
+  uint32_t n_turns;      // Started, counting up forever
+  uint32_t reading;      // The turn the next sample was taken in
+} scan_t;
+
+static scan_t SCAN;
+static SemaphoreHandle_t SCAN_DONE = NULL;
+
+// The ADC is sampled continuously at CONFIG_OPENLUX_ADC_SAMPLE_RATE and every
+// per milliseconds worth of samples is averaged into one published reading.
 // Return the task handle
-void start_sensor_polling(adc1_channel_t ch, adc_atten_t atn, unsigned int per) {
-  die_politely(adc1_config_width(ADC_WIDTH_BIT_12), "Failed to set ADC bus width");
-  die_politely(adc1_config_channel_atten(ch, atn), "Failed to set channel attenuation");
-  // Fail check this
-  gpio_pad_select_gpio(LED);
-  gpio_set_direction(LED, GPIO_MODE_OUTPUT);
-  ESP_LOGI(TAG, "Started sensor polling on channel %d at %.2fHz", ch, 1000/((double) per));
+void start_sensor_polling(adc_atten_t atn, unsigned int per) {
+  // Every photodiode is set up before the stream starts, since I2S has the
+  // ADC from then on
+  for (int c = 0; c < SENSOR_CHANNELS; c++) {
+    die_politely(hal_setup_adc(CHANNELS[c].adc, atn), "Failed to set up a photodiode");
+    hal_setup_led(CHANNELS[c].led);
+  }
+  die_politely(hal_adc_stream_start(CHANNELS[0].adc, atn, CONFIG_OPENLUX_ADC_SAMPLE_RATE),
+               "Failed to start continuous ADC acquisition");
+  PHASE_DONE = xSemaphoreCreateBinary();
+  SCAN_DONE = xSemaphoreCreateBinary();
+  MEASURING = xSemaphoreCreateMutex();
   poll_args* args = (poll_args*) malloc(sizeof(poll_args));
-  args->channel = ch;
-  args->samples = per / (unsigned int) portTICK_PERIOD_MS;
+  args->samples = ((uint64_t) CONFIG_OPENLUX_ADC_SAMPLE_RATE * per) / 1000;
+  if (args->samples == 0) {
+    args->samples = 1;
+  }
+  ESP_LOGI(TAG, "Started sensor polling of %d channels at %.2fHz (%u samples per reading)",
+           SENSOR_CHANNELS, 1000/((double) per), args->samples);
   TaskHandle_t poll_handle = NULL;
   xTaskCreate(poll_avg, "SENSOR_POLLING", 4096, args, 2, &poll_handle);
 }
 
+// The most recent reading, or -1 if nothing has been published yet
 int get_sensor_value(void) {
-  return SENSOR_VALUE;
+  sample_t latest;
+  return sample_ring_latest(&latest) ? latest.raw : -1;
+}
+
+// Light the LEDs in the mask and nothing else
+static void light(int mask) {
+  for (int c = 0; c < SENSOR_CHANNELS; c++) {
+    hal_set_led(CHANNELS[c].led, (mask >> c) & 1);
+  }
+  LED_STATE = mask;
+}
+
+// Sample a channel's photodiode from now on
+static esp_err_t select_channel(int channel) {
+  esp_err_t err = ESP_OK;
+  if (CHANNELS[channel].adc != CHANNELS[CHANNEL].adc) {
+    err = hal_adc_stream_select(CHANNELS[channel].adc);
+  }
+  if (!err) {
+    CHANNEL = channel;
+  }
+  return err;
 }
 
 void set_led(int status) { // The key makes me ill. Better place for it...
-  gpio_set_level(LED, status);
-  ESP_LOGI(TAG, "LED set to %d", status);
-  if (status && get_status() != READING) {
-    set_status(READING);
+  status &= (1 << SENSOR_CHANNELS) - 1;
+  if (status) {
+    select_channel(__builtin_ctz(status));
   }
-  if (!status && (get_status() == READING)) {
-    revert_status();
+  light(status);
+  ESP_LOGI(TAG, "LEDs set to %d", status);
+  if (status && !in_status(READING)) {
+    begin_status(READING);
+  }
+  if (!status && in_status(READING)) {
+    end_status(READING);
   }
 }
   
+// Called by the polling task for every raw sample while a phase is armed,
+// with when it was taken. Returns false once the phase is complete, after
+// which the rest of the block must not be fed to whatever phase is armed next.
+static bool feed_phase(uint16_t raw, int64_t time_us) {
+  if (time_us < PHASE.from_us) {
+    return true;
+  }
+  stats_add(&PHASE.stats, raw);
+  if (--PHASE.left) {
+    return true;
+  }
+  PHASE.armed = false;
+  xSemaphoreGive(PHASE_DONE);
+  return false;
+}
+
+// Dark or lit samples of one channel
+static esp_err_t measure_phase(int channel, bool lit, uint32_t n, running_stats_t* out) {
+  // Twice as long as the samples should take, plus a second of slack
+  uint32_t timeout_ms = (uint64_t) (n + hal_adc_stream_lag()) * 2000 /
+                        CONFIG_OPENLUX_ADC_SAMPLE_RATE + SETTLE_US / 1000 + 1000;
+  esp_err_t err = select_channel(channel);
+  if (err) {
+    return err;
+  }
+  light(lit ? 1 << channel : 0);
+  // The polling task may still be feeding the rest of a block to a phase
+  // that timed out, so it is held off the statistics while they are reset,
+  // and anything it gave since must not end this phase
+  PHASE.from_us = INT64_MAX;
+  stats_reset(&PHASE.stats);
+  PHASE.left = n;
+  PHASE.from_us = hal_time_us() + SETTLE_US;
+  int64_t start = esp_timer_get_time();
+  while (xSemaphoreTake(PHASE_DONE, 0)) {
+  }
+  // Last, since this hands the phase over to the polling task
+  PHASE.armed = true;
+  if (!xSemaphoreTake(PHASE_DONE, pdMS_TO_TICKS(timeout_ms))) {
+    PHASE.armed = false;
+    return ESP_ERR_TIMEOUT;
+  }
+  metric_since(METRIC_MEASURE_PHASE, start);
+  *out = PHASE.stats;
+  return ESP_OK;
+}
+
+// The first channel on the same photodiode, whose dark reading this one shares
+static int dark_channel(int channel) {
+  int c = 0;
+  while (CHANNELS[c].adc != CHANNELS[channel].adc) {
+    c++;
+  }
+  return c;
+}
+
+// Take exactly n samples in the dark and n lit on each channel in turn,
+// without keeping any of them. Photodiodes are read in the dark once, before
+// the first of their channels is lit.
+esp_err_t measure(uint32_t n, measurement_t m[SENSOR_CHANNELS]) {
+  running_stats_t dark[SENSOR_CHANNELS];
+  running_stats_t lit;
+  if (n == 0 || n > MEASURE_MAX_SAMPLES) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  int well = get_current_well();
+  xSemaphoreTake(MEASURING, portMAX_DELAY);
+  // Clears any READING status a client left behind by lighting an LED
+  set_led(0);
+  begin_status(READING);
+  esp_err_t err = ESP_OK;
+  for (int c = 0; c < SENSOR_CHANNELS && !err; c++) {
+    int d = dark_channel(c);
+    if (d == c) {
+      err = measure_phase(c, false, n, &dark[c]);
+    }
+    if (!err) {
+      err = measure_phase(c, true, n, &lit);
+    }
+    if (!err) {
+      summarise(&dark[d], &lit, c, well, &m[c]);
+    }
+  }
+  light(0);
+  end_status(READING);
+  xSemaphoreGive(MEASURING);
+  return err;
+}
+
+// Take exactly n samples in the dark from every photodiode, e.g. once for a
+// whole raster scanned row
+esp_err_t measure_dark(uint32_t n, running_stats_t dark[SENSOR_CHANNELS]) {
+  if (n == 0 || n > MEASURE_MAX_SAMPLES) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  xSemaphoreTake(MEASURING, portMAX_DELAY);
+  set_led(0);
+  begin_status(READING);
+  esp_err_t err = ESP_OK;
+  for (int c = 0; c < SENSOR_CHANNELS && !err; c++) {
+    int d = dark_channel(c);
+    if (d == c) {
+      err = measure_phase(c, false, n, &dark[c]);
+    } else {
+      dark[c] = dark[d];
+    }
+  }
+  end_status(READING);
+  xSemaphoreGive(MEASURING);
+  return err;
+}
+
+void summarise(const running_stats_t* dark, const running_stats_t* light, int channel,
+               int well, measurement_t* m) {
+  m->samples = light->n;
+  m->dark_mean = stats_mean(dark);
+  m->dark_sd = stats_sd(dark);
+  m->dark_median = stats_median(dark);
+  m->light_mean = stats_mean(light);
+  m->light_sd = stats_sd(light);
+  m->light_median = stats_median(light);
+  m->signal = m->light_mean - m->dark_mean;
+  m->signal_se = sqrtf(m->light_sd * m->light_sd / light->n +
+                       m->dark_sd * m->dark_sd / dark->n);
+  m->od = od_from_means(channel, well, m->light_mean, m->dark_mean);
+  m->channel = channel;
+  trace_well(channel, well, m->signal);
+}
+
+esp_err_t begin_scan(scan_listener_t listener) {
+  xSemaphoreTake(MEASURING, portMAX_DELAY);
+  set_led(0);
+  esp_err_t err = select_channel(0);
+  if (err) {
+    xSemaphoreGive(MEASURING);
+    return err;
+  }
+  begin_status(READING);
+  light(1);
+  SCAN.turns[0].start_us = hal_time_us();
+  SCAN.turns[0].settled_us = SCAN.turns[0].start_us + SETTLE_US;
+  SCAN.turns[0].channel = 0;
+  SCAN.n_turns = 1;
+  SCAN.reading = 0;
+  SCAN.ending = false;
+  xSemaphoreTake(SCAN_DONE, 0);
+  // Last, since this hands the scan over to the polling task
+  SCAN.listener = listener;
+  return ESP_OK;
+}
+
+esp_err_t end_scan(int64_t until_us) {
+  SCAN.until_us = until_us;
+  SCAN.ending = true;
+  // Allow for the DMA backlog, plus a second of slack
+  uint32_t timeout_ms = (uint64_t) hal_adc_stream_lag() * 1000 / CONFIG_OPENLUX_ADC_SAMPLE_RATE + 1000;
+  esp_err_t err = ESP_OK;
+  if (!xSemaphoreTake(SCAN_DONE, pdMS_TO_TICKS(timeout_ms))) {
+    SCAN.listener = NULL;
+    err = ESP_ERR_TIMEOUT;
+  }
+  light(0);
+  end_status(READING);
+  xSemaphoreGive(MEASURING);
+  return err;
+}
+
+// Hand the LEDs on to the next channel. Skipped if the turns of samples
+// still to come would be forgotten, or the photodiode can't be switched.
+static void next_turn(void) {
+  if (SCAN.n_turns - SCAN.reading >= SCAN_TURNS) {
+    return;
+  }
+  int next = (SCAN.turns[(SCAN.n_turns - 1) % SCAN_TURNS].channel + 1) % SENSOR_CHANNELS;
+  int64_t start_us = hal_time_us();
+  if (select_channel(next) != ESP_OK) {
+    return;
+  }
+  light(1 << next);
+  scan_turn_t* turn = &SCAN.turns[SCAN.n_turns % SCAN_TURNS];
+  turn->start_us = start_us;
+  turn->settled_us = hal_time_us() + SETTLE_US;
+  turn->channel = next;
+  SCAN.n_turns++;
+}
+
+// Called by the polling task with every block while a scan is on. The block
+// goes to the listener in runs of samples from one channel, leaving out any
+// taken before the LED and photodiode settled.
+static void feed_scan(const uint16_t* block, size_t n, int64_t first_us) {
+  scan_listener_t listener = SCAN.listener;
+  if (!listener) {
+    return;
+  }
+  int channel = -1;
+  size_t from = 0;
+  for (size_t i = 0; i <= n; i++) {
+    int c = -1;
+    int64_t t = first_us + (int64_t) (i * SAMPLE_US);
+    if (i < n) {
+      while (SCAN.reading + 1 < SCAN.n_turns &&
+             SCAN.turns[(SCAN.reading + 1) % SCAN_TURNS].start_us <= t) {
+        SCAN.reading++;
+      }
+      const scan_turn_t* turn = &SCAN.turns[SCAN.reading % SCAN_TURNS];
+      if (t >= turn->settled_us) {
+        c = turn->channel;
+      }
+    }
+    if (c != channel || i == n) {
+      if (channel >= 0) {
+        listener(channel, block + from, i - from, first_us + (int64_t) (from * SAMPLE_US),
+                 SAMPLE_US);
+      }
+      channel = c;
+      from = i;
+    }
+  }
+  if (SCAN.ending && first_us + (int64_t) (n * SAMPLE_US) >= SCAN.until_us) {
+    SCAN.listener = NULL;
+    SCAN.ending = false;
+    xSemaphoreGive(SCAN_DONE);
+  } else if (SENSOR_CHANNELS > 1) {
+    next_turn();
+  }
+}
+
+// Decimate the raw sample stream: sum blocks of samples off the DMA buffers
+// and publish the rounded mean of every opts->samples of them to the ring.
+// Samples also go to any measurement phase that is armed, or scan that is on.
 static void poll_avg(void* args) {
   poll_args* opts = (poll_args*)args;
+  uint16_t block[ADC_BLOCK];
+  uint64_t sum = 0;
+  unsigned int count = 0;
   while (true) {
-    float avg = 0;
-    for (int i = 0; i < opts->samples; i++) {
-      avg += adc1_get_raw(opts->channel);
-      vTaskDelay(1);
+    // A phase armed part way through a read only starts with the next one
+    bool measuring = PHASE.armed;
+    int64_t first_us;
+    size_t got = hal_adc_stream_read(block, ADC_BLOCK, &first_us);
+    int64_t start = esp_timer_get_time();
+    feed_scan(block, got, first_us);
+    for (size_t i = 0; i < got; i++) {
+      if (measuring) {
+        measuring = feed_phase(block[i], first_us + (int64_t) (i * SAMPLE_US));
+      }
+      sum += block[i];
+      if (++count == opts->samples) {
+        uint16_t raw = (sum + count / 2) / count;
+        int well = get_current_well();
+        int channel = CHANNEL;
+        int16_t od = ((LED_STATE >> channel) & 1) ? od_from_raw(channel, well, raw) : OD_NONE;
+        sample_ring_push(raw, well, LED_STATE, channel, od);
+        trace_reading(channel, well, LED_STATE, raw);
+        sum = 0;
+        count = 0;
+      }
     }
-    SENSOR_VALUE = round(avg / opts->samples);
+    metric_since(METRIC_SENSOR_BLOCK, start);
   }
 }
@@ -1,11 +1,63 @@
 #include <driver/adc.h>
+#include <esp_err.h>
+#include <stddef.h>
+#include "stats.h"
+#include "samples.h"
+#include "sdkconfig.h"
 
 #ifndef SENSORS_H
 #define SENSORS_H
+// Channels: LED and photodiode pairs, e.g. one LED per wavelength, set up in
+// menuconfig. A well measurement reads every channel in turn without moving.
+// LEDs may share a photodiode, in which case they share its dark reading.
+#define SENSOR_CHANNELS CONFIG_OPENLUX_CHANNELS
+typedef struct sensor_channel {
+  int led;             // GPIO
+  adc1_channel_t adc;  // Of the photodiode
+} sensor_channel_t;
+
+// One well measurement: the same number of raw samples taken with the LED off
+// (dark) and then on (light). Raster scans take a row's dark samples once and
+// as many lit ones as pass over each well.
+typedef struct measurement {
+  uint32_t samples;    // Taken lit (and dark, unless raster scanned)
+  float dark_mean;
+  float dark_sd;
+  float dark_median;
+  float light_mean;
+  float light_sd;
+  float light_median;
+  float signal;        // Light less dark mean
+  float signal_se;     // Standard error of the signal
+  int16_t od;          // Calibrated optical density in thousandths, or OD_NONE
+  uint8_t channel;
+} measurement_t;
+
 // System initialisation
-extern void start_sensor_polling(adc1_channel_t, adc_atten_t, unsigned int);
+extern void start_sensor_polling(adc_atten_t, unsigned int);
 // Getters
 extern int get_sensor_value(void);
-// Setters
+// Setters. Bit n lights channel n's LED, and readings are then published
+// from the photodiode of the lowest channel lit.
 extern void set_led(int);
+// Blocks until the measurement is done, leaving the LEDs off, and fills in
+// one measurement per channel. Fails with ESP_ERR_TIMEOUT if the samples stop
+// arriving and ESP_ERR_INVALID_ARG for no samples or more than
+// MEASURE_MAX_SAMPLES.
+#define MEASURE_MAX_SAMPLES 100000
+extern esp_err_t measure(uint32_t, measurement_t[SENSOR_CHANNELS]);
+extern esp_err_t measure_dark(uint32_t, running_stats_t[SENSOR_CHANNELS]);
+// Fill in a measurement of a channel and well (-1 for none) from its dark and
+// lit samples
+extern void summarise(const running_stats_t*, const running_stats_t*, int, int,
+                      measurement_t*);
+// Read-while-moving. While a scan is on the channels take turns with their
+// LEDs lit, a block of samples each, and the listener is called on the
+// polling task with every run of raw samples from one channel: the channel,
+// the samples, when the first was taken (hal_time_us clock) and the time
+// between samples, so it mustn't block. Ending the scan waits for samples up
+// to the given time to be passed.
+typedef void (*scan_listener_t)(int, const uint16_t*, size_t, int64_t, float);
+extern esp_err_t begin_scan(scan_listener_t);
+extern esp_err_t end_scan(int64_t);
 #endif
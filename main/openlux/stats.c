@@ -0,0 +1,105 @@
+#include "stats.h"
+#include <math.h>
+
+// How far along the data each P-squared marker's desired position moves per
+// value: the minimum, the quartile either side of the median, and the maximum
+static const float STEP[5] = { 0.0f, 0.25f, 0.5f, 0.75f, 1.0f };
+
+void stats_reset(running_stats_t* s) {
+  s->n = 0;
+  s->mean = 0;
+  s->m2 = 0;
+}
+
+// Piecewise parabolic prediction of marker i's height moved d places
+static float parabolic(const running_stats_t* s, int i, int d) {
+  float a = (float) d / (s->pos[i + 1] - s->pos[i - 1]);
+  float b = (s->pos[i] - s->pos[i - 1] + d) * (s->q[i + 1] - s->q[i]) /
+            (s->pos[i + 1] - s->pos[i]);
+  float c = (s->pos[i + 1] - s->pos[i] - d) * (s->q[i] - s->q[i - 1]) /
+            (s->pos[i] - s->pos[i - 1]);
+  return s->q[i] + a * (b + c);
+}
+
+static float linear(const running_stats_t* s, int i, int d) {
+  return s->q[i] + d * (s->q[i + d] - s->q[i]) / (s->pos[i + d] - s->pos[i]);
+}
+
+static void p2_add(running_stats_t* s, float x) {
+  // The first five values are kept sorted as the initial markers
+  if (s->n <= 5) {
+    int i = s->n - 1;
+    for (; i > 0 && s->q[i - 1] > x; i--) {
+      s->q[i] = s->q[i - 1];
+    }
+    s->q[i] = x;
+    if (s->n == 5) {
+      for (i = 0; i < 5; i++) {
+        s->pos[i] = i;
+        s->want[i] = 4 * STEP[i];
+      }
+    }
+    return;
+  }
+  // Find the cell the value falls in, stretching the ends if need be
+  int k;
+  if (x < s->q[0]) {
+    s->q[0] = x;
+    k = 0;
+  } else if (x >= s->q[4]) {
+    s->q[4] = x;
+    k = 3;
+  } else {
+    for (k = 0; x >= s->q[k + 1]; k++) {
+    }
+  }
+  for (int i = k + 1; i < 5; i++) {
+    s->pos[i]++;
+  }
+  for (int i = 0; i < 5; i++) {
+    s->want[i] += STEP[i];
+  }
+  // Nudge the middle markers towards where they should be
+  for (int i = 1; i < 4; i++) {
+    float off = s->want[i] - s->pos[i];
+    if ((off >= 1 && s->pos[i + 1] - s->pos[i] > 1) ||
+        (off <= -1 && s->pos[i - 1] - s->pos[i] < -1)) {
+      int d = (off > 0) ? 1 : -1;
+      float q = parabolic(s, i, d);
+      if (s->q[i - 1] < q && q < s->q[i + 1]) {
+        s->q[i] = q;
+      } else {
+        s->q[i] = linear(s, i, d);
+      }
+      s->pos[i] += d;
+    }
+  }
+}
+
+void stats_add(running_stats_t* s, float x) {
+  s->n++;
+  float delta = x - s->mean;
+  s->mean += delta / s->n;
+  s->m2 += delta * (x - s->mean);
+  p2_add(s, x);
+}
+
+float stats_mean(const running_stats_t* s) {
+  return s->mean;
+}
+
+// Sample standard deviation, 0 for fewer than two values
+float stats_sd(const running_stats_t* s) {
+  return (s->n > 1) ? sqrtf(s->m2 / (s->n - 1)) : 0.0f;
+}
+
+float stats_median(const running_stats_t* s) {
+  if (s->n == 0) {
+    return 0.0f;
+  }
+  if (s->n < 5) {
+    // Still exact: the values are sorted in q
+    return (s->n % 2) ? s->q[s->n / 2] : (s->q[s->n / 2 - 1] + s->q[s->n / 2]) / 2;
+  }
+  return s->q[2];
+}
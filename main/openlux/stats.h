@@ -0,0 +1,24 @@
+#include <stdint.h>
+
+#ifndef STATS_H
+#define STATS_H
+// Running statistics over a stream of values, updated one value at a time
+// without keeping any of them. The mean and variance use Welford's method and
+// the median is the P-squared estimate, which tracks five markers and is
+// exact for up to five values.
+typedef struct running_stats {
+  uint32_t n;
+  float mean;
+  float m2;       // Sum of squared differences from the mean
+  // P-squared markers: heights, actual and desired positions
+  float q[5];
+  int pos[5];
+  float want[5];
+} running_stats_t;
+
+extern void stats_reset(running_stats_t*);
+extern void stats_add(running_stats_t*, float);
+extern float stats_mean(const running_stats_t*);
+extern float stats_sd(const running_stats_t*);
+extern float stats_median(const running_stats_t*);
+#endif
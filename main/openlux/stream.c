@@ -0,0 +1,226 @@
+#include "stream.h"
+#include "common.h"
+#include "samples.h"
+#include "job.h"
+#include "batch.h"
+#include "calib.h"
+#include "plate.h"
+#include "sensors.h"
+#include "web.h"
+
+// The HTTP server runs every handler on one task, so a request that never
+// finishes would lock everyone else out. Instead, /events answers with the
+// Server-Sent Events headers written straight to the socket and returns,
+// leaving the session open. Once per frame the STREAM task gathers new
+// readings and status changes into one event block and queues it onto the
+// server task, which writes it to every subscribed socket.
+
+// How often batched events are pushed to clients
+static const int FRAME_PERIOD_MS = 100;
+// Send a comment after this long without events, so dead peers are noticed
+static const int KEEPALIVE_MS = 10000;
+// Largest event block pushed in one frame; anything left waits for the next
+#define FRAME_SIZE 2048
+// A raster row sends a well event per well and channel in one burst, then
+// cycle and done, all of which have to fit
+#define JOB_QUEUE_SIZE (PLATE_COLS * SENSOR_CHANNELS + 2)
+// How long the end of a cycle or run waits for room, rather than be dropped
+static const int JOB_END_WAIT_MS = 1000;
+// Maximum number of browsers subscribed at once
+#define MAX_CLIENTS 4
+
+typedef struct status_event {
+  uint32_t sync;         // Last batch operation done
+  status_t status;
+} status_event_t;
+
+typedef struct frame {
+  httpd_handle_t server;
+  size_t len;
+  char data[FRAME_SIZE];
+} frame_t;
+
+// Subscribed sockets. Only ever touched from the server task.
+static int CLIENTS[MAX_CLIENTS] = { -1, -1, -1, -1 };
+// How many of the above are in use, read by the STREAM task to skip sending
+static volatile int N_CLIENTS = 0;
+// Status changes and plate run progress waiting to be pushed
+static QueueHandle_t STATUS_EVENTS = NULL;
+static QueueHandle_t JOB_EVENTS = NULL;
+static QueueHandle_t OP_EVENTS = NULL;
+// Names for job_event_kind_t, as they appear on the wire
+static const char* JOB_KINDS[] = { "start", "well", "cycle", "done", "stopped" };
+
+static const char HEADERS[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Content-Type: text/event-stream\r\n"
+  "Cache-Control: no-cache\r\n"
+  "Access-Control-Allow-Origin: *\r\n\r\n";
+
+// Runs on whichever task changed the status, so it must not block
+static void on_status(status_t status) {
+  status_event_t ev = { batch_last_done(), status };
+  xQueueSend(STATUS_EVENTS, &ev, 0);
+}
+
+// Runs on the job task. Should the queue fill up, a well event is dropped
+// and GET /run still says where the run is up to, but the end of a cycle or
+// run waits its turn, since clients go by it.
+static void on_job(const job_event_t* ev) {
+  bool end = ev->kind == JOB_CYCLE || ev->kind == JOB_FINISHED || ev->kind == JOB_STOPPED;
+  xQueueSend(JOB_EVENTS, ev, end ? JOB_END_WAIT_MS / portTICK_PERIOD_MS : 0);
+}
+
+// Runs on the batch task, or the server task for cancelled operations. The
+// sync field of status events still says how far the batches have got if
+// this fills up.
+static void on_op(const batch_event_t* ev) {
+  xQueueSend(OP_EVENTS, ev, 0);
+}
+
+static void drop_client(int idx) {
+  ESP_LOGI(TAG, "Event stream client %d disconnected", CLIENTS[idx]);
+  CLIENTS[idx] = -1;
+  N_CLIENTS--;
+}
+
+// Runs on the server task: write one frame to every subscriber
+static void send_frame(void* arg) {
+  frame_t* frame = (frame_t*) arg;
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if (CLIENTS[i] < 0) {
+      continue;
+    }
+    int sent = httpd_socket_send(frame->server, CLIENTS[i], frame->data, frame->len, 0);
+    if (sent != (int) frame->len) {
+      httpd_sess_trigger_close(frame->server, CLIENTS[i]);
+      drop_client(i);
+    }
+  }
+  free(frame);
+}
+
+esp_err_t stream_get(httpd_req_t* req) {
+  int fd = httpd_req_to_sockfd(req);
+  int slot = -1;
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if (CLIENTS[i] < 0) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot < 0) {
+    ESP_LOGW(TAG, "Too many event stream clients");
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+  }
+  // Start with where things currently stand, so the page doesn't wait a frame
+  char hello[64];
+  int len = sprintf(hello, "event: status\ndata: %u;%d\n\n", batch_last_done(), get_status());
+  if (httpd_socket_send(req->handle, fd, HEADERS, sizeof(HEADERS) - 1, 0) < 0 ||
+      httpd_socket_send(req->handle, fd, hello, len, 0) < 0) {
+    return ESP_FAIL;
+  }
+  CLIENTS[slot] = fd;
+  N_CLIENTS++;
+  ESP_LOGI(TAG, "Event stream client %d connected", fd);
+  return ESP_OK;
+}
+
+void stream_session_closed(httpd_handle_t server, int fd) {
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if (CLIENTS[i] == fd) {
+      drop_client(i);
+    }
+  }
+}
+
+// Append as much as fits of everything that happened since the last frame
+static size_t build_frame(char* buf, sample_cursor_t* cur) {
+  size_t len = 0;
+  status_event_t ev;
+  while (len < FRAME_SIZE - 64 && xQueueReceive(STATUS_EVENTS, &ev, 0)) {
+    len += sprintf(buf + len, "event: status\ndata: %u;%d\n\n", ev.sync, ev.status);
+  }
+  // Job events are "kind;cycle;well;value", and measured wells add
+  // ";dark;signal;signal_se;light_sd;light_median;od;channel"
+  job_event_t job;
+  while (len < FRAME_SIZE - 160 && xQueueReceive(JOB_EVENTS, &job, 0)) {
+    len += sprintf(buf + len, "event: job\ndata: %s;%d;%d;%d", JOB_KINDS[job.kind],
+                   job.cycle, job.well, job.value);
+    if (job.kind == JOB_WELL && job.value >= 0) {
+      len += sprintf(buf + len, ";%.1f;%.1f;%.2f;%.1f;%.1f", job.m.dark_mean,
+                     job.m.signal, job.m.signal_se, job.m.light_sd, job.m.light_median);
+      len += format_od(buf + len, ';', job.m.od);
+      len += sprintf(buf + len, ";%u", job.m.channel);
+    }
+    len += sprintf(buf + len, "\n\n");
+  }
+  // Batch operations are "id;code;ok", and measurements add
+  // ";light;dark;signal;signal_se;od;channel"
+  batch_event_t op;
+  while (len < FRAME_SIZE - 128 && xQueueReceive(OP_EVENTS, &op, 0)) {
+    len += sprintf(buf + len, "event: op\ndata: %u;%d;%d", op.id, op.code, op.ok);
+    if (op.code == OP_MEASURE && op.ok) {
+      len += sprintf(buf + len, ";%.1f;%.1f;%.1f;%.2f", op.m.light_mean, op.m.dark_mean,
+                     op.m.signal, op.m.signal_se);
+      len += format_od(buf + len, ';', op.m.od);
+      len += sprintf(buf + len, ";%u", op.m.channel);
+    }
+    len += sprintf(buf + len, "\n\n");
+  }
+  // Readings go out as one multi-line event per frame, each line
+  // "seq;time_us;raw;well;led;od;channel" as for /samples
+  sample_t s;
+  bool any = false;
+  while (len < FRAME_SIZE - 80 && sample_ring_read(cur, &s, 1)) {
+    if (!any) {
+      len += sprintf(buf + len, "event: readings\n");
+      any = true;
+    }
+    len += sprintf(buf + len, "data: %u;%lld;%u;%d;%u", s.seq,
+                   (long long) s.time_us, s.raw, s.well, s.led);
+    len += format_od(buf + len, ';', s.od);
+    len += sprintf(buf + len, ";%u\n", s.channel);
+  }
+  if (any) {
+    buf[len++] = '\n';
+  }
+  return len;
+}
+
+static void stream_loop(void* arg) {
+  httpd_handle_t server = (httpd_handle_t) arg;
+  sample_cursor_t cur;
+  sample_cursor_init(&cur);
+  TickType_t last_wake = xTaskGetTickCount();
+  TickType_t last_sent = last_wake;
+  while (true) {
+    vTaskDelayUntil(&last_wake, FRAME_PERIOD_MS / portTICK_PERIOD_MS);
+    frame_t* frame = malloc(sizeof(frame_t));
+    if (!frame) {
+      continue;
+    }
+    frame->server = server;
+    frame->len = build_frame(frame->data, &cur);
+    if (!frame->len && (last_wake - last_sent) * portTICK_PERIOD_MS >= KEEPALIVE_MS) {
+      frame->len = sprintf(frame->data, ": keepalive\n\n");
+    }
+    if (!frame->len || !N_CLIENTS ||
+        httpd_queue_work(server, send_frame, frame) != ESP_OK) {
+      free(frame);
+      continue;
+    }
+    last_sent = last_wake;
+  }
+}
+
+void start_event_stream(httpd_handle_t server) {
+  STATUS_EVENTS = xQueueCreate(16, sizeof(status_event_t));
+  JOB_EVENTS = xQueueCreate(JOB_QUEUE_SIZE, sizeof(job_event_t));
+  OP_EVENTS = xQueueCreate(32, sizeof(batch_event_t));
+  set_status_listener(on_status);
+  set_job_listener(on_job);
+  set_batch_listener(on_op);
+  xTaskCreate(stream_loop, "EVENT_STREAM", 4096, server, 2, NULL);
+}
@@ -0,0 +1,13 @@
+#include <esp_http_server.h>
+
+#ifndef STREAM_H
+#define STREAM_H
+// Server-Sent Events push of readings, status changes, plate run progress and
+// batch operations as they are done
+// System initialisation:
+extern void start_event_stream(httpd_handle_t);
+// URI handler for /events:
+extern esp_err_t stream_get(httpd_req_t*);
+// Must be called whenever the server closes a session:
+extern void stream_session_closed(httpd_handle_t, int);
+#endif
@@ -0,0 +1,184 @@
+#include "trace.h"
+#include "common.h"
+#include "calib.h"
+#include "motors.h"
+#include "plate.h"
+#include "sensors.h"
+#include "web.h"
+#include <esp_timer.h>
+#include <math.h>
+#include <string.h>
+
+// Bytes of trace held between GETs: a 96 well plate run comes to about 10k,
+// and readings at the default rate to 80 bytes a second. The calibration at
+// the start takes 600 bytes a channel of a 96 well plate, and over half of
+// the ring for 384 wells on four channels.
+#define TRACE_SIZE 16384
+// Longest request body kept; nothing the firmware takes comes close
+#define TRACE_MAX_BODY 2048
+
+_Static_assert(sizeof(trace_record_t) == 16, "Trace records are 16 bytes");
+_Static_assert(sizeof(trace_header_t) == 16, "Trace header is 16 bytes");
+_Static_assert(sizeof(calib_well_t) * SENSOR_CHANNELS * PLATE_WELLS + 64 < TRACE_SIZE,
+               "The calibration fits in the ring");
+
+static uint8_t RING[TRACE_SIZE];
+// Bytes ever written and read, which only ever grow, so HEAD - TAIL is held
+static size_t HEAD = 0;
+static size_t TAIL = 0;
+// Records not kept since the last one that was
+static uint32_t DROPPED = 0;
+// When the last record was written
+static int64_t LAST_US = 0;
+static volatile bool TRACING = false;
+static portMUX_TYPE LOCK = portMUX_INITIALIZER_UNLOCKED;
+
+// Called with the lock held and the room checked
+static void put(const void* data, size_t len) {
+  size_t at = HEAD % TRACE_SIZE;
+  size_t first = (len < TRACE_SIZE - at) ? len : TRACE_SIZE - at;
+  memcpy(RING + at, data, first);
+  memcpy(RING, (const uint8_t*) data + first, len - first);
+  HEAD += len;
+}
+
+static void record(trace_kind_t kind, int arg, int32_t a, int32_t b, const void* extra,
+                   size_t len) {
+  if (!TRACING) {
+    return;
+  }
+  trace_record_t rec = { 0, kind, arg, len, a, b };
+  portENTER_CRITICAL(&LOCK);
+  // Tracing may have been restarted while this waited
+  if (!TRACING) {
+    portEXIT_CRITICAL(&LOCK);
+    return;
+  }
+  // Timed inside the lock, so records are in time order whoever writes them
+  int64_t now = esp_timer_get_time();
+  size_t need = sizeof(rec) + len + (DROPPED ? sizeof(rec) : 0);
+  if (need > TRACE_SIZE - (HEAD - TAIL)) {
+    DROPPED++;
+  } else {
+    if (DROPPED) {
+      trace_record_t gap = { now - LAST_US, TRACE_GAP, 0, 0, DROPPED, 0 };
+      put(&gap, sizeof(gap));
+      LAST_US = now;
+      DROPPED = 0;
+    }
+    rec.dt_us = now - LAST_US;
+    LAST_US = now;
+    put(&rec, sizeof(rec));
+    if (len) {
+      put(extra, len);
+    }
+  }
+  portEXIT_CRITICAL(&LOCK);
+}
+
+void trace_reading(int channel, int well, uint8_t leds, uint16_t raw) {
+  record(TRACE_READING, channel, well, raw | leds << 16, NULL, 0);
+}
+
+void trace_move(int r_steps, int c_steps) {
+  record(TRACE_MOVE, 0, r_steps, c_steps, NULL, 0);
+}
+
+void trace_status(int status, int begun) {
+  record(TRACE_STATUS, status, begun, 0, NULL, 0);
+}
+
+void trace_well(int channel, int well, float signal) {
+  record(TRACE_WELL, channel, well, lroundf(signal * 100), NULL, 0);
+}
+
+void trace_request(int method, const char* uri) {
+  record(TRACE_REQUEST, method, 0, 0, uri, strlen(uri));
+}
+
+void trace_body(const void* body, size_t len) {
+  record(TRACE_BODY, 0, 0, 0, body, (len < TRACE_MAX_BODY) ? len : TRACE_MAX_BODY);
+}
+
+// Throws away whatever hadn't been read and starts a new trace. The ring is
+// emptied and nothing recorded while the start of the trace, which is mostly
+// the calibration, is copied straight into it.
+void trace_start(void) {
+  trace_header_t header = {
+    .magic = TRACE_MAGIC,
+    .version = TRACE_VERSION,
+    .wells = PLATE_WELLS,
+    .channels = SENSOR_CHANNELS,
+  };
+  int r_pos = -1;
+  int c_pos = -1;
+  park_position(&r_pos, &c_pos);
+  portENTER_CRITICAL(&LOCK);
+  TRACING = false;
+  HEAD = TAIL = 0;
+  DROPPED = 0;
+  portEXIT_CRITICAL(&LOCK);
+
+  size_t at = sizeof(header) + sizeof(trace_record_t);
+  size_t calib_len = calib_snapshot(RING + at, TRACE_SIZE - at);
+  trace_record_t start = { 0, TRACE_START, 0, calib_len, r_pos, c_pos };
+  memcpy(RING, &header, sizeof(header));
+  memcpy(RING + sizeof(header), &start, sizeof(start));
+
+  portENTER_CRITICAL(&LOCK);
+  HEAD = at + calib_len;
+  LAST_US = esp_timer_get_time();
+  TRACING = true;
+  portEXIT_CRITICAL(&LOCK);
+}
+
+void trace_stop(void) {
+  TRACING = false;
+}
+
+// Take up to max bytes off the ring, stopping at end
+static size_t drain(uint8_t* buf, size_t max, size_t end) {
+  portENTER_CRITICAL(&LOCK);
+  // Never past HEAD, which is held back while trace_start fills the ring
+  size_t n = (end < HEAD) ? end : HEAD;
+  n = (n > TAIL) ? n - TAIL : 0;
+  n = (n < max) ? n : max;
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = RING[(TAIL + i) % TRACE_SIZE];
+  }
+  TAIL += n;
+  portEXIT_CRITICAL(&LOCK);
+  return n;
+}
+
+size_t trace_read(void* buf, size_t max) {
+  return drain(buf, max, HEAD);
+}
+
+// Sends everything recorded since the last GET. Anything recorded while this
+// is being sent waits for the next one.
+esp_err_t trace_get(httpd_req_t* req) {
+  // Handlers only ever run on the server task, so this can live off the stack
+  static uint8_t buf[1024];
+  size_t end = HEAD;
+  size_t n;
+  httpd_resp_set_type(req, "application/octet-stream");
+  while ((n = drain(buf, sizeof(buf), end)) > 0) {
+    // What was taken off the ring goes with the client
+    if (!sent(req, httpd_resp_send_chunk(req, (const char*) buf, n))) {
+      return ESP_FAIL;
+    }
+  }
+  return sent(req, httpd_resp_send_chunk(req, "", 0)) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t trace_post(httpd_req_t* req) {
+  trace_start();
+  return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+}
+
+// What was recorded can still be fetched
+esp_err_t trace_delete(httpd_req_t* req) {
+  trace_stop();
+  return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+}
@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <esp_http_server.h>
+
+#ifndef TRACE_H
+#define TRACE_H
+// A compact binary trace of what the firmware was asked to do and what it did
+// (readings, moves, status changes, measured wells and HTTP requests), for
+// replaying on the simulator (see bench/openlux_replay.c). Tracing is off
+// until POST /trace starts it afresh, and DELETE /trace stops it. Records go
+// into a ring in static memory that GET /trace drains, so a client fetching
+// it every few seconds can keep a trace going for as long as it likes.
+// Should the ring fill up, records are dropped and a TRACE_GAP says how many.
+//
+// A trace is a trace_header_t, then records, each a trace_record_t followed
+// by len bytes. Successive GETs concatenated make one trace. The first record
+// is a TRACE_START with the state the device started from, so a replay can
+// start from it too.
+#define TRACE_MAGIC 0x54584C4F // "OLXT"
+#define TRACE_VERSION 2
+
+typedef struct trace_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t wells;        // Plate format the firmware was built for
+  uint8_t channels;      // See sensors.h
+  uint8_t reserved[7];
+} trace_header_t;
+
+typedef enum trace_kind {
+  TRACE_READING = 1,     // arg: channel, a: well (-1 if none), b: raw | leds << 16
+  TRACE_MOVE,            // a: row steps, b: column steps, as the move starts
+  TRACE_STATUS,          // arg: status, a: 1 begun or 0 ended
+  TRACE_WELL,            // arg: channel, a: well, b: signal in hundredths
+  TRACE_REQUEST,         // arg: method, followed by the URI
+  TRACE_BODY,            // Followed by the body of the request before
+  TRACE_GAP,             // a: records dropped here for want of room
+  TRACE_START            // a: row steps, b: column steps from the end stops
+                         // with the carriage at rest (-1 if it wasn't),
+                         // followed by the calibration (calib_snapshot)
+} trace_kind_t;
+
+typedef struct trace_record {
+  uint32_t dt_us;        // Since the record before, or tracing started
+  uint8_t kind;
+  uint8_t arg;
+  uint16_t len;          // Bytes following the record
+  int32_t a;
+  int32_t b;
+} trace_record_t;
+
+// Starting afresh, stopping and taking up to max bytes of trace off the ring,
+// as the URI handlers do:
+extern void trace_start(void);
+extern void trace_stop(void);
+extern size_t trace_read(void*, size_t);
+// Recording, from any task. Each does nothing unless tracing is on.
+extern void trace_reading(int, int, uint8_t, uint16_t);
+extern void trace_move(int, int);
+extern void trace_status(int, int);
+extern void trace_well(int, int, float);
+extern void trace_request(int, const char*);
+extern void trace_body(const void*, size_t);
+// URI handlers for /trace:
+extern esp_err_t trace_get(httpd_req_t*);
+extern esp_err_t trace_post(httpd_req_t*);
+extern esp_err_t trace_delete(httpd_req_t*);
+#endif
@@ -1,21 +1,54 @@
 #include "sensors.h"
 #include "motors.h"
 #include "common.h"
+#include "samples.h"
+#include "stream.h"
+#include "job.h"
+#include "batch.h"
+#include "results.h"
+#include "assets.h"
+#include "metrics.h"
+#include "calib.h"
+#include "trace.h"
+#include <esp_timer.h>
 #include "web.h"
+#include <unistd.h>
 
-// This determines the size of the HTTP chunks the ESP is sending
-// This can be tweaked for better large-file performance
-static const long CHUNK_SIZE = 24576; // 24KiB
+// This determines the size of the HTTP chunks the ESP sends for files that
+// aren't cached in RAM. Handlers all run on the server task, so one static
+// buffer of this size does for every request.
+#define CHUNK_SIZE 4096
+// Browsers keep every file but check its ETag each time they use it, so new
+// firmware shows up straight away and anything unchanged costs only a 304.
+// Page and script must come from the same firmware, so neither is used
+// unchecked.
+static const char* CACHE_CONTROL = "no-cache";
+// Most wells a /route request can ask about, one per well of a 384 well plate
+#define ROUTE_MAX_WELLS 384
 
 // Declare some static functions we'll be defining later.
 // URI handlers:
 static esp_err_t status_get(httpd_req_t*);
-static esp_err_t command_post(httpd_req_t*);
+static esp_err_t state_get(httpd_req_t*);
+static esp_err_t plate_get(httpd_req_t*);
+static esp_err_t samples_get(httpd_req_t*);
+static esp_err_t batch_post(httpd_req_t*);
+static esp_err_t batch_delete(httpd_req_t*);
+static esp_err_t route_post(httpd_req_t*);
+static esp_err_t run_post(httpd_req_t*);
+static esp_err_t run_get(httpd_req_t*);
+static esp_err_t run_delete(httpd_req_t*);
+static esp_err_t results_get(httpd_req_t*);
+static esp_err_t calibration_get(httpd_req_t*);
+static esp_err_t calibration_delete(httpd_req_t*);
 static esp_err_t static_get(httpd_req_t*);
+static esp_err_t queue_batch(httpd_req_t*);
+static esp_err_t serve_static(httpd_req_t*);
+// Session callbacks:
+static void session_closed(httpd_handle_t, int);
 // Helper functions:
-static char* file_to_mime(char[]);
-static void uri_to_path(char*, const char*);
-static void send_file_as_chunks(httpd_req_t*, char[]);
+static esp_err_t send_file_as_chunks(httpd_req_t*, const asset_t*);
+static size_t read_chunk(char*, FILE*);
 
 // Set up some valid URIs
 httpd_uri_t status_get_uri = {
@@ -25,10 +58,122 @@ httpd_uri_t status_get_uri = {
   .user_ctx = NULL  // No extra data needed
 };
 
-httpd_uri_t command_post_uri = {
-  .uri      = "/command",
+httpd_uri_t state_get_uri = {
+  .uri      = "/state", // How often each status has been entered
+  .method   = HTTP_GET,
+  .handler  = state_get,
+  .user_ctx = NULL
+};
+
+httpd_uri_t plate_get_uri = {
+  .uri      = "/plate", // The plate format the device was built for
+  .method   = HTTP_GET,
+  .handler  = plate_get,
+  .user_ctx = NULL
+};
+
+httpd_uri_t samples_get_uri = {
+  .uri      = "/samples", // Every reading since a given point lives here
+  .method   = HTTP_GET,
+  .handler  = samples_get,
+  .user_ctx = NULL
+};
+
+httpd_uri_t events_get_uri = {
+  .uri      = "/events", // Readings and status changes are pushed from here
+  .method   = HTTP_GET,
+  .handler  = stream_get,
+  .user_ctx = NULL
+};
+
+httpd_uri_t metrics_get_uri = {
+  .uri      = "/metrics", // Timings and task statistics, for Prometheus
+  .method   = HTTP_GET,
+  .handler  = metrics_get,
+  .user_ctx = NULL
+};
+
+httpd_uri_t batch_post_uri = {
+  .uri      = "/batch", // Queues a batch of moves, LED changes and measurements
+  .method   = HTTP_POST,
+  .handler  = batch_post,
+  .user_ctx = NULL
+};
+
+httpd_uri_t batch_delete_uri = {
+  .uri      = "/batch", // Drops batch operations that haven't started
+  .method   = HTTP_DELETE,
+  .handler  = batch_delete,
+  .user_ctx = NULL
+};
+
+httpd_uri_t route_post_uri = {
+  .uri      = "/route", // Orders a set of wells for the quickest read
+  .method   = HTTP_POST,
+  .handler  = route_post,
+  .user_ctx = NULL
+};
+
+httpd_uri_t run_post_uri = {
+  .uri      = "/run", // Starts a plate run
   .method   = HTTP_POST,
-  .handler  = command_post,
+  .handler  = run_post,
+  .user_ctx = NULL
+};
+
+httpd_uri_t run_get_uri = {
+  .uri      = "/run", // Where the current plate run is up to
+  .method   = HTTP_GET,
+  .handler  = run_get,
+  .user_ctx = NULL
+};
+
+httpd_uri_t run_delete_uri = {
+  .uri      = "/run", // Cancels the current plate run
+  .method   = HTTP_DELETE,
+  .handler  = run_delete,
+  .user_ctx = NULL
+};
+
+httpd_uri_t results_get_uri = {
+  .uri      = "/results", // Every measurement logged to flash
+  .method   = HTTP_GET,
+  .handler  = results_get,
+  .user_ctx = NULL
+};
+
+httpd_uri_t calibration_get_uri = {
+  .uri      = "/calibration", // Each well's blank and slope
+  .method   = HTTP_GET,
+  .handler  = calibration_get,
+  .user_ctx = NULL
+};
+
+httpd_uri_t calibration_delete_uri = {
+  .uri      = "/calibration", // Goes back to the nominal response
+  .method   = HTTP_DELETE,
+  .handler  = calibration_delete,
+  .user_ctx = NULL
+};
+
+httpd_uri_t trace_get_uri = {
+  .uri      = "/trace", // The trace recorded since the last GET, see trace.h
+  .method   = HTTP_GET,
+  .handler  = trace_get,
+  .user_ctx = NULL
+};
+
+httpd_uri_t trace_post_uri = {
+  .uri      = "/trace", // Starts a new trace
+  .method   = HTTP_POST,
+  .handler  = trace_post,
+  .user_ctx = NULL
+};
+
+httpd_uri_t trace_delete_uri = {
+  .uri      = "/trace", // Stops tracing
+  .method   = HTTP_DELETE,
+  .handler  = trace_delete,
   .user_ctx = NULL
 };
 
@@ -40,55 +185,485 @@ httpd_uri_t static_get_uri = {
   .user_ctx = NULL // We aren't sending any extra data to static_get
 };
 
+// Every request but those for the trace itself is traced on its way in, so it
+// can be replayed. The handlers are registered through here, each with its
+// httpd_uri_t as user_ctx.
+static esp_err_t traced(httpd_req_t* req) {
+  const httpd_uri_t* uri = (const httpd_uri_t*) req->user_ctx;
+  trace_request(req->method, req->uri);
+  req->user_ctx = uri->user_ctx;
+  return uri->handler(req);
+}
+
+static void register_traced(httpd_handle_t server, const httpd_uri_t* uri) {
+  httpd_uri_t wrapped = *uri;
+  wrapped.handler = traced;
+  wrapped.user_ctx = (void*) uri;
+  httpd_register_uri_handler(server, &wrapped);
+}
+
+// Sending fails when a client goes away or stops reading part way through a
+// response, which is the client's problem and nobody else's: the handler
+// gives up and returns ESP_FAIL, so the server closes just that session.
+bool sent(httpd_req_t* req, esp_err_t err) {
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Client %d went away during %s (%s)", httpd_req_to_sockfd(req), req->uri,
+             esp_err_to_name(err));
+    metric_dropped_response();
+  }
+  return err == ESP_OK;
+}
+
 // This handler is very simple. When it receives a request, it sends back the
 // latest available sensor reading and device status. It takes a pointer to the
 // request (so that it can respond to it) and returns ESP_OK if all goes well.
 static esp_err_t status_get(httpd_req_t* req) {
-  // 10 (32 bit sync key) + 4 (sensor) + 1 (;) + 1 (status) + 1 (null)
-  char msg[17];
-  sprintf(msg, "%d;%d;%d", SYNC_KEY, get_status(), get_sensor_value());
+  int64_t start = esp_timer_get_time();
+  // 10 (last batch operation) + 1 (;) + 1 (status) + 1 (;) + 4 (sensor) + 1 (null)
+  char msg[18];
+  sprintf(msg, "%u;%d;%d", batch_last_done(), get_status(), get_sensor_value());
   // Our text isn't HTML, so just set the response type to text/plain
-  die_politely(httpd_resp_set_type(req, "text/plain"), "Failed to set response type");
+  httpd_resp_set_type(req, "text/plain");
   // Send the value back in an HTTP response, handling failure
-  die_politely(httpd_resp_send(req, msg, strlen(msg)), "Failed to send HTTP response");
+  if (!sent(req, httpd_resp_send(req, msg, strlen(msg)))) {
+    return ESP_FAIL;
+  }
+  metric_since(METRIC_HTTP_STATUS, start);
   // Return ESP_OK so the connection isn't killed
   return ESP_OK;
 }
 
-static esp_err_t command_post(httpd_req_t* req) {
-  SYNC_KEY++;
-  char data[req->content_len + 1];
-  httpd_req_recv(req, data, req->content_len);
-  //data[sizeof(data) - 1] = '\0';
-  if (SYNC_KEY == atoi(strtok(data, ";"))) {
-    char *coord = strtok(NULL, ";");
-    int led = atoi(strtok(NULL, ";"));
-    int row = atoi(strtok(coord, ","));
-    int col  = atoi(strtok(NULL, ","));
-    goto_coord(row,col);
-    set_led(led);
-    httpd_resp_send(req, "", 0);
-    ESP_LOGI(TAG, "New sync key is: %d, and the status is: %d", SYNC_KEY, get_status());
-  } else {
-    httpd_resp_send_500(req);
+// Reports "status;refused" followed by one "status;entered;last_us" line for
+// each status, with the number of times it has been entered and when it last
+// was (microseconds since boot). Refused counts illegal state transitions.
+static esp_err_t state_get(httpd_req_t* req) {
+  status_stats_t stats;
+  char msg[192];
+  get_status_stats(&stats);
+  int len = sprintf(msg, "%d;%u\n", get_status(), stats.refused);
+  for (int i = 0; i <= READING; i++) {
+    len += sprintf(msg + len, "%d;%u;%lld\n", i, stats.entered[i],
+                   (long long) stats.last_us[i]);
   }
-  return ESP_OK;
+  httpd_resp_set_type(req, "text/plain");
+  return sent(req, httpd_resp_send(req, msg, len)) ? ESP_OK : ESP_FAIL;
+}
+
+// Reports "format;rows;columns", so the page lays out the right plate
+static esp_err_t plate_get(httpd_req_t* req) {
+  char msg[16];
+  sprintf(msg, "%s;%d;%d", PLATE_NAME, PLATE_ROWS, PLATE_COLS);
+  httpd_resp_set_type(req, "text/plain");
+  return sent(req, httpd_resp_send(req, msg, strlen(msg))) ? ESP_OK : ESP_FAIL;
+}
+
+// This handler lets a client catch up on every reading it hasn't seen yet,
+// rather than sampling whatever the latest value is. The client passes the
+// sequence number it wants to start from as ?since=N (0 for everything still
+// buffered). The first line of the response is "next;dropped", the value of
+// since to use next time and how many readings were lost to overwriting,
+// followed by one "seq;time_us;raw;well;led;od;channel" line per reading,
+// where led has bit n set for each channel lit, od is the calibrated optical
+// density, or empty with the channel's LED off or between wells, and channel
+// is whose photodiode was read.
+static esp_err_t samples_get(httpd_req_t* req) {
+  // Handlers only ever run on the server task, so this can live off the stack
+  static sample_t batch[SAMPLE_RING_SIZE];
+  sample_cursor_t cur = { 0, 0 };
+  char query[32];
+  char since[12];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+      httpd_query_key_value(query, "since", since, sizeof(since)) == ESP_OK) {
+    cur.next = strtoul(since, NULL, 10);
+  }
+  size_t n = sample_ring_read(&cur, batch, SAMPLE_RING_SIZE);
+  httpd_resp_set_type(req, "text/plain");
+  // Lines are gathered into a buffer and sent a chunk at a time
+  char buf[1024];
+  int len = sprintf(buf, "%u;%u\n", cur.next, cur.dropped);
+  for (size_t i = 0; i < n; i++) {
+    if (len > sizeof(buf) - 64) {
+      if (!sent(req, httpd_resp_send_chunk(req, buf, len))) {
+        return ESP_FAIL;
+      }
+      len = 0;
+    }
+    len += sprintf(buf + len, "%u;%lld;%u;%d;%u", batch[i].seq,
+                   (long long) batch[i].time_us, batch[i].raw, batch[i].well,
+                   batch[i].led);
+    len += format_od(buf + len, ';', batch[i].od);
+    len += sprintf(buf + len, ";%u\n", batch[i].channel);
+  }
+  if (!sent(req, httpd_resp_send_chunk(req, buf, len))) {
+    return ESP_FAIL;
+  }
+  return sent(req, httpd_resp_send_chunk(req, "", 0)) ? ESP_OK : ESP_FAIL;
+}
+
+// This handler queues a batch of operations, as described in batch.h. The
+// reply gives each operation's ID, and progress is pushed on /events. A batch
+// that is malformed or asks for something impossible gets a 400, and 409
+// during a plate run or 503 if the queue hasn't room for it, in which case
+// none of it is queued.
+static esp_err_t batch_post(httpd_req_t* req) {
+  int64_t start = esp_timer_get_time();
+  esp_err_t err = queue_batch(req);
+  metric_since(METRIC_HTTP_BATCH, start);
+  return err;
 }
 
-// This is the catch-all handler for static web pages. This function takes a
-// pointer to a request and returns ESP_OK if all goes well.
+static esp_err_t queue_batch(httpd_req_t* req) {
+  // Handlers only ever run on the server task, so these can live off the stack
+  static uint8_t data[sizeof(batch_header_t) + BATCH_MAX_OPS * sizeof(batch_op_t)];
+  static batch_op_t ops[BATCH_MAX_OPS];
+  size_t len = 0;
+  if (req->content_len > sizeof(data)) {
+    httpd_resp_set_status(req, "413 Payload Too Large");
+    return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+  }
+  while (len < req->content_len) {
+    int got = httpd_req_recv(req, (char*) data + len, req->content_len - len);
+    if (got <= 0) {
+      return ESP_FAIL;
+    }
+    len += got;
+  }
+  trace_body(data, len);
+  int n = batch_decode(data, len, ops);
+  if (n < 0) {
+    httpd_resp_set_status(req, "400 Bad Request");
+    return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+  }
+  uint32_t first;
+  esp_err_t err = batch_submit(ops, n, &first);
+  if (err) {
+    httpd_resp_set_status(req, (err == ESP_ERR_INVALID_STATE) ? "409 Conflict" :
+                               (err == ESP_ERR_NO_MEM) ? "503 Service Unavailable" :
+                               "400 Bad Request");
+    return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+  }
+  // The reply reuses the request buffer: the header, then an ID per operation
+  for (int i = 0; i < n; i++) {
+    uint32_t id = first + i;
+    memcpy(data + sizeof(batch_header_t) + i * sizeof(id), &id, sizeof(id));
+  }
+  len = sizeof(batch_header_t) + n * sizeof(uint32_t);
+  httpd_resp_set_type(req, "application/octet-stream");
+  return sent(req, httpd_resp_send(req, (const char*) data, len)) ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t batch_delete(httpd_req_t* req) {
+  batch_cancel();
+  return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+}
+
+// This handler works out the order to read a set of wells in. The body is a
+// comma separated list of row-major well numbers (0 is A1) and the response is
+// the same wells in visiting order, then ";" and the predicted travel time in
+// milliseconds. Repeated wells or ones that aren't on the plate get a 400.
+static esp_err_t route_post(httpd_req_t* req) {
+  // Handlers only ever run on the server task, so these can live off the stack
+  static int wells[ROUTE_MAX_WELLS];
+  static char data[ROUTE_MAX_WELLS * 4 + 1];
+  static bool seen[ROUTE_MAX_WELLS];
+  size_t len = 0;
+  if (req->content_len >= sizeof(data)) {
+    httpd_resp_set_status(req, "413 Payload Too Large");
+    return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+  }
+  while (len < req->content_len) {
+    int got = httpd_req_recv(req, data + len, req->content_len - len);
+    if (got <= 0) {
+      return ESP_FAIL;
+    }
+    len += got;
+  }
+  trace_body(data, len);
+  data[len] = '\0';
+  memset(seen, 0, sizeof(seen));
+  int n = 0;
+  for (char* tok = strtok(data, ","); tok; tok = strtok(NULL, ",")) {
+    char* end;
+    long well = strtol(tok, &end, 10);
+    if (end == tok || well < 0 || well >= ROUTE_MAX_WELLS || seen[well] ||
+        n == ROUTE_MAX_WELLS) {
+      httpd_resp_set_status(req, "400 Bad Request");
+      return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+    }
+    seen[well] = true;
+    wells[n++] = (int) well;
+  }
+  int64_t travel_us = order_wells(wells, n);
+  if (travel_us < 0) {
+    httpd_resp_set_status(req, "400 Bad Request");
+    return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+  }
+  // The reply reuses the request buffer, which every well fitted into
+  len = 0;
+  for (int i = 0; i < n; i++) {
+    len += sprintf(data + len, (i ? ",%d" : "%d"), wells[i]);
+  }
+  httpd_resp_set_type(req, "text/plain");
+  if (!sent(req, httpd_resp_send_chunk(req, data, len))) {
+    return ESP_FAIL;
+  }
+  len = sprintf(data, ";%lld", (long long) (travel_us / 1000));
+  if (!sent(req, httpd_resp_send_chunk(req, data, len))) {
+    return ESP_FAIL;
+  }
+  return sent(req, httpd_resp_send_chunk(req, "", 0)) ? ESP_OK : ESP_FAIL;
+}
+
+// This handler starts a plate run, which the firmware then carries out on its
+// own. The body is form encoded: wells is a comma separated list of row-major
+// well numbers (0 is A1), repeats the number of cycles over them, interval
+// the milliseconds from the start of one cycle to the next and samples the
+// number of dark and lit samples taken at each well. Progress is pushed on /events.
+// Answers 409 if a run or batch is already going and 400 if the description is bad.
+static esp_err_t run_post(httpd_req_t* req) {
+  // Handlers only ever run on the server task, so these can live off the stack
+  static job_spec_t spec;
+  // Up to three digits and a comma per well
+  static char data[JOB_MAX_WELLS * 4 + 128];
+  static char wells[JOB_MAX_WELLS * 4 + 1];
+  char value[12];
+  size_t len = 0;
+  if (req->content_len >= sizeof(data)) {
+    httpd_resp_set_status(req, "413 Payload Too Large");
+    return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+  }
+  while (len < req->content_len) {
+    int got = httpd_req_recv(req, data + len, req->content_len - len);
+    if (got <= 0) {
+      return ESP_FAIL;
+    }
+    len += got;
+  }
+  trace_body(data, len);
+  data[len] = '\0';
+  memset(&spec, 0, sizeof(spec));
+  spec.repeats = 1;
+  spec.samples = CONFIG_OPENLUX_MEASURE_SAMPLES;
+  if (httpd_query_key_value(data, "repeats", value, sizeof(value)) == ESP_OK) {
+    spec.repeats = atoi(value);
+  }
+  if (httpd_query_key_value(data, "interval", value, sizeof(value)) == ESP_OK) {
+    spec.interval_ms = strtoul(value, NULL, 10);
+  }
+  if (httpd_query_key_value(data, "samples", value, sizeof(value)) == ESP_OK) {
+    spec.samples = strtoul(value, NULL, 10);
+  }
+  if (httpd_query_key_value(data, "mode", value, sizeof(value)) == ESP_OK) {
+    spec.raster = !strcmp(value, "raster");
+  }
+  // A calibration pass over the wells given: a blank, or a reference whose
+  // wells are all of the given OD
+  if (httpd_query_key_value(data, "calibrate", value, sizeof(value)) == ESP_OK) {
+    spec.calibrate = !strcmp(value, "blank")       ? CALIB_BLANK
+                   : !strcmp(value, "reference") ? CALIB_REFERENCE
+                                                  : CALIB_REFERENCE + 1;
+  }
+  if (httpd_query_key_value(data, "od", value, sizeof(value)) == ESP_OK) {
+    spec.reference_od = strtof(value, NULL);
+  }
+  // More wells than a run can take is refused rather than cut short
+  bool too_many = false;
+  if (httpd_query_key_value(data, "wells", wells, sizeof(wells)) == ESP_OK) {
+    char* tok = strtok(wells, ",");
+    for (; tok && spec.n_wells < JOB_MAX_WELLS; tok = strtok(NULL, ",")) {
+      spec.wells[spec.n_wells++] = atoi(tok);
+    }
+    too_many = tok != NULL;
+  }
+  esp_err_t err = ESP_ERR_INVALID_ARG;
+  if (!too_many) {
+    // Batches drive the motors and LED too, so wait for them to finish
+    err = batch_busy() ? ESP_ERR_INVALID_STATE : job_start(&spec);
+  }
+  if (err == ESP_ERR_INVALID_STATE) {
+    httpd_resp_set_status(req, "409 Conflict");
+  } else if (err) {
+    httpd_resp_set_status(req, "400 Bad Request");
+  }
+  return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+}
+
+// Reports "running;cycle;repeats;done;wells", where done is how many wells
+// have been read so far this cycle
+static esp_err_t run_get(httpd_req_t* req) {
+  job_progress_t p;
+  char msg[64];
+  job_get_progress(&p);
+  sprintf(msg, "%d;%d;%d;%d;%d", p.running, p.cycle, p.repeats, p.done, p.n_wells);
+  httpd_resp_set_type(req, "text/plain");
+  return sent(req, httpd_resp_send(req, msg, strlen(msg))) ? ESP_OK : ESP_FAIL;
+}
+
+// The run stops at the next well, or straight away if it is between cycles
+static esp_err_t run_delete(httpd_req_t* req) {
+  job_stop();
+  return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+}
+
+// This handler streams the result log straight off flash. Optional query
+// parameters pick what to send: since and until (exclusive) are sequence
+// numbers, run keeps only one plate run, and format=bin sends the raw records
+// (see results.h) rather than CSV. The X-Log-First and X-Log-Next headers
+// give the span of the whole log, so a client can pick up where it left off.
+static esp_err_t results_get(httpd_req_t* req) {
+  // Handlers only ever run on the server task, so these can live off the stack
+  static result_record_t batch[32];
+  // Room for two batches of CSV lines, each well under 96 characters
+  static char buf[2 * 32 * 96];
+  static char first_hdr[12];
+  static char next_hdr[12];
+  char query[96];
+  char value[12];
+  result_cursor_t cur = { 0, 0, false };
+  uint32_t until = UINT32_MAX;
+  long run = -1;
+  bool binary = false;
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    if (httpd_query_key_value(query, "since", value, sizeof(value)) == ESP_OK) {
+      cur.next = strtoul(value, NULL, 10);
+    }
+    if (httpd_query_key_value(query, "until", value, sizeof(value)) == ESP_OK) {
+      until = strtoul(value, NULL, 10);
+    }
+    if (httpd_query_key_value(query, "run", value, sizeof(value)) == ESP_OK) {
+      run = strtol(value, NULL, 10);
+    }
+    if (httpd_query_key_value(query, "format", value, sizeof(value)) == ESP_OK) {
+      binary = !strcmp(value, "bin");
+    }
+  }
+  uint32_t first, next;
+  results_span(&first, &next);
+  sprintf(first_hdr, "%u", first);
+  sprintf(next_hdr, "%u", next);
+  httpd_resp_set_hdr(req, "X-Log-First", first_hdr);
+  httpd_resp_set_hdr(req, "X-Log-Next", next_hdr);
+  httpd_resp_set_type(req, binary ? "application/octet-stream" : "text/csv");
+  size_t len = 0;
+  if (!binary) {
+    len = sprintf(buf, "seq,run,time_ms,cycle,well,channel,light,dark,signal_se,od\n");
+  }
+  // Stop at the head as it was when the request came in, so a run that is
+  // still going can't keep the response open
+  size_t n;
+  while (cur.next < until && cur.next < next &&
+         (n = results_read(&cur, batch, sizeof(batch) / sizeof(batch[0]))) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      result_record_t* rec = &batch[i];
+      if (rec->seq >= until || rec->seq >= next) {
+        break;
+      }
+      if (run >= 0 && rec->run != run) {
+        continue;
+      }
+      if (binary) {
+        memcpy(buf + len, rec, sizeof(*rec));
+        len += sizeof(*rec);
+      } else {
+        len += sprintf(buf + len, "%u,%u,%u,%u,%d,%d,%.1f,%.1f,%.2f", rec->seq, rec->run,
+                       rec->time_ms, rec->cycle, rec->well, rec->channel, rec->light,
+                       rec->dark, rec->signal_se / 100.0f);
+        len += format_od(buf + len, ',', rec->od);
+        buf[len++] = '\n';
+      }
+    }
+    if (len >= sizeof(buf) / 2) {
+      if (!sent(req, httpd_resp_send_chunk(req, buf, len))) {
+        return ESP_FAIL;
+      }
+      len = 0;
+    }
+  }
+  if (!sent(req, httpd_resp_send_chunk(req, buf, len))) {
+    return ESP_FAIL;
+  }
+  return sent(req, httpd_resp_send_chunk(req, "", 0)) ? ESP_OK : ESP_FAIL;
+}
+
+// Lists the calibration as CSV, one line per channel and well with its blank
+// lit and light less dark readings and the signal it loses per unit OD. The
+// X-Calibration header says which passes it has had: blank, reference, both
+// or none.
+static esp_err_t calibration_get(httpd_req_t* req) {
+  static char buf[1024];
+  uint8_t passes = calib_passes();
+  const char* had = (passes & (1 << CALIB_BLANK))
+                      ? ((passes & (1 << CALIB_REFERENCE)) ? "both" : "blank")
+                      : ((passes & (1 << CALIB_REFERENCE)) ? "reference" : "none");
+  httpd_resp_set_hdr(req, "X-Calibration", had);
+  httpd_resp_set_type(req, "text/csv");
+  size_t len = sprintf(buf, "channel,well,light,signal,counts_per_od\n");
+  for (int ch = 0; ch < SENSOR_CHANNELS; ch++) {
+    for (int well = 0; well < PLATE_WELLS; well++) {
+      calib_well_t c;
+      calib_get_well(ch, well, &c);
+      len += sprintf(buf + len, "%d,%d,%.1f,%.1f,%.1f\n", ch, well, c.light / 16.0f,
+                     c.signal / 16.0f, c.counts / 16.0f);
+      if (len >= sizeof(buf) - 64) {
+        if (!sent(req, httpd_resp_send_chunk(req, buf, len))) {
+          return ESP_FAIL;
+        }
+        len = 0;
+      }
+    }
+  }
+  if (!sent(req, httpd_resp_send_chunk(req, buf, len))) {
+    return ESP_FAIL;
+  }
+  return sent(req, httpd_resp_send_chunk(req, "", 0)) ? ESP_OK : ESP_FAIL;
+}
+
+// Not while a run (which may be a calibration pass) is going
+static esp_err_t calibration_delete(httpd_req_t* req) {
+  if (job_running()) {
+    httpd_resp_set_status(req, "409 Conflict");
+  } else if (calib_reset() != ESP_OK) {
+    httpd_resp_set_status(req, "500 Internal Server Error");
+  }
+  return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+}
+
+// This is the catch-all handler for static web pages. Files are looked up in
+// the manifest made at build time, which gives the MIME type and ETag, and
+// sent as stored: gzipped where that made them smaller. A client that already
+// has the current version (If-None-Match) gets a 304 with no body.
 static esp_err_t static_get(httpd_req_t* req) {
-  // SPIFFS limits filenames to 32 bytes, so we don't need to worry about
-  // anything longer than that.
-  char path[32];
-  // Extract the URI from the request pointer and convert it into a path
-  uri_to_path(path, req->uri);
-  // Attempt to set the content-type of the response, exiting on failure
-  die_politely(httpd_resp_set_type(req, file_to_mime(path)), "Failed to set response type");
-  // Send the requested file back to the client in chunks
-  send_file_as_chunks(req, path);
-  // Return ESP_OK so the connection isn't killed
-  return ESP_OK;
+  int64_t start = esp_timer_get_time();
+  esp_err_t err = serve_static(req);
+  metric_since(METRIC_HTTP_STATIC, start);
+  return err;
+}
+
+static esp_err_t serve_static(httpd_req_t* req) {
+  asset_t* asset = find_asset(req->uri);
+  if (!asset) {
+    ESP_LOGW(TAG, "No web file for %s", req->uri);
+    return sent(req, httpd_resp_send_404(req)) ? ESP_OK : ESP_FAIL;
+  }
+  httpd_resp_set_hdr(req, "ETag", asset->etag);
+  httpd_resp_set_hdr(req, "Cache-Control", CACHE_CONTROL);
+  // Long enough for a few ETags, which is all a browser ever sends back
+  char match[64];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match)) == ESP_OK &&
+      strstr(match, asset->etag)) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    return sent(req, httpd_resp_send(req, "", 0)) ? ESP_OK : ESP_FAIL;
+  }
+  // Every browser accepts gzip, so Accept-Encoding isn't checked
+  if (asset->gzipped) {
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+  }
+  httpd_resp_set_type(req, asset->mime);
+  const uint8_t* data = asset_data(asset);
+  if (data) {
+    return sent(req, httpd_resp_send(req, (const char*) data, asset->size)) ? ESP_OK : ESP_FAIL;
+  }
+  return send_file_as_chunks(req, asset);
 }
 
 // This function returns a handle (pointer) to the server
@@ -100,15 +675,55 @@ httpd_handle_t start_webserver(void) {
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
   // For static web serving, wildcard URIs are important. Let's enable those...
   config.uri_match_fn = httpd_uri_match_wildcard;
+  // The event stream needs to know when its sockets go away
+  config.close_fn = session_closed;
+  // The default of 8 handlers isn't enough any more
+  config.max_uri_handlers = 20;
+  // Every socket lwIP has but the server's own three. Browsers keep a few
+  // open between requests, and one more for /events, so the default of 7
+  // ran out with two people watching.
+  config.max_open_sockets = CONFIG_LWIP_MAX_SOCKETS - 3;
+  // Once they are all in use, a new client takes the place of the one that
+  // has gone longest without a request, rather than being turned away. That
+  // may be an event stream, which the page reconnects.
+  config.lru_purge_enable = true;
+  // Connections left waiting while a handler runs, so a burst of page loads
+  // isn't refused
+  config.backlog_conn = 8;
+  // Handlers all run on the server task, so a client that stops reading
+  // holds up everyone else until its send times out
+  config.send_wait_timeout = 2;
+  config.recv_wait_timeout = 2;
   
+  // The pages can't be served without the manifest, but the API still works
+  if (load_assets() != ESP_OK) {
+    ESP_LOGW(TAG, "Web files missing, was the webdata partition flashed?");
+  }
   // Log status and port number to the user
   ESP_LOGI(TAG, "Starting server on port: %d", config.server_port);
   // Try starting the server
   if (httpd_start(&server, &config) == ESP_OK) {
     // Set URI handlers here
-    httpd_register_uri_handler(server, &status_get_uri);
-    httpd_register_uri_handler(server, &command_post_uri);
-    httpd_register_uri_handler(server, &static_get_uri);
+    register_traced(server, &status_get_uri);
+    register_traced(server, &state_get_uri);
+    register_traced(server, &plate_get_uri);
+    register_traced(server, &samples_get_uri);
+    register_traced(server, &events_get_uri);
+    register_traced(server, &metrics_get_uri);
+    register_traced(server, &batch_post_uri);
+    register_traced(server, &batch_delete_uri);
+    register_traced(server, &route_post_uri);
+    register_traced(server, &run_post_uri);
+    register_traced(server, &run_get_uri);
+    register_traced(server, &run_delete_uri);
+    register_traced(server, &results_get_uri);
+    register_traced(server, &calibration_get_uri);
+    register_traced(server, &calibration_delete_uri);
+    httpd_register_uri_handler(server, &trace_get_uri);
+    httpd_register_uri_handler(server, &trace_post_uri);
+    httpd_register_uri_handler(server, &trace_delete_uri);
+    register_traced(server, &static_get_uri);
+    start_event_stream(server);
     return server;
   }
   // If we haven't returned by now, starting the server failed. Let the user know:
@@ -116,105 +731,51 @@ httpd_handle_t start_webserver(void) {
   return NULL;
 }
 
-// This function takes a filename as a char array, tests for different fill
-// extensions, and returns the proper mime-type.
-static char* file_to_mime(char fn[]) {
-  // Test if ".html" is part of the filename
-  if (strstr(fn, ".html")) {
-    // If so, return the HTML mime-type
-    return "text/html";
-  } else if (strstr(fn, ".css")) {
-    return "text/css";
-  } else if (strstr(fn, ".js")) {
-    return "application/javascript";
-  } else if (strstr(fn, ".png")) {
-    return "image/png";
-  } else if (strstr(fn, ".jpg") || strstr(fn, ".JPG") || strstr(fn, ".jpeg")) {
-    return "image/jpeg";
-  } else if (strstr(fn, ".svg")) {
-    return "image/svg+xml";
-  } else {
-    // Unsupported file-types default to octet-streams
-    return "application/octet-stream";
-  }
-}
-
-// This function takes two strings (char pointers), the first is a buffer for
-// constructing the path and the second is the request URI. This function adds
-// the WEB prefix so that data can be accessed via SPIFFS and also adds an
-// implicit index.html to URIs without extensions. The resultant path is stored
-// in path_buf.
-static void uri_to_path(char* path_buf, const char* uri) {
-  // Start by copying the WEB prefix into the path
-  strcpy(path_buf, WEB);
-  // Add on the URI
-  strcat(path_buf, uri);
-  // Check if the current path contains a dot. This is indicative of a file
-  // extension, but isn't foolproof. It'll do for now though
-  if (!strchr(path_buf, '.')) {
-    // Check if the last character is a slash, if not, add one.
-    if (path_buf[strlen(path_buf) - 1] != '/') {
-      // Add a trailing slash
-      strcat(path_buf, "/");
-    }
-    // Add the implied index.html to the end of the path
-    strcat(path_buf, "index.html");
-  }
+// Called by the server whenever a session ends. Having a close function makes
+// closing the socket our job.
+static void session_closed(httpd_handle_t server, int fd) {
+  stream_session_closed(server, fd);
+  close(fd);
 }
 
-// This function takes a request pointer and file path (as a char array) to
-// serve back to the client
-static void send_file_as_chunks(httpd_req_t* req, char path[]) {
-  // Kick things off by opening the requested file as read-only
-  FILE* fp = fopen(path, "r");
-  // If fopen failed, let the user know and return early.
+// This function streams a file that isn't cached in RAM back to the client
+static esp_err_t send_file_as_chunks(httpd_req_t* req, const asset_t* asset) {
+  static char msg[CHUNK_SIZE];
+  FILE* fp = open_asset(asset);
+  // If the file has gone missing, let the user know and give up
   if (!fp) {
-    // Log which file couldn't be opened
-    ESP_LOGE(TAG, "Failed to open %s", path);
-    return;
-  }
-  // Attempt to allocate a chunk of memory to read the file into
-  char* msg = malloc(CHUNK_SIZE);
-  // If allocation failed, let the user know and return early
-  if (!msg) {
-    // Log the amount of memory that was requested for allocation
-    ESP_LOGE(TAG, "Failed to allocate %ld bytes on the heap", CHUNK_SIZE);
-    return;
-  }
-  // Read a chunk of the file into msg and record the number of bytes read. 1 is
-  // the size of each array element in msg (a char is 1 byte) and CHUNK_SIZE
-  // tells fread how many of these elements to read.
-  long bytes_read = fread(msg, 1, CHUNK_SIZE, fp);
+    ESP_LOGE(TAG, "Failed to open %s", asset->path);
+    return sent(req, httpd_resp_send_500(req)) ? ESP_OK : ESP_FAIL;
+  }
+  size_t bytes_read = read_chunk(msg, fp);
+  bool ok;
   // Did everything fit into one chunk?
   if (bytes_read < CHUNK_SIZE) {
-    // If so, just send a complete response, reporting and handling any failure
-    die_politely(httpd_resp_send(req, msg, bytes_read), "Failed to send HTTP response");
-    // Log the size of the response that was sent
-    ESP_LOGI(TAG, "Sent %s in %ld bytes", path, bytes_read);
+    // If so, just send a complete response
+    ok = sent(req, httpd_resp_send(req, msg, bytes_read));
   } else {
-    // Otherwise, send the response in chunks.
-    // Use this to record the number of chunks sent (for logging purposes)
-    unsigned int chunks = 0;
-    // Send chunks so long as data is still being read
-    while (bytes_read > 0) {
-      // Send a chunk of data, reporting and handling any failure
-      die_politely(httpd_resp_send_chunk(req, msg, bytes_read), "Failed to send chunked HTTP response");
-      // Log the size of the chunk that was sent
-      ESP_LOGI(TAG, "Sent a chunk of %ld bytes from %s", bytes_read, path);
-      // Update the number of chunks sent
-      chunks++;
-      // Read in the next chunk of data and report the number of bytes read
-      bytes_read = fread(msg, 1, CHUNK_SIZE, fp);
+    // Otherwise send chunks so long as data is still being read, and the
+    // client is still there to take them
+    ok = true;
+    while (ok && bytes_read > 0) {
+      ok = sent(req, httpd_resp_send_chunk(req, msg, bytes_read));
+      bytes_read = ok ? read_chunk(msg, fp) : 0;
     }
-    // Once all chunks have been sent, chunk transmission must be terminated
-    // with a transmission of zero bytes. Don't forget to catch errors...
-    die_politely(httpd_resp_send_chunk(req, "", 0), "Failed to terminate chunked HTTP response");
-    // Log the number of chunks and bytes sent
-    ESP_LOGI(TAG, "Sent %s in %ld bytes (%d chunks)", path,
-             chunks * CHUNK_SIZE - bytes_read, chunks);
-  }
-  // The msg buffer is no longer needed, so the memory is freed
-  free(msg);
-  // The file pointer is no longer needed, so the file is closed
+    // Chunk transmission must be terminated with a transmission of zero bytes
+    ok = ok && sent(req, httpd_resp_send_chunk(req, "", 0));
+  }
   fclose(fp);
+  if (!ok) {
+    return ESP_FAIL;
+  }
+  ESP_LOGI(TAG, "Sent %s in %u bytes", asset->path, (unsigned) asset->size);
+  return ESP_OK;
+}
+
+// Read the next chunk of a file, timing how long flash takes about it
+static size_t read_chunk(char* buf, FILE* fp) {
+  int64_t start = esp_timer_get_time();
+  size_t got = fread(buf, 1, CHUNK_SIZE, fp);
+  metric_since(METRIC_FLASH_READ, start);
+  return got;
 }
@@ -4,4 +4,7 @@
 #define WEB_H
 // System initialisation:
 extern httpd_handle_t start_webserver(void);
+// For handlers: whether part of a response went out. If not, the client has
+// gone and the handler should return ESP_FAIL to close its session.
+extern bool sent(httpd_req_t*, esp_err_t);
 #endif
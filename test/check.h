@@ -0,0 +1,34 @@
+#include <stdio.h>
+
+#ifndef CHECK_H
+#define CHECK_H
+// Checks for the host tests. A failed check prints where it was and carries
+// on, so one run reports every failure; check_done() gives the exit status.
+static int CHECK_FAILED = 0;
+
+#define CHECK(cond)                                                          \
+  do {                                                                       \
+    if (!(cond)) {                                                           \
+      fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond);     \
+      CHECK_FAILED++;                                                        \
+    }                                                                        \
+  } while (0)
+
+#define CHECK_EQ(a, b)                                                       \
+  do {                                                                       \
+    long long a_ = (long long) (a);                                          \
+    long long b_ = (long long) (b);                                          \
+    if (a_ != b_) {                                                          \
+      fprintf(stderr, "%s:%d: failed: %s == %s (%lld, %lld)\n", __FILE__,    \
+              __LINE__, #a, #b, a_, b_);                                     \
+      CHECK_FAILED++;                                                        \
+    }                                                                        \
+  } while (0)
+
+static inline int check_done(void) {
+  if (CHECK_FAILED) {
+    fprintf(stderr, "%d checks failed\n", CHECK_FAILED);
+  }
+  return CHECK_FAILED ? 1 : 0;
+}
+#endif
@@ -0,0 +1,116 @@
+// Batches are queued whole or not at all: a bad operation, too many of them
+// or a full queue turns the batch away, and cancelled operations are still
+// reported, as failed. Batches off the wire are checked before any of that.
+#include "check.h"
+#include "batch.h"
+#include "plate.h"
+#include "sensors.h"
+#include <stdatomic.h>
+#include <string.h>
+
+static atomic_int FINISHED = 0;
+static atomic_int FAILED = 0;
+
+static void listen(const batch_event_t* ev) {
+  atomic_fetch_add(&FINISHED, 1);
+  if (!ev->ok) {
+    atomic_fetch_add(&FAILED, 1);
+  }
+}
+
+static esp_err_t submit_one(batch_op_t op) {
+  uint32_t first;
+  return batch_submit(&op, 1, &first);
+}
+
+// A header for n operations followed by n waits, returning the length
+static size_t encode(uint8_t* buf, int version, int n) {
+  batch_header_t header = { .version = version, .n_ops = n };
+  memcpy(buf, &header, sizeof(header));
+  for (int i = 0; i < n; i++) {
+    batch_op_t op = { .code = OP_WAIT, .value = i };
+    memcpy(buf + sizeof(header) + i * sizeof(op), &op, sizeof(op));
+  }
+  return sizeof(header) + n * sizeof(batch_op_t);
+}
+
+static void check_decode(void) {
+  static uint8_t buf[sizeof(batch_header_t) + 255 * sizeof(batch_op_t)];
+  static batch_op_t ops[BATCH_MAX_OPS];
+  size_t len = encode(buf, BATCH_VERSION, 3);
+  CHECK_EQ(batch_decode(buf, len, ops), 3);
+  CHECK_EQ(ops[2].code, OP_WAIT);
+  CHECK_EQ(ops[2].value, 2);
+  // Cut short, with bytes left over, or shorter than a header
+  CHECK_EQ(batch_decode(buf, len - 1, ops), -1);
+  CHECK_EQ(batch_decode(buf, len + 1, ops), -1);
+  CHECK_EQ(batch_decode(buf, sizeof(batch_header_t) - 1, ops), -1);
+  CHECK_EQ(batch_decode(buf, 0, ops), -1);
+  // Bad headers
+  len = encode(buf, BATCH_VERSION + 1, 3);
+  CHECK_EQ(batch_decode(buf, len, ops), -1);
+  len = encode(buf, BATCH_VERSION, 0);
+  CHECK_EQ(batch_decode(buf, len, ops), -1);
+  len = encode(buf, BATCH_VERSION, BATCH_MAX_OPS);
+  CHECK_EQ(batch_decode(buf, len, ops), BATCH_MAX_OPS);
+  len = encode(buf, BATCH_VERSION, BATCH_MAX_OPS + 1);
+  CHECK_EQ(batch_decode(buf, len, ops), -1);
+  len = encode(buf, BATCH_VERSION, 255);
+  CHECK_EQ(batch_decode(buf, len, ops), -1);
+  // Bad operation
+  len = encode(buf, BATCH_VERSION, 3);
+  buf[sizeof(batch_header_t) + sizeof(batch_op_t)] = 0;
+  CHECK_EQ(batch_decode(buf, len, ops), -1);
+}
+
+int main(void) {
+  static batch_op_t ops[BATCH_MAX_OPS + 1];
+  uint32_t first = 0;
+  check_decode();
+  init_status();
+  set_batch_listener(listen);
+  start_batch_runner();
+  // Operations only start once the device is ready
+  begin_status(READY);
+
+  for (int i = 0; i <= BATCH_MAX_OPS; i++) {
+    ops[i] = (batch_op_t) { .code = OP_WAIT, .value = 60000 };
+  }
+  CHECK_EQ(batch_submit(ops, 0, &first), ESP_ERR_INVALID_ARG);
+  CHECK_EQ(batch_submit(ops, BATCH_MAX_OPS + 1, &first), ESP_ERR_INVALID_ARG);
+  CHECK_EQ(submit_one((batch_op_t) { .code = 0 }), ESP_ERR_INVALID_ARG);
+  CHECK_EQ(submit_one((batch_op_t) { .code = OP_MOVE, .row = PLATE_ROWS + 1, .col = 1 }),
+           ESP_ERR_INVALID_ARG);
+  CHECK_EQ(submit_one((batch_op_t) { .code = OP_MOVE, .row = 1, .col = 0 }),
+           ESP_ERR_INVALID_ARG);
+  // LED levels are a bit for each channel
+  CHECK_EQ(submit_one((batch_op_t) { .code = OP_LED, .level = 1 << SENSOR_CHANNELS }),
+           ESP_ERR_INVALID_ARG);
+  CHECK_EQ(submit_one((batch_op_t) { .code = OP_MEASURE, .value = MEASURE_MAX_SAMPLES + 1 }),
+           ESP_ERR_INVALID_ARG);
+  CHECK_EQ(submit_one((batch_op_t) { .code = OP_WAIT, .value = 3600001 }),
+           ESP_ERR_INVALID_ARG);
+  // One bad operation turns away the whole batch
+  ops[5].code = OP_LED;
+  ops[5].level = 1 << SENSOR_CHANNELS;
+  CHECK_EQ(batch_submit(ops, 10, &first), ESP_ERR_INVALID_ARG);
+  ops[5] = ops[4];
+  CHECK(!batch_busy());
+  CHECK_EQ(first, 0);
+
+  // A full queue takes nothing more until it is cancelled
+  CHECK_EQ(batch_submit(ops, BATCH_MAX_OPS, &first), ESP_OK);
+  CHECK_EQ(first, 1);
+  CHECK(batch_busy());
+  vTaskDelay(pdMS_TO_TICKS(50));
+  CHECK_EQ(batch_submit(ops, 2, &first), ESP_ERR_NO_MEM);
+  batch_cancel();
+  CHECK_EQ(atomic_load(&FAILED), BATCH_MAX_OPS - 1);
+  CHECK_EQ(atomic_load(&FINISHED), BATCH_MAX_OPS - 1);
+  CHECK_EQ(batch_last_done(), BATCH_MAX_OPS);
+  // The wait under way still has to finish
+  CHECK(batch_busy());
+  CHECK_EQ(batch_submit(ops, 2, &first), ESP_OK);
+  CHECK_EQ(first, BATCH_MAX_OPS + 1);
+  return check_done();
+}
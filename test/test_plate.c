@@ -0,0 +1,126 @@
+// Plate runs on the simulator report the OD of each well: from the nominal
+// response out of the box, and through blank and reference passes once each
+// well position has a response of its own. The result log keeps the OD as
+// it was reported.
+#include "check.h"
+#include "motors.h"
+#include "sensors.h"
+#include "job.h"
+#include "results.h"
+#include "calib.h"
+#include "sim.h"
+#include <math.h>
+#include <unistd.h>
+
+// Two rows are plenty, and a few hundred samples a well keep noise well
+// inside the tolerance
+#define WELLS (2 * PLATE_COLS)
+static const uint32_t SAMPLES = 500;
+static const float TOLERANCE = 0.02;
+
+static SemaphoreHandle_t RUN_DONE = NULL;
+static volatile int MEASURED = 0;
+static volatile float OD_ERROR = 0;
+static int16_t OD[SENSOR_CHANNELS][WELLS];
+
+static void on_job(const job_event_t* ev) {
+  if (ev->kind == JOB_WELL && ev->value >= 0) {
+    double want = sim_plate_od(ev->well / PLATE_COLS + 1, ev->well % PLATE_COLS + 1,
+                               ev->m.channel);
+    float err = fabsf(ev->m.od / 1000.0f - want);
+    if (err > OD_ERROR) {
+      OD_ERROR = err;
+    }
+    OD[ev->m.channel][ev->well] = ev->m.od;
+    MEASURED++;
+  } else if (ev->kind == JOB_FINISHED || ev->kind == JOB_STOPPED) {
+    xSemaphoreGive(RUN_DONE);
+  }
+}
+
+// Returns the worst OD error of the run
+static float run_plate(bool raster, calib_pass_t calibrate, float od) {
+  static job_spec_t spec;
+  spec.n_wells = WELLS;
+  spec.repeats = 1;
+  spec.samples = SAMPLES;
+  spec.raster = raster;
+  spec.calibrate = calibrate;
+  spec.reference_od = od;
+  for (int i = 0; i < WELLS; i++) {
+    spec.wells[i] = i;
+  }
+  MEASURED = 0;
+  OD_ERROR = 0;
+  CHECK_EQ(job_start(&spec), ESP_OK);
+  xSemaphoreTake(RUN_DONE, portMAX_DELAY);
+  while (job_running()) {
+    vTaskDelay(1);
+  }
+  // A raster scan leaves out a well that didn't pass under the photodiode
+  // for long enough on some channel, which only ever happens to a few
+  if (raster) {
+    CHECK(MEASURED >= WELLS * SENSOR_CHANNELS * 9 / 10);
+  } else {
+    CHECK_EQ(MEASURED, WELLS * SENSOR_CHANNELS);
+  }
+  return OD_ERROR;
+}
+
+int main(void) {
+  const char* log_path = "test_plate.bin";
+  const char* settings_path = "test_plate.nvs";
+  unlink(log_path);
+  unlink(settings_path);
+  sim_set_store_path(log_path);
+  sim_set_settings_path(settings_path);
+  sim_set_time_scale(50);
+  init_status();
+  CHECK_EQ(open_results(), ESP_OK);
+  load_calibration();
+  start_sensor_polling(ADC_ATTEN_DB_0, CONFIG_OPENLUX_SENSOR_PERIOD_MS);
+  setup_motor_driver();
+  start_goto_loop(xTaskGetCurrentTaskHandle());
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  start_job_runner();
+  RUN_DONE = xSemaphoreCreateBinary();
+  set_job_listener(on_job);
+  begin_status(READY);
+
+  // The nominal response is the simulated photodiode's own
+  CHECK(run_plate(false, CALIB_NONE, 0) < TOLERANCE);
+  CHECK(run_plate(true, CALIB_NONE, 0) < TOLERANCE);
+  // and what was reported is what was logged
+  static result_record_t rec[WELLS * SENSOR_CHANNELS];
+  result_cursor_t cur = { .next = 0, .located = false };
+  CHECK_EQ(results_read(&cur, rec, WELLS * SENSOR_CHANNELS), WELLS * SENSOR_CHANNELS);
+  size_t n = results_read(&cur, rec, WELLS * SENSOR_CHANNELS);
+  CHECK_EQ(n, MEASURED);
+  for (size_t i = 0; i < n; i++) {
+    CHECK_EQ(rec[i].od, OD[rec[i].channel][rec[i].well]);
+  }
+
+  // Each position passing up to 5% more or less light throws the nominal
+  // response out, until it is calibrated
+  sim_set_gain_spread(0.05);
+  CHECK(run_plate(false, CALIB_NONE, 0) > 5 * TOLERANCE);
+  sim_set_plate_od(0);
+  run_plate(false, CALIB_BLANK, 0);
+  sim_set_plate_od(1);
+  run_plate(false, CALIB_REFERENCE, 1);
+  CHECK_EQ(calib_passes(), (1 << CALIB_BLANK) | (1 << CALIB_REFERENCE));
+  sim_set_plate_od(-1);
+  CHECK(run_plate(false, CALIB_NONE, 0) < TOLERANCE);
+  CHECK(run_plate(true, CALIB_NONE, 0) < TOLERANCE);
+
+  // The calibration was saved, and going back to nominal is too
+  load_calibration();
+  CHECK(run_plate(false, CALIB_NONE, 0) < TOLERANCE);
+  CHECK_EQ(calib_reset(), ESP_OK);
+  load_calibration();
+  CHECK_EQ(calib_passes(), 0);
+  CHECK(run_plate(false, CALIB_NONE, 0) > 5 * TOLERANCE);
+  unlink(log_path);
+  unlink(settings_path);
+  return check_done();
+}
@@ -0,0 +1,100 @@
+// The result log in the simulator's flash file: records come back in order,
+// a write torn by a power cut is skipped after a restart, and once the log
+// has wrapped the oldest sectors go while the rest read back intact
+#include "check.h"
+#include "hal.h"
+#include "results.h"
+#include "sim.h"
+#include <unistd.h>
+
+static const char* PATH = "test_results.bin";
+
+static void append(uint32_t run, int well) {
+  result_record_t rec = { .run = run, .well = well, .light = well };
+  CHECK_EQ(results_append(&rec), ESP_OK);
+}
+
+// Reads everything from seq on, checking it is numbered without gaps, and
+// returns how many records there were
+static uint32_t read_all(uint32_t seq, result_record_t* last) {
+  static result_record_t out[64];
+  result_cursor_t cur = { .next = seq, .located = false };
+  uint32_t count = 0;
+  size_t n;
+  while ((n = results_read(&cur, out, 64)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      if (out[i].seq != seq + count + i) {
+        CHECK_EQ(out[i].seq, seq + count + i);
+        return count;
+      }
+    }
+    count += n;
+    *last = out[n - 1];
+  }
+  return count;
+}
+
+int main(void) {
+  unlink(PATH);
+  sim_set_store_path(PATH);
+  CHECK_EQ(open_results(), ESP_OK);
+  uint32_t first, next;
+  results_span(&first, &next);
+  CHECK_EQ(first, 0);
+  CHECK_EQ(next, 0);
+
+  uint32_t run = results_new_run();
+  for (int i = 0; i < 10; i++) {
+    append(run, i);
+  }
+  result_record_t last;
+  CHECK_EQ(read_all(0, &last), 10);
+  CHECK_EQ(last.well, 9);
+  CHECK_EQ(last.run, run);
+
+  // Power goes off part way through writing the next record: it is skipped,
+  // and the log carries on after it, in a new run
+  result_record_t torn = { .seq = 10, .run = run, .well = 10 };
+  CHECK_EQ(hal_store_write(10 * sizeof(torn), &torn, 12), ESP_OK);
+  CHECK_EQ(open_results(), ESP_OK);
+  results_span(&first, &next);
+  CHECK_EQ(first, 0);
+  CHECK_EQ(next, 10);
+  CHECK(results_new_run() > run);
+  append(run, 99);
+  CHECK_EQ(read_all(0, &last), 11);
+  CHECK_EQ(last.seq, 10);
+  CHECK_EQ(last.well, 99);
+
+  // Going round the partition more than once erases the oldest sectors, a
+  // whole one at a time
+  size_t size;
+  CHECK_EQ(hal_store_open(&size), ESP_OK);
+  uint32_t slots = size / sizeof(result_record_t);
+  uint32_t per_sector = HAL_STORE_SECTOR / sizeof(result_record_t);
+  for (uint32_t i = 0; i < slots + per_sector / 2; i++) {
+    append(run, i & 0x3FF);
+  }
+  results_span(&first, &next);
+  CHECK_EQ(next, 11 + slots + per_sector / 2);
+  CHECK(first > 0);
+  CHECK(next - first <= slots);
+  CHECK(next - first > slots - 2 * per_sector);
+  CHECK_EQ(read_all(first, &last), next - first);
+  CHECK_EQ(last.seq, next - 1);
+  // A reader after records that have gone moves up to the oldest left
+  result_cursor_t cur = { .next = 0, .located = false };
+  CHECK_EQ(results_read(&cur, &last, 1), 1);
+  CHECK_EQ(last.seq, first);
+
+  // A reader partway through picks up where it asked, and a restart finds
+  // the same span
+  CHECK_EQ(read_all(next - 5, &last), 5);
+  CHECK_EQ(open_results(), ESP_OK);
+  uint32_t first2, next2;
+  results_span(&first2, &next2);
+  CHECK_EQ(first2, first);
+  CHECK_EQ(next2, next);
+  unlink(PATH);
+  return check_done();
+}
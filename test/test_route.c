@@ -0,0 +1,93 @@
+// Well ordering: route_wells gives back the wells it was given, predicts the
+// travel time of the order it picked, and never does worse than snaking
+// through the plate row by row
+#include "check.h"
+#include "route.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_WELLS 384
+
+static const motion_profile_t PROFILE = {
+  .start_rate = CONFIG_OPENLUX_START_STEP_RATE,
+  .max_rate = CONFIG_OPENLUX_MAX_STEP_RATE,
+  .accel = CONFIG_OPENLUX_STEP_ACCEL
+};
+
+static const plate_grid_t PLATES[] = {
+  { 8, 12, 464 },
+  { 16, 24, 232 }
+};
+
+// The selected wells in serpentine order: along the first row with any,
+// back along the next, and so on
+static int serpentine(const bool* picked, const plate_grid_t* grid, int* wells) {
+  int n = 0;
+  bool back = false;
+  for (int r = 0; r < grid->rows; r++) {
+    int from = n;
+    for (int i = 0; i < grid->cols; i++) {
+      int c = back ? grid->cols - 1 - i : i;
+      if (picked[r * grid->cols + c]) {
+        wells[n++] = r * grid->cols + c;
+      }
+    }
+    back ^= n > from;
+  }
+  return n;
+}
+
+static void check_route(const bool* picked, const plate_grid_t* grid, bool whole_rows) {
+  static int snake[MAX_WELLS];
+  static int wells[MAX_WELLS];
+  int n = serpentine(picked, grid, snake);
+  int64_t snake_cost = route_cost(snake, n, -1, grid, &PROFILE);
+  // Row-major, as the page collects them
+  int m = 0;
+  for (int w = 0; w < grid->rows * grid->cols; w++) {
+    if (picked[w]) {
+      wells[m++] = w;
+    }
+  }
+  int64_t cost = route_wells(wells, n, -1, grid, &PROFILE);
+  CHECK(cost >= 0);
+  CHECK_EQ(cost, route_cost(wells, n, -1, grid, &PROFILE));
+  CHECK(cost <= snake_cost);
+  if (whole_rows) {
+    CHECK_EQ(cost, snake_cost);
+  }
+  // The same wells, each once
+  static bool seen[MAX_WELLS];
+  memset(seen, 0, sizeof(seen));
+  for (int i = 0; i < n; i++) {
+    CHECK(picked[wells[i]] && !seen[wells[i]]);
+    seen[wells[i]] = true;
+  }
+}
+
+int main(void) {
+  static bool picked[MAX_WELLS];
+  srand(1);
+  for (size_t p = 0; p < sizeof(PLATES) / sizeof(PLATES[0]); p++) {
+    const plate_grid_t* grid = &PLATES[p];
+    int total = grid->rows * grid->cols;
+    for (int w = 0; w < total; w++) {
+      picked[w] = true;
+    }
+    check_route(picked, grid, true);
+    for (int w = 0; w < total; w++) {
+      picked[w] = (w / grid->cols) % 2 == 0;
+    }
+    check_route(picked, grid, true);
+    for (int trial = 0; trial < 20; trial++) {
+      for (int w = 0; w < total; w++) {
+        picked[w] = rand() % 3 == 0;
+      }
+      check_route(picked, grid, false);
+    }
+  }
+  // Wells off the plate are refused
+  int off[] = { 0, 96 };
+  CHECK_EQ(route_wells(off, 2, -1, &PLATES[0], &PROFILE), -1);
+  return check_done();
+}
@@ -0,0 +1,50 @@
+// The reading ring: consumers see readings in order, and one that falls
+// behind by more than the ring skips to the oldest still held and counts what
+// it missed
+#include "check.h"
+#include "samples.h"
+
+static void push(int n) {
+  for (int i = 0; i < n; i++) {
+    sample_ring_push(sample_ring_head() & 0x0FFF, -1, 0, 0, OD_NONE);
+  }
+}
+
+int main(void) {
+  static sample_t out[SAMPLE_RING_SIZE];
+  sample_t latest;
+  CHECK(!sample_ring_latest(&latest));
+
+  sample_cursor_t cur;
+  sample_cursor_init(&cur);
+  push(10);
+  CHECK_EQ(sample_ring_read(&cur, out, 4), 4);
+  CHECK_EQ(out[0].seq, 0);
+  CHECK_EQ(out[3].raw, 3);
+  CHECK_EQ(sample_ring_read(&cur, out, SAMPLE_RING_SIZE), 6);
+  CHECK_EQ(out[5].seq, 9);
+  CHECK_EQ(cur.dropped, 0);
+  CHECK_EQ(sample_ring_read(&cur, out, SAMPLE_RING_SIZE), 0);
+  CHECK(sample_ring_latest(&latest));
+  CHECK_EQ(latest.seq, 9);
+
+  // Overwritten readings are skipped and counted
+  push(SAMPLE_RING_SIZE + 20);
+  CHECK_EQ(sample_ring_read(&cur, out, SAMPLE_RING_SIZE), SAMPLE_RING_SIZE);
+  CHECK_EQ(cur.dropped, 20);
+  CHECK_EQ(out[0].seq, 30);
+  CHECK_EQ(out[SAMPLE_RING_SIZE - 1].seq, SAMPLE_RING_SIZE + 29);
+
+  // A new cursor starts at the next reading, and one from the future (from
+  // before a reboot) starts again at the head
+  sample_cursor_t fresh;
+  sample_cursor_init(&fresh);
+  CHECK_EQ(sample_ring_read(&fresh, out, SAMPLE_RING_SIZE), 0);
+  sample_cursor_t future = { sample_ring_head() + 100, 0 };
+  push(1);
+  CHECK_EQ(sample_ring_read(&future, out, SAMPLE_RING_SIZE), 0);
+  CHECK_EQ(future.next, sample_ring_head());
+  CHECK_EQ(sample_ring_read(&fresh, out, SAMPLE_RING_SIZE), 1);
+  CHECK_EQ(fresh.dropped, 0);
+  return check_done();
+}
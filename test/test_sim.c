@@ -0,0 +1,51 @@
+// The simulated hardware: the carriage follows the coil patterns clocked into
+// the shift register as the steppers would, and the photodiode sees more
+// light with the LED on than off
+#include "check.h"
+#include "hal.h"
+#include "sim.h"
+
+// Energise one coil of each axis, by phase, for a tick of the step stream
+static void latch(int r_phase, int c_phase) {
+  step_run_t run = { (1 << (r_phase & 3)) | (1 << (c_phase & 3)) << 4, 1 };
+  hal_step_stream_write(&run, 1);
+}
+
+static void check_carriage(int r_want, int c_want) {
+  int r, c;
+  hal_step_stream_flush();
+  sim_get_carriage(&r, &c);
+  CHECK_EQ(r, r_want);
+  CHECK_EQ(c, c_want);
+}
+
+int main(void) {
+  sim_set_carriage(1000, 1000);
+  latch(0, 0);
+  check_carriage(1000, 1000);
+  // A phase forward is a step forward, and a phase back a step back
+  uint64_t steps = sim_step_count();
+  for (int i = 1; i <= 10; i++) {
+    latch(i, -i);
+  }
+  check_carriage(1010, 990);
+  CHECK_EQ(sim_step_count() - steps, 20);
+  // Two phases on is a stall, which goes nowhere
+  latch(12, -10);
+  check_carriage(1010, 990);
+  // Nothing goes past the end stops
+  sim_set_carriage(2, 2);
+  for (int i = 1; i <= 5; i++) {
+    latch(12 - i, -10 - i);
+  }
+  check_carriage(0, 0);
+
+  sim_set_noise(0);
+  hal_setup_led(5);
+  hal_set_led(5, 0);
+  int dark = hal_read_adc(ADC1_CHANNEL_0);
+  hal_set_led(5, 1);
+  int lit = hal_read_adc(ADC1_CHANNEL_0);
+  CHECK(lit > dark);
+  return check_done();
+}
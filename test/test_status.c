@@ -0,0 +1,69 @@
+// The device state machine: legal transitions are made and reported, anything
+// else is refused and counted without changing the state
+#include "check.h"
+#include "common.h"
+
+static status_t HEARD = INITIALISING;
+static int CHANGES = 0;
+
+static void listen(status_t status) {
+  HEARD = status;
+  CHANGES++;
+}
+
+static EventBits_t bits(void) {
+  return xEventGroupGetBits(state_events()) &
+         (STATE_READY_BIT | STATE_IDLE_BIT | STATE_DARK_BIT);
+}
+
+int main(void) {
+  init_status();
+  set_status_listener(listen);
+  status_stats_t stats;
+  CHECK_EQ(get_status(), INITIALISING);
+  CHECK_EQ(bits(), STATE_IDLE_BIT | STATE_DARK_BIT);
+
+  // Nothing but READY ends start up, and only once
+  CHECK(!end_status(READY));
+  CHECK(!begin_status(INITIALISING));
+  CHECK(begin_status(READY));
+  CHECK(!begin_status(READY));
+  CHECK_EQ(get_status(), READY);
+  CHECK_EQ(HEARD, READY);
+  CHECK_EQ(bits(), STATE_READY_BIT | STATE_IDLE_BIT | STATE_DARK_BIT);
+
+  // One motion at a time, ended by the same kind
+  CHECK(!end_status(HOMING));
+  CHECK(begin_status(HOMING));
+  CHECK(!begin_status(MOVING));
+  CHECK(!begin_status(HOMING));
+  CHECK(!end_status(MOVING));
+  CHECK(in_status(HOMING));
+  CHECK(!in_status(MOVING));
+  CHECK_EQ(bits(), STATE_READY_BIT | STATE_DARK_BIT);
+
+  // Reading goes on alongside motion, which is reported over it
+  CHECK(begin_status(READING));
+  CHECK(!begin_status(READING));
+  CHECK_EQ(get_status(), HOMING);
+  CHECK_EQ(bits(), STATE_READY_BIT);
+  CHECK(end_status(HOMING));
+  CHECK_EQ(get_status(), READING);
+  CHECK_EQ(HEARD, READING);
+  CHECK(end_status(READING));
+  CHECK(!end_status(READING));
+  CHECK_EQ(get_status(), READY);
+  CHECK_EQ(bits(), STATE_READY_BIT | STATE_IDLE_BIT | STATE_DARK_BIT);
+
+  // Only the transitions that were made were reported and counted
+  CHECK(begin_status(MOVING));
+  CHECK(end_status(MOVING));
+  CHECK_EQ(CHANGES, 7);
+  get_status_stats(&stats);
+  CHECK_EQ(stats.refused, 9);
+  CHECK_EQ(stats.entered[READY], 1);
+  CHECK_EQ(stats.entered[HOMING], 1);
+  CHECK_EQ(stats.entered[MOVING], 1);
+  CHECK_EQ(stats.entered[READING], 1);
+  return check_done();
+}
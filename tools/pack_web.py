@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+# Packs the web interface for serving from SPIFFS. Every file under the source
+# directory is copied to the output directory under the same name, gzipped
+# whenever that makes it smaller, and a manifest is written alongside listing
+# one file per line:
+#
+#   path<TAB>mime type<TAB>ETag<TAB>stored size<TAB>1 if gzipped
+#
+# The web server only serves files listed in the manifest, so it never has to
+# guess a MIME type or look anything up on flash to answer a request.
+import gzip
+import os
+import shutil
+import sys
+import zlib
+
+MANIFEST = "manifest.tsv"
+# SPIFFS object names, including the leading slash and terminator
+MAX_NAME = 32
+
+MIME_TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".json": "application/json",
+    ".png": "image/png",
+    ".jpg": "image/jpeg",
+    ".jpeg": "image/jpeg",
+    ".svg": "image/svg+xml",
+    ".ico": "image/x-icon",
+}
+
+
+def pack(src, dst):
+    if os.path.isdir(dst):
+        shutil.rmtree(dst)
+    os.makedirs(dst)
+    entries = []
+    for root, dirs, files in os.walk(src):
+        dirs.sort()
+        for name in sorted(files):
+            full = os.path.join(root, name)
+            path = "/" + os.path.relpath(full, src).replace(os.sep, "/")
+            if len(path) >= MAX_NAME:
+                sys.exit("%s: name is too long for SPIFFS" % path)
+            with open(full, "rb") as f:
+                data = f.read()
+            # A fixed mtime keeps the image the same from one build to the next
+            packed = gzip.compress(data, 9, mtime=0)
+            gzipped = len(packed) < len(data)
+            if not gzipped:
+                packed = data
+            out = os.path.join(dst, path[1:])
+            os.makedirs(os.path.dirname(out), exist_ok=True)
+            with open(out, "wb") as f:
+                f.write(packed)
+            mime = MIME_TYPES.get(os.path.splitext(name)[1].lower(),
+                                  "application/octet-stream")
+            etag = '"%08x"' % (zlib.crc32(data) & 0xFFFFFFFF)
+            entries.append((path, mime, etag, len(packed), int(gzipped)))
+    with open(os.path.join(dst, MANIFEST), "w") as f:
+        for entry in entries:
+            f.write("%s\t%s\t%s\t%d\t%d\n" % entry)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit("Usage: %s SOURCE_DIR OUTPUT_DIR" % sys.argv[0])
+    pack(sys.argv[1], sys.argv[2])
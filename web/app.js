@@ -1,12 +1,21 @@
-// Wait for the page to load before requesting sensor values
+// Plate layout, replaced by whatever format the device was built for
 var rowCount = 8;
 var colCount = 12;
 
+// Wait for the page to load before requesting sensor values
 document.addEventListener('DOMContentLoaded', _ => {
-    updateReading();
+    openStream();
     // updateTime();
     resetData();
-    buildPlate(rowCount, colCount);
+    // /plate is "format;rows;columns"
+    fetch('/plate').then((resp) => resp.text()).then((text) => {
+        var [format, rows, cols] = text.split(';');
+        console.log('Plate format: ' + format + ' well');
+        rowCount = Number(rows);
+        colCount = Number(cols);
+    }).catch(() => {
+        console.log('Plate format unknown, assuming 96 well');
+    }).finally(() => buildPlate(rowCount, colCount));
 });
 
 var mousedown = 0;
@@ -14,7 +23,6 @@ var dragmode = 0;
 var startingWell = null;
 var preselectedWells = [];
 var running = false;
-var programRunning = false;
 document.addEventListener('mousedown', _ => {
     mousedown = 1
 });
@@ -24,13 +32,10 @@ document.addEventListener('mouseup', _ => {
     dragmode = 0;
 });
 
-var recordQueue = -1;
 var status = -1;
-var activeWell = '';
 var startTime = Date.now();
-var syncKey = 0;
-
-const samPer = 500;
+// ID of the last batch operation sent, which status events catch up to
+var lastOp = 0;
 
 function updateTime() {
     var time = document.getElementById('time-elapsed');
@@ -38,32 +43,41 @@ function updateTime() {
     window.setTimeout(updateTime, 200);
 }
 
-// Take a well name String at some point
-function gotoWell(row, col) {
-    syncKey++;
-    console.log('Go! (' + row + ',' + col + ')'); 
-    req = new Request('/command', {method: 'POST', body: syncKey + ';' + row + ',' + col + ';0'});
-    fetch(req).then((resp) => {
-        if (resp.status == 500) {
-            gotoWell(row,col);
+// Operation codes for /batch, see batch.h
+const OP_MOVE = 1;
+const OP_HOME = 4;
+
+// Send operations [code, row, col, level, value] to be done in order, as one
+// batch: a little-endian header of version and count, then 8 bytes each
+function sendOps(ops) {
+    var view = new DataView(new ArrayBuffer(4 + 8 * ops.length));
+    view.setUint8(0, 1);
+    view.setUint8(1, ops.length);
+    ops.forEach((op, i) => {
+        for (var j = 0; j < 4; j++) {
+            view.setUint8(4 + 8 * i + j, op[j] || 0);
         }
+        view.setUint32(8 + 8 * i, op[4] || 0, true);
     });
-}
-
-function powerLED(val) {
-    syncKey++;
-    console.log('Power LED: ' + val);
-    var well = nameToCoords(activeWell);
-    req = new Request('/command', { method: 'POST', body: syncKey + ';' + well.r + ',' + well.c + ';' + val});
-    fetch(req).then((resp) => {
-        if (resp.status == 500) {
-            gotoWell(well.r,well.c);
+    fetch('/batch', {method: 'POST', body: view.buffer}).then((resp) => {
+        if (!resp.ok) {
+            console.log('Batch not queued: ' + resp.status);
+            return;
         }
+        return resp.arrayBuffer().then((buf) => {
+            var ids = new DataView(buf);
+            lastOp = ids.getUint32(buf.byteLength - 4, true);
+        });
     });
 }
 
+function gotoWell(row, col) {
+    console.log('Go! (' + row + ',' + col + ')');
+    sendOps([[OP_MOVE, row, col]]);
+}
+
 function homeDevice() {
-    gotoWell(0, 0);
+    sendOps([[OP_HOME]]);
 }
 
 function resetData() {
@@ -83,19 +97,15 @@ function resetWells() {
     });
 }
 
-function changeActive(well) {
-    activeWell = well;
-    powerLED(0);
+function addWell(name) {
     var wells = JSON.parse(localStorage.getItem('Wells'));
     if (wells == null) {
         wells = [];
     }
-    // console.log(wells);
-    // console.log(activeWell);
-    if (!wells.includes(activeWell)) {
-        wells.push(activeWell)
+    if (!wells.includes(name)) {
+        wells.push(name)
         localStorage.setItem('Wells', JSON.stringify(wells));
-        localStorage.setItem(activeWell, JSON.stringify([]));
+        localStorage.setItem(name, JSON.stringify([]));
     }
 }
 
@@ -107,6 +117,14 @@ function downloadData() {
     link.click();
 }
 
+// Every measurement the device has kept in flash, straight off the device
+function downloadLog() {
+    var link = document.createElement('a');
+    link.download = 'openlux_log.csv';
+    link.href = '/results';
+    link.click();
+}
+
 function exportCSVTime() {
     var wells = JSON.parse(localStorage.getItem('Wells'));
     var data = wells.map((well) => JSON.parse(localStorage.getItem(well)));
@@ -119,7 +137,7 @@ function exportCSVTime() {
         rowData = data.map((arr) => arr.shift());
         console.log(rowData);
         row = rowData.reduce((acc, obj) =>
-            (obj == null) ? acc + ',,' : acc + ',' + obj.time + ',' + obj.val, '');
+            (obj == null) ? acc + ',,' : acc + ',' + obj.time + ',' + obj.od, '');
         csv += capRow(row);
     } while (rowData.some((x) => x != null));
     return csv;
@@ -142,7 +160,7 @@ function exportCSV() {
                 var name = coordToName(r,c);
                 if (wells.includes(name)) {
                     var obj = JSON.parse(localStorage.getItem(name));
-                    row += obj.pop().val + ',';
+                    row += obj.pop().od + ',';
                 } else {
                     row += ',';
                 }
@@ -153,41 +171,57 @@ function exportCSV() {
     return csv;
 }
 
-function updateReading() {
-    var url = '/status';
-    // var dataDisplay = document.getElementById('data-display');
+// Readings, status changes and plate run progress are pushed by the device
+// over Server-Sent Events
+function openStream() {
     var statusDisplay = document.getElementById('status-display');
-    fetch(url).then(response => {
-        response.text().then(txt => {
-            console.log('Wanted ' + syncKey + ', Got ' + Number(txt.split(';')[0]));
-            if (Number(txt.split(';')[0]) == syncKey) {
-                // console.log('Synckeys match! (' + syncKey + ')');
-                status = Number(txt.split(';')[1]);
-                // console.log('Got status: ' + status);
-                var sensor = txt.split(';')[2];
-                // dataDisplay.textContent = sensor;
-                if (recordQueue == 1) {
-                    saveRecording(sensor);
-                }
-                if (recordQueue > 0) {
-                    recordQueue--;
-                }
-                // console.log(recordQueue);
+    var stream = new EventSource('/events');
+    stream.addEventListener('status', (ev) => {
+        var [key, stat] = ev.data.split(';');
+        if (Number(key) >= lastOp) {
+            status = Number(stat);
+        }
+        statusDisplay.textContent = translateStatus(status);
+    });
+    // Plate runs are carried out by the device, which reports each well as it
+    // is measured: kind;cycle;well;value;dark;signal;signal_se;light_sd;
+    // light_median;od;channel, the OD already calibrated by the device. The
+    // plate is coloured by the first channel; the others are kept as "A1/2"
+    // and so on.
+    stream.addEventListener('job', (ev) => {
+        var [kind, cycle, well, value, dark, signal, error, sd, median, od, channel] =
+            ev.data.split(';');
+        if (kind == 'well' && Number(value) >= 0) {
+            var name = indexToName(Number(well));
+            if (Number(channel) > 0) {
+                name += '/' + (Number(channel) + 1);
+                addWell(name);
+                saveRecording(name, value, dark, error, od);
+                return;
             }
-        });
+            addWell(name);
+            saveRecording(name, value, dark, error, od);
+            setWellColor(name);
+        } else if ((kind == 'done' || kind == 'stopped') && running) {
+            showRunning(false);
+        }
     });
-    statusDisplay.textContent = translateStatus(status);
-    window.setTimeout(updateReading, samPer);
+    stream.onerror = _ => {
+        statusDisplay.textContent = translateStatus(-1);
+    };
 }
 
-function saveRecording(sensor) {
-    var data = JSON.parse(localStorage.getItem(activeWell));
+function saveRecording(name, sensor, dark, error, od) {
+    var data = JSON.parse(localStorage.getItem(name));
     // console.log(data);
     data.push({
         time: (Date.now() - startTime) / 1000,
-        val: Number(sensor)
+        val: Number(sensor),
+        dark: Number(dark),
+        err: Number(error),
+        od: Number(od)
     });
-    localStorage.setItem(activeWell, JSON.stringify(data));
+    localStorage.setItem(name, JSON.stringify(data));
 }
 
 function translateStatus(status) {
@@ -210,6 +244,9 @@ function translateStatus(status) {
 }
 
 function buildPlate(rows, cols) {
+    // The grid in theme.css is sized from these
+    document.getElementById('plate').style.setProperty('--rows', rows);
+    document.getElementById('plate').style.setProperty('--cols', cols);
     var plate = document.getElementById('wells');
     for (var r = 1; r <= rows; r++) {
         var rl = String.fromCharCode(64 + r);
@@ -283,119 +320,32 @@ function wellClickListener(well, r, c, name) {
 
 function readSelected() {
     var selectedWells = document.querySelectorAll('.well.selected');
-    // console.log('Reading wells: ');
-    // console.log([...selectedWells]);
-    //console.log(sortDistance([...selectedWells]));
-    readWells(sortDistance([...selectedWells]));
+    startRun([...selectedWells].map((well) => well.id), 1, 0);
 }
 
-function sortDistance(wells)
-{
-    console.log(wells)
-    if (wells.length>1)
-    {
-        var sortedWells = [];
-        while(wells.length > 0) {
-            var currentWell = wells.shift();
-            sortedWells.push(currentWell);
-            wells.sort(compareDistance(currentWell));
-        }
-        return sortedWells;
-    }
-    else
-    {
-        return wells;
-    }
-    
-
-}
-
-function runProgram(prog) {
-    if (prog.samples > 0 && status == 1 && running) {
-        programRunning = true;
-        var wells = prog.wells.map((id) => ({id: id}));
-        console.log(wells);
-        readWells(wells);
-        prog.samples--;
-        setTimeout(runProgram, prog.samplingInterval * 1000 * 60, prog);
-    } else if (prog.samples > 0 && running) {
-        console.log("New read requested, but old has yet to finish!");
-        setTimeout(runProgram, 1, prog);
-    } else {
-        programRunning = false;
-        startStop();
-    }
-}
-
-function getDistance(a,b) {
-    var {r:arow,c:acol} = a;
-    var {r:brow,c:bcol} = b;
-    var distance = Math.sqrt((brow-arow)**2+(bcol-acol)**2);
-    return distance;
-}
-
-function compareDistance(r) {
-    var rc = nameToCoords(r.id);
-    return ((a,b) => {
-        var acoor =nameToCoords(a.id);
-        var bcoor =nameToCoords(b.id);
-
-        var adist = getDistance(rc,acoor);
-        var bdist = getDistance(rc,bcoor);
-        var diff = adist - bdist;
-        if (diff == 0) {
-            return(nthWell(acoor)-nthWell(bcoor));
-        }
-        else
-        {
-            return(diff);
+// Hand a whole plate run to the device: every well, repeats times, with
+// cycles starting interval milliseconds apart
+function startRun(names, repeats, interval) {
+    var wells = names.map((name) => {
+        var {r, c} = nameToCoords(name);
+        return (r - 1) * colCount + (c - 1);
+    });
+    var body = 'wells=' + wells.join(',') + '&repeats=' + repeats +
+        '&interval=' + interval;
+    fetch(new Request('/run', {method: 'POST', body: body})).then((resp) => {
+        if (!resp.ok) {
+            console.log('Run not started: ' + resp.status);
+            showRunning(false);
         }
     });
 }
-function nthWell(coor){
-     return ((coor.r-1)*colCount+coor.c);
-}
 
-function readWells(wells) {
-    if ((status == 1 && wells.length > 0 && running)) {
-        status = -1;
-        
-        console.log('Was ready, beginning now!');
-        console.log('Have some wells, laddie:', wells);
-        var well = wells.shift();
-        console.log('Active well: ' + activeWell + ' Targeted well: ' + well.id);
-        if (activeWell == well.id) {
-            console.log('Target well was matched');
-            powerLED(1);
-            recordQueue = 2; // FIXME: Better number here
-        } else {
-            console.log('We are not at the right well yet...');
-            var {r, c} = nameToCoords(well.id);
-            changeActive(well.id);
-            gotoWell(r,c);
-            // console.log('nearly there');
-            wells.unshift(well);
-        }
-    } else if (wells.length > 0 || recordQueue >= 0) {
-        console.log('Status is: ' + status);
-        if (recordQueue == 0) {
-            powerLED(0);
-            console.log("HERE");
-            setActiveWellColor();
-            recordQueue--;
-        }
-    } else {
-        powerLED(0);
-        if (!programRunning) {
-            startStop();
-        }
-        return;
-    }
-    window.setTimeout(readWells, 1, wells);
+function runProgram(prog) {
+    startRun(prog.wells, prog.samples, prog.samplingInterval * 1000 * 60);
 }
 
-function sensorToOD(val) {
-    return (val-2836) / -378;
+function indexToName(index) {
+    return coordToName(Math.floor(index / colCount) + 1, index % colCount + 1);
 }
 
 function ODToHue(val) {
@@ -404,37 +354,33 @@ function ODToHue(val) {
     return hue;
 }
 
-function sensorToHue(val) {
-    var low = 1900;
-    var high = 2500;
-    var num = (val - low) / (high - low);
-    var hue = Math.round(num * 250);
-    return (Math.max(0, Math.min(250, hue)));
-}
-
-function setActiveWellColor() {
+function setWellColor(name) {
     // console.log('Setting color');
-    var well = document.getElementById(activeWell);
-    var wellData = JSON.parse(localStorage.getItem(activeWell));
+    var well = document.getElementById(name);
+    var wellData = JSON.parse(localStorage.getItem(name));
     // console.log(wellData);
     if (wellData.length > 0) {
         // console.log("Send help");
         var rec = wellData.pop()
-        // var od = sensorToOD(rec.val);
-        // var odLab = document.createTextNode(od);
-        //well.appendChild(odLab);
-        // console.log(well);
-        // console.log(od);
-        well.style.backgroundColor = 'hsl(' + sensorToHue(rec.val) + ', 100%, 50%)';
+        var hue = Math.max(0, Math.min(240, ODToHue(rec.od)));
+        well.style.backgroundColor = 'hsl(' + hue + ', 100%, 50%)';
     }
 }
 
 function startStop() {
-    running = !running;
+    showRunning(!running);
+    if (running) {
+        readSelected();
+    } else {
+        fetch(new Request('/run', {method: 'DELETE'}));
+    }
+}
+
+function showRunning(run) {
+    running = run;
     console.log("Start/Stop: " + running);
     var button = document.getElementById("start");
     if (running) {
-        readSelected();
         button.innerHTML = "STOP";
         button.style.backgroundColor = "red";
     } else {